@@ -35,6 +35,8 @@ extern "C" {
 
 #include <workers.h>
 
+#include <stdbool.h>
+
 #include <openssl/ssl.h>
 
 /**
@@ -111,6 +113,16 @@ pgmoneta_decrypt_directory(char* d, struct workers* workers);
 int
 pgmoneta_decrypt_archive(char* path);
 
+/**
+ * Create a cipher context for file encryption based on the master key
+ * and the configured encryption mode
+ * @param encrypt true for encrypt and false for decrypt
+ * @param ctx The resulting context
+ * @return 0 upon success, otherwise 1
+ */
+int
+pgmoneta_create_encryption_context(bool encrypt, EVP_CIPHER_CTX** ctx);
+
 #ifdef __cplusplus
 }
 #endif
@@ -53,6 +53,38 @@ pgmoneta_backup(int client_fd, int server, char** argv);
 int
 pgmoneta_get_backup_max_rate(int server);
 
+/**
+ * Get the manifest checksum algorithm for a server
+ * @param server The server
+ * @return The manifest checksum algorithm
+ */
+int
+pgmoneta_get_manifest_checksum(int server);
+
+/**
+ * Get the number of seconds between WAL status replies for a server
+ * @param server The server
+ * @return The number of seconds
+ */
+int
+pgmoneta_get_wal_status_interval(int server);
+
+/**
+ * Get the number of WAL bytes between WAL status replies for a server
+ * @param server The server
+ * @return The number of bytes
+ */
+int
+pgmoneta_get_wal_status_size(int server);
+
+/**
+ * Get the number of connections used for a base backup of a server
+ * @param server The server
+ * @return The number of connections
+ */
+int
+pgmoneta_get_backup_connections(int server);
+
 #ifdef __cplusplus
 }
 #endif
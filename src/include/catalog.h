@@ -0,0 +1,191 @@
+/*
+ * Copyright (C) 2024 The pgmoneta community
+ *
+ * Redistribution and use in source and binary forms, with or without modification,
+ * are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, this list
+ * of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice, this
+ * list of conditions and the following disclaimer in the documentation and/or other
+ * materials provided with the distribution.
+ *
+ * 3. Neither the name of the copyright holder nor the names of its contributors may
+ * be used to endorse or promote products derived from this software without specific
+ * prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL
+ * THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT
+ * OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR
+ * TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef PGMONETA_CATALOG_H
+#define PGMONETA_CATALOG_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* pgmoneta */
+#include <pgmoneta.h>
+#include <info.h>
+
+/* system */
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdlib.h>
+
+#define CATALOG_MAX_BACKUPS 128
+
+#define CATALOG_SIZE_BACKUP             0
+#define CATALOG_SIZE_WAL                1
+#define CATALOG_SIZE_WAL_SHIPPING       2
+#define CATALOG_SIZE_SERVER_OTHER       3
+#define CATALOG_SIZE_WAL_SHIPPING_OTHER 4
+#define NUMBER_OF_CATALOG_SIZES         5
+
+/** @struct
+ * Defines the backups of a server in the catalog.
+ *
+ * Writers serialize on the lock and make the sequence odd while they
+ * change the entries. Readers copy the entries without locking and retry
+ * if the sequence changed meanwhile.
+ *
+ * The sizes are kept up to date by the backup, WAL and delete paths,
+ * and are reconciled with the disk periodically
+ */
+struct catalog_server
+{
+   atomic_ulong sequence;                      /**< The sequence, odd while the entries change */
+   atomic_schar lock;                          /**< The writer lock */
+   bool loaded;                                /**< Do the entries mirror the backup directory */
+   int number_of_backups;                      /**< The number of backups */
+   atomic_bool sizes;                          /**< Have the sizes been reconciled */
+   atomic_long size[NUMBER_OF_CATALOG_SIZES];  /**< The sizes in bytes */
+   struct backup backups[CATALOG_MAX_BACKUPS]; /**< The backups sorted by label */
+} __attribute__ ((aligned (64)));
+
+/** @struct
+ * Defines the backup catalog
+ */
+struct catalog
+{
+   int number_of_servers;           /**< The number of servers */
+   atomic_bool sizes;               /**< Has the size of the base directory been reconciled */
+   atomic_long other_size;          /**< The bytes in the base directory outside of the servers */
+   struct catalog_server servers[]; /**< The servers */
+} __attribute__ ((aligned (64)));
+
+/**
+ * Create the shared memory of the backup catalog
+ * @param p_size The size of the segment
+ * @param p_shmem The shared memory segment
+ * @return 0 upon success, otherwise 1
+ */
+int
+pgmoneta_init_catalog(size_t* p_size, void** p_shmem);
+
+/**
+ * Load the catalog from the backup directories of all servers
+ */
+void
+pgmoneta_catalog_load(void);
+
+/**
+ * Refresh the catalog entry of a backup from its backup.info file.
+ * The entry is removed if the backup directory no longer exists
+ * @param directory The backup directory
+ */
+void
+pgmoneta_catalog_refresh(char* directory);
+
+/**
+ * Get the backups of a backup directory from the catalog
+ * @param directory The directory
+ * @param number_of_backups The number of backups
+ * @param backups The backups
+ * @return 0 upon success, 1 if the catalog doesn't cover the directory
+ */
+int
+pgmoneta_catalog_get_backups(char* directory, int* number_of_backups, struct backup*** backups);
+
+/**
+ * Get a backup from the catalog
+ * @param directory The directory
+ * @param label The label
+ * @param backup The backup
+ * @return 0 upon success, 1 if the catalog doesn't have the backup
+ */
+int
+pgmoneta_catalog_get_backup(char* directory, char* label, struct backup** backup);
+
+/**
+ * Add to a size of a server
+ * @param server The server
+ * @param type The size type
+ * @param delta The bytes to add, negative to subtract
+ */
+void
+pgmoneta_catalog_add_size(int server, int type, long delta);
+
+/**
+ * Set a size of a server
+ * @param server The server
+ * @param type The size type
+ * @param size The size in bytes
+ */
+void
+pgmoneta_catalog_set_size(int server, int type, unsigned long size);
+
+/**
+ * Get a size of a server. The disk is walked when the size
+ * isn't known yet
+ * @param server The server
+ * @param type The size type
+ * @return The size in bytes
+ */
+unsigned long
+pgmoneta_catalog_size(int server, int type);
+
+/**
+ * Get the size of the directory of a server
+ * @param server The server
+ * @return The size in bytes
+ */
+unsigned long
+pgmoneta_catalog_server_size(int server);
+
+/**
+ * Get the size of the WAL shipping directory of a server
+ * @param server The server
+ * @return The size in bytes
+ */
+unsigned long
+pgmoneta_catalog_wal_shipping_server_size(int server);
+
+/**
+ * Get the disk space used in the base directory
+ * @return The size in bytes
+ */
+unsigned long
+pgmoneta_catalog_used_space(void);
+
+/**
+ * Walk the base directory and the WAL shipping directories,
+ * and reset all sizes from the disk
+ */
+void
+pgmoneta_catalog_reconcile(void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
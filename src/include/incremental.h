@@ -0,0 +1,73 @@
+/*
+ * Copyright (C) 2024 The pgmoneta community
+ *
+ * Redistribution and use in source and binary forms, with or without modification,
+ * are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, this list
+ * of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice, this
+ * list of conditions and the following disclaimer in the documentation and/or other
+ * materials provided with the distribution.
+ *
+ * 3. Neither the name of the copyright holder nor the names of its contributors may
+ * be used to endorse or promote products derived from this software without specific
+ * prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL
+ * THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT
+ * OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR
+ * TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef PGMONETA_INCREMENTAL_H
+#define PGMONETA_INCREMENTAL_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <workers.h>
+
+#include <stdint.h>
+#include <stdlib.h>
+
+#define INCREMENTAL_PREFIX     "INCREMENTAL."
+#define INCREMENTAL_MAGIC      0xd3ae1f0d
+#define INCREMENTAL_BLOCK_SIZE 8192
+#define INCREMENTAL_MAX_BLOCKS 131072
+
+/**
+ * Reconstruct a full file from a PostgreSQL 17 incremental file and the
+ * stored version of the file in the prior backup
+ * @param incremental The path of the INCREMENTAL.<name> file
+ * @param prior The path of the stored file in the prior backup, or NULL if there is none
+ * @param to The path of the reconstructed file
+ * @param blocks The number of blocks taken from the incremental file
+ * @return 0 upon success, otherwise 1
+ */
+int
+pgmoneta_incremental_reconstruct_file(char* incremental, char* prior, char* to, uint32_t* blocks);
+
+/**
+ * Reconstruct all incremental files of a backup against the prior backup,
+ * remove the incremental files and update the backup_manifest
+ * @param directory The data directory of the incremental backup
+ * @param prior The data directory of the prior backup
+ * @param workers The optional workers
+ * @return 0 upon success, otherwise 1
+ */
+int
+pgmoneta_incremental_combine(char* directory, char* prior, struct workers* workers);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
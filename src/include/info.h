@@ -54,6 +54,9 @@ extern "C" {
 #define INFO_CHKPT_WALPOS   "CHKPT_WALPOS"
 #define INFO_START_TIMELINE "START_TIMELINE"
 #define INFO_END_TIMELINE   "END_TIMELINE"
+#define INFO_FORMAT         "FORMAT"
+
+#define INFO_FORMAT_VERSION 1
 
 #define VALID_UNKNOWN -1
 #define VALID_FALSE    0
@@ -85,6 +88,85 @@ struct backup
    uint32_t end_timeline;                                    /**< The ending timeline of the backup */
 } __attribute__ ((aligned (64)));
 
+/** @struct
+ * Defines a set of changes to a backup information file, which are
+ * written together when committed
+ */
+struct info_transaction
+{
+   char directory[MAX_PATH]; /**< The backup directory */
+   int number_of_keys;       /**< The number of keys */
+   int size;                 /**< The capacity of the keys */
+   char** keys;              /**< The keys in file order */
+   char** values;            /**< The values */
+};
+
+/**
+ * Begin a transaction on a backup information file
+ * @param directory The backup directory
+ * @param transaction The transaction
+ * @return 0 upon success, otherwise 1
+ */
+int
+pgmoneta_info_begin(char* directory, struct info_transaction** transaction);
+
+/**
+ * Begin a transaction that creates a new backup information file
+ * @param directory The backup directory
+ * @param label The label
+ * @param status The status
+ * @param transaction The transaction
+ * @return 0 upon success, otherwise 1
+ */
+int
+pgmoneta_info_create(char* directory, char* label, int status, struct info_transaction** transaction);
+
+/**
+ * Set a string in a transaction
+ * @param transaction The transaction
+ * @param key The key
+ * @param value The value
+ * @return 0 upon success, otherwise 1
+ */
+int
+pgmoneta_info_set_string(struct info_transaction* transaction, char* key, char* value);
+
+/**
+ * Set an unsigned long in a transaction
+ * @param transaction The transaction
+ * @param key The key
+ * @param value The value
+ * @return 0 upon success, otherwise 1
+ */
+int
+pgmoneta_info_set_unsigned_long(struct info_transaction* transaction, char* key, unsigned long value);
+
+/**
+ * Set a bool in a transaction
+ * @param transaction The transaction
+ * @param key The key
+ * @param value The value
+ * @return 0 upon success, otherwise 1
+ */
+int
+pgmoneta_info_set_bool(struct info_transaction* transaction, char* key, bool value);
+
+/**
+ * Commit a transaction by writing and syncing a new backup information
+ * file, which replaces the old one atomically. The transaction is freed
+ * @param transaction The transaction
+ * @return 0 upon success, otherwise 1
+ */
+int
+pgmoneta_info_commit(struct info_transaction* transaction);
+
+/**
+ * Discard a transaction
+ * @param transaction The transaction
+ */
+void
+pgmoneta_info_rollback(struct info_transaction* transaction);
+
 /**
  * Create a backup information file
  * @param directory The backup directory
@@ -132,7 +214,7 @@ int
 pgmoneta_get_info_string(struct backup* backup, char* key, char** value);
 
 /**
- * Get the backups
+ * Get the backups, from the catalog when it covers the directory
  * @param directory The directory
  * @param number_of_backups The number of backups
  * @param backups The backups
@@ -142,7 +224,7 @@ int
 pgmoneta_get_backups(char* directory, int* number_of_backups, struct backup*** backups);
 
 /**
- * Get a backup
+ * Get a backup, from the catalog when it has the backup
  * @param directory The directory
  * @param label The label
  * @param backup The backup
@@ -151,6 +233,16 @@ pgmoneta_get_backups(char* directory, int* number_of_backups, struct backup*** b
 int
 pgmoneta_get_backup(char* directory, char* label, struct backup** backup);
 
+/**
+ * Read a backup from its backup.info file, bypassing the catalog
+ * @param directory The directory
+ * @param label The label
+ * @param backup The backup
+ * @return The result
+ */
+int
+pgmoneta_read_backup(char* directory, char* label, struct backup** backup);
+
 /**
  * Get the number of valid backups
  * @param i The server
@@ -33,10 +33,23 @@
 extern "C" {
 #endif
 
+#include <manifest.h>
 #include <workers.h>
 
 #include <stdlib.h>
 
+/** @struct
+ * Defines the statistics of a link step
+ */
+struct link_statistics
+{
+   unsigned long manifest_files; /**< The number of files linked based on the manifests */
+   unsigned long compared_files; /**< The number of files compared, because they were missing from a manifest */
+   unsigned long linked_files;   /**< The number of files linked */
+   unsigned long bytes_saved;    /**< The number of bytes no longer stored */
+   unsigned long bytes_not_read; /**< The number of bytes a comparison would have read */
+};
+
 /**
  * Create link two directories
  * @param from The from directory
@@ -46,6 +59,21 @@ extern "C" {
 void
 pgmoneta_link(char* from, char* to, struct workers* workers);
 
+/**
+ * Create link two data directories based on their manifests, including the
+ * tablespaces. Files with the same manifest checksum are linked without
+ * reading them, files missing from one of the manifests are compared
+ * @param from The from directory
+ * @param to The to directory
+ * @param from_manifest The manifest of the from directory
+ * @param to_manifest The manifest of the to directory
+ * @param workers The optional workers
+ * @param statistics The optional resulting statistics
+ */
+void
+pgmoneta_link_manifest(char* from, char* to, struct manifest* from_manifest, struct manifest* to_manifest,
+                       struct workers* workers, struct link_statistics* statistics);
+
 /**
  * Relink link two directories
  * @param from The from directory
@@ -35,22 +35,62 @@ extern "C" {
 
 #include <pgmoneta.h>
 #include <node.h>
+#include <pipeline.h>
+#include <workers.h>
 
+#include <stdint.h>
+#include <time.h>
+
+#define MANIFEST_CHECKSUM_LENGTH 64
+
+/** @struct
+ * A file entry in the manifest. The path lives in the string arena of the manifest
+ */
 struct manifest_file
 {
-   char* path;
-   char* checksum;
-   char* algorithm;
-   size_t size;
-   struct manifest_file* next;
-} __attribute__ ((aligned (64)));
+   size_t size;                                /**< The size of the file */
+   uint32_t path;                              /**< The offset of the path in the arena */
+   uint32_t path_length;                       /**< The length of the path */
+   uint32_t hash;                              /**< The hash of the path */
+   uint8_t algorithm;                          /**< The checksum algorithm */
+   uint8_t checksum_length;                    /**< The length of the checksum in bytes */
+   uint8_t checksum[MANIFEST_CHECKSUM_LENGTH]; /**< The raw checksum */
+   size_t offset;                              /**< The offset of the entry in the manifest */
+   size_t length;                              /**< The length of the entry in the manifest */
+};
 
+/** @struct
+ * A parsed manifest. The files are a flat array and all paths are interned in one arena
+ */
 struct manifest
 {
-   char* checksum;
-   char* content;
-   struct manifest_file* files;
-} __attribute__ ((aligned (64)));
+   char* map;                                  /**< The mapped manifest file */
+   size_t map_size;                            /**< The size of the mapping */
+   size_t content_size;                        /**< The number of bytes covered by the manifest checksum */
+   uint8_t checksum[MANIFEST_CHECKSUM_LENGTH]; /**< The manifest checksum, always SHA256 */
+   uint8_t checksum_length;                    /**< The length of the manifest checksum */
+   char* strings;                              /**< The string arena */
+   size_t strings_size;                        /**< The used size of the arena */
+   size_t strings_capacity;                    /**< The capacity of the arena */
+   struct manifest_file* files;                /**< The files */
+   unsigned long number_of_files;              /**< The number of files */
+   unsigned long files_capacity;               /**< The capacity of the files array */
+   uint32_t* index;                            /**< Open addressing index of file positions + 1 */
+   uint32_t index_mask;                        /**< The index size - 1 */
+};
+
+/** @struct
+ * A file for a manifest written by pgmoneta
+ */
+struct manifest_item
+{
+   char* path;                                 /**< The path relative to the data directory */
+   size_t size;                                /**< The size of the file */
+   time_t modified;                            /**< The modification time of the file */
+   uint8_t algorithm;                          /**< The checksum algorithm */
+   uint8_t checksum_length;                    /**< The length of the checksum in bytes */
+   uint8_t checksum[MANIFEST_CHECKSUM_LENGTH]; /**< The raw checksum */
+};
 
 /**
  * Parse the manifest json into manifest struct
@@ -62,12 +102,116 @@ int
 pgmoneta_parse_manifest(char* manifest_path, struct manifest** manifest);
 
 /**
- * Verify checksum of the manifest and the checksum
+ * Parse the backup_manifest of a backup directory. A compressed or encrypted
+ * manifest is restored to a temporary file first
+ * @param directory The directory holding the manifest
+ * @param manifest The manifest
+ * @return 0 on parsing success, otherwise 1
+ */
+int
+pgmoneta_manifest_load(char* directory, struct manifest** manifest);
+
+/**
+ * Find a file in a manifest
+ * @param manifest The manifest
+ * @param path The path of the file
+ * @return The file, or NULL if not found
+ */
+struct manifest_file*
+pgmoneta_manifest_find(struct manifest* manifest, char* path);
+
+/**
+ * Get the path of a file in a manifest
+ * @param manifest The manifest
+ * @param file The file
+ * @return The path
+ */
+char*
+pgmoneta_manifest_file_path(struct manifest* manifest, struct manifest_file* file);
+
+/**
+ * Get the name of a manifest checksum algorithm
+ * @param algorithm The algorithm
+ * @return The name as used by PostgreSQL
+ */
+char*
+pgmoneta_manifest_algorithm_name(int algorithm);
+
+/**
+ * Format the checksum of a file as a hex string
+ * @param file The file
+ * @param buffer The buffer, at least 2 * MANIFEST_CHECKSUM_LENGTH + 1 bytes
+ * @return The buffer
+ */
+char*
+pgmoneta_manifest_file_checksum(struct manifest_file* file, char* buffer);
+
+/**
+ * Do two manifest entries describe the same content. Entries without a
+ * checksum, or with checksums of different algorithms, are never the same
+ * @param file1 The first file
+ * @param file2 The second file
+ * @return true if the content is the same, otherwise false
+ */
+bool
+pgmoneta_manifest_file_equal(struct manifest_file* file1, struct manifest_file* file2);
+
+/**
+ * Write a new backup_manifest for a directory where incremental files have been
+ * reconstructed. Each INCREMENTAL.<name> entry is replaced by a <name> entry
+ * with the size and checksum of the file on disk, the other entries are kept as is
+ * @param manifest The manifest of the incremental backup
+ * @param directory The directory holding the manifest
+ * @return 0 upon success, otherwise 1
+ */
+int
+pgmoneta_manifest_rewrite_incremental(struct manifest* manifest, char* directory);
+
+/**
+ * Create a pipeline stage that computes the manifest checksum of the data
+ * passing through it
+ * @param algorithm The checksum algorithm
+ * @param stage The resulting stage
+ * @return 0 upon success, otherwise 1
+ */
+int
+pgmoneta_manifest_create_checksum(int algorithm, struct pipeline_stage** stage);
+
+/**
+ * Finish a checksum stage
+ * @param stage The checksum stage
+ * @param checksum The checksum, at least MANIFEST_CHECKSUM_LENGTH bytes
+ * @param checksum_length The length of the checksum
+ * @param bytes The number of bytes that passed through the stage
+ * @return 0 upon success, otherwise 1
+ */
+int
+pgmoneta_manifest_checksum_final(struct pipeline_stage* stage, uint8_t* checksum, size_t* checksum_length, size_t* bytes);
+
+/**
+ * Write the backup_manifest for a backup that wasn't taken with BASE_BACKUP
+ * @param directory The data directory
+ * @param system_identifier The system identifier, 0 writes a version 1 manifest
+ * @param items The files
+ * @param number_of_items The number of files
+ * @param timeline The timeline of the WAL range
+ * @param start_lsn The start of the WAL range
+ * @param end_lsn The end of the WAL range
+ * @return 0 upon success, otherwise 1
+ */
+int
+pgmoneta_manifest_create(char* directory, uint64_t system_identifier, struct manifest_item* items, unsigned long number_of_items,
+                         uint32_t timeline, char* start_lsn, char* end_lsn);
+
+/**
+ * Verify checksum of the manifest and the checksum of each file in it.
+ * Stops at the first mismatch
  * @param root The root directory holding the manifest
+ * @param workers The optional workers
  * @return 0 if verification turns out ok, 1 otherwise
  */
 int
-pgmoneta_manifest_checksum_verify(char* root);
+pgmoneta_manifest_checksum_verify(char* root, struct workers* workers);
 
 /**
  * Compare manifests
@@ -33,9 +33,11 @@
 extern "C" {
 #endif
 
+#include <manifest.h>
 #include <memory.h>
 #include <pgmoneta.h>
 #include <tablespace.h>
+#include <workers.h>
 
 #include <stdbool.h>
 #include <stdlib.h>
@@ -46,6 +48,8 @@ extern "C" {
 #define MESSAGE_STATUS_OK    1
 #define MESSAGE_STATUS_ERROR 2
 
+#define MANIFEST_UPLOAD_CHUNK_SIZE 65536
+
 extern struct token_bucket bucket;
 
 /** @struct
@@ -364,12 +368,13 @@ pgmoneta_create_standby_status_update_message(int64_t received, int64_t flushed,
  * @param checksum_algorithm The checksum algorithm to be applied to backup manifest
  * @param compression The compression type
  * @param compression_level The compression level
+ * @param incremental Request an incremental backup against the uploaded manifest (PostgreSQL 17+)
  * @param msg The resulting message
  * @return 0 upon success, otherwise 1
  */
 int
 pgmoneta_create_base_backup_message(int server_version, char* label, bool include_wal, char* checksum_algorithm,
-                                    int compression, int compression_level,
+                                    int compression, int compression_level, bool incremental,
                                     struct message** msg);
 
 /**
@@ -400,6 +405,16 @@ pgmoneta_create_search_replication_slot_message(char* slot_name, struct message*
 int
 pgmoneta_send_copy_done_message(SSL* ssl, int socket);
 
+/**
+ * Upload the manifest of a prior backup for an incremental backup (PostgreSQL 17+)
+ * @param ssl The SSL structure
+ * @param socket The socket
+ * @param manifest The manifest
+ * @return 0 upon success, otherwise 1
+ */
+int
+pgmoneta_upload_manifest(SSL* ssl, int socket, struct manifest* manifest);
+
 /**
  * Create a query message for a simple query
  * @param query The query to be executed on server
@@ -522,10 +537,11 @@ pgmoneta_consume_data_row_messages(SSL* ssl, int socket, struct stream_buffer* b
  * @param version The server version
  * @param bucket The rate limit bucket
  * @param network_bucket The network rate limit bucket
+ * @param workers The optional workers used to verify the manifest
  * @return 0 upon success, otherwise 1
  */
 int
-pgmoneta_receive_archive_files(SSL* ssl, int socket, struct stream_buffer* buffer, char* basedir, struct tablespace* tablespaces, int version, struct token_bucket* bucket, struct token_bucket* network_bucket);
+pgmoneta_receive_archive_files(SSL* ssl, int socket, struct stream_buffer* buffer, char* basedir, struct tablespace* tablespaces, int version, struct token_bucket* bucket, struct token_bucket* network_bucket, struct workers* workers);
 
 /**
  * Receive backup tar files from the copy stream and write to disk
@@ -537,10 +553,12 @@ pgmoneta_receive_archive_files(SSL* ssl, int socket, struct stream_buffer* buffe
  * @param tablespaces The user level tablespaces
  * @param bucket The rate limit bucket
  * @param network_bucket The network rate limit bucket
+ * @param workers The optional workers used to verify the manifest
+ * @param store Compress and encrypt the files with the workers while the backup is received
  * @return 0 upon success, otherwise 1
  */
 int
-pgmoneta_receive_archive_stream(SSL* ssl, int socket, struct stream_buffer* buffer, char* basedir, struct tablespace* tablespaces, struct token_bucket* bucket, struct token_bucket* network_bucket);
+pgmoneta_receive_archive_stream(SSL* ssl, int socket, struct stream_buffer* buffer, char* basedir, struct tablespace* tablespaces, struct token_bucket* bucket, struct token_bucket* network_bucket, struct workers* workers, bool store);
 
 /**
  * Receive mainfest file from the copy stream and write to disk
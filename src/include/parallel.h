@@ -0,0 +1,85 @@
+/*
+ * Copyright (C) 2024 The pgmoneta community
+ *
+ * Redistribution and use in source and binary forms, with or without modification,
+ * are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, this list
+ * of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice, this
+ * list of conditions and the following disclaimer in the documentation and/or other
+ * materials provided with the distribution.
+ *
+ * 3. Neither the name of the copyright holder nor the names of its contributors may
+ * be used to endorse or promote products derived from this software without specific
+ * prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL
+ * THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT
+ * OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR
+ * TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef PGMONETA_PARALLEL_H
+#define PGMONETA_PARALLEL_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <pgmoneta.h>
+#include <tablespace.h>
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include <openssl/ssl.h>
+
+#define PARALLEL_CHUNK_SIZE (1024 * 1024)
+
+/**
+ * Can a parallel base backup be taken over a connection. The user must be
+ * allowed to start and stop a backup, and to list and read the files of the
+ * data directory, and the server must not be in recovery
+ * @param ssl The SSL structure of a non-replication connection
+ * @param socket The socket of a non-replication connection
+ * @param version The server version
+ * @return true if supported, otherwise false
+ */
+bool
+pgmoneta_parallel_backup_supported(SSL* ssl, int socket, int version);
+
+/**
+ * Take a base backup over several connections. One connection starts and
+ * stops the backup, the files of the data directory and the tablespaces are
+ * copied in chunks by child processes each using their own connection. The
+ * backup_label, the WAL needed for consistency and the backup_manifest are
+ * written the same way as by BASE_BACKUP
+ * @param server The server
+ * @param usr The user
+ * @param label The backup label
+ * @param basedir The base directory for the backup
+ * @param tablespaces The user level tablespaces
+ * @param connections The number of connections copying the files
+ * @param store Compress and encrypt the data files as soon as they are copied
+ * @param startpos [out] The WAL starting point, at least 20 bytes
+ * @param start_timeline [out] The starting timeline
+ * @param endpos [out] The WAL ending point, at least 20 bytes
+ * @param end_timeline [out] The ending timeline
+ * @return 0 upon success, otherwise 1
+ */
+int
+pgmoneta_parallel_backup(int server, int usr, char* label, char* basedir, struct tablespace* tablespaces, int connections, bool store,
+                         char* startpos, uint32_t* start_timeline, char* endpos, uint32_t* end_timeline);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -104,6 +104,18 @@ extern "C" {
 #define COMPRESSION_SERVER_ZSTD  6
 #define COMPRESSION_SERVER_LZ4   7
 
+#define MANIFEST_CHECKSUM_NONE   0
+#define MANIFEST_CHECKSUM_CRC32C 1
+#define MANIFEST_CHECKSUM_SHA224 2
+#define MANIFEST_CHECKSUM_SHA256 3
+#define MANIFEST_CHECKSUM_SHA384 4
+#define MANIFEST_CHECKSUM_SHA512 5
+
+#define WAL_SYNC_OFF     0
+#define WAL_SYNC_MESSAGE 1
+#define WAL_SYNC_SIZE    2
+#define WAL_SYNC_SEGMENT 3
+
 #define STORAGE_ENGINE_LOCAL 1 << 0
 #define STORAGE_ENGINE_SSH   1 << 1
 #define STORAGE_ENGINE_S3    1 << 2
@@ -114,6 +126,19 @@ extern "C" {
 #define UPDATE_PROCESS_TITLE_MINIMAL 2
 #define UPDATE_PROCESS_TITLE_VERBOSE 3
 
+#define HISTOGRAM_NETWORK_READ 0
+#define HISTOGRAM_TAR_EXTRACT  1
+#define HISTOGRAM_FILE_WRITE   2
+#define HISTOGRAM_COMPRESS     3
+#define HISTOGRAM_ENCRYPT      4
+#define HISTOGRAM_FSYNC        5
+#define HISTOGRAM_UPLOAD       6
+#define HISTOGRAM_DECOMPRESS   7
+#define HISTOGRAM_DECRYPT      8
+#define NUMBER_OF_HISTOGRAMS   9
+
+#define HISTOGRAM_BUCKETS 64
+
 #define CREATE_SLOT_UNDEFINED 0
 #define CREATE_SLOT_YES       1
 #define CREATE_SLOT_NO        2
@@ -191,6 +216,11 @@ extern void* shmem;
  */
 extern void* prometheus_cache_shmem;
 
+/**
+ * Shared memory used to contain the backup catalog
+ */
+extern void* catalog_shmem;
+
 /** @struct
  * Defines a server
  */
@@ -211,7 +241,6 @@ struct server
    int create_slot;                    /**< Create a slot */
    atomic_bool backup;                 /**< Is there an active backup */
    atomic_bool delete;                 /**< Is there an active delete */
-   atomic_bool wal;                    /**< Is there an active wal */
    int wal_size;                       /**< The size of the WAL files */
    bool wal_streaming;                 /**< Is WAL streaming active */
    bool valid;                         /**< Is the server valid */
@@ -231,6 +260,11 @@ struct server
    int workers;                       /**< The number of workers */
    int backup_max_rate;     /**< Number of tokens added to the bucket with each replenishment for backup. */
    int network_max_rate;    /**< Number of bytes of tokens added every one second to limit the netowrk backup rate */
+   int manifest;            /**< The manifest checksum algorithm */
+   int wal_status_interval; /**< The number of seconds between WAL status replies */
+   int wal_status_size;     /**< The number of WAL bytes between WAL status replies */
+   atomic_ulong wal_status_replies; /**< The number of WAL status replies sent */
+   int backup_connections;  /**< The number of connections used for a base backup */
 } __attribute__ ((aligned (64)));
 
 /** @struct
@@ -248,20 +282,38 @@ struct user
  * response over and over depending on the cache
  * settings.
  *
- * The `valid_until` field stores the result
- * of `time(2)`.
- *
- * The cache is protected by the `lock` field.
+ * The response is rendered into the buffer which
+ * isn't `active`, and published by switching `active`.
+ * Readers copy the active buffer and retry if its
+ * `sequence` changed meanwhile.
  *
- * The `size` field stores the size of the allocated
- * `data` payload.
+ * The `data` payload holds two buffers of `size` bytes.
  */
 struct prometheus_cache
 {
-   time_t valid_until;   /**< when the cache will become not valid */
-   atomic_schar lock;    /**< lock to protect the cache */
-   size_t size;          /**< size of the cache */
-   char data[];          /**< the payload */
+   atomic_long rendering;    /**< when the current rendering started, 0 if none */
+   atomic_long requested;    /**< when the metrics were last requested */
+   atomic_bool overflow;     /**< did the last rendering exceed the buffer size */
+   atomic_int active;        /**< the buffer being served, -1 if none */
+   atomic_ulong sequence[2]; /**< the sequence of each buffer, odd while it is written */
+   time_t created[2];        /**< when each buffer was rendered */
+   size_t length[2];         /**< the length of the text in each buffer */
+   size_t gzip_length[2];    /**< the length of the gzip text following the text, 0 if none */
+   size_t size;              /**< size of each buffer */
+   char data[];              /**< the payload */
+} __attribute__ ((aligned (64)));
+
+/** @struct
+ * Defines a latency histogram.
+ *
+ * The buckets are log-linear in microseconds: two buckets
+ * for each power of two, starting at [0, 1) and [1, 2)
+ */
+struct histogram
+{
+   atomic_ulong bucket[HISTOGRAM_BUCKETS]; /**< The number of observations in each bucket */
+   atomic_ulong count;                     /**< The number of observations */
+   atomic_ulong sum;                       /**< The sum of the observations in microseconds */
 } __attribute__ ((aligned (64)));
 
 /** @struct
@@ -269,6 +321,7 @@ struct prometheus_cache
  */
 struct prometheus
 {
+   struct histogram histograms[NUMBER_OF_HISTOGRAMS]; /**< The latency of the backup, WAL and restore stages */
 } __attribute__ ((aligned (64)));
 
 /** @struct
@@ -320,6 +373,7 @@ struct configuration
    int retention_months;                /**< The retention months for the server */
    int retention_years;                 /**< The retention years for the server */
    bool link;     /**< Use link */
+   bool incremental; /**< Use incremental backups */
 
    int log_type;                      /**< The logging type */
    int log_level;                     /**< The logging level */
@@ -360,6 +414,17 @@ struct configuration
    int backup_max_rate; /**< Number of tokens added to the bucket with each replenishment for backup. */
    int network_max_rate;    /**< Number of bytes of tokens added every one second to limit the netowrk backup rate */
 
+   int manifest;            /**< The manifest checksum algorithm */
+
+   int wal_status_interval; /**< The number of seconds between WAL status replies */
+   int wal_status_size;     /**< The number of WAL bytes between WAL status replies */
+
+   int backup_connections;  /**< The number of connections used for a base backup */
+
+   int wal_sync;            /**< When received WAL is synced to disk */
+   int wal_sync_size;       /**< The number of WAL bytes between syncs */
+   bool wal_direct_io;      /**< Write WAL using direct I/O */
+
    struct server servers[NUMBER_OF_SERVERS];       /**< The servers */
    struct user users[NUMBER_OF_USERS];             /**< The users */
    struct user admins[NUMBER_OF_ADMINS];           /**< The admins */
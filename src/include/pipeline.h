@@ -0,0 +1,262 @@
+/*
+ * Copyright (C) 2024 The pgmoneta community
+ *
+ * Redistribution and use in source and binary forms, with or without modification,
+ * are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, this list
+ * of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice, this
+ * list of conditions and the following disclaimer in the documentation and/or other
+ * materials provided with the distribution.
+ *
+ * 3. Neither the name of the copyright holder nor the names of its contributors may
+ * be used to endorse or promote products derived from this software without specific
+ * prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL
+ * THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT
+ * OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR
+ * TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef PGMONETA_PIPELINE_H
+#define PGMONETA_PIPELINE_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <workers.h>
+
+#include <stdbool.h>
+#include <stdlib.h>
+
+#define PIPELINE_BUFFER_SIZE (1024 * 1024)
+
+struct pipeline_stage;
+
+typedef int (* pipeline_process)(struct pipeline_stage*, void*, size_t, bool);
+typedef void (* pipeline_destroy)(struct pipeline_stage*);
+typedef void (* pipeline_completed)(char*, void*);
+
+/** @struct
+ * Defines a stage in a streaming pipeline. Each stage transforms the
+ * bytes it is given and hands the result to the next stage
+ */
+struct pipeline_stage
+{
+   pipeline_process process;     /**< Process a chunk, last is true for the final chunk */
+   pipeline_destroy destroy;     /**< Release the stage state */
+   void* state;                  /**< The stage state */
+   struct pipeline_stage* next;  /**< The next stage */
+};
+
+/**
+ * Create a compression stage
+ * @param compression_type The compression type
+ * @param level The compression level
+ * @param stage The resulting stage
+ * @return 0 upon success, otherwise 1
+ */
+int
+pgmoneta_pipeline_create_compressor(int compression_type, int level, struct pipeline_stage** stage);
+
+/**
+ * Create a decompression stage
+ * @param compression_type The compression type
+ * @param stage The resulting stage
+ * @return 0 upon success, otherwise 1
+ */
+int
+pgmoneta_pipeline_create_decompressor(int compression_type, struct pipeline_stage** stage);
+
+/**
+ * Create a cipher stage using the master key
+ * @param encrypt true for encrypt and false for decrypt
+ * @param stage The resulting stage
+ * @return 0 upon success, otherwise 1
+ */
+int
+pgmoneta_pipeline_create_cipher(bool encrypt, struct pipeline_stage** stage);
+
+/**
+ * Create a stage that writes to a file
+ * @param path The file path
+ * @param stage The resulting stage
+ * @return 0 upon success, otherwise 1
+ */
+int
+pgmoneta_pipeline_create_file_writer(char* path, struct pipeline_stage** stage);
+
+/**
+ * Create a stage that extracts a tar stream into a directory. The members
+ * are written as their data arrives, so the archive itself never hits the disk
+ * @param directory The target directory
+ * @param completed The optional function called with the path of each completed file
+ * @param data The data for the completed function
+ * @param stage The resulting stage
+ * @return 0 upon success, otherwise 1
+ */
+int
+pgmoneta_pipeline_create_tar_extractor(char* directory, pipeline_completed completed, void* data, struct pipeline_stage** stage);
+
+/**
+ * Create a stage that encodes a WAL segment in front of a compressor. The
+ * page header fields that follow from the first page are cleared and runs
+ * of empty pages are replaced by a count. A stream that does not start
+ * with a long page header is passed through
+ * @param stage The resulting stage
+ * @return 0 upon success, otherwise 1
+ */
+int
+pgmoneta_pipeline_create_wal_encoder(struct pipeline_stage** stage);
+
+/**
+ * Create a stage that decodes a WAL segment written by the WAL encoder.
+ * Other streams are passed through
+ * @param stage The resulting stage
+ * @return 0 upon success, otherwise 1
+ */
+int
+pgmoneta_pipeline_create_wal_decoder(struct pipeline_stage** stage);
+
+/**
+ * Append a stage to the end of a pipeline
+ * @param pipeline The pipeline
+ * @param stage The stage
+ * @return 0 upon success, otherwise 1
+ */
+int
+pgmoneta_pipeline_append(struct pipeline_stage** pipeline, struct pipeline_stage* stage);
+
+/**
+ * Push a chunk into a pipeline
+ * @param pipeline The pipeline
+ * @param buffer The buffer
+ * @param size The size of the buffer
+ * @param last Is this the last chunk
+ * @return 0 upon success, otherwise 1
+ */
+int
+pgmoneta_pipeline_write(struct pipeline_stage* pipeline, void* buffer, size_t size, bool last);
+
+/**
+ * Push the content of a file through a pipeline
+ * @param pipeline The pipeline
+ * @param from The file path
+ * @return 0 upon success, otherwise 1
+ */
+int
+pgmoneta_pipeline_file(struct pipeline_stage* pipeline, char* from);
+
+/**
+ * Destroy a pipeline
+ * @param pipeline The pipeline
+ */
+void
+pgmoneta_pipeline_destroy(struct pipeline_stage* pipeline);
+
+/**
+ * Get the file suffix of a compression type
+ * @param compression_type The compression type
+ * @return The suffix, or an empty string
+ */
+char*
+pgmoneta_compression_suffix(int compression_type);
+
+/**
+ * Find the stored version of a file, which may be compressed and encrypted
+ * @param path The path of the original file
+ * @return The path of the stored file, or NULL if there is none
+ */
+char*
+pgmoneta_stored_file(char* path);
+
+/**
+ * Create the stages that decrypt and decompress a stored file based on its suffix
+ * @param path The path of the stored file
+ * @param pipeline The resulting pipeline, NULL for a plain file
+ * @return 0 upon success, otherwise 1
+ */
+int
+pgmoneta_pipeline_create_decoder(char* path, struct pipeline_stage** pipeline);
+
+/**
+ * Decrypt and decompress a stored file in one pass based on its suffix.
+ * The stored file is kept
+ * @param from The path of the stored file
+ * @param to The path of the plain file
+ * @return 0 upon success, otherwise 1
+ */
+int
+pgmoneta_decrypt_decompress_file(char* from, char* to);
+
+/**
+ * Get the name of a stored file once it is decrypted and decompressed
+ * @param path The path of the stored file
+ * @return The path of the plain file, or NULL upon failure
+ */
+char*
+pgmoneta_restored_file_name(char* path);
+
+/**
+ * Restore a stored file into its plain form. Compressed and encrypted files
+ * are decoded straight into the target, other files are copied
+ * @param from The path of the stored file
+ * @param to The path of the plain file
+ * @param workers The optional workers
+ * @return 0 upon success, otherwise 1
+ */
+int
+pgmoneta_restore_stored_file(char* from, char* to, struct workers* workers);
+
+/**
+ * Compress and encrypt a single file in one pass, also remove the original file
+ * @param from The file path
+ * @param to The path of the compressed and encrypted file
+ * @return 0 upon success, otherwise 1
+ */
+int
+pgmoneta_compress_encrypt_file(char* from, char* to);
+
+/**
+ * Compress and encrypt a single file into its stored form in one pass as
+ * configured, also remove the original file
+ * @param from The file path
+ * @return 0 upon success, otherwise 1
+ */
+int
+pgmoneta_store_file(char* from);
+
+/**
+ * Compress and encrypt the files under the directory in place recursively
+ * in one pass, also remove the original files
+ * @param d The data directory
+ * @param workers The optional workers
+ * @return 0 upon success, otherwise 1
+ */
+int
+pgmoneta_compress_encrypt_data(char* d, struct workers* workers);
+
+/**
+ * Compress and encrypt the files under the tablespace directories in place
+ * recursively in one pass, also remove the original files
+ * @param root The root directory
+ * @param workers The optional workers
+ * @return 0 upon success, otherwise 1
+ */
+int
+pgmoneta_compress_encrypt_tablespaces(char* root, struct workers* workers);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -34,29 +34,54 @@ extern "C" {
 #endif
 
 #include <ev.h>
+#include <stdbool.h>
+#include <stdint.h>
 #include <stdlib.h>
 
 /*
- * Value to disable the Prometheus cache,
- * it is equivalent to set `metrics_cache`
+ * Value to disable the Prometheus snapshot,
+ * it is equivalent to set `metrics_cache_max_age`
  * to 0 (seconds).
  */
 #define PGMONETA_PROMETHEUS_CACHE_DISABLED 0
 
 /**
- * Max size of the cache (in bytes).
- * If the cache request exceeds this size
- * the caching should be aborted in some way.
+ * The default number of seconds a snapshot is served
+ */
+#define PROMETHEUS_DEFAULT_CACHE_MAX_AGE 5
+
+/**
+ * Max size of a snapshot buffer (in bytes).
  */
 #define PROMETHEUS_MAX_CACHE_SIZE (1024 * 1024)
 
 /**
- * The default cache size in the case
+ * The default snapshot buffer size in the case
  * the user did not set any particular
  * configuration option.
  */
 #define PROMETHEUS_DEFAULT_CACHE_SIZE (256 * 1024)
 
+/**
+ * Max size of a HTTP request served from the main loop
+ */
+#define PROMETHEUS_MAX_REQUEST_SIZE 8192
+
+/**
+ * Number of seconds an idle keep-alive connection is kept open
+ */
+#define PROMETHEUS_KEEP_ALIVE_TIMEOUT 300
+
+/**
+ * Number of seconds without requests after which the snapshot isn't rendered anymore
+ */
+#define PROMETHEUS_IDLE_TIMEOUT 300
+
+/**
+ * Number of seconds after which a rendering is considered lost
+ */
+#define PROMETHEUS_RENDER_TIMEOUT 300
+
 /**
  * Create a prometheus instance
  * @param fd The client descriptor
@@ -71,18 +96,30 @@ void
 pgmoneta_prometheus_reset(void);
 
 /**
- * Allocates, for the first time, the Prometheus cache.
+ * Start a latency measurement
+ * @return The start time in nanoseconds
+ */
+uint64_t
+pgmoneta_prometheus_timer(void);
+
+/**
+ * Record a latency measurement in a histogram
+ * @param histogram The histogram, like HISTOGRAM_NETWORK_READ
+ * @param start The start time from pgmoneta_prometheus_timer()
+ */
+void
+pgmoneta_prometheus_observe(int histogram, uint64_t start);
+
+/**
+ * Allocates, for the first time, the Prometheus snapshot.
  *
- * The cache structure, as well as its dynamically sized payload,
- * are created as shared memory chunks.
+ * The snapshot holds two buffers of `metrics_cache_max_size` bytes,
+ * one being served while the other one is rendered.
  *
  * Assumes the shared memory for the cofiguration is already set.
  *
- * The cache will be allocated as soon as this method is invoked,
- * even if the cache has not been configured at all!
- *
  * If the memory cannot be allocated, the function issues errors
- * in the logs and disables the caching machinaery.
+ * in the logs and every scrape is served by its own process.
  *
  * @param p_size a pointer to where to store the size of
  * allocated chunk of memory
@@ -94,6 +131,46 @@ pgmoneta_prometheus_reset(void);
 int
 pgmoneta_init_prometheus_cache(size_t* p_size, void** p_shmem);
 
+/**
+ * Is a new snapshot needed. If so, the rendering is claimed
+ * and pgmoneta_prometheus_snapshot() must be invoked
+ * @return true if a snapshot must be rendered, otherwise false
+ */
+bool
+pgmoneta_prometheus_snapshot_due(void);
+
+/**
+ * Render the metrics into the buffer which isn't served, and publish it
+ */
+void
+pgmoneta_prometheus_snapshot(void);
+
+/**
+ * Can the scrapes be served from the snapshot
+ * @return true if there is a recent snapshot, otherwise false
+ */
+bool
+pgmoneta_prometheus_snapshot_valid(void);
+
+/**
+ * Serve a metrics connection from the main loop.
+ *
+ * The requests are answered from the snapshot with keep-alive and
+ * gzip support, and the connection is closed when the client is done
+ * @param loop The loop
+ * @param client_fd The client descriptor
+ * @return 0 upon success, otherwise 1
+ */
+int
+pgmoneta_prometheus_serve(struct ev_loop* loop, int client_fd);
+
+/**
+ * Close the metrics connections served from the main loop
+ * @param loop The loop
+ */
+void
+pgmoneta_prometheus_close_clients(struct ev_loop* loop);
+
 #ifdef __cplusplus
 }
 #endif
@@ -98,6 +98,47 @@ pgmoneta_tls_valid(void);
 int
 pgmoneta_generate_file_sha256_hash(char* filename, char** sha256);
 
+/**
+ * Start recording the SHA256 of the files written by the pipelines. The
+ * registry is in shared memory, so the workers and the child processes
+ * record into it as well
+ * @return 0 upon success, otherwise 1
+ */
+int
+pgmoneta_sha256_registry_start(void);
+
+/**
+ * Are the SHA256 of the written files recorded
+ * @return True if recorded, otherwise false
+ */
+bool
+pgmoneta_sha256_registry_active(void);
+
+/**
+ * Record the SHA256 of a file that has been written
+ * @param path The file path
+ * @param fd The file descriptor of the file, still open
+ * @param hash The SHA256 digest
+ */
+void
+pgmoneta_sha256_registry_add(char* path, int fd, unsigned char* hash);
+
+/**
+ * Get the recorded SHA256 of a file. Nothing is returned for a file that
+ * has changed since it was recorded
+ * @param path The file path
+ * @param sha256 The hash value
+ * @return 0 upon success, otherwise 1
+ */
+int
+pgmoneta_sha256_registry_get(char* path, char** sha256);
+
+/**
+ * Stop recording the SHA256 of the written files
+ */
+void
+pgmoneta_sha256_registry_stop(void);
+
 /**
  * Generate SHA256 for a string.
  * @param filename The string.
@@ -44,6 +44,12 @@ extern "C" {
 #define LONG_TIME_LENGHT  16 + 1
 #define UTC_TIME_LENGTH   29 + 1
 
+#define COPY_METHOD_CLONE      0
+#define COPY_METHOD_RANGE      1
+#define COPY_METHOD_SENDFILE   2
+#define COPY_METHOD_READ_WRITE 3
+#define NUMBER_OF_COPY_METHODS 4
+
 /** @struct
  * Defines the signal structure
  */
@@ -53,6 +59,15 @@ struct signal_info
    int slot;                /**< The slot */
 };
 
+/** @struct
+ * Defines the statistics of the file copies done by a process
+ */
+struct copy_statistics
+{
+   unsigned long files[NUMBER_OF_COPY_METHODS]; /**< The number of files finished by each copy method */
+   unsigned long bytes[NUMBER_OF_COPY_METHODS]; /**< The number of bytes copied by each copy method */
+};
+
 /** @struct
  * Defines pgmoneta commands.
  * The necessary fields are marked with an ">".
@@ -490,6 +505,15 @@ pgmoneta_remove_whitespace(char* orig);
 unsigned long
 pgmoneta_directory_size(char* directory);
 
+/**
+ * Calculate the disk usage of a file, link or directory the same way as
+ * pgmoneta_directory_size() counts it
+ * @param path The path
+ * @return The size in bytes
+ */
+unsigned long
+pgmoneta_disk_usage(char* path);
+
 /**
  * Get directories
  * @param base The base directory
@@ -538,7 +562,8 @@ int
 pgmoneta_delete_file(char* file, struct workers* workers);
 
 /**
- * Copy a PostgreSQL installation
+ * Copy a PostgreSQL installation, compressed and encrypted files
+ * are restored into their plain form
  * @param from The from directory
  * @param to The to directory
  * @param base The base directory
@@ -572,6 +597,27 @@ pgmoneta_copy_directory(char* from, char* to, char** restore_last_paths, struct
 int
 pgmoneta_copy_file(char* from, char* to, struct workers* workers);
 
+/**
+ * Reset the copy statistics of the process
+ */
+void
+pgmoneta_reset_copy_statistics(void);
+
+/**
+ * Get the copy statistics of the process
+ * @param statistics The statistics
+ */
+void
+pgmoneta_get_copy_statistics(struct copy_statistics* statistics);
+
+/**
+ * Get the name of a copy method
+ * @param method The copy method
+ * @return The name
+ */
+char*
+pgmoneta_copy_method_name(int method);
+
 /**
  * Move a file
  * @param from The from file
@@ -658,7 +704,8 @@ char*
 pgmoneta_get_symlink(char* symlink);
 
 /**
- * Copy WAL files
+ * Copy WAL files, compressed and encrypted files are restored
+ * into their plain form
  * @param from The from directory
  * @param to The to directory
  * @param start The start file
@@ -936,6 +983,14 @@ pgmoneta_get_file_size(char* file_path);
 bool
 pgmoneta_is_file_archive(char* file_path);
 
+/**
+ * Is the file a WAL segment, based on its name
+ * @param file_path The file path
+ * @return True if the name is a WAL segment name, otherwise false
+ */
+bool
+pgmoneta_is_wal_segment(char* file_path);
+
 /** @struct
  * Defines token bucket structure
  */
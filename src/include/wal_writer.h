@@ -0,0 +1,161 @@
+/*
+ * Copyright (C) 2024 The pgmoneta community
+ *
+ * Redistribution and use in source and binary forms, with or without modification,
+ * are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, this list
+ * of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice, this
+ * list of conditions and the following disclaimer in the documentation and/or other
+ * materials provided with the distribution.
+ *
+ * 3. Neither the name of the copyright holder nor the names of its contributors may
+ * be used to endorse or promote products derived from this software without specific
+ * prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL
+ * THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT
+ * OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR
+ * TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef PGMONETA_WAL_WRITER_H
+#define PGMONETA_WAL_WRITER_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <pgmoneta.h>
+#include <pipeline.h>
+
+#include <stdbool.h>
+#include <stdlib.h>
+
+#ifdef HAVE_LIBURING
+#include <liburing.h>
+#endif
+
+#define WAL_WRITER_MAX_FILES   2
+#define WAL_WRITER_BUFFER_SIZE (256 * 1024)
+#define WAL_WRITER_ALIGNMENT   4096
+
+/** @struct
+ * Defines a WAL segment file written by a WAL writer
+ */
+struct wal_writer_file
+{
+   int fd;                     /**< The file descriptor */
+   char root[MAX_PATH];        /**< The directory of the segment */
+   char filename[MISC_LENGTH]; /**< The name of the segment */
+};
+
+/** @struct
+ * Defines a WAL writer. The same WAL is written to every open file, and
+ * the positions are byte offsets in the current segment. When compression
+ * or encryption is configured the WAL of the first file is also pushed
+ * through a pipeline, and the stored segment replaces the plain one once
+ * the segment is complete
+ */
+struct wal_writer
+{
+   int server;             /**< The server */
+   int segsize;            /**< The size of a segment */
+   int sync;               /**< The sync policy */
+   int sync_size;          /**< The number of bytes between syncs for the size policy */
+   bool direct;            /**< Are the files opened with O_DIRECT */
+   char* buffer;           /**< The aligned write buffer */
+   size_t buffer_offset;   /**< The segment offset of the first byte in the buffer */
+   size_t buffer_length;   /**< The number of bytes in the buffer */
+   size_t position;        /**< The number of bytes received for the segment */
+   size_t issued;          /**< The number of bytes written to the files */
+   size_t synced;          /**< The number of bytes synced to disk */
+   bool store;             /**< Are the segments of the first file compressed and encrypted */
+   struct pipeline_stage* pipeline;  /**< The pipeline of the stored segment */
+   char store_path[MAX_PATH];        /**< The partial path of the stored segment */
+   int number_of_files;    /**< The number of open files */
+   struct wal_writer_file files[WAL_WRITER_MAX_FILES]; /**< The open files */
+#ifdef HAVE_LIBURING
+   bool uring;             /**< Is the ring available */
+   struct io_uring ring;   /**< The ring used to batch the writes and syncs */
+#endif
+};
+
+/**
+ * Create a WAL writer using the configured sync policy, compression and encryption
+ * @param server The server
+ * @param segsize The size of a WAL segment
+ * @param writer The resulting writer
+ * @return 0 upon success, otherwise 1
+ */
+int
+pgmoneta_wal_writer_create(int server, int segsize, struct wal_writer** writer);
+
+/**
+ * Open the partial file of a segment for writing. A new file is
+ * preallocated to the segment size. The first file is the one that is
+ * compressed and encrypted
+ * @param writer The writer
+ * @param root The directory
+ * @param filename The segment name
+ * @return 0 upon success, otherwise 1
+ */
+int
+pgmoneta_wal_writer_open(struct wal_writer* writer, char* root, char* filename);
+
+/**
+ * Write WAL to all open files, syncing according to the policy
+ * @param writer The writer
+ * @param data The data
+ * @param length The length of the data
+ * @return 0 upon success, otherwise 1
+ */
+int
+pgmoneta_wal_writer_write(struct wal_writer* writer, void* data, size_t length);
+
+/**
+ * Write out the buffered WAL and sync all open files
+ * @param writer The writer
+ * @return 0 upon success, otherwise 1
+ */
+int
+pgmoneta_wal_writer_sync(struct wal_writer* writer);
+
+/**
+ * Get the number of bytes of the segment that can be reported as flushed.
+ * This is the synced position, unless the sync policy is off
+ * @param writer The writer
+ * @return The number of bytes
+ */
+size_t
+pgmoneta_wal_writer_flushed(struct wal_writer* writer);
+
+/**
+ * Close the segment. A complete segment is synced and renamed from its
+ * partial name, and replaced by its stored form when there is one
+ * @param writer The writer
+ * @param partial Is the segment incomplete
+ * @return 0 upon success, otherwise 1
+ */
+int
+pgmoneta_wal_writer_close(struct wal_writer* writer, bool partial);
+
+/**
+ * Destroy a WAL writer
+ * @param writer The writer
+ */
+void
+pgmoneta_wal_writer_destroy(struct wal_writer* writer);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -36,46 +36,105 @@ extern "C" {
 #include <pgmoneta.h>
 
 #include <pthread.h>
+#include <stdatomic.h>
 #include <stdio.h>
 #include <stdlib.h>
 
-struct semaphore
+#define WORKERS_QUEUE_SIZE 4096
+#define WORKER_DEQUE_SIZE  1024
+#define WORKER_BATCH_SIZE     4
+
+/** @struct
+ * Defines a unit of work
+ */
+struct task
 {
-   pthread_mutex_t mutex;
-   pthread_cond_t cond;
-   int value;
+   void (*function)(void* arg); /**< The function */
+   void* arg;                   /**< The argument */
 };
 
-struct task
+/** @struct
+ * Defines a slot in the submission queue
+ */
+struct slot
 {
-   struct task* previous;
-   void (*function)(void* arg);
-   void* arg;
+   atomic_size_t sequence;     /**< The sequence number of the slot */
+   struct task* _Atomic task;  /**< The task */
 };
 
+/** @struct
+ * Defines the bounded, lock-free submission queue shared by all workers
+ */
 struct queue
 {
-   pthread_mutex_t rwmutex;
-   struct task* front;
-   struct task* rear;
-   struct semaphore* has_tasks;
-   int number_of_tasks;
+   struct slot* slots;                                  /**< The slots */
+   size_t mask;                                         /**< The index mask */
+   atomic_size_t enqueue_position __attribute__ ((aligned (64))); /**< The next position to enqueue */
+   atomic_size_t dequeue_position __attribute__ ((aligned (64))); /**< The next position to dequeue */
 };
 
+/** @struct
+ * Defines the per-worker work-stealing deque. The owner pushes and
+ * takes at the bottom, other workers steal from the top
+ */
+struct deque
+{
+   struct task* _Atomic* tasks;                  /**< The tasks */
+   long mask;                                    /**< The index mask */
+   atomic_long top __attribute__ ((aligned (64)));    /**< The top index */
+   atomic_long bottom __attribute__ ((aligned (64))); /**< The bottom index */
+};
+
+/** @struct
+ * Defines the statistics of a worker
+ */
+struct worker_statistics
+{
+   unsigned long executed;       /**< The number of tasks executed */
+   unsigned long local;          /**< The number of tasks taken from the own deque */
+   unsigned long submitted;      /**< The number of tasks taken from the submission queue */
+   unsigned long stolen;         /**< The number of tasks stolen from other workers */
+   unsigned long steal_failures; /**< The number of steal attempts that found no work */
+   unsigned long parks;          /**< The number of times the worker went to sleep */
+};
+
+/** @struct
+ * Defines a worker
+ */
 struct worker
 {
-   pthread_t pthread;
-   struct workers* workers;
+   pthread_t pthread;                     /**< The thread */
+   int index;                             /**< The index of the worker */
+   unsigned int seed;                     /**< The victim selection seed */
+   struct deque deque;                    /**< The deque */
+   atomic_ulong executed;                 /**< The number of tasks executed */
+   atomic_ulong local;                    /**< The number of tasks taken from the own deque */
+   atomic_ulong submitted;                /**< The number of tasks taken from the submission queue */
+   atomic_ulong stolen;                   /**< The number of tasks stolen from other workers */
+   atomic_ulong steal_failures;           /**< The number of steal attempts that found no work */
+   atomic_ulong parks;                    /**< The number of times the worker went to sleep */
+   struct workers* workers;               /**< The worker pool */
 };
 
+/** @struct
+ * Defines a worker pool
+ */
 struct workers
 {
-   struct worker** worker;
-   volatile int number_of_alive;
-   volatile int number_of_working;
-   pthread_mutex_t worker_lock;
-   pthread_cond_t worker_all_idle;
-   struct queue queue;
+   struct worker** worker;      /**< The workers */
+   int number_of_workers;       /**< The number of workers */
+   atomic_int number_of_alive;  /**< The number of running workers */
+   atomic_bool keepalive;       /**< Should the workers keep running */
+   atomic_int pending;          /**< The number of tasks waiting to be picked up */
+   atomic_int outstanding;      /**< The number of tasks not yet finished */
+   atomic_int sleeping;         /**< The number of parked workers */
+   atomic_ulong queue_full;     /**< The number of times the submission queue was full */
+   atomic_bool outcome;         /**< The outcome of the tasks, false once a task failed */
+   pthread_mutex_t park_lock;   /**< The lock for parking workers */
+   pthread_cond_t has_tasks;    /**< Signaled when tasks are added */
+   pthread_mutex_t worker_lock; /**< The lock for waiting on completion */
+   pthread_cond_t worker_all_idle; /**< Signaled when all tasks are done */
+   struct queue queue;          /**< The submission queue */
 };
 
 struct worker_input
@@ -97,7 +156,8 @@ int
 pgmoneta_workers_initialize(int num, struct workers** workers);
 
 /**
- * Add work to the queue
+ * Add work to the queue. Work added from a worker thread goes to the
+ * deque of that worker, otherwise to the submission queue
  * @param workers The workers
  * @param function The function pointer
  * @param ap The arguments
@@ -120,6 +180,16 @@ pgmoneta_workers_wait(struct workers* workers);
 void
 pgmoneta_workers_destroy(struct workers* workers);
 
+/**
+ * Get the statistics of a worker
+ * @param workers The workers
+ * @param index The index of the worker
+ * @param statistics The resulting statistics
+ * @return 0 upon success, otherwise 1
+ */
+int
+pgmoneta_workers_statistics(struct workers* workers, int index, struct worker_statistics* statistics);
+
 /**
  * Get the number of workers for a server
  * @param server The server identifier
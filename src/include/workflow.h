@@ -87,6 +87,13 @@ pgmoneta_workflow_delete(struct workflow* workflow);
 struct workflow*
 pgmoneta_workflow_create_basebackup(void);
 
+/**
+ * Create a workflow for reconstructing an incremental backup
+ * @return The workflow
+ */
+struct workflow*
+pgmoneta_workflow_create_incremental(void);
+
 /**
  * Create a workflow for the restore
  * @return The workflow
@@ -198,6 +205,14 @@ pgmoneta_workflow_create_cleanup(int type);
  */
 struct workflow*
 pgmoneta_workflow_encryption(bool encrypt);
+
+/**
+ * Create a workflow that compresses and encrypts each file in a single pass
+ * @return The workflow
+ */
+struct workflow*
+pgmoneta_workflow_create_compress_encrypt(void);
+
 #ifdef __cplusplus
 }
 #endif
@@ -584,13 +584,68 @@ static const EVP_CIPHER* (*get_cipher(int mode))(void)
    return &EVP_aes_256_cbc;
 }
 
-// enc: 1 for encrypt, 0 for decrypt
-static int
-encrypt_file(char* from, char* to, int enc)
+int
+pgmoneta_create_encryption_context(bool encrypt, EVP_CIPHER_CTX** ctx)
 {
    unsigned char key[EVP_MAX_KEY_LENGTH];
    unsigned char iv[EVP_MAX_IV_LENGTH];
    char* master_key = NULL;
+   EVP_CIPHER_CTX* c = NULL;
+   const EVP_CIPHER* (* cipher_fp)(void) = NULL;
+   struct configuration* config;
+
+   *ctx = NULL;
+
+   config = (struct configuration*)shmem;
+   cipher_fp = get_cipher(config->encryption);
+
+   if (pgmoneta_get_master_key(&master_key))
+   {
+      pgmoneta_log_fatal("pgmoneta_get_master_key: Invalid master key");
+      goto error;
+   }
+
+   memset(&key, 0, sizeof(key));
+   memset(&iv, 0, sizeof(iv));
+   if (derive_key_iv(master_key, key, iv, config->encryption) != 0)
+   {
+      pgmoneta_log_fatal("derive_key_iv: Failed to derive key and iv");
+      goto error;
+   }
+
+   if (!(c = EVP_CIPHER_CTX_new()))
+   {
+      pgmoneta_log_fatal("EVP_CIPHER_CTX_new: Failed to get context");
+      goto error;
+   }
+
+   if (EVP_CipherInit_ex(c, cipher_fp(), NULL, key, iv, encrypt ? 1 : 0) == 0)
+   {
+      pgmoneta_log_error("EVP_CipherInit_ex: Failed to initialize context");
+      goto error;
+   }
+
+   *ctx = c;
+
+   free(master_key);
+
+   return 0;
+
+error:
+
+   if (c != NULL)
+   {
+      EVP_CIPHER_CTX_free(c);
+   }
+   free(master_key);
+
+   return 1;
+}
+
+// enc: 1 for encrypt, 0 for decrypt
+static int
+encrypt_file(char* from, char* to, int enc)
+{
    EVP_CIPHER_CTX* ctx = NULL;
    struct configuration* config;
    const EVP_CIPHER* (* cipher_fp)(void) = NULL;
@@ -611,22 +666,8 @@ encrypt_file(char* from, char* to, int enc)
    unsigned char inbuf[inbuf_size];
    unsigned char outbuf[outbuf_size];
 
-   if (pgmoneta_get_master_key(&master_key))
-   {
-      pgmoneta_log_fatal("pgmoneta_get_master_key: Invalid master key");
-      goto error;
-   }
-   memset(&key, 0, sizeof(key));
-   memset(&iv, 0, sizeof(iv));
-   if (derive_key_iv(master_key, key, iv, config->encryption) != 0)
-   {
-      pgmoneta_log_fatal("derive_key_iv: Failed to derive key and iv");
-      goto error;
-   }
-
-   if (!(ctx = EVP_CIPHER_CTX_new()))
+   if (pgmoneta_create_encryption_context(enc == 1, &ctx))
    {
-      pgmoneta_log_fatal("EVP_CIPHER_CTX_new: Failed to get context");
       goto error;
    }
 
@@ -638,18 +679,12 @@ encrypt_file(char* from, char* to, int enc)
    }
 
    out = fopen(to, "w");
-   if (in == NULL)
+   if (out == NULL)
    {
       pgmoneta_log_error("fopen: Could not open %s", to);
       goto error;
    }
 
-   if (EVP_CipherInit_ex(ctx, cipher_fp(), NULL, key, iv, enc) == 0)
-   {
-      pgmoneta_log_error("EVP_CipherInit_ex: ailed to initialize context");
-      goto error;
-   }
-
    while ((inl = fread(inbuf, sizeof(char), inbuf_size, in)) > 0)
    {
       if (EVP_CipherUpdate(ctx, outbuf, &outl, inbuf, inl) == 0)
@@ -689,7 +724,6 @@ encrypt_file(char* from, char* to, int enc)
    {
       EVP_CIPHER_CTX_free(ctx);
    }
-   free(master_key);
    fclose(in);
    fclose(out);
    return 0;
@@ -699,8 +733,13 @@ error:
    {
       EVP_CIPHER_CTX_free(ctx);
    }
-   free(master_key);
-   fclose(in);
-   fclose(out);
+   if (in != NULL)
+   {
+      fclose(in);
+   }
+   if (out != NULL)
+   {
+      fclose(out);
+   }
    return 1;
 }
@@ -35,6 +35,7 @@
 #include <lz4_compression.h>
 #include <management.h>
 #include <network.h>
+#include <prometheus.h>
 #include <restore.h>
 #include <utils.h>
 #include <workflow.h>
@@ -263,6 +264,7 @@ int
 pgmoneta_extract_tar_file(char* file_path, char* destination)
 {
    char* archive_name = NULL;
+   uint64_t start;
    struct archive* a;
    struct archive_entry* entry;
    struct configuration* config;
@@ -320,11 +322,13 @@ pgmoneta_extract_tar_file(char* file_path, char* destination)
       }
 
       archive_entry_set_pathname(entry, dst_file_path);
+      start = pgmoneta_prometheus_timer();
       if (archive_read_extract(a, entry, 0) != ARCHIVE_OK)
       {
          pgmoneta_log_error("Failed to extract entry: %s", archive_error_string(a));
          goto error;
       }
+      pgmoneta_prometheus_observe(HISTOGRAM_TAR_EXTRACT, start);
    }
 
    free(archive_name);
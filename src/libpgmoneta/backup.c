@@ -29,6 +29,7 @@
 /* pgmoneta */
 #include <pgmoneta.h>
 #include <backup.h>
+#include <catalog.h>
 #include <info.h>
 #include <logging.h>
 #include <management.h>
@@ -62,6 +63,7 @@ pgmoneta_backup(int client_fd, int server, char** argv)
    struct workflow* current = NULL;
    struct node* i_nodes = NULL;
    struct node* o_nodes = NULL;
+   struct info_transaction* info = NULL;
    struct configuration* config;
 
    pgmoneta_start_logging();
@@ -91,6 +93,7 @@ pgmoneta_backup(int client_fd, int server, char** argv)
    root = pgmoneta_get_server_backup_identifier(server, &date[0]);
 
    pgmoneta_mkdir(root);
+   pgmoneta_catalog_refresh(root);
 
    d = pgmoneta_get_server_backup_identifier_data(server, &date[0]);
 
@@ -127,7 +130,7 @@ pgmoneta_backup(int client_fd, int server, char** argv)
    }
 
    size = pgmoneta_directory_size(d);
-   pgmoneta_update_info_unsigned_long(root, INFO_BACKUP, size);
+   pgmoneta_catalog_add_size(server, CATALOG_SIZE_BACKUP, size);
 
    total_seconds = (int)difftime(time(NULL), start_time);
    hours = total_seconds / 3600;
@@ -139,7 +142,12 @@ pgmoneta_backup(int client_fd, int server, char** argv)
 
    pgmoneta_log_info("Backup: %s/%s (Elapsed: %s)", config->servers[server].name, &date[0], &elapsed[0]);
 
-   pgmoneta_update_info_unsigned_long(root, INFO_ELAPSED, total_seconds);
+   if (!pgmoneta_info_begin(root, &info))
+   {
+      pgmoneta_info_set_unsigned_long(info, INFO_BACKUP, size);
+      pgmoneta_info_set_unsigned_long(info, INFO_ELAPSED, total_seconds);
+      pgmoneta_info_commit(info);
+   }
 
    atomic_store(&config->servers[server].backup, false);
 
@@ -194,3 +202,63 @@ pgmoneta_get_backup_max_rate(int server)
 
    return config->backup_max_rate;
 }
+
+int
+pgmoneta_get_manifest_checksum(int server)
+{
+   struct configuration* config;
+
+   config = (struct configuration*)shmem;
+
+   if (config->servers[server].manifest != -1)
+   {
+      return config->servers[server].manifest;
+   }
+
+   return config->manifest;
+}
+
+int
+pgmoneta_get_wal_status_interval(int server)
+{
+   struct configuration* config;
+
+   config = (struct configuration*)shmem;
+
+   if (config->servers[server].wal_status_interval != -1)
+   {
+      return config->servers[server].wal_status_interval;
+   }
+
+   return config->wal_status_interval;
+}
+
+int
+pgmoneta_get_wal_status_size(int server)
+{
+   struct configuration* config;
+
+   config = (struct configuration*)shmem;
+
+   if (config->servers[server].wal_status_size != -1)
+   {
+      return config->servers[server].wal_status_size;
+   }
+
+   return config->wal_status_size;
+}
+
+int
+pgmoneta_get_backup_connections(int server)
+{
+   struct configuration* config;
+
+   config = (struct configuration*)shmem;
+
+   if (config->servers[server].backup_connections != -1)
+   {
+      return config->servers[server].backup_connections;
+   }
+
+   return config->backup_connections;
+}
@@ -0,0 +1,920 @@
+/*
+ * Copyright (C) 2024 The pgmoneta community
+ *
+ * Redistribution and use in source and binary forms, with or without modification,
+ * are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, this list
+ * of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice, this
+ * list of conditions and the following disclaimer in the documentation and/or other
+ * materials provided with the distribution.
+ *
+ * 3. Neither the name of the copyright holder nor the names of its contributors may
+ * be used to endorse or promote products derived from this software without specific
+ * prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL
+ * THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT
+ * OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR
+ * TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/* pgmoneta */
+#include <pgmoneta.h>
+#include <catalog.h>
+#include <info.h>
+#include <logging.h>
+#include <shmem.h>
+#include <utils.h>
+
+/* system */
+#include <dirent.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <string.h>
+
+static int find_server(char* directory);
+static char* strip_slashes(char* directory);
+static int find_label(struct catalog_server* cs, char* label, bool* found);
+static void lock_server(struct catalog_server* cs);
+static void unlock_server(struct catalog_server* cs);
+static unsigned long read_begin(struct catalog_server* cs);
+static bool read_retry(struct catalog_server* cs, unsigned long sequence);
+static void load_server(int server);
+static struct catalog_server* server_sizes(int server);
+static void reconcile_server(int server);
+static void reconcile_directory(char* directory, long* wal, long* backup, long* other);
+
+int
+pgmoneta_init_catalog(size_t* p_size, void** p_shmem)
+{
+   size_t size;
+   struct catalog* catalog = NULL;
+   struct configuration* config;
+
+   config = (struct configuration*)shmem;
+
+   size = sizeof(struct catalog) + config->number_of_servers * sizeof(struct catalog_server);
+
+   if (pgmoneta_create_shared_memory(size, config->hugepage, (void**)&catalog))
+   {
+      goto error;
+   }
+
+   memset(catalog, 0, size);
+   catalog->number_of_servers = config->number_of_servers;
+   atomic_init(&catalog->sizes, false);
+   atomic_init(&catalog->other_size, 0);
+
+   for (int i = 0; i < catalog->number_of_servers; i++)
+   {
+      atomic_init(&catalog->servers[i].sequence, 0);
+      atomic_init(&catalog->servers[i].lock, STATE_FREE);
+      atomic_init(&catalog->servers[i].sizes, false);
+      for (int j = 0; j < NUMBER_OF_CATALOG_SIZES; j++)
+      {
+         atomic_init(&catalog->servers[i].size[j], 0);
+      }
+   }
+
+   *p_shmem = catalog;
+   *p_size = size;
+
+   return 0;
+
+error:
+
+   *p_size = 0;
+   *p_shmem = NULL;
+
+   return 1;
+}
+
+void
+pgmoneta_catalog_load(void)
+{
+   struct catalog* catalog;
+   struct configuration* config;
+
+   catalog = (struct catalog*)catalog_shmem;
+   config = (struct configuration*)shmem;
+
+   if (catalog == NULL)
+   {
+      return;
+   }
+
+   /* The sizes are unknown until the next reconciliation */
+   atomic_store(&catalog->sizes, false);
+
+   for (int i = 0; i < catalog->number_of_servers && i < config->number_of_servers; i++)
+   {
+      atomic_store(&catalog->servers[i].sizes, false);
+      load_server(i);
+   }
+
+   /* Servers added by a reload are read from the disk */
+   for (int i = config->number_of_servers; i < catalog->number_of_servers; i++)
+   {
+      lock_server(&catalog->servers[i]);
+      atomic_fetch_add(&catalog->servers[i].sequence, 1);
+      catalog->servers[i].loaded = false;
+      catalog->servers[i].number_of_backups = 0;
+      atomic_fetch_add(&catalog->servers[i].sequence, 1);
+      unlock_server(&catalog->servers[i]);
+   }
+}
+
+void
+pgmoneta_catalog_refresh(char* directory)
+{
+   int server;
+   int index;
+   bool found = false;
+   char* d = NULL;
+   char* label = NULL;
+   struct backup* backup = NULL;
+   struct catalog_server* cs = NULL;
+   struct catalog* catalog;
+
+   catalog = (struct catalog*)catalog_shmem;
+
+   if (catalog == NULL || directory == NULL)
+   {
+      return;
+   }
+
+   d = strip_slashes(directory);
+   if (d == NULL)
+   {
+      return;
+   }
+
+   label = strrchr(d, '/');
+   if (label == NULL)
+   {
+      goto done;
+   }
+
+   *label = '\0';
+   label++;
+
+   server = find_server(d);
+   if (server == -1)
+   {
+      goto done;
+   }
+
+   cs = &catalog->servers[server];
+
+   if (strlen(label) == 0 || strlen(label) >= MISC_LENGTH)
+   {
+      goto done;
+   }
+
+   /* Read the file under the lock, so concurrent refreshes can't be reordered */
+   lock_server(cs);
+
+   if (pgmoneta_exists(directory))
+   {
+      pgmoneta_read_backup(d, label, &backup);
+   }
+
+   atomic_fetch_add(&cs->sequence, 1);
+
+   index = find_label(cs, label, &found);
+
+   if (backup == NULL)
+   {
+      if (found)
+      {
+         memmove(&cs->backups[index], &cs->backups[index + 1],
+                 (cs->number_of_backups - index - 1) * sizeof(struct backup));
+         cs->number_of_backups--;
+      }
+   }
+   else if (found)
+   {
+      memcpy(&cs->backups[index], backup, sizeof(struct backup));
+   }
+   else if (cs->number_of_backups < CATALOG_MAX_BACKUPS)
+   {
+      memmove(&cs->backups[index + 1], &cs->backups[index],
+              (cs->number_of_backups - index) * sizeof(struct backup));
+      memcpy(&cs->backups[index], backup, sizeof(struct backup));
+      cs->number_of_backups++;
+   }
+   else if (cs->loaded)
+   {
+      pgmoneta_log_debug("Catalog: More than %d backups, using the disk", CATALOG_MAX_BACKUPS);
+      cs->loaded = false;
+   }
+
+   atomic_fetch_add(&cs->sequence, 1);
+   unlock_server(cs);
+
+done:
+
+   free(backup);
+   free(d);
+}
+
+int
+pgmoneta_catalog_get_backups(char* directory, int* number_of_backups, struct backup*** backups)
+{
+   int server;
+   int number = 0;
+   unsigned long sequence;
+   bool loaded;
+   struct backup** bcks = NULL;
+   struct catalog_server* cs = NULL;
+   struct catalog* catalog;
+
+   catalog = (struct catalog*)catalog_shmem;
+
+   *number_of_backups = 0;
+   *backups = NULL;
+
+   if (catalog == NULL)
+   {
+      return 1;
+   }
+
+   server = find_server(directory);
+   if (server == -1)
+   {
+      return 1;
+   }
+
+   cs = &catalog->servers[server];
+
+   do
+   {
+      if (bcks != NULL)
+      {
+         for (int i = 0; i < number; i++)
+         {
+            free(bcks[i]);
+         }
+         free(bcks);
+         bcks = NULL;
+      }
+
+      sequence = read_begin(cs);
+
+      loaded = cs->loaded;
+      number = cs->number_of_backups;
+
+      if (!loaded || number < 0 || number > CATALOG_MAX_BACKUPS)
+      {
+         number = 0;
+         continue;
+      }
+
+      bcks = (struct backup**)malloc(number * sizeof(struct backup*));
+      if (bcks == NULL && number > 0)
+      {
+         return 1;
+      }
+
+      for (int i = 0; i < number; i++)
+      {
+         bcks[i] = (struct backup*)malloc(sizeof(struct backup));
+         if (bcks[i] != NULL)
+         {
+            memcpy(bcks[i], &cs->backups[i], sizeof(struct backup));
+         }
+      }
+   }
+   while (read_retry(cs, sequence));
+
+   if (!loaded)
+   {
+      return 1;
+   }
+
+   for (int i = 0; i < number; i++)
+   {
+      if (bcks[i] == NULL)
+      {
+         goto error;
+      }
+   }
+
+   *number_of_backups = number;
+   *backups = bcks;
+
+   return 0;
+
+error:
+
+   for (int i = 0; i < number; i++)
+   {
+      free(bcks[i]);
+   }
+   free(bcks);
+
+   return 1;
+}
+
+int
+pgmoneta_catalog_get_backup(char* directory, char* label, struct backup** backup)
+{
+   int server;
+   int index;
+   bool found;
+   bool loaded;
+   unsigned long sequence;
+   struct backup* bck = NULL;
+   struct catalog_server* cs = NULL;
+   struct catalog* catalog;
+
+   catalog = (struct catalog*)catalog_shmem;
+
+   *backup = NULL;
+
+   if (catalog == NULL || label == NULL)
+   {
+      return 1;
+   }
+
+   server = find_server(directory);
+   if (server == -1)
+   {
+      return 1;
+   }
+
+   cs = &catalog->servers[server];
+
+   bck = (struct backup*)malloc(sizeof(struct backup));
+   if (bck == NULL)
+   {
+      return 1;
+   }
+
+   do
+   {
+      sequence = read_begin(cs);
+
+      found = false;
+      loaded = cs->loaded;
+
+      if (loaded && cs->number_of_backups >= 0 && cs->number_of_backups <= CATALOG_MAX_BACKUPS)
+      {
+         index = find_label(cs, label, &found);
+         if (found)
+         {
+            memcpy(bck, &cs->backups[index], sizeof(struct backup));
+         }
+      }
+   }
+   while (read_retry(cs, sequence));
+
+   if (!loaded || !found)
+   {
+      free(bck);
+      return 1;
+   }
+
+   *backup = bck;
+
+   return 0;
+}
+
+void
+pgmoneta_catalog_add_size(int server, int type, long delta)
+{
+   struct catalog_server* cs = NULL;
+
+   cs = server_sizes(server);
+
+   if (cs != NULL && type >= 0 && type < NUMBER_OF_CATALOG_SIZES)
+   {
+      atomic_fetch_add(&cs->size[type], delta);
+   }
+}
+
+void
+pgmoneta_catalog_set_size(int server, int type, unsigned long size)
+{
+   struct catalog_server* cs = NULL;
+
+   cs = server_sizes(server);
+
+   if (cs != NULL && type >= 0 && type < NUMBER_OF_CATALOG_SIZES)
+   {
+      atomic_store(&cs->size[type], (long)size);
+   }
+}
+
+unsigned long
+pgmoneta_catalog_size(int server, int type)
+{
+   long size;
+   char* d = NULL;
+   unsigned long result = 0;
+   struct catalog_server* cs = NULL;
+
+   cs = server_sizes(server);
+
+   if (cs != NULL && type >= 0 && type < NUMBER_OF_CATALOG_SIZES)
+   {
+      size = atomic_load(&cs->size[type]);
+
+      return size > 0 ? (unsigned long)size : 0;
+   }
+
+   if (type == CATALOG_SIZE_BACKUP)
+   {
+      d = pgmoneta_get_server_backup(server);
+   }
+   else if (type == CATALOG_SIZE_WAL)
+   {
+      d = pgmoneta_get_server_wal(server);
+   }
+   else if (type == CATALOG_SIZE_WAL_SHIPPING)
+   {
+      d = pgmoneta_get_server_wal_shipping_wal(server);
+   }
+
+   if (d != NULL)
+   {
+      result = pgmoneta_directory_size(d);
+   }
+
+   free(d);
+
+   return result;
+}
+
+unsigned long
+pgmoneta_catalog_server_size(int server)
+{
+   char* d = NULL;
+   unsigned long result;
+
+   if (server_sizes(server) != NULL)
+   {
+      return pgmoneta_catalog_size(server, CATALOG_SIZE_BACKUP) +
+             pgmoneta_catalog_size(server, CATALOG_SIZE_WAL) +
+             pgmoneta_catalog_size(server, CATALOG_SIZE_SERVER_OTHER);
+   }
+
+   d = pgmoneta_get_server(server);
+   result = pgmoneta_directory_size(d);
+   free(d);
+
+   return result;
+}
+
+unsigned long
+pgmoneta_catalog_wal_shipping_server_size(int server)
+{
+   char* d = NULL;
+   unsigned long result = 0;
+
+   if (server_sizes(server) != NULL)
+   {
+      return pgmoneta_catalog_size(server, CATALOG_SIZE_WAL_SHIPPING) +
+             pgmoneta_catalog_size(server, CATALOG_SIZE_WAL_SHIPPING_OTHER);
+   }
+
+   d = pgmoneta_get_server_wal_shipping(server);
+   if (d != NULL)
+   {
+      result = pgmoneta_directory_size(d);
+   }
+   free(d);
+
+   return result;
+}
+
+unsigned long
+pgmoneta_catalog_used_space(void)
+{
+   long other;
+   char* d = NULL;
+   unsigned long result = 0;
+   struct catalog* catalog;
+   struct configuration* config;
+
+   catalog = (struct catalog*)catalog_shmem;
+   config = (struct configuration*)shmem;
+
+   if (catalog != NULL && atomic_load(&catalog->sizes) && catalog->number_of_servers >= config->number_of_servers)
+   {
+      other = atomic_load(&catalog->other_size);
+      result = other > 0 ? (unsigned long)other : 0;
+
+      for (int i = 0; i < config->number_of_servers; i++)
+      {
+         result += pgmoneta_catalog_server_size(i);
+      }
+
+      return result;
+   }
+
+   d = pgmoneta_append(d, config->base_dir);
+   d = pgmoneta_append(d, "/");
+
+   result = pgmoneta_directory_size(d);
+
+   free(d);
+
+   return result;
+}
+
+void
+pgmoneta_catalog_reconcile(void)
+{
+   long other = 0;
+   bool server;
+   char* path = NULL;
+   DIR* dir = NULL;
+   struct dirent* entry;
+   struct catalog* catalog;
+   struct configuration* config;
+
+   catalog = (struct catalog*)catalog_shmem;
+   config = (struct configuration*)shmem;
+
+   if (catalog == NULL)
+   {
+      return;
+   }
+
+   for (int i = 0; i < catalog->number_of_servers && i < config->number_of_servers; i++)
+   {
+      reconcile_server(i);
+   }
+
+   /* Everything in the base directory that doesn't belong to a server */
+   dir = opendir(config->base_dir);
+   if (dir == NULL)
+   {
+      return;
+   }
+
+   while ((entry = readdir(dir)) != NULL)
+   {
+      if (!strcmp(entry->d_name, ".") || !strcmp(entry->d_name, ".."))
+      {
+         continue;
+      }
+
+      server = false;
+      for (int i = 0; !server && i < config->number_of_servers; i++)
+      {
+         server = !strcmp(entry->d_name, config->servers[i].name);
+      }
+
+      if (!server)
+      {
+         path = pgmoneta_append(NULL, config->base_dir);
+         path = pgmoneta_append(path, "/");
+         path = pgmoneta_append(path, entry->d_name);
+
+         other += pgmoneta_disk_usage(path);
+
+         free(path);
+         path = NULL;
+      }
+   }
+
+   closedir(dir);
+
+   atomic_store(&catalog->other_size, other);
+   atomic_store(&catalog->sizes, true);
+
+   pgmoneta_log_debug("Catalog: Reconciled %lu bytes", pgmoneta_catalog_used_space());
+}
+
+static int
+find_server(char* directory)
+{
+   int server = -1;
+   char* d = NULL;
+   char* sd = NULL;
+   char* backup_directory = NULL;
+   struct catalog* catalog;
+   struct configuration* config;
+
+   catalog = (struct catalog*)catalog_shmem;
+   config = (struct configuration*)shmem;
+
+   if (directory == NULL)
+   {
+      return -1;
+   }
+
+   d = strip_slashes(directory);
+   if (d == NULL)
+   {
+      return -1;
+   }
+
+   for (int i = 0; server == -1 && i < catalog->number_of_servers && i < config->number_of_servers; i++)
+   {
+      backup_directory = pgmoneta_get_server_backup(i);
+      sd = strip_slashes(backup_directory);
+
+      if (sd != NULL && !strcmp(d, sd))
+      {
+         server = i;
+      }
+
+      free(backup_directory);
+      free(sd);
+   }
+
+   free(d);
+
+   return server;
+}
+
+static char*
+strip_slashes(char* directory)
+{
+   char* d = NULL;
+   size_t length;
+
+   d = pgmoneta_append(d, directory);
+   if (d == NULL)
+   {
+      return NULL;
+   }
+
+   length = strlen(d);
+   while (length > 1 && d[length - 1] == '/')
+   {
+      d[--length] = '\0';
+   }
+
+   return d;
+}
+
+static int
+find_label(struct catalog_server* cs, char* label, bool* found)
+{
+   int low = 0;
+   int high = cs->number_of_backups - 1;
+   int middle;
+   int cmp;
+
+   *found = false;
+
+   while (low <= high)
+   {
+      middle = low + (high - low) / 2;
+      cmp = strncmp(cs->backups[middle].label, label, MISC_LENGTH);
+
+      if (cmp == 0)
+      {
+         *found = true;
+         return middle;
+      }
+      else if (cmp < 0)
+      {
+         low = middle + 1;
+      }
+      else
+      {
+         high = middle - 1;
+      }
+   }
+
+   return low;
+}
+
+static void
+lock_server(struct catalog_server* cs)
+{
+   signed char free_state;
+
+retry:
+   free_state = STATE_FREE;
+   if (!atomic_compare_exchange_strong(&cs->lock, &free_state, STATE_IN_USE))
+   {
+      /* Sleep for 1ms */
+      SLEEP_AND_GOTO(1000000L, retry)
+   }
+}
+
+static void
+unlock_server(struct catalog_server* cs)
+{
+   atomic_store(&cs->lock, STATE_FREE);
+}
+
+static unsigned long
+read_begin(struct catalog_server* cs)
+{
+   unsigned long sequence;
+
+   while ((sequence = atomic_load(&cs->sequence)) & 1)
+   {
+      /* Sleep for 10us */
+      SLEEP(10000L)
+   }
+
+   return sequence;
+}
+
+static bool
+read_retry(struct catalog_server* cs, unsigned long sequence)
+{
+   atomic_thread_fence(memory_order_acquire);
+
+   return atomic_load(&cs->sequence) != sequence;
+}
+
+static void
+load_server(int server)
+{
+   bool loaded;
+   int number_of_directories = 0;
+   int number_of_backups = 0;
+   char** dirs = NULL;
+   char* d = NULL;
+   struct backup** backups = NULL;
+   struct catalog_server* cs = NULL;
+   struct catalog* catalog;
+   struct configuration* config;
+
+   catalog = (struct catalog*)catalog_shmem;
+   config = (struct configuration*)shmem;
+
+   cs = &catalog->servers[server];
+
+   d = pgmoneta_get_server_backup(server);
+
+   /* Readers only wait while the entries are copied, not while the disk is read */
+   lock_server(cs);
+
+   pgmoneta_get_directories(d, &number_of_directories, &dirs);
+
+   loaded = number_of_directories <= CATALOG_MAX_BACKUPS;
+
+   if (loaded && number_of_directories > 0)
+   {
+      backups = (struct backup**)malloc(number_of_directories * sizeof(struct backup*));
+      loaded = backups != NULL;
+   }
+
+   for (int i = 0; loaded && i < number_of_directories; i++)
+   {
+      pgmoneta_read_backup(d, dirs[i], &backups[i]);
+      number_of_backups++;
+
+      if (backups[i] == NULL || strlen(dirs[i]) >= MISC_LENGTH)
+      {
+         loaded = false;
+      }
+   }
+
+   atomic_fetch_add(&cs->sequence, 1);
+
+   cs->loaded = loaded;
+   cs->number_of_backups = 0;
+
+   for (int i = 0; loaded && i < number_of_backups; i++)
+   {
+      memcpy(&cs->backups[i], backups[i], sizeof(struct backup));
+      cs->number_of_backups++;
+   }
+
+   atomic_fetch_add(&cs->sequence, 1);
+   unlock_server(cs);
+
+   if (!loaded)
+   {
+      pgmoneta_log_debug("Catalog: %s is read from the disk", config->servers[server].name);
+   }
+
+   for (int i = 0; i < number_of_backups; i++)
+   {
+      free(backups[i]);
+   }
+   free(backups);
+
+   for (int i = 0; i < number_of_directories; i++)
+   {
+      free(dirs[i]);
+   }
+   free(dirs);
+   free(d);
+}
+
+static struct catalog_server*
+server_sizes(int server)
+{
+   struct catalog* catalog;
+   struct configuration* config;
+
+   catalog = (struct catalog*)catalog_shmem;
+   config = (struct configuration*)shmem;
+
+   if (catalog == NULL || server < 0 || server >= catalog->number_of_servers || server >= config->number_of_servers)
+   {
+      return NULL;
+   }
+
+   if (!atomic_load(&catalog->servers[server].sizes))
+   {
+      return NULL;
+   }
+
+   return &catalog->servers[server];
+}
+
+static void
+reconcile_server(int server)
+{
+   long backup = 0;
+   long wal = 0;
+   long other = 0;
+   long ws_wal = 0;
+   long ws_other = 0;
+   char* d = NULL;
+   struct catalog_server* cs = NULL;
+   struct catalog* catalog;
+
+   catalog = (struct catalog*)catalog_shmem;
+
+   cs = &catalog->servers[server];
+
+   d = pgmoneta_get_server(server);
+   reconcile_directory(d, &wal, &backup, &other);
+   free(d);
+
+   d = pgmoneta_get_server_wal_shipping(server);
+   if (d != NULL)
+   {
+      reconcile_directory(d, &ws_wal, NULL, &ws_other);
+   }
+   free(d);
+
+   atomic_store(&cs->size[CATALOG_SIZE_BACKUP], backup);
+   atomic_store(&cs->size[CATALOG_SIZE_WAL], wal);
+   atomic_store(&cs->size[CATALOG_SIZE_SERVER_OTHER], other);
+   atomic_store(&cs->size[CATALOG_SIZE_WAL_SHIPPING], ws_wal);
+   atomic_store(&cs->size[CATALOG_SIZE_WAL_SHIPPING_OTHER], ws_other);
+   atomic_store(&cs->sizes, true);
+}
+
+static void
+reconcile_directory(char* directory, long* wal, long* backup, long* other)
+{
+   char* path = NULL;
+   unsigned long size;
+   DIR* dir = NULL;
+   struct dirent* entry;
+
+   dir = opendir(directory);
+   if (dir == NULL)
+   {
+      return;
+   }
+
+   while ((entry = readdir(dir)) != NULL)
+   {
+      if (!strcmp(entry->d_name, ".") || !strcmp(entry->d_name, ".."))
+      {
+         continue;
+      }
+
+      path = pgmoneta_append(NULL, directory);
+      if (!pgmoneta_ends_with(path, "/"))
+      {
+         path = pgmoneta_append(path, "/");
+      }
+      path = pgmoneta_append(path, entry->d_name);
+
+      size = pgmoneta_disk_usage(path);
+
+      if (!strcmp(entry->d_name, "wal"))
+      {
+         *wal += size;
+      }
+      else if (backup != NULL && !strcmp(entry->d_name, "backup"))
+      {
+         *backup += size;
+      }
+      else
+      {
+         *other += size;
+      }
+
+      free(path);
+      path = NULL;
+   }
+
+   closedir(dir);
+}
@@ -30,6 +30,7 @@
 #include <pgmoneta.h>
 #include <configuration.h>
 #include <logging.h>
+#include <prometheus.h>
 #include <security.h>
 #include <shmem.h>
 #include <utils.h>
@@ -72,6 +73,8 @@ static int as_seconds(char* str, int* age, int default_age);
 static int as_bytes(char* str, int* bytes, int default_bytes);
 static int as_retention(char* str, int* days, int* weeks, int* months, int* years);
 static int as_create_slot(char* str, int* create_slot);
+static int as_manifest(char* str, int* manifest);
+static int as_wal_sync(char* str, int* wal_sync);
 
 static int transfer_configuration(struct configuration* config, struct configuration* reload);
 static void copy_server(struct server* dst, struct server* src);
@@ -109,12 +112,15 @@ pgmoneta_init_configuration(void* shm)
    config->retention_years = -1;
 
    config->link = true;
+   config->incremental = false;
 
    config->tls = false;
 
    config->blocking_timeout = 30;
    config->authentication_timeout = 5;
 
+   config->metrics_cache_max_age = PROMETHEUS_DEFAULT_CACHE_MAX_AGE;
+
    config->buffer_size = DEFAULT_BUFFER_SIZE;
    config->keep_alive = true;
    config->nodelay = true;
@@ -132,6 +138,17 @@ pgmoneta_init_configuration(void* shm)
    config->backup_max_rate = 0;
    config->network_max_rate = 0;
 
+   config->manifest = MANIFEST_CHECKSUM_CRC32C;
+
+   config->wal_status_interval = 10;
+   config->wal_status_size = 1024 * 1024;
+
+   config->backup_connections = 1;
+
+   config->wal_sync = WAL_SYNC_SEGMENT;
+   config->wal_sync_size = 1024 * 1024;
+   config->wal_direct_io = false;
+
    return 0;
 }
 
@@ -209,7 +226,6 @@ pgmoneta_read_configuration(void* shm, char* filename)
 
                   atomic_init(&srv.backup, false);
                   atomic_init(&srv.delete, false);
-                  atomic_init(&srv.wal, false);
                   srv.wal_streaming = false;
                   srv.valid = false;
                   srv.cur_timeline = 1; // by default current timeline is 1
@@ -217,6 +233,11 @@ pgmoneta_read_configuration(void* shm, char* filename)
                   srv.workers = -1;
                   srv.backup_max_rate = -1;
                   srv.network_max_rate = -1;
+                  srv.manifest = -1;
+                  srv.wal_status_interval = -1;
+                  srv.wal_status_size = -1;
+                  srv.backup_connections = -1;
+                  atomic_init(&srv.wal_status_replies, 0);
 
                   idx_server++;
                }
@@ -478,7 +499,7 @@ pgmoneta_read_configuration(void* shm, char* filename)
                {
                   if (!strcmp(section, "pgmoneta"))
                   {
-                     if (as_seconds(value, &config->metrics_cache_max_age, 0))
+                     if (as_seconds(value, &config->metrics_cache_max_age, PROMETHEUS_DEFAULT_CACHE_MAX_AGE))
                      {
                         unknown = true;
                      }
@@ -1178,6 +1199,20 @@ pgmoneta_read_configuration(void* shm, char* filename)
                      unknown = true;
                   }
                }
+               else if (!strcmp(key, "incremental"))
+               {
+                  if (!strcmp(section, "pgmoneta"))
+                  {
+                     if (as_bool(value, &config->incremental))
+                     {
+                        unknown = true;
+                     }
+                  }
+                  else
+                  {
+                     unknown = true;
+                  }
+               }
                else if (!strcmp(key, "encryption"))
                {
                   if (!strcmp(section, "pgmoneta"))
@@ -1189,6 +1224,132 @@ pgmoneta_read_configuration(void* shm, char* filename)
                      unknown = true;
                   }
                }
+               else if (!strcmp(key, "manifest"))
+               {
+                  if (!strcmp(section, "pgmoneta"))
+                  {
+                     if (as_manifest(value, &config->manifest))
+                     {
+                        unknown = true;
+                     }
+                  }
+                  else if (strlen(section) > 0)
+                  {
+                     if (as_manifest(value, &srv.manifest))
+                     {
+                        unknown = true;
+                     }
+                  }
+                  else
+                  {
+                     unknown = true;
+                  }
+               }
+               else if (!strcmp(key, "wal_sync"))
+               {
+                  if (!strcmp(section, "pgmoneta"))
+                  {
+                     if (as_wal_sync(value, &config->wal_sync))
+                     {
+                        unknown = true;
+                     }
+                  }
+                  else
+                  {
+                     unknown = true;
+                  }
+               }
+               else if (!strcmp(key, "wal_sync_size"))
+               {
+                  if (!strcmp(section, "pgmoneta"))
+                  {
+                     if (as_bytes(value, &config->wal_sync_size, 1024 * 1024))
+                     {
+                        unknown = true;
+                     }
+                  }
+                  else
+                  {
+                     unknown = true;
+                  }
+               }
+               else if (!strcmp(key, "wal_direct_io"))
+               {
+                  if (!strcmp(section, "pgmoneta"))
+                  {
+                     if (as_bool(value, &config->wal_direct_io))
+                     {
+                        unknown = true;
+                     }
+                  }
+                  else
+                  {
+                     unknown = true;
+                  }
+               }
+               else if (!strcmp(key, "wal_status_interval"))
+               {
+                  if (!strcmp(section, "pgmoneta"))
+                  {
+                     if (as_seconds(value, &config->wal_status_interval, 10))
+                     {
+                        unknown = true;
+                     }
+                  }
+                  else if (strlen(section) > 0)
+                  {
+                     if (as_seconds(value, &srv.wal_status_interval, -1))
+                     {
+                        unknown = true;
+                     }
+                  }
+                  else
+                  {
+                     unknown = true;
+                  }
+               }
+               else if (!strcmp(key, "wal_status_size"))
+               {
+                  if (!strcmp(section, "pgmoneta"))
+                  {
+                     if (as_bytes(value, &config->wal_status_size, 1024 * 1024))
+                     {
+                        unknown = true;
+                     }
+                  }
+                  else if (strlen(section) > 0)
+                  {
+                     if (as_bytes(value, &srv.wal_status_size, -1))
+                     {
+                        unknown = true;
+                     }
+                  }
+                  else
+                  {
+                     unknown = true;
+                  }
+               }
+               else if (!strcmp(key, "backup_connections"))
+               {
+                  if (!strcmp(section, "pgmoneta"))
+                  {
+                     if (as_int(value, &config->backup_connections))
+                     {
+                        unknown = true;
+                     }
+                  }
+                  else if (strlen(section) > 0)
+                  {
+                     if (as_int(value, &srv.backup_connections))
+                     {
+                        unknown = true;
+                     }
+                  }
+                  else
+                  {
+                     unknown = true;
+                  }
+               }
                else if (!strcmp(key, "backup_max_rate"))
                {
                   if (!strcmp(section, "pgmoneta"))
@@ -1457,6 +1618,11 @@ pgmoneta_validate_configuration(void* shm)
       config->workers = 0;
    }
 
+   if (config->backup_connections < 1)
+   {
+      config->backup_connections = 1;
+   }
+
    for (int i = 0; i < config->number_of_servers; i++)
    {
       if (!strcmp(config->servers[i].name, "pgmoneta"))
@@ -1527,6 +1693,21 @@ pgmoneta_validate_configuration(void* shm)
       {
          config->servers[i].network_max_rate = -1;
       }
+
+      if (config->servers[i].wal_status_interval < -1)
+      {
+         config->servers[i].wal_status_interval = -1;
+      }
+
+      if (config->servers[i].wal_status_size < -1)
+      {
+         config->servers[i].wal_status_size = -1;
+      }
+
+      if (config->servers[i].backup_connections == 0 || config->servers[i].backup_connections < -1)
+      {
+         config->servers[i].backup_connections = -1;
+      }
    }
 
    return 0;
@@ -2964,6 +3145,68 @@ as_create_slot(char* str, int* create_slot)
    return 1;
 }
 
+static int
+as_manifest(char* str, int* manifest)
+{
+   if (!strcasecmp(str, "none"))
+   {
+      *manifest = MANIFEST_CHECKSUM_NONE;
+   }
+   else if (!strcasecmp(str, "crc32c"))
+   {
+      *manifest = MANIFEST_CHECKSUM_CRC32C;
+   }
+   else if (!strcasecmp(str, "sha224"))
+   {
+      *manifest = MANIFEST_CHECKSUM_SHA224;
+   }
+   else if (!strcasecmp(str, "sha256"))
+   {
+      *manifest = MANIFEST_CHECKSUM_SHA256;
+   }
+   else if (!strcasecmp(str, "sha384"))
+   {
+      *manifest = MANIFEST_CHECKSUM_SHA384;
+   }
+   else if (!strcasecmp(str, "sha512"))
+   {
+      *manifest = MANIFEST_CHECKSUM_SHA512;
+   }
+   else
+   {
+      return 1;
+   }
+
+   return 0;
+}
+
+static int
+as_wal_sync(char* str, int* wal_sync)
+{
+   if (!strcasecmp(str, "off"))
+   {
+      *wal_sync = WAL_SYNC_OFF;
+   }
+   else if (!strcasecmp(str, "message"))
+   {
+      *wal_sync = WAL_SYNC_MESSAGE;
+   }
+   else if (!strcasecmp(str, "size"))
+   {
+      *wal_sync = WAL_SYNC_SIZE;
+   }
+   else if (!strcasecmp(str, "segment"))
+   {
+      *wal_sync = WAL_SYNC_SEGMENT;
+   }
+   else
+   {
+      return 1;
+   }
+
+   return 0;
+}
+
 static int
 transfer_configuration(struct configuration* config, struct configuration* reload)
 {
@@ -2990,6 +3233,7 @@ transfer_configuration(struct configuration* config, struct configuration* reloa
    config->retention_months = reload->retention_months;
    config->retention_years = reload->retention_years;
    config->link = reload->link;
+   config->incremental = reload->incremental;
 
    /* log_type */
    restart_int("log_type", config->log_type, reload->log_type);
@@ -3059,6 +3303,13 @@ transfer_configuration(struct configuration* config, struct configuration* reloa
    config->workers = reload->workers;
    config->backup_max_rate = reload->backup_max_rate;
    config->network_max_rate = reload->network_max_rate;
+   config->manifest = reload->manifest;
+   config->wal_status_interval = reload->wal_status_interval;
+   config->wal_status_size = reload->wal_status_size;
+   config->backup_connections = reload->backup_connections;
+   config->wal_sync = reload->wal_sync;
+   config->wal_sync_size = reload->wal_sync_size;
+   config->wal_direct_io = reload->wal_direct_io;
 
    /* prometheus */
 
@@ -3095,6 +3346,10 @@ copy_server(struct server* dst, struct server* src)
    dst->workers = src->workers;
    dst->backup_max_rate = src->backup_max_rate;
    dst->network_max_rate = src->network_max_rate;
+   dst->manifest = src->manifest;
+   dst->wal_status_interval = src->wal_status_interval;
+   dst->wal_status_size = src->wal_status_size;
+   dst->backup_connections = src->backup_connections;
 }
 
 static void
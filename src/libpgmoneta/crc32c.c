@@ -0,0 +1,242 @@
+/*
+ * Copyright (C) 2024 The pgmoneta community
+ *
+ * Redistribution and use in source and binary forms, with or without modification,
+ * are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, this list
+ * of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice, this
+ * list of conditions and the following disclaimer in the documentation and/or other
+ * materials provided with the distribution.
+ *
+ * 3. Neither the name of the copyright holder nor the names of its contributors may
+ * be used to endorse or promote products derived from this software without specific
+ * prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL
+ * THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT
+ * OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR
+ * TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/* pgmoneta */
+#include <pgmoneta.h>
+#include <crc32c.h>
+
+/* system */
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+
+#if defined(__x86_64__)
+#define CRC32C_SSE42
+#include <nmmintrin.h>
+#elif defined(__aarch64__)
+#define CRC32C_ARMV8
+#include <arm_acle.h>
+#if defined(HAVE_LINUX)
+#include <sys/auxv.h>
+#include <asm/hwcap.h>
+#endif
+#endif
+
+/* Reflected Castagnoli polynomial 0x1EDC6F41 */
+#define CRC32C_POLYNOMIAL 0x82F63B78
+
+static uint32_t crc32c_table[8][256];
+static uint32_t (*crc32c_function)(uint32_t, const unsigned char*, size_t) = NULL;
+static char* crc32c_name = NULL;
+static pthread_once_t crc32c_once = PTHREAD_ONCE_INIT;
+
+static void crc32c_initialize(void);
+static uint32_t crc32c_sb8(uint32_t crc, const unsigned char* p, size_t length);
+#if defined(CRC32C_SSE42)
+static uint32_t crc32c_sse42(uint32_t crc, const unsigned char* p, size_t length);
+#endif
+#if defined(CRC32C_ARMV8)
+static bool crc32c_armv8_available(void);
+static uint32_t crc32c_armv8(uint32_t crc, const unsigned char* p, size_t length);
+#endif
+
+uint32_t
+pgmoneta_crc32c(uint32_t crc, void* data, size_t length)
+{
+   pthread_once(&crc32c_once, crc32c_initialize);
+
+   return ~crc32c_function(~crc, (const unsigned char*)data, length);
+}
+
+char*
+pgmoneta_crc32c_implementation(void)
+{
+   pthread_once(&crc32c_once, crc32c_initialize);
+
+   return crc32c_name;
+}
+
+static void
+crc32c_initialize(void)
+{
+   uint32_t crc;
+
+   for (int i = 0; i < 256; i++)
+   {
+      crc = i;
+      for (int j = 0; j < 8; j++)
+      {
+         crc = (crc & 1) ? (crc >> 1) ^ CRC32C_POLYNOMIAL : crc >> 1;
+      }
+      crc32c_table[0][i] = crc;
+   }
+
+   for (int i = 0; i < 256; i++)
+   {
+      for (int k = 1; k < 8; k++)
+      {
+         crc32c_table[k][i] = (crc32c_table[k - 1][i] >> 8) ^ crc32c_table[0][crc32c_table[k - 1][i] & 0xFF];
+      }
+   }
+
+   crc32c_function = crc32c_sb8;
+   crc32c_name = "slicing-by-8";
+
+#if defined(CRC32C_SSE42)
+   if (__builtin_cpu_supports("sse4.2"))
+   {
+      crc32c_function = crc32c_sse42;
+      crc32c_name = "sse4.2";
+   }
+#elif defined(CRC32C_ARMV8)
+   if (crc32c_armv8_available())
+   {
+      crc32c_function = crc32c_armv8;
+      crc32c_name = "armv8";
+   }
+#endif
+}
+
+static uint32_t
+crc32c_sb8(uint32_t crc, const unsigned char* p, size_t length)
+{
+   uint32_t one;
+   uint32_t two;
+
+   while (length > 0 && ((uintptr_t)p & 7) != 0)
+   {
+      crc = crc32c_table[0][(crc ^ *p++) & 0xFF] ^ (crc >> 8);
+      length--;
+   }
+
+   while (length >= 8)
+   {
+      one = ((uint32_t)p[0] | ((uint32_t)p[1] << 8) | ((uint32_t)p[2] << 16) | ((uint32_t)p[3] << 24)) ^ crc;
+      two = (uint32_t)p[4] | ((uint32_t)p[5] << 8) | ((uint32_t)p[6] << 16) | ((uint32_t)p[7] << 24);
+
+      crc = crc32c_table[7][one & 0xFF] ^
+            crc32c_table[6][(one >> 8) & 0xFF] ^
+            crc32c_table[5][(one >> 16) & 0xFF] ^
+            crc32c_table[4][one >> 24] ^
+            crc32c_table[3][two & 0xFF] ^
+            crc32c_table[2][(two >> 8) & 0xFF] ^
+            crc32c_table[1][(two >> 16) & 0xFF] ^
+            crc32c_table[0][two >> 24];
+
+      p += 8;
+      length -= 8;
+   }
+
+   while (length > 0)
+   {
+      crc = crc32c_table[0][(crc ^ *p++) & 0xFF] ^ (crc >> 8);
+      length--;
+   }
+
+   return crc;
+}
+
+#if defined(CRC32C_SSE42)
+__attribute__((target("sse4.2")))
+static uint32_t
+crc32c_sse42(uint32_t crc, const unsigned char* p, size_t length)
+{
+   uint64_t crc64 = crc;
+   uint64_t value;
+
+   while (length > 0 && ((uintptr_t)p & 7) != 0)
+   {
+      crc64 = _mm_crc32_u8((uint32_t)crc64, *p++);
+      length--;
+   }
+
+   while (length >= 8)
+   {
+      memcpy(&value, p, sizeof(value));
+      crc64 = _mm_crc32_u64(crc64, value);
+      p += 8;
+      length -= 8;
+   }
+
+   while (length > 0)
+   {
+      crc64 = _mm_crc32_u8((uint32_t)crc64, *p++);
+      length--;
+   }
+
+   return (uint32_t)crc64;
+}
+#endif
+
+#if defined(CRC32C_ARMV8)
+static bool
+crc32c_armv8_available(void)
+{
+#if defined(__ARM_FEATURE_CRC32) || defined(__APPLE__)
+   return true;
+#elif defined(HAVE_LINUX) && defined(HWCAP_CRC32)
+   return (getauxval(AT_HWCAP) & HWCAP_CRC32) != 0;
+#else
+   return false;
+#endif
+}
+
+#if defined(__clang__)
+__attribute__((target("crc")))
+#else
+__attribute__((target("+crc")))
+#endif
+static uint32_t
+crc32c_armv8(uint32_t crc, const unsigned char* p, size_t length)
+{
+   uint64_t value;
+
+   while (length > 0 && ((uintptr_t)p & 7) != 0)
+   {
+      crc = __crc32cb(crc, *p++);
+      length--;
+   }
+
+   while (length >= 8)
+   {
+      memcpy(&value, p, sizeof(value));
+      crc = __crc32cd(crc, value);
+      p += 8;
+      length -= 8;
+   }
+
+   while (length > 0)
+   {
+      crc = __crc32cb(crc, *p++);
+      length--;
+   }
+
+   return crc;
+}
+#endif
@@ -28,6 +28,7 @@
 
 /* pgmoneta */
 #include <pgmoneta.h>
+#include <catalog.h>
 #include <delete.h>
 #include <workflow.h>
 #include <info.h>
@@ -49,7 +50,7 @@
  * @param backup_index The index of the oldest backup
  */
 static void
-delete_wal_older_than(char* srv_wal, char* base, int backup_index);
+delete_wal_older_than(int srv, int type, char* srv_wal, char* base, int backup_index);
 
 int
 pgmoneta_delete(int srv, char* backup_id)
@@ -157,7 +158,7 @@ pgmoneta_delete_wal(int srv)
    {
 
       d = pgmoneta_get_server_wal(srv);
-      delete_wal_older_than(srv_wal, d, backup_index);
+      delete_wal_older_than(srv, CATALOG_SIZE_WAL, srv_wal, d, backup_index);
       free(d);
       d = NULL;
 
@@ -165,7 +166,7 @@ pgmoneta_delete_wal(int srv)
       wal_shipping = pgmoneta_get_server_wal_shipping_wal(srv);
       if (wal_shipping != NULL)
       {
-         delete_wal_older_than(srv_wal, wal_shipping, backup_index);
+         delete_wal_older_than(srv, CATALOG_SIZE_WAL_SHIPPING, srv_wal, wal_shipping, backup_index);
       }
 
       free(wal_shipping);
@@ -207,12 +208,13 @@ error:
 }
 
 static void
-delete_wal_older_than(char* srv_wal, char* base, int backup_index)
+delete_wal_older_than(int srv, int type, char* srv_wal, char* base, int backup_index)
 {
    int number_of_wal_files = 0;
    char** wal_files = NULL;
    char wal_address[MAX_PATH];
    bool delete;
+   unsigned long deleted = 0;
 
    if (pgmoneta_get_wal_files(base, &number_of_wal_files, &wal_files))
    {
@@ -248,6 +250,7 @@ delete_wal_older_than(char* srv_wal, char* base, int backup_index)
          }
 
          pgmoneta_log_trace("WAL: Deleting %s", wal_address);
+         deleted += pgmoneta_disk_usage(wal_address);
          pgmoneta_delete_file(wal_address, NULL);
       }
       else
@@ -256,6 +259,8 @@ delete_wal_older_than(char* srv_wal, char* base, int backup_index)
       }
    }
 
+   pgmoneta_catalog_add_size(srv, type, -(long)deleted);
+
    for (int i = 0; i < number_of_wal_files; i++)
    {
       free(wal_files[i]);
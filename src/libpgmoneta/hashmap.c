@@ -513,7 +513,7 @@ hashmap_rehash_helper(struct hashmap* m)
    pgmoneta_hashmap_destroy(m);
    memcpy(m, new_hash, sizeof(struct hashmap));
 
-   pgmoneta_hashmap_destroy(new_hash);
+   /* The table is now owned by m, so only release the container */
    free(new_hash);
 
    return 0;
@@ -0,0 +1,439 @@
+/*
+ * Copyright (C) 2024 The pgmoneta community
+ *
+ * Redistribution and use in source and binary forms, with or without modification,
+ * are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, this list
+ * of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice, this
+ * list of conditions and the following disclaimer in the documentation and/or other
+ * materials provided with the distribution.
+ *
+ * 3. Neither the name of the copyright holder nor the names of its contributors may
+ * be used to endorse or promote products derived from this software without specific
+ * prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL
+ * THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT
+ * OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR
+ * TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/* pgmoneta */
+#include <pgmoneta.h>
+#include <incremental.h>
+#include <logging.h>
+#include <manifest.h>
+#include <pipeline.h>
+#include <utils.h>
+#include <workers.h>
+
+/* system */
+#include <errno.h>
+#include <fcntl.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#define INCREMENTAL_RUN_BLOCKS 128
+
+struct incremental_combine
+{
+   atomic_bool failed;  /**< Set on the first failure */
+   atomic_ulong files;  /**< The number of reconstructed files */
+   atomic_ulong blocks; /**< The number of blocks taken from incremental files */
+};
+
+struct incremental_task
+{
+   struct incremental_combine* combine; /**< The shared state */
+   char incremental[MAX_PATH];          /**< The incremental file */
+   char prior[MAX_PATH];                /**< The stored file in the prior backup, or empty */
+   char to[MAX_PATH];                   /**< The reconstructed file */
+};
+
+static void do_reconstruct(void* arg);
+static int read_fully(int fd, void* buffer, size_t size, off_t offset);
+static int write_fully(int fd, void* buffer, size_t size, off_t offset);
+
+int
+pgmoneta_incremental_reconstruct_file(char* incremental, char* prior, char* to, uint32_t* blocks)
+{
+   int fd = -1;
+   int out = -1;
+   uint32_t header[3];
+   uint32_t number_of_blocks = 0;
+   uint32_t truncation_block_length = 0;
+   uint32_t length = 0;
+   uint32_t prior_length = 0;
+   uint32_t missing = 0;
+   uint32_t run = 0;
+   uint32_t* block_numbers = NULL;
+   size_t header_length = 0;
+   char* buffer = NULL;
+   struct stat st;
+
+   *blocks = 0;
+
+   fd = open(incremental, O_RDONLY);
+   if (fd == -1)
+   {
+      pgmoneta_log_error("Incremental: Could not open %s: %s", incremental, strerror(errno));
+      goto error;
+   }
+
+   if (read_fully(fd, &header[0], sizeof(header), 0) || header[0] != INCREMENTAL_MAGIC)
+   {
+      pgmoneta_log_error("Incremental: %s is not an incremental file", incremental);
+      goto error;
+   }
+
+   number_of_blocks = header[1];
+   truncation_block_length = header[2];
+
+   if (number_of_blocks > INCREMENTAL_MAX_BLOCKS || truncation_block_length > INCREMENTAL_MAX_BLOCKS)
+   {
+      pgmoneta_log_error("Incremental: %s has an invalid header", incremental);
+      goto error;
+   }
+
+   header_length = sizeof(header) + number_of_blocks * sizeof(uint32_t);
+
+   if (number_of_blocks > 0)
+   {
+      block_numbers = (uint32_t*)malloc(number_of_blocks * sizeof(uint32_t));
+      if (block_numbers == NULL || read_fully(fd, block_numbers, number_of_blocks * sizeof(uint32_t), sizeof(header)))
+      {
+         goto error;
+      }
+
+      // the block data starts at the next block boundary
+      header_length = (header_length + INCREMENTAL_BLOCK_SIZE - 1) / INCREMENTAL_BLOCK_SIZE * INCREMENTAL_BLOCK_SIZE;
+   }
+
+   if (fstat(fd, &st) || (size_t)st.st_size != header_length + (size_t)number_of_blocks * INCREMENTAL_BLOCK_SIZE)
+   {
+      pgmoneta_log_error("Incremental: %s has an invalid size", incremental);
+      goto error;
+   }
+
+   length = truncation_block_length;
+   for (uint32_t i = 0; i < number_of_blocks; i++)
+   {
+      if (block_numbers[i] >= INCREMENTAL_MAX_BLOCKS)
+      {
+         pgmoneta_log_error("Incremental: %s has an invalid block number %u", incremental, block_numbers[i]);
+         goto error;
+      }
+      length = MAX(length, block_numbers[i] + 1);
+   }
+
+   if (prior != NULL)
+   {
+      if (pgmoneta_decrypt_decompress_file(prior, to))
+      {
+         goto error;
+      }
+      prior_length = (uint32_t)(pgmoneta_get_file_size(to) / INCREMENTAL_BLOCK_SIZE);
+   }
+
+   // blocks below the truncation length that are in neither source are zero, like pg_combinebackup does
+   if (prior_length < truncation_block_length)
+   {
+      missing = truncation_block_length - prior_length;
+      for (uint32_t i = 0; i < number_of_blocks; i++)
+      {
+         if (block_numbers[i] >= prior_length && block_numbers[i] < truncation_block_length)
+         {
+            missing--;
+         }
+      }
+
+      if (missing > 0)
+      {
+         pgmoneta_log_debug("Incremental: %u blocks of %s are neither in the prior backup nor in %s, zero filled", missing, to, incremental);
+      }
+   }
+
+   out = open(to, O_WRONLY | O_CREAT, 0600);
+   if (out == -1)
+   {
+      pgmoneta_log_error("Incremental: Could not open %s: %s", to, strerror(errno));
+      goto error;
+   }
+
+   // prior blocks at or above the truncation length are gone, and the sent blocks past it are
+   // written below, so cut the prior file first and then extend it with zeros
+   if (ftruncate(out, (off_t)truncation_block_length * INCREMENTAL_BLOCK_SIZE) ||
+       ftruncate(out, (off_t)length * INCREMENTAL_BLOCK_SIZE))
+   {
+      pgmoneta_log_error("Incremental: Could not truncate %s: %s", to, strerror(errno));
+      goto error;
+   }
+
+   buffer = (char*)malloc(INCREMENTAL_RUN_BLOCKS * INCREMENTAL_BLOCK_SIZE);
+   if (buffer == NULL)
+   {
+      goto error;
+   }
+
+   // copy runs of consecutive blocks with a single read and write
+   for (uint32_t i = 0; i < number_of_blocks; i += run)
+   {
+      run = 1;
+      while (i + run < number_of_blocks && run < INCREMENTAL_RUN_BLOCKS &&
+             block_numbers[i + run] == block_numbers[i] + run)
+      {
+         run++;
+      }
+
+      if (read_fully(fd, buffer, (size_t)run * INCREMENTAL_BLOCK_SIZE,
+                     (off_t)(header_length + (size_t)i * INCREMENTAL_BLOCK_SIZE)) ||
+          write_fully(out, buffer, (size_t)run * INCREMENTAL_BLOCK_SIZE,
+                      (off_t)block_numbers[i] * INCREMENTAL_BLOCK_SIZE))
+      {
+         pgmoneta_log_error("Incremental: Could not reconstruct %s: %s", to, strerror(errno));
+         goto error;
+      }
+   }
+
+   if (close(out))
+   {
+      out = -1;
+      goto error;
+   }
+   out = -1;
+
+   close(fd);
+   free(block_numbers);
+   free(buffer);
+
+   *blocks = number_of_blocks;
+
+   return 0;
+
+error:
+
+   if (fd != -1)
+   {
+      close(fd);
+   }
+   if (out != -1)
+   {
+      close(out);
+   }
+   free(block_numbers);
+   free(buffer);
+
+   return 1;
+}
+
+int
+pgmoneta_incremental_combine(char* directory, char* prior, struct workers* workers)
+{
+   char* path = NULL;
+   char* name = NULL;
+   char* stored = NULL;
+   char target[MAX_PATH];
+   unsigned long number_of_tasks = 0;
+   struct manifest* manifest = NULL;
+   struct manifest_file* mf = NULL;
+   struct incremental_combine combine;
+   struct incremental_task* tasks = NULL;
+   struct incremental_task* task = NULL;
+   struct timespec start;
+   struct timespec end;
+   double elapsed;
+
+   clock_gettime(CLOCK_MONOTONIC, &start);
+
+   atomic_init(&combine.failed, false);
+   atomic_init(&combine.files, 0);
+   atomic_init(&combine.blocks, 0);
+
+   if (pgmoneta_manifest_load(directory, &manifest))
+   {
+      goto error;
+   }
+
+   tasks = (struct incremental_task*)malloc((manifest->number_of_files + 1) * sizeof(struct incremental_task));
+   if (tasks == NULL)
+   {
+      goto error;
+   }
+
+   for (unsigned long i = 0; i < manifest->number_of_files && !atomic_load(&combine.failed); i++)
+   {
+      mf = &manifest->files[i];
+      path = pgmoneta_manifest_file_path(manifest, mf);
+
+      name = strrchr(path, '/');
+      name = name != NULL ? name + 1 : path;
+
+      if (strncmp(name, INCREMENTAL_PREFIX, strlen(INCREMENTAL_PREFIX)))
+      {
+         continue;
+      }
+
+      memset(target, 0, MAX_PATH);
+      snprintf(target, MAX_PATH, "%.*s%s", (int)(name - path), path, name + strlen(INCREMENTAL_PREFIX));
+
+      task = &tasks[number_of_tasks];
+      memset(task, 0, sizeof(struct incremental_task));
+      task->combine = &combine;
+
+      if (snprintf(task->incremental, MAX_PATH, "%s/%s", directory, path) >= MAX_PATH ||
+          snprintf(task->to, MAX_PATH, "%s/%s", directory, target) >= MAX_PATH ||
+          snprintf(task->prior, MAX_PATH, "%s/%s", prior, target) >= MAX_PATH)
+      {
+         pgmoneta_log_error("Incremental: The path of %s is too long", path);
+         atomic_store(&combine.failed, true);
+         continue;
+      }
+
+      stored = pgmoneta_stored_file(task->prior);
+      if (snprintf(task->prior, MAX_PATH, "%s", stored != NULL ? stored : "") >= MAX_PATH)
+      {
+         pgmoneta_log_error("Incremental: The path of %s is too long", stored);
+         atomic_store(&combine.failed, true);
+         free(stored);
+         stored = NULL;
+         continue;
+      }
+      free(stored);
+      stored = NULL;
+
+      number_of_tasks++;
+
+      if (workers == NULL || pgmoneta_workers_add(workers, do_reconstruct, task))
+      {
+         do_reconstruct(task);
+      }
+   }
+
+   if (workers != NULL)
+   {
+      pgmoneta_workers_wait(workers);
+   }
+
+   if (atomic_load(&combine.failed))
+   {
+      goto error;
+   }
+
+   if (pgmoneta_manifest_rewrite_incremental(manifest, directory))
+   {
+      pgmoneta_log_error("Incremental: Could not update the manifest in %s", directory);
+      goto error;
+   }
+
+   clock_gettime(CLOCK_MONOTONIC, &end);
+   elapsed = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1000000000.0;
+
+   pgmoneta_log_debug("Incremental: %lu files reconstructed from %lu changed blocks in %.3f s",
+                      atomic_load(&combine.files), atomic_load(&combine.blocks), elapsed);
+
+   free(tasks);
+   pgmoneta_manifest_free(manifest);
+
+   return 0;
+
+error:
+
+   free(tasks);
+   pgmoneta_manifest_free(manifest);
+
+   return 1;
+}
+
+static void
+do_reconstruct(void* arg)
+{
+   uint32_t blocks = 0;
+   struct incremental_task* task = (struct incremental_task*)arg;
+   struct incremental_combine* combine = task->combine;
+
+   if (atomic_load(&combine->failed))
+   {
+      return;
+   }
+
+   if (strlen(task->prior) == 0)
+   {
+      pgmoneta_log_debug("Incremental: No prior version of %s", task->to);
+   }
+
+   if (pgmoneta_incremental_reconstruct_file(task->incremental, strlen(task->prior) > 0 ? task->prior : NULL, task->to, &blocks))
+   {
+      atomic_store(&combine->failed, true);
+      return;
+   }
+
+   pgmoneta_delete_file(task->incremental, NULL);
+
+   atomic_fetch_add(&combine->files, 1);
+   atomic_fetch_add(&combine->blocks, blocks);
+}
+
+static int
+read_fully(int fd, void* buffer, size_t size, off_t offset)
+{
+   char* p = (char*)buffer;
+   ssize_t r;
+
+   while (size > 0)
+   {
+      r = pread(fd, p, size, offset);
+      if (r < 0 && errno == EINTR)
+      {
+         continue;
+      }
+      if (r <= 0)
+      {
+         return 1;
+      }
+
+      p += r;
+      size -= (size_t)r;
+      offset += r;
+   }
+
+   return 0;
+}
+
+static int
+write_fully(int fd, void* buffer, size_t size, off_t offset)
+{
+   char* p = (char*)buffer;
+   ssize_t w;
+
+   while (size > 0)
+   {
+      w = pwrite(fd, p, size, offset);
+      if (w < 0 && errno == EINTR)
+      {
+         continue;
+      }
+      if (w <= 0)
+      {
+         return 1;
+      }
+
+      p += w;
+      size -= (size_t)w;
+      offset += w;
+   }
+
+   return 0;
+}
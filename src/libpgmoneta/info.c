@@ -28,201 +28,284 @@
 
 /* pgmoneta */
 #include <pgmoneta.h>
+#include <catalog.h>
 #include <info.h>
 #include <logging.h>
 #include <utils.h>
 
 /* system */
+#include <errno.h>
+#include <fcntl.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <unistd.h>
+#include <sys/stat.h>
 
-void
-pgmoneta_create_info(char* directory, char* label, int status)
+static int transaction_create(char* directory, struct info_transaction** transaction);
+static int transaction_set(struct info_transaction* transaction, char* key, size_t key_length, char* value, size_t value_length);
+static int read_info(char* path, struct info_transaction* transaction);
+static char* info_path(char* directory, char* suffix);
+static void sync_directory(char* directory);
+
+int
+pgmoneta_info_begin(char* directory, struct info_transaction** transaction)
 {
-   char buffer[128];
-   char* s = NULL;
-   FILE* sfile = NULL;
+   char* path = NULL;
+   struct info_transaction* t = NULL;
+
+   *transaction = NULL;
+
+   if (transaction_create(directory, &t))
+   {
+      goto error;
+   }
+
+   path = info_path(directory, NULL);
 
-   s = pgmoneta_append(s, directory);
-   s = pgmoneta_append(s, "/backup.info");
+   if (read_info(path, t))
+   {
+      goto error;
+   }
 
-   sfile = fopen(s, "w");
+   *transaction = t;
 
-   memset(&buffer[0], 0, sizeof(buffer));
-   snprintf(&buffer[0], sizeof(buffer), "STATUS=%d\n", status);
-   fputs(&buffer[0], sfile);
+   free(path);
 
-   memset(&buffer[0], 0, sizeof(buffer));
-   snprintf(&buffer[0], sizeof(buffer), "LABEL=%s\n", label);
-   fputs(&buffer[0], sfile);
+   return 0;
 
-   memset(&buffer[0], 0, sizeof(buffer));
-   snprintf(&buffer[0], sizeof(buffer), "TABLESPACES=0\n");
-   fputs(&buffer[0], sfile);
+error:
 
-   memset(&buffer[0], 0, sizeof(buffer));
-   snprintf(&buffer[0], sizeof(buffer), "PGMONETA_VERSION=%s\n", VERSION);
-   fputs(&buffer[0], sfile);
+   pgmoneta_log_error("Info: Could not read %s", path != NULL ? path : directory);
 
-   pgmoneta_permission(s, 6, 0, 0);
+   pgmoneta_info_rollback(t);
+   free(path);
 
-   if (sfile != NULL)
+   return 1;
+}
+
+int
+pgmoneta_info_create(char* directory, char* label, int status, struct info_transaction** transaction)
+{
+   struct info_transaction* t = NULL;
+
+   *transaction = NULL;
+
+   if (transaction_create(directory, &t))
    {
-      fclose(sfile);
+      goto error;
    }
 
-   free(s);
+   if (pgmoneta_info_set_unsigned_long(t, INFO_STATUS, status) ||
+       pgmoneta_info_set_string(t, INFO_LABEL, label) ||
+       pgmoneta_info_set_unsigned_long(t, INFO_TABLESPACES, 0) ||
+       pgmoneta_info_set_string(t, "PGMONETA_VERSION", VERSION))
+   {
+      goto error;
+   }
+
+   *transaction = t;
+
+   return 0;
+
+error:
+
+   pgmoneta_info_rollback(t);
+
+   return 1;
 }
 
-void
-pgmoneta_update_info_unsigned_long(char* directory, char* key, unsigned long value)
+int
+pgmoneta_info_set_string(struct info_transaction* transaction, char* key, char* value)
 {
-   char buffer[128];
-   char line[128];
-   bool found = false;
+   return transaction_set(transaction, key, strlen(key), value, strlen(value));
+}
+
+int
+pgmoneta_info_set_unsigned_long(struct info_transaction* transaction, char* key, unsigned long value)
+{
+   char v[MISC_LENGTH];
+
+   snprintf(&v[0], sizeof(v), "%lu", value);
+
+   return pgmoneta_info_set_string(transaction, key, &v[0]);
+}
+
+int
+pgmoneta_info_set_bool(struct info_transaction* transaction, char* key, bool value)
+{
+   return pgmoneta_info_set_unsigned_long(transaction, key, value ? 1 : 0);
+}
+
+int
+pgmoneta_info_commit(struct info_transaction* transaction)
+{
+   int fd = -1;
+   size_t length = 0;
+   char* data = NULL;
    char* s = NULL;
-   FILE* sfile = NULL;
    char* d = NULL;
-   FILE* dfile = NULL;
+   char header[MISC_LENGTH];
 
-   s = pgmoneta_append(s, directory);
-   s = pgmoneta_append(s, "/backup.info");
+   if (transaction == NULL)
+   {
+      return 1;
+   }
 
-   d = pgmoneta_append(d, directory);
-   d = pgmoneta_append(d, "/backup.info.tmp");
+   s = info_path(transaction->directory, NULL);
+   d = info_path(transaction->directory, ".tmp");
 
-   sfile = fopen(s, "r");
-   dfile = fopen(d, "w");
+   /* The file is written in one go, so it is small enough to build in memory */
+   snprintf(&header[0], sizeof(header), "%s=%d\n", INFO_FORMAT, INFO_FORMAT_VERSION);
+   data = pgmoneta_append(data, &header[0]);
 
-   while ((fgets(&buffer[0], sizeof(buffer), sfile)) != NULL)
+   for (int i = 0; i < transaction->number_of_keys; i++)
    {
-      char k[MISC_LENGTH];
-      char v[MISC_LENGTH];
-      char* ptr = NULL;
+      data = pgmoneta_append(data, transaction->keys[i]);
+      data = pgmoneta_append(data, "=");
+      data = pgmoneta_append(data, transaction->values[i]);
+      data = pgmoneta_append(data, "\n");
+   }
 
-      memset(&k[0], 0, sizeof(k));
-      memset(&v[0], 0, sizeof(v));
+   if (data == NULL)
+   {
+      goto error;
+   }
 
-      memset(&line[0], 0, sizeof(line));
-      memcpy(&line[0], &buffer[0], strlen(&buffer[0]));
+   length = strlen(data);
 
-      ptr = strtok(&buffer[0], "=");
-      memcpy(&k[0], ptr, strlen(ptr));
+   fd = open(d, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+   if (fd == -1)
+   {
+      goto error;
+   }
 
-      ptr = strtok(NULL, "=");
-      memcpy(&v[0], ptr, strlen(ptr) - 1);
+   for (size_t offset = 0; offset < length;)
+   {
+      ssize_t written = write(fd, data + offset, length - offset);
 
-      if (!strcmp(key, &k[0]))
+      if (written == -1)
       {
-         memset(&line[0], 0, sizeof(line));
-         snprintf(&line[0], sizeof(line), "%s=%lu\n", key, value);
-         fputs(&line[0], dfile);
-         found = true;
-      }
-      else
-      {
-         fputs(&line[0], dfile);
+         if (errno == EINTR)
+         {
+            continue;
+         }
+         goto error;
       }
-   }
 
-   if (!found)
-   {
-      memset(&line[0], 0, sizeof(line));
-      snprintf(&line[0], sizeof(line), "%s=%lu\n", key, value);
-      fputs(&line[0], dfile);
+      offset += written;
    }
 
-   if (sfile != NULL)
+   if (fsync(fd))
    {
-      fclose(sfile);
+      goto error;
    }
 
-   if (dfile != NULL)
+   close(fd);
+   fd = -1;
+
+   if (pgmoneta_move_file(d, s))
    {
-      fclose(dfile);
+      goto error;
    }
 
-   pgmoneta_move_file(d, s);
    pgmoneta_permission(s, 6, 0, 0);
+   sync_directory(transaction->directory);
 
+   pgmoneta_catalog_refresh(transaction->directory);
+
+   pgmoneta_info_rollback(transaction);
+   free(data);
    free(s);
    free(d);
-}
 
-void
-pgmoneta_update_info_string(char* directory, char* key, char* value)
-{
-   char buffer[128];
-   char line[128];
-   bool found = false;
-   char* s = NULL;
-   FILE* sfile = NULL;
-   char* d = NULL;
-   FILE* dfile = NULL;
-
-   s = pgmoneta_append(s, directory);
-   s = pgmoneta_append(s, "/backup.info");
+   return 0;
 
-   d = pgmoneta_append(d, directory);
-   d = pgmoneta_append(d, "/backup.info.tmp");
+error:
 
-   sfile = fopen(s, "r");
-   dfile = fopen(d, "w");
+   pgmoneta_log_error("Info: Could not write %s (%s)", s != NULL ? s : transaction->directory, strerror(errno));
+   errno = 0;
 
-   while ((fgets(&buffer[0], sizeof(buffer), sfile)) != NULL)
+   if (fd != -1)
    {
-      char k[MISC_LENGTH];
-      char v[MISC_LENGTH];
-      char* ptr = NULL;
+      close(fd);
+      unlink(d);
+   }
+
+   pgmoneta_info_rollback(transaction);
+   free(data);
+   free(s);
+   free(d);
 
-      memset(&k[0], 0, sizeof(k));
-      memset(&v[0], 0, sizeof(v));
+   return 1;
+}
 
-      memset(&line[0], 0, sizeof(line));
-      memcpy(&line[0], &buffer[0], strlen(&buffer[0]));
+void
+pgmoneta_info_rollback(struct info_transaction* transaction)
+{
+   if (transaction == NULL)
+   {
+      return;
+   }
+
+   for (int i = 0; i < transaction->number_of_keys; i++)
+   {
+      free(transaction->keys[i]);
+      free(transaction->values[i]);
+   }
 
-      ptr = strtok(&buffer[0], "=");
-      memcpy(&k[0], ptr, strlen(ptr));
+   free(transaction->keys);
+   free(transaction->values);
+   free(transaction);
+}
 
-      ptr = strtok(NULL, "=");
-      memcpy(&v[0], ptr, strlen(ptr) - 1);
+void
+pgmoneta_create_info(char* directory, char* label, int status)
+{
+   struct info_transaction* transaction = NULL;
 
-      if (!strcmp(key, &k[0]))
-      {
-         memset(&line[0], 0, sizeof(line));
-         snprintf(&line[0], sizeof(line), "%s=%s\n", key, value);
-         fputs(&line[0], dfile);
-         found = true;
-      }
-      else
-      {
-         fputs(&line[0], dfile);
-      }
+   if (!pgmoneta_info_create(directory, label, status, &transaction))
+   {
+      pgmoneta_info_commit(transaction);
    }
+}
 
-   if (!found)
+void
+pgmoneta_update_info_unsigned_long(char* directory, char* key, unsigned long value)
+{
+   struct info_transaction* transaction = NULL;
+
+   if (pgmoneta_info_begin(directory, &transaction))
    {
-      memset(&line[0], 0, sizeof(line));
-      snprintf(&line[0], sizeof(line), "%s=%s\n", key, value);
-      fputs(&line[0], dfile);
+      return;
    }
 
-   if (sfile != NULL)
+   if (pgmoneta_info_set_unsigned_long(transaction, key, value))
    {
-      fclose(sfile);
+      pgmoneta_info_rollback(transaction);
+      return;
    }
 
-   if (dfile != NULL)
+   pgmoneta_info_commit(transaction);
+}
+
+void
+pgmoneta_update_info_string(char* directory, char* key, char* value)
+{
+   struct info_transaction* transaction = NULL;
+
+   if (pgmoneta_info_begin(directory, &transaction))
    {
-      fclose(dfile);
+      return;
    }
 
-   pgmoneta_move_file(d, s);
-   pgmoneta_permission(s, 6, 0, 0);
+   if (pgmoneta_info_set_string(transaction, key, value))
+   {
+      pgmoneta_info_rollback(transaction);
+      return;
+   }
 
-   free(s);
-   free(d);
+   pgmoneta_info_commit(transaction);
 }
 
 void
@@ -272,6 +355,11 @@ pgmoneta_get_backups(char* directory, int* number_of_backups, struct backup*** b
    int number_of_directories;
    char** dirs;
 
+   if (!pgmoneta_catalog_get_backups(directory, number_of_backups, backups))
+   {
+      return 0;
+   }
+
    *number_of_backups = 0;
    *backups = NULL;
 
@@ -288,7 +376,7 @@ pgmoneta_get_backups(char* directory, int* number_of_backups, struct backup*** b
 
       d = pgmoneta_append(d, directory);
 
-      pgmoneta_get_backup(d, dirs[i], &bcks[i]);
+      pgmoneta_read_backup(d, dirs[i], &bcks[i]);
 
       free(d);
    }
@@ -308,130 +396,146 @@ pgmoneta_get_backups(char* directory, int* number_of_backups, struct backup*** b
 int
 pgmoneta_get_backup(char* directory, char* label, struct backup** backup)
 {
-   char buffer[MISC_LENGTH];
-   char* fn;
-   FILE* file = NULL;
+   if (!pgmoneta_catalog_get_backup(directory, label, backup))
+   {
+      return 0;
+   }
+
+   return pgmoneta_read_backup(directory, label, backup);
+}
+
+int
+pgmoneta_read_backup(char* directory, char* label, struct backup** backup)
+{
+   char* fn = NULL;
+   char* value = NULL;
    int tbl_idx = 0;
-   struct backup* bck;
+   struct info_transaction* t = NULL;
+   struct backup* bck = NULL;
 
    *backup = NULL;
 
-   fn = NULL;
    fn = pgmoneta_append(fn, directory);
    fn = pgmoneta_append(fn, "/");
    fn = pgmoneta_append(fn, label);
-   fn = pgmoneta_append(fn, "/backup.info");
-
-   file = fopen(fn, "r");
 
    bck = (struct backup*)malloc(sizeof(struct backup));
+   if (bck == NULL)
+   {
+      goto error;
+   }
+
    memset(bck, 0, sizeof(struct backup));
 
-   memcpy(&bck->label[0], label, strlen(label));
+   snprintf(&bck->label[0], sizeof(bck->label), "%s", label);
    bck->valid = VALID_UNKNOWN;
 
-   if (file != NULL)
+   /* A missing file leaves the backup with an unknown status */
+   if (!transaction_create(fn, &t))
    {
-      while ((fgets(&buffer[0], sizeof(buffer), file)) != NULL)
-      {
-         char key[MISC_LENGTH];
-         char value[MISC_LENGTH];
-         char* ptr = NULL;
+      free(fn);
+      fn = info_path(t->directory, NULL);
 
-         memset(&key[0], 0, sizeof(key));
-         memset(&value[0], 0, sizeof(value));
+      if (read_info(fn, t))
+      {
+         t->number_of_keys = 0;
+      }
+   }
 
-         ptr = strtok(&buffer[0], "=");
-         memcpy(&key[0], ptr, strlen(ptr));
+   for (int i = 0; t != NULL && i < t->number_of_keys; i++)
+   {
+      char* key = t->keys[i];
 
-         ptr = strtok(NULL, "=");
-         memcpy(&value[0], ptr, strlen(ptr) - 1);
+      value = t->values[i];
 
-         if (!strcmp(INFO_STATUS, &key[0]))
-         {
-            if (!strcmp("1", &value[0]))
-            {
-               bck->valid = VALID_TRUE;
-            }
-            else
-            {
-               bck->valid = VALID_FALSE;
-            }
-         }
-         else if (!strcmp(INFO_LABEL, &key[0]))
-         {
-            memcpy(&bck->label[0], &value[0], strlen(&value[0]));
-         }
-         else if (!strcmp(INFO_WAL, &key[0]))
-         {
-            memcpy(&bck->wal[0], &value[0], strlen(&value[0]));
-         }
-         else if (!strcmp(INFO_BACKUP, &key[0]))
-         {
-            bck->backup_size = strtoul(&value[0], &ptr, 10);
-         }
-         else if (!strcmp(INFO_RESTORE, &key[0]))
-         {
-            bck->restore_size = strtoul(&value[0], &ptr, 10);
-         }
-         else if (!strcmp(INFO_ELAPSED, &key[0]))
-         {
-            bck->elapsed_time = atoi(&value[0]);
-         }
-         else if (!strcmp(INFO_VERSION, &key[0]))
-         {
-            bck->version = atoi(&value[0]);
-         }
-         else if (!strcmp(INFO_MINOR_VERSION, &key[0]))
-         {
-            bck->minor_version = atoi(&value[0]);
-         }
-         else if (!strcmp(INFO_KEEP, &key[0]))
-         {
-            bck->keep = atoi(&value[0]) == 1 ? true : false;
-         }
-         else if (!strcmp(INFO_TABLESPACES, &key[0]))
-         {
-            bck->number_of_tablespaces = strtoul(&value[0], &ptr, 10);
-         }
-         else if (pgmoneta_starts_with(&key[0], "TABLESPACE"))
+      if (!strcmp(INFO_STATUS, key))
+      {
+         bck->valid = !strcmp("1", value) ? VALID_TRUE : VALID_FALSE;
+      }
+      else if (!strcmp(INFO_LABEL, key))
+      {
+         snprintf(&bck->label[0], sizeof(bck->label), "%s", value);
+      }
+      else if (!strcmp(INFO_WAL, key))
+      {
+         snprintf(&bck->wal[0], sizeof(bck->wal), "%s", value);
+      }
+      else if (!strcmp(INFO_BACKUP, key))
+      {
+         bck->backup_size = strtoul(value, NULL, 10);
+      }
+      else if (!strcmp(INFO_RESTORE, key))
+      {
+         bck->restore_size = strtoul(value, NULL, 10);
+      }
+      else if (!strcmp(INFO_ELAPSED, key))
+      {
+         bck->elapsed_time = atoi(value);
+      }
+      else if (!strcmp(INFO_VERSION, key))
+      {
+         bck->version = atoi(value);
+      }
+      else if (!strcmp(INFO_MINOR_VERSION, key))
+      {
+         bck->minor_version = atoi(value);
+      }
+      else if (!strcmp(INFO_KEEP, key))
+      {
+         bck->keep = atoi(value) == 1 ? true : false;
+      }
+      else if (!strcmp(INFO_TABLESPACES, key))
+      {
+         bck->number_of_tablespaces = strtoul(value, NULL, 10);
+      }
+      else if (pgmoneta_starts_with(key, "TABLESPACE"))
+      {
+         if (tbl_idx < MAX_NUMBER_OF_TABLESPACES)
          {
-            memcpy(&bck->tablespaces[tbl_idx], &value[0], strlen(&value[0]));
+            snprintf(&bck->tablespaces[tbl_idx][0], sizeof(bck->tablespaces[tbl_idx]), "%s", value);
             tbl_idx++;
          }
-         else if (pgmoneta_starts_with(&key[0], INFO_START_WALPOS))
-         {
-            sscanf(&value[0], "%X/%X", &bck->start_lsn_hi32, &bck->start_lsn_lo32);
-         }
-         else if (pgmoneta_starts_with(&key[0], INFO_END_WALPOS))
-         {
-            sscanf(&value[0], "%X/%X", &bck->end_lsn_hi32, &bck->end_lsn_lo32);
-         }
-         else if (pgmoneta_starts_with(&key[0], INFO_CHKPT_WALPOS))
-         {
-            sscanf(&value[0], "%X/%X", &bck->checkpoint_lsn_hi32, &bck->checkpoint_lsn_lo32);
-         }
-         else if (pgmoneta_starts_with(&key[0], INFO_START_TIMELINE))
-         {
-            bck->start_timeline = atoi(&value[0]);
-         }
-         else if (pgmoneta_starts_with(&key[0], INFO_END_TIMELINE))
-         {
-            bck->end_timeline = atoi(&value[0]);
-         }
+      }
+      else if (!strcmp(INFO_START_WALPOS, key))
+      {
+         sscanf(value, "%X/%X", &bck->start_lsn_hi32, &bck->start_lsn_lo32);
+      }
+      else if (!strcmp(INFO_END_WALPOS, key))
+      {
+         sscanf(value, "%X/%X", &bck->end_lsn_hi32, &bck->end_lsn_lo32);
+      }
+      else if (!strcmp(INFO_CHKPT_WALPOS, key))
+      {
+         sscanf(value, "%X/%X", &bck->checkpoint_lsn_hi32, &bck->checkpoint_lsn_lo32);
+      }
+      else if (!strcmp(INFO_START_TIMELINE, key))
+      {
+         bck->start_timeline = atoi(value);
+      }
+      else if (!strcmp(INFO_END_TIMELINE, key))
+      {
+         bck->end_timeline = atoi(value);
       }
    }
 
-   *backup = bck;
-
-   if (file != NULL)
+   if (bck->number_of_tablespaces > MAX_NUMBER_OF_TABLESPACES)
    {
-      fclose(file);
+      bck->number_of_tablespaces = MAX_NUMBER_OF_TABLESPACES;
    }
 
+   *backup = bck;
+
+   pgmoneta_info_rollback(t);
    free(fn);
 
    return 0;
+
+error:
+
+   pgmoneta_info_rollback(t);
+   free(fn);
+
+   return 1;
 }
 
 int
@@ -463,3 +567,244 @@ pgmoneta_get_number_of_valid_backups(int server)
 
    return result;
 }
+
+static int
+transaction_create(char* directory, struct info_transaction** transaction)
+{
+   struct info_transaction* t = NULL;
+
+   *transaction = NULL;
+
+   if (directory == NULL || strlen(directory) >= MAX_PATH)
+   {
+      return 1;
+   }
+
+   t = (struct info_transaction*)malloc(sizeof(struct info_transaction));
+   if (t == NULL)
+   {
+      return 1;
+   }
+
+   memset(t, 0, sizeof(struct info_transaction));
+   memcpy(&t->directory[0], directory, strlen(directory));
+
+   *transaction = t;
+
+   return 0;
+}
+
+static int
+transaction_set(struct info_transaction* transaction, char* key, size_t key_length, char* value, size_t value_length)
+{
+   int index = -1;
+   char* v = NULL;
+
+   if (transaction == NULL || key_length == 0)
+   {
+      return 1;
+   }
+
+   for (int i = 0; index == -1 && i < transaction->number_of_keys; i++)
+   {
+      if (strlen(transaction->keys[i]) == key_length && !strncmp(transaction->keys[i], key, key_length))
+      {
+         index = i;
+      }
+   }
+
+   v = strndup(value, value_length);
+   if (v == NULL)
+   {
+      return 1;
+   }
+
+   if (index != -1)
+   {
+      free(transaction->values[index]);
+      transaction->values[index] = v;
+
+      return 0;
+   }
+
+   if (transaction->number_of_keys == transaction->size)
+   {
+      int size = transaction->size == 0 ? 32 : transaction->size * 2;
+      char** keys = NULL;
+      char** values = NULL;
+
+      keys = (char**)realloc(transaction->keys, size * sizeof(char*));
+      if (keys == NULL)
+      {
+         free(v);
+         return 1;
+      }
+      transaction->keys = keys;
+
+      values = (char**)realloc(transaction->values, size * sizeof(char*));
+      if (values == NULL)
+      {
+         free(v);
+         return 1;
+      }
+      transaction->values = values;
+
+      transaction->size = size;
+   }
+
+   transaction->keys[transaction->number_of_keys] = strndup(key, key_length);
+   if (transaction->keys[transaction->number_of_keys] == NULL)
+   {
+      free(v);
+      return 1;
+   }
+
+   transaction->values[transaction->number_of_keys] = v;
+   transaction->number_of_keys++;
+
+   return 0;
+}
+
+static int
+read_info(char* path, struct info_transaction* transaction)
+{
+   int fd = -1;
+   char* data = NULL;
+   char* ptr = NULL;
+   char* end = NULL;
+   size_t length = 0;
+   struct stat st;
+
+   fd = open(path, O_RDONLY);
+   if (fd == -1)
+   {
+      goto error;
+   }
+
+   if (fstat(fd, &st))
+   {
+      goto error;
+   }
+
+   data = (char*)malloc(st.st_size + 1);
+   if (data == NULL)
+   {
+      goto error;
+   }
+
+   while (length < (size_t)st.st_size)
+   {
+      ssize_t r = read(fd, data + length, st.st_size - length);
+
+      if (r == -1 && errno == EINTR)
+      {
+         continue;
+      }
+      else if (r <= 0)
+      {
+         break;
+      }
+
+      length += r;
+   }
+
+   close(fd);
+   fd = -1;
+
+   data[length] = '\0';
+
+   /* One pass over KEY=VALUE lines, the values may contain '=' */
+   ptr = data;
+   end = data + length;
+
+   while (ptr < end)
+   {
+      char* eol = memchr(ptr, '\n', end - ptr);
+      char* eq = NULL;
+      size_t line_length;
+
+      if (eol == NULL)
+      {
+         eol = end;
+      }
+
+      line_length = eol - ptr;
+      if (line_length > 0 && ptr[line_length - 1] == '\r')
+      {
+         line_length--;
+      }
+
+      eq = memchr(ptr, '=', line_length);
+
+      if (eq != NULL)
+      {
+         size_t key_length = eq - ptr;
+         char* value = eq + 1;
+         size_t value_length = line_length - key_length - 1;
+
+         if (key_length == strlen(INFO_FORMAT) && !strncmp(ptr, INFO_FORMAT, key_length))
+         {
+            if (strtol(value, NULL, 10) > INFO_FORMAT_VERSION)
+            {
+               pgmoneta_log_warn("Info: %s has a newer format (%.*s)", path, (int)value_length, value);
+            }
+         }
+         else if (transaction_set(transaction, ptr, key_length, value, value_length))
+         {
+            goto error;
+         }
+      }
+
+      ptr = eol + 1;
+   }
+
+   free(data);
+
+   return 0;
+
+error:
+
+   if (fd != -1)
+   {
+      close(fd);
+   }
+
+   free(data);
+
+   errno = 0;
+
+   return 1;
+}
+
+static char*
+info_path(char* directory, char* suffix)
+{
+   char* path = NULL;
+
+   path = pgmoneta_append(path, directory);
+   if (!pgmoneta_ends_with(path, "/"))
+   {
+      path = pgmoneta_append(path, "/");
+   }
+   path = pgmoneta_append(path, "backup.info");
+
+   if (suffix != NULL)
+   {
+      path = pgmoneta_append(path, suffix);
+   }
+
+   return path;
+}
+
+static void
+sync_directory(char* directory)
+{
+   int fd;
+
+   fd = open(directory, O_RDONLY | O_DIRECTORY);
+   if (fd != -1)
+   {
+      fsync(fd);
+      close(fd);
+   }
+}
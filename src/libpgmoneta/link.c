@@ -31,18 +31,45 @@
 #include <info.h>
 #include <link.h>
 #include <logging.h>
+#include <manifest.h>
 #include <utils.h>
 #include <workers.h>
 
 /* system */
 #include <dirent.h>
+#include <limits.h>
+#include <stdatomic.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <unistd.h>
 #include <sys/types.h>
 #include <sys/stat.h>
 
+struct link_manifest
+{
+   struct manifest* from_manifest; /**< The manifest of the from directory */
+   struct manifest* to_manifest;   /**< The manifest of the to directory */
+   struct workers* workers;        /**< The optional workers */
+   atomic_ulong manifest_files;    /**< The number of files linked based on the manifests */
+   atomic_ulong compared_files;    /**< The number of files compared */
+   atomic_ulong linked_files;      /**< The number of files linked */
+   atomic_ulong bytes_saved;       /**< The number of bytes no longer stored */
+   atomic_ulong bytes_not_read;    /**< The number of bytes a comparison would have read */
+};
+
+struct link_task
+{
+   struct link_manifest* lm; /**< The shared state */
+   char from[MAX_PATH];      /**< The from file */
+   char to[MAX_PATH];        /**< The to file */
+   bool compare;             /**< Compare the files before linking */
+};
+
+static void link_manifest_directory(struct link_manifest* lm, char* from, char* to, char* relative);
+static void link_manifest_tablespaces(struct link_manifest* lm, char* from, char* to);
+static struct manifest_file* link_manifest_find(struct manifest* manifest, char* path);
 static void do_link(void* arg);
+static void do_link_manifest(void* arg);
 static void do_relink(void* arg);
 static void do_tablespace(void* arg);
 
@@ -154,6 +181,251 @@ do_link(void* arg)
    free(wi);
 }
 
+void
+pgmoneta_link_manifest(char* from, char* to, struct manifest* from_manifest, struct manifest* to_manifest,
+                       struct workers* workers, struct link_statistics* statistics)
+{
+   struct link_manifest lm;
+
+   lm.from_manifest = from_manifest;
+   lm.to_manifest = to_manifest;
+   lm.workers = workers;
+   atomic_init(&lm.manifest_files, 0);
+   atomic_init(&lm.compared_files, 0);
+   atomic_init(&lm.linked_files, 0);
+   atomic_init(&lm.bytes_saved, 0);
+   atomic_init(&lm.bytes_not_read, 0);
+
+   link_manifest_directory(&lm, from, to, "");
+
+   // the tasks refer to the shared state
+   if (workers != NULL)
+   {
+      pgmoneta_workers_wait(workers);
+   }
+
+   if (statistics != NULL)
+   {
+      statistics->manifest_files = atomic_load(&lm.manifest_files);
+      statistics->compared_files = atomic_load(&lm.compared_files);
+      statistics->linked_files = atomic_load(&lm.linked_files);
+      statistics->bytes_saved = atomic_load(&lm.bytes_saved);
+      statistics->bytes_not_read = atomic_load(&lm.bytes_not_read);
+   }
+}
+
+static void
+link_manifest_directory(struct link_manifest* lm, char* from, char* to, char* relative)
+{
+   DIR* from_dir = opendir(from);
+   char from_entry[MAX_PATH];
+   char to_entry[MAX_PATH];
+   char path[MAX_PATH];
+   struct dirent* entry;
+   struct stat statbuf;
+   struct manifest_file* from_file = NULL;
+   struct manifest_file* to_file = NULL;
+   bool compare;
+   struct link_task* task = NULL;
+
+   if (from_dir == NULL)
+   {
+      return;
+   }
+
+   while ((entry = readdir(from_dir)))
+   {
+      if (!strcmp(entry->d_name, ".") || !strcmp(entry->d_name, ".."))
+      {
+         continue;
+      }
+
+      if (snprintf(from_entry, sizeof(from_entry), "%s/%s", from, entry->d_name) >= (int)sizeof(from_entry) ||
+          snprintf(to_entry, sizeof(to_entry), "%s/%s", to, entry->d_name) >= (int)sizeof(to_entry))
+      {
+         pgmoneta_log_debug("Link: The path of %s/%s is too long", from, entry->d_name);
+         continue;
+      }
+
+      if (strlen(relative) == 0)
+      {
+         snprintf(path, sizeof(path), "%s", entry->d_name);
+      }
+      else
+      {
+         snprintf(path, sizeof(path), "%s/%s", relative, entry->d_name);
+      }
+
+      if (!strcmp(path, "pg_tblspc"))
+      {
+         link_manifest_tablespaces(lm, from_entry, to_entry);
+         continue;
+      }
+
+      if (lstat(from_entry, &statbuf) || S_ISLNK(statbuf.st_mode))
+      {
+         continue;
+      }
+
+      if (S_ISDIR(statbuf.st_mode))
+      {
+         link_manifest_directory(lm, from_entry, to_entry, path);
+         continue;
+      }
+
+      if (!S_ISREG(statbuf.st_mode) || !pgmoneta_exists(to_entry))
+      {
+         continue;
+      }
+
+      from_file = link_manifest_find(lm->from_manifest, path);
+      to_file = link_manifest_find(lm->to_manifest, path);
+      compare = true;
+
+      if (from_file != NULL && to_file != NULL &&
+          from_file->algorithm != MANIFEST_CHECKSUM_NONE && from_file->algorithm == to_file->algorithm)
+      {
+         // a different checksum means the content differs, so there is nothing to read
+         if (!pgmoneta_manifest_file_equal(from_file, to_file))
+         {
+            continue;
+         }
+
+         // the same size and checksum are trusted without reading the files, also for CRC32C
+         compare = false;
+      }
+
+      task = (struct link_task*)malloc(sizeof(struct link_task));
+      if (task == NULL)
+      {
+         break;
+      }
+
+      task->lm = lm;
+      memcpy(task->from, from_entry, sizeof(task->from));
+      memcpy(task->to, to_entry, sizeof(task->to));
+      task->compare = compare;
+
+      if (lm->workers == NULL || pgmoneta_workers_add(lm->workers, do_link_manifest, (void*)task))
+      {
+         do_link_manifest(task);
+      }
+   }
+
+   closedir(from_dir);
+}
+
+static void
+link_manifest_tablespaces(struct link_manifest* lm, char* from, char* to)
+{
+   DIR* from_dir = opendir(from);
+   char from_entry[MAX_PATH];
+   char to_entry[MAX_PATH];
+   char path[MAX_PATH];
+   char* from_real = NULL;
+   char* to_real = NULL;
+   struct dirent* entry;
+
+   if (from_dir == NULL)
+   {
+      return;
+   }
+
+   while ((entry = readdir(from_dir)))
+   {
+      if (!strcmp(entry->d_name, ".") || !strcmp(entry->d_name, ".."))
+      {
+         continue;
+      }
+
+      if (snprintf(from_entry, sizeof(from_entry), "%s/%s", from, entry->d_name) >= (int)sizeof(from_entry) ||
+          snprintf(to_entry, sizeof(to_entry), "%s/%s", to, entry->d_name) >= (int)sizeof(to_entry))
+      {
+         pgmoneta_log_debug("Link: The path of %s/%s is too long", from, entry->d_name);
+         continue;
+      }
+      snprintf(path, sizeof(path), "pg_tblspc/%s", entry->d_name);
+
+      // pg_tblspc/<oid> points to the tablespace directory of each backup, link to the real file
+      from_real = realpath(from_entry, NULL);
+      to_real = realpath(to_entry, NULL);
+
+      if (from_real != NULL && to_real != NULL && strcmp(from_real, to_real) &&
+          pgmoneta_is_directory(from_real) && pgmoneta_is_directory(to_real))
+      {
+         link_manifest_directory(lm, from_real, to_real, path);
+      }
+
+      free(from_real);
+      free(to_real);
+      from_real = NULL;
+      to_real = NULL;
+   }
+
+   closedir(from_dir);
+}
+
+static struct manifest_file*
+link_manifest_find(struct manifest* manifest, char* path)
+{
+   char name[MAX_PATH];
+   char* suffixes[] = {".gz", ".zstd", ".lz4", ".bz2"};
+   struct manifest_file* mf = NULL;
+
+   snprintf(name, sizeof(name), "%s", path);
+
+   mf = pgmoneta_manifest_find(manifest, name);
+
+   // the stored file may carry an encryption and a compression suffix
+   if (mf == NULL && pgmoneta_ends_with(name, ".aes"))
+   {
+      name[strlen(name) - strlen(".aes")] = '\0';
+      mf = pgmoneta_manifest_find(manifest, name);
+   }
+
+   for (int i = 0; mf == NULL && i < (int)(sizeof(suffixes) / sizeof(suffixes[0])); i++)
+   {
+      if (pgmoneta_ends_with(name, suffixes[i]))
+      {
+         name[strlen(name) - strlen(suffixes[i])] = '\0';
+         mf = pgmoneta_manifest_find(manifest, name);
+      }
+   }
+
+   return mf;
+}
+
+static void
+do_link_manifest(void* arg)
+{
+   struct link_task* task = (struct link_task*)arg;
+   struct link_manifest* lm = task->lm;
+   size_t size = 0;
+
+   size = pgmoneta_get_file_size(task->from);
+
+   if (task->compare)
+   {
+      atomic_fetch_add(&lm->compared_files, 1);
+   }
+   else
+   {
+      atomic_fetch_add(&lm->manifest_files, 1);
+      atomic_fetch_add(&lm->bytes_not_read, size + pgmoneta_get_file_size(task->to));
+   }
+
+   if (!task->compare || pgmoneta_compare_files(task->from, task->to))
+   {
+      pgmoneta_delete_file(task->from, NULL);
+      pgmoneta_symlink_file(task->from, task->to);
+
+      atomic_fetch_add(&lm->linked_files, 1);
+      atomic_fetch_add(&lm->bytes_saved, size);
+   }
+
+   free(task);
+}
+
 void
 pgmoneta_relink(char* from, char* to, struct workers* workers)
 {
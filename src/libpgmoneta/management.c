@@ -28,6 +28,7 @@
 
 /* pgmoneta */
 #include <pgmoneta.h>
+#include <catalog.h>
 #include <info.h>
 #include <json.h>
 #include <logging.h>
@@ -636,14 +637,7 @@ pgmoneta_management_write_status(int socket, bool offline)
 
    config = (struct configuration*)shmem;
 
-   d = NULL;
-   d = pgmoneta_append(d, config->base_dir);
-   d = pgmoneta_append(d, "/");
-
-   used_size = pgmoneta_directory_size(d);
-
-   free(d);
-   d = NULL;
+   used_size = pgmoneta_catalog_used_space();
 
    free_size = pgmoneta_free_space(config->base_dir);
    total_size = pgmoneta_total_space(config->base_dir);
@@ -722,18 +716,13 @@ pgmoneta_management_write_status(int socket, bool offline)
          goto error;
       }
 
-      d = pgmoneta_get_server(i);
-
-      server_size = pgmoneta_directory_size(d);
+      server_size = pgmoneta_catalog_server_size(i);
 
       if (write_int64("pgmoneta_management_write_status", socket, server_size))
       {
          goto error;
       }
 
-      free(d);
-      d = NULL;
-
       d = pgmoneta_get_server_backup(i);
 
       pgmoneta_get_directories(d, &number_of_directories, &array);
@@ -855,14 +844,7 @@ pgmoneta_management_write_details(int socket, bool offline)
 
    config = (struct configuration*)shmem;
 
-   d = NULL;
-   d = pgmoneta_append(d, config->base_dir);
-   d = pgmoneta_append(d, "/");
-
-   used_size = pgmoneta_directory_size(d);
-
-   free(d);
-   d = NULL;
+   used_size = pgmoneta_catalog_used_space();
 
    free_size = pgmoneta_free_space(config->base_dir);
    total_size = pgmoneta_total_space(config->base_dir);
@@ -964,18 +946,13 @@ pgmoneta_management_write_details(int socket, bool offline)
          goto error;
       }
 
-      d = pgmoneta_get_server(i);
-
-      server_size = pgmoneta_directory_size(d);
+      server_size = pgmoneta_catalog_server_size(i);
 
       if (write_int64("pgmoneta_management_write_details", socket, server_size))
       {
          goto error;
       }
 
-      free(d);
-      d = NULL;
-
       d = pgmoneta_get_server_backup(i);
 
       pgmoneta_get_backups(d, &number_of_backups, &backups);
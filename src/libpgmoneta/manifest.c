@@ -28,28 +28,107 @@
 
 /* pgmoneta */
 #include <pgmoneta.h>
+#include <incremental.h>
 #include <logging.h>
 #include <manifest.h>
-#include <security.h>
+#include <crc32c.h>
+#include <pipeline.h>
 #include <utils.h>
+#include <workers.h>
 
 /* system */
-#include <cjson/cJSON.h>
+#include <fcntl.h>
+#include <stdatomic.h>
+#include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <openssl/evp.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#define MANIFEST_MAX_DEPTH 64
+
+#define MANIFEST_READ_ALIGNMENT   4096
+#define MANIFEST_READ_BUFFER_SIZE (1024 * 1024)
+
+struct manifest_parser
+{
+   char* data;
+   size_t size;
+   size_t position;
+   struct manifest* manifest;
+};
+
+struct manifest_verify
+{
+   char* root;                /**< The root directory */
+   struct manifest* manifest; /**< The manifest */
+   atomic_bool failed;        /**< Set on the first failure */
+   atomic_ulong bytes;        /**< The number of bytes hashed */
+   atomic_ulong files;        /**< The number of files verified */
+};
+
+struct manifest_verify_task
+{
+   struct manifest_verify* verify; /**< The shared verification state */
+   struct manifest_file* file;     /**< The file to verify */
+};
+
+struct manifest_hash
+{
+   uint8_t algorithm;   /**< The checksum algorithm */
+   EVP_MD_CTX* ctx;     /**< The digest context, NULL for CRC32C */
+   uint32_t crc;        /**< The CRC32C */
+   size_t bytes;        /**< The number of bytes hashed */
+   atomic_bool* failed; /**< Set when the verification failed elsewhere */
+};
 
 static void manifest_init(struct manifest** manifest);
-static void manifest_file_init(struct manifest_file** file, char* path, char* checksum, char* algorithm, size_t size);
-static void manifest_file_free(struct manifest_file* file);
-static int manifest_file_hash(char* algorithm, char* file_path, char** hash);
+static int manifest_map(char* manifest_path, struct manifest* manifest);
+static int manifest_parse_document(struct manifest_parser* parser);
+static int manifest_parse_files(struct manifest_parser* parser);
+static int manifest_parse_file(struct manifest_parser* parser);
+static int manifest_parse_string(struct manifest_parser* parser, char** value, size_t* length, bool* escaped);
+static int manifest_parse_number(struct manifest_parser* parser, size_t* value);
+static int manifest_skip_value(struct manifest_parser* parser, int depth);
+static bool manifest_expect(struct manifest_parser* parser, char c);
+static void manifest_skip_whitespace(struct manifest_parser* parser);
+static bool manifest_key(char* value, size_t length, char* key);
+static int manifest_intern(struct manifest* manifest, char* value, size_t length, bool escaped, bool encoded, struct manifest_file* file);
+static int manifest_unescape(char* value, size_t length, char* out, size_t* out_length);
+static int manifest_hex_decode(char* value, size_t length, uint8_t* out, size_t capacity, size_t* out_length);
+static char* manifest_hex_encode(uint8_t* value, size_t length, char* buffer);
+static int manifest_algorithm(char* value, size_t length, uint8_t* algorithm);
+static uint32_t manifest_path_hash(char* path, size_t length);
+static struct manifest_file* manifest_lookup(struct manifest* manifest, char* path, size_t length, uint32_t hash);
+static void manifest_verify_file(void* arg);
+static int manifest_file_hash(uint8_t algorithm, char* file_path, uint8_t* checksum, size_t* checksum_length, size_t* bytes, atomic_bool* failed);
+static int manifest_hash_init(uint8_t algorithm, atomic_bool* failed, struct manifest_hash* hash);
+static int manifest_hash_update(struct manifest_hash* hash, void* data, size_t length);
+static int manifest_hash_final(struct manifest_hash* hash, uint8_t* checksum, size_t* checksum_length);
+static int manifest_hash_process(struct pipeline_stage* stage, void* buffer, size_t size, bool last);
+static void manifest_hash_destroy(struct pipeline_stage* stage);
+static int manifest_build_index(struct manifest* manifest);
+static int manifest_write(FILE* file, EVP_MD_CTX* ctx, char* data, size_t length);
+static char* manifest_entry(char* path, struct stat* st, uint8_t algorithm, uint8_t* checksum, size_t checksum_length);
 
 int
-pgmoneta_manifest_checksum_verify(char* root)
+pgmoneta_manifest_checksum_verify(char* root, struct workers* workers)
 {
    char manifest_path[MAX_PATH];
-   char* manifest_sha256 = NULL;
+   char expected[2 * MANIFEST_CHECKSUM_LENGTH + 1];
+   char actual[2 * MANIFEST_CHECKSUM_LENGTH + 1];
+   unsigned char digest[EVP_MAX_MD_SIZE];
+   unsigned int digest_length = 0;
    struct manifest* manifest = NULL;
-   struct manifest_file* file = NULL;
+   struct manifest_verify verify;
+   struct manifest_verify_task* tasks = NULL;
+   struct timespec start;
+   struct timespec end;
+   double elapsed;
+   unsigned long bytes;
 
    memset(manifest_path, 0, MAX_PATH);
    if (pgmoneta_ends_with(root, "/"))
@@ -65,54 +144,78 @@ pgmoneta_manifest_checksum_verify(char* root)
    {
       goto error;
    }
+
    // first check manifest checksum, it's always a SHA256 hash
-   pgmoneta_generate_string_sha256_hash(manifest->content, &manifest_sha256);
-   if (!pgmoneta_compare_string(manifest_sha256, manifest->checksum))
+   if (!EVP_Digest(manifest->map, manifest->content_size, digest, &digest_length, EVP_sha256(), NULL))
+   {
+      pgmoneta_log_error("Unable to generate manifest checksum");
+      goto error;
+   }
+   if (digest_length != manifest->checksum_length || memcmp(digest, manifest->checksum, digest_length))
+   {
+      pgmoneta_log_error("Manifest checksum mismatch. Getting %s, should be %s",
+                         manifest_hex_encode(digest, digest_length, actual),
+                         manifest_hex_encode(manifest->checksum, manifest->checksum_length, expected));
+      goto error;
+   }
+
+   tasks = (struct manifest_verify_task*)malloc((manifest->number_of_files + 1) * sizeof(struct manifest_verify_task));
+   if (tasks == NULL)
    {
-      pgmoneta_log_error("Manifest checksum mismatch. Getting %s, should be %s", manifest_sha256, manifest->checksum);
       goto error;
    }
-   file = manifest->files;
-   while (file != NULL)
+
+   verify.root = root;
+   verify.manifest = manifest;
+   atomic_init(&verify.failed, false);
+   atomic_init(&verify.bytes, 0);
+   atomic_init(&verify.files, 0);
+
+   clock_gettime(CLOCK_MONOTONIC, &start);
+
+   for (unsigned long i = 0; i < manifest->number_of_files && !atomic_load(&verify.failed); i++)
    {
-      char file_path[MAX_PATH];
-      size_t file_size = 0;
-      char* hash = NULL;
+      tasks[i].verify = &verify;
+      tasks[i].file = &manifest->files[i];
 
-      memset(file_path, 0, MAX_PATH);
-      if (pgmoneta_ends_with(root, "/"))
+      if (workers != NULL)
       {
-         snprintf(file_path, MAX_PATH, "%s%s", root, file->path);
+         if (pgmoneta_workers_add(workers, manifest_verify_file, &tasks[i]))
+         {
+            manifest_verify_file(&tasks[i]);
+         }
       }
       else
       {
-         snprintf(file_path, MAX_PATH, "%s/%s", root, file->path);
-      }
-      file_size = pgmoneta_get_file_size(file_path);
-      if (file_size != file->size)
-      {
-         pgmoneta_log_error("File size mismatch: %s, getting %lu, should be %lu", file_size, file->size);
+         manifest_verify_file(&tasks[i]);
       }
+   }
 
-      if (manifest_file_hash(file->algorithm, file_path, &hash))
-      {
-         pgmoneta_log_error("Unable to generate hash for file %s with algorithm %s", file_path, file->algorithm);
-         goto error;
-      }
-      if (!pgmoneta_compare_string(hash, file->checksum))
-      {
-         pgmoneta_log_error("File checksum mismatch, path: %s. Getting %s, should be %s", file_path, manifest_sha256, manifest->checksum);
-      }
-      free(hash);
-      file = file->next;
+   if (workers != NULL)
+   {
+      pgmoneta_workers_wait(workers);
+   }
+
+   clock_gettime(CLOCK_MONOTONIC, &end);
+   elapsed = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1000000000.0;
+   bytes = atomic_load(&verify.bytes);
+
+   pgmoneta_log_debug("Manifest verification: %lu/%lu files, %lu bytes in %.3f s (%.2f MB/s)",
+                      atomic_load(&verify.files), manifest->number_of_files, bytes, elapsed,
+                      elapsed > 0 ? bytes / elapsed / (1024 * 1024) : 0.0);
+
+   if (atomic_load(&verify.failed))
+   {
+      goto error;
    }
+
+   free(tasks);
    pgmoneta_manifest_free(manifest);
-   free(manifest_sha256);
    return 0;
 
 error:
+   free(tasks);
    pgmoneta_manifest_free(manifest);
-   free(manifest_sha256);
    return 1;
 }
 
@@ -120,340 +223,1958 @@ int
 pgmoneta_parse_manifest(char* manifest_path, struct manifest** manifest)
 {
    struct manifest* m = NULL;
-   FILE* f = NULL;
-   size_t checksum_size = 0;
-   size_t content_size = 0;
-   size_t size = 0;
-   char* json = NULL;
-   char* ptr = NULL;
-   struct cJSON* manifest_json = NULL;
-   struct cJSON* manifest_checksum = NULL;
-   struct cJSON* files = NULL;
-   struct cJSON* file = NULL;
+   struct manifest_parser parser;
 
    *manifest = NULL;
    manifest_init(&m);
 
+   if (m == NULL)
+   {
+      goto error;
+   }
+
    if (!pgmoneta_exists(manifest_path))
    {
       pgmoneta_log_error("Could not find backup manifest: %s", manifest_path);
       goto error;
    }
-   size = pgmoneta_get_file_size(manifest_path);
-   json = (char*) malloc(size + 1);
-   memset(json, 0, size + 1);
 
-   f = fopen(manifest_path, "r");
-   if (f == NULL)
+   if (manifest_map(manifest_path, m))
    {
       pgmoneta_log_error("Could not open backup manifest: %s", manifest_path);
       goto error;
    }
 
-   size = fread(json, 1, size, f);
+   // size the file array and the arena from the manifest size, an entry is roughly 160 bytes
+   m->files_capacity = m->map_size / 160 + 16;
+   m->files = (struct manifest_file*)malloc(m->files_capacity * sizeof(struct manifest_file));
+   m->strings_capacity = m->map_size / 4 + 1024;
+   m->strings = (char*)malloc(m->strings_capacity);
+   if (m->files == NULL || m->strings == NULL)
+   {
+      pgmoneta_log_error("Unable to allocate space for manifest %s", manifest_path);
+      goto error;
+   }
+
+   memset(&parser, 0, sizeof(struct manifest_parser));
+   parser.data = m->map;
+   parser.size = m->map_size;
+   parser.position = 0;
+   parser.manifest = m;
 
-   manifest_json = cJSON_Parse(json);
-   if (manifest_json == NULL)
+   if (manifest_parse_document(&parser))
    {
-      const char* error_ptr = cJSON_GetErrorPtr();
-      if (error_ptr != NULL)
-      {
-         pgmoneta_log_error("Unable to parse manifest: %s", error_ptr);
-      }
+      pgmoneta_log_error("Unable to parse manifest %s at offset %lu", manifest_path, parser.position);
+      goto error;
+   }
+
+   if (m->content_size == 0 || m->checksum_length == 0)
+   {
+      pgmoneta_log_error("Incomplete manifest, missing manifest checksum");
       goto error;
    }
 
-   files = cJSON_GetObjectItemCaseSensitive(manifest_json, "Files");
-   manifest_checksum = cJSON_GetObjectItemCaseSensitive(manifest_json, "Manifest-Checksum");
-   if (!cJSON_IsString(manifest_checksum))
+   if (manifest_build_index(m))
    {
-      pgmoneta_log_error("Unable to parse manifest %s", manifest_path);
+      pgmoneta_log_error("Unable to index manifest %s", manifest_path);
       goto error;
    }
-   checksum_size = strlen(manifest_checksum->valuestring);
-   m->checksum = (char*)malloc(checksum_size + 1);
-   memset(m->checksum, 0, checksum_size + 1);
-   memcpy(m->checksum, manifest_checksum->valuestring, checksum_size);
 
-   struct manifest_file* tmp = NULL;
-   cJSON_ArrayForEach(file, files)
+   *manifest = m;
+   return 0;
+
+error:
+   pgmoneta_manifest_free(m);
+   return 1;
+}
+
+int
+pgmoneta_manifest_load(char* directory, struct manifest** manifest)
+{
+   int fd = -1;
+   int length;
+   char path[MAX_PATH];
+   char temporary[MAX_PATH];
+   char* stored = NULL;
+   struct configuration* config;
+
+   config = (struct configuration*)shmem;
+
+   *manifest = NULL;
+
+   memset(path, 0, MAX_PATH);
+   memset(temporary, 0, MAX_PATH);
+
+   if (pgmoneta_ends_with(directory, "/"))
+   {
+      snprintf(path, MAX_PATH, "%s%s", directory, "backup_manifest");
+   }
+   else
+   {
+      snprintf(path, MAX_PATH, "%s/%s", directory, "backup_manifest");
+   }
+
+   stored = pgmoneta_stored_file(path);
+   if (stored == NULL)
    {
-      struct manifest_file* manifest_file = NULL;
-      struct cJSON* file_path = cJSON_GetObjectItemCaseSensitive(file, "Path");
-      struct cJSON* file_size = cJSON_GetObjectItemCaseSensitive(file, "Size");
-      struct cJSON* file_checksum = cJSON_GetObjectItemCaseSensitive(file, "Checksum");
-      struct cJSON* file_algorithm = cJSON_GetObjectItemCaseSensitive(file, "Checksum-Algorithm");
+      pgmoneta_log_debug("Could not find backup manifest in %s", directory);
+      goto error;
+   }
 
-      if (!cJSON_IsNumber(file_size) || !cJSON_IsString(file_path) || !cJSON_IsString(file_checksum) || !cJSON_IsString(file_algorithm))
+   if (!strcmp(stored, path))
+   {
+      if (pgmoneta_parse_manifest(path, manifest))
       {
-         pgmoneta_log_error("Unable to parse manifest %s", manifest_path);
          goto error;
       }
-      manifest_file_init(&manifest_file, file_path->valuestring, file_checksum->valuestring, file_algorithm->valuestring, file_size->valuedouble);
-      if (manifest_file == NULL)
+   }
+   else
+   {
+      if (pgmoneta_ends_with(config->base_dir, "/"))
+      {
+         length = snprintf(temporary, MAX_PATH, "%s%s", config->base_dir, "backup_manifest.XXXXXX");
+      }
+      else
+      {
+         length = snprintf(temporary, MAX_PATH, "%s/%s", config->base_dir, "backup_manifest.XXXXXX");
+      }
+
+      if (length >= MAX_PATH)
       {
-         pgmoneta_log_error("Unable to allocated space for manifest file info");
+         pgmoneta_log_error("Could not create temporary manifest in %s", config->base_dir);
+         memset(temporary, 0, MAX_PATH);
          goto error;
       }
-      if (tmp == NULL)
+
+      fd = mkstemp(temporary);
+      if (fd == -1)
       {
-         tmp = manifest_file;
-         m->files = tmp;
+         pgmoneta_log_error("Could not create temporary manifest %s", temporary);
+         memset(temporary, 0, MAX_PATH);
+         goto error;
       }
-      else
+      close(fd);
+
+      // the mapping stays valid once the temporary file is removed
+      if (pgmoneta_decrypt_decompress_file(stored, temporary) ||
+          pgmoneta_parse_manifest(temporary, manifest))
       {
-         tmp->next = manifest_file;
-         tmp = tmp->next;
+         goto error;
       }
+
+      pgmoneta_delete_file(temporary, NULL);
    }
 
-   ptr = strstr(json, "\"Manifest-Checksum\"");
+   free(stored);
 
-   if (ptr == NULL)
-   {
-      pgmoneta_log_error("Incomplete manifest, missing manifest checksum");
-      goto error;
-   }
+   return 0;
 
-   // save preceding lines before the manifest checksum field,
-   // in order to verify the checksum of the manifest itself
-   content_size = ptr - json;
-   m->content = (char*)malloc(content_size + 1);
-   memset(m->content, 0, content_size + 1);
-   memcpy(m->content, json, content_size);
+error:
 
-   if (manifest_json != NULL)
-   {
-      cJSON_Delete(manifest_json);
-   }
-   if (f != NULL)
+   if (strlen(temporary) > 0)
    {
-      fclose(f);
+      pgmoneta_delete_file(temporary, NULL);
    }
-   free(json);
-   *manifest = m;
-   return 0;
-error:
-   if (manifest_json != NULL)
+   free(stored);
+
+   return 1;
+}
+
+struct manifest_file*
+pgmoneta_manifest_find(struct manifest* manifest, char* path)
+{
+   size_t length = 0;
+
+   if (manifest == NULL || path == NULL)
    {
-      cJSON_Delete(manifest_json);
+      return NULL;
    }
-   if (m != NULL)
+
+   length = strlen(path);
+
+   return manifest_lookup(manifest, path, length, manifest_path_hash(path, length));
+}
+
+char*
+pgmoneta_manifest_file_path(struct manifest* manifest, struct manifest_file* file)
+{
+   return manifest->strings + file->path;
+}
+
+char*
+pgmoneta_manifest_file_checksum(struct manifest_file* file, char* buffer)
+{
+   return manifest_hex_encode(file->checksum, file->checksum_length, buffer);
+}
+
+char*
+pgmoneta_manifest_algorithm_name(int algorithm)
+{
+   switch (algorithm)
    {
-      pgmoneta_manifest_free(m);
+      case MANIFEST_CHECKSUM_NONE:
+         return "NONE";
+      case MANIFEST_CHECKSUM_CRC32C:
+         return "CRC32C";
+      case MANIFEST_CHECKSUM_SHA224:
+         return "SHA224";
+      case MANIFEST_CHECKSUM_SHA256:
+         return "SHA256";
+      case MANIFEST_CHECKSUM_SHA384:
+         return "SHA384";
+      case MANIFEST_CHECKSUM_SHA512:
+         return "SHA512";
+      default:
+         return "UNKNOWN";
    }
-   if (f != NULL)
+}
+
+bool
+pgmoneta_manifest_file_equal(struct manifest_file* file1, struct manifest_file* file2)
+{
+   if (file1 == NULL || file2 == NULL)
    {
-      fclose(f);
+      return false;
    }
-   free(json);
-   return 1;
+
+   return file1->algorithm != MANIFEST_CHECKSUM_NONE && file1->algorithm == file2->algorithm &&
+          file1->size == file2->size && file1->checksum_length == file2->checksum_length &&
+          !memcmp(file1->checksum, file2->checksum, file1->checksum_length);
 }
 
 int
-pgmoneta_compare_manifests(char* old_manifest, char* new_manifest, struct node** deleted_files, struct node** changed_files, struct node** new_files)
+pgmoneta_manifest_rewrite_incremental(struct manifest* manifest, char* directory)
 {
-   struct manifest* m1 = NULL;
-   struct manifest* m2 = NULL;
-   struct manifest_file* mf1 = NULL;
-   struct manifest_file* mf2 = NULL;
-   struct node* deleted_files_head = NULL;
-   struct node* changed_files_head = NULL;
-   struct node* new_files_head = NULL;
-   struct node* n = NULL;
+   FILE* file = NULL;
+   EVP_MD_CTX* ctx = NULL;
+   char manifest_path[MAX_PATH];
+   char tmp_manifest_path[MAX_PATH];
+   char file_path[MAX_PATH];
+   int length;
+   char checksum_hex[2 * MANIFEST_CHECKSUM_LENGTH + 1];
+   unsigned char digest[EVP_MAX_MD_SIZE];
+   unsigned int digest_length = 0;
+   uint8_t checksum[MANIFEST_CHECKSUM_LENGTH];
+   size_t checksum_length = 0;
+   size_t bytes = 0;
+   size_t position = 0;
+   char* path = NULL;
+   char* name = NULL;
+   char* target = NULL;
+   char* entry = NULL;
+   char* trailer = NULL;
+   atomic_bool failed;
+   struct manifest_file* mf = NULL;
+   struct stat st;
 
-   *deleted_files = NULL;
-   *changed_files = NULL;
-   *new_files = NULL;
+   atomic_init(&failed, false);
 
-   if (pgmoneta_parse_manifest(old_manifest, &m1))
+   memset(manifest_path, 0, MAX_PATH);
+   memset(tmp_manifest_path, 0, MAX_PATH);
+
+   if (pgmoneta_ends_with(directory, "/"))
+   {
+      snprintf(manifest_path, MAX_PATH, "%s%s", directory, "backup_manifest");
+   }
+   else
+   {
+      snprintf(manifest_path, MAX_PATH, "%s/%s", directory, "backup_manifest");
+   }
+   if (snprintf(tmp_manifest_path, MAX_PATH, "%s.tmp", manifest_path) >= MAX_PATH)
    {
+      pgmoneta_log_error("Could not create manifest %s.tmp", manifest_path);
+      memset(tmp_manifest_path, 0, MAX_PATH);
       goto error;
    }
 
-   if (pgmoneta_parse_manifest(new_manifest, &m2))
+   file = fopen(tmp_manifest_path, "wb");
+   if (file == NULL)
    {
+      pgmoneta_log_error("Could not create manifest %s", tmp_manifest_path);
       goto error;
    }
 
-   mf1 = m1->files;
-   while (mf1 != NULL)
+   ctx = EVP_MD_CTX_new();
+   if (ctx == NULL || !EVP_DigestInit_ex(ctx, EVP_sha256(), NULL))
    {
-      bool deleted = true;
-
-      mf2 = m2->files;
-      while (mf2 != NULL && deleted)
-      {
-         if (!strcmp(mf1->path, mf2->path))
-         {
-            deleted = false;
-
-            if (strcmp(mf1->checksum, mf2->checksum))
-            {
-               pgmoneta_log_trace("%s: %s <-> %s", mf1->path, mf1->checksum, mf2->checksum);
-
-               if (pgmoneta_create_node_string(mf1->path, mf1->checksum, &n))
-               {
-                  goto error;
-               }
+      goto error;
+   }
 
-               pgmoneta_append_node(&changed_files_head, n);
-               n = NULL;
+   for (unsigned long i = 0; i < manifest->number_of_files; i++)
+   {
+      mf = &manifest->files[i];
+      path = pgmoneta_manifest_file_path(manifest, mf);
 
-               break;
-            }
-         }
+      name = strrchr(path, '/');
+      name = name != NULL ? name + 1 : path;
 
-         mf2 = mf2->next;
+      // everything between the entries is kept as is
+      if (manifest_write(file, ctx, manifest->map + position, mf->offset - position))
+      {
+         goto error;
       }
+      position = mf->offset + mf->length;
 
-      if (deleted)
+      if (strncmp(name, INCREMENTAL_PREFIX, strlen(INCREMENTAL_PREFIX)))
       {
-         if (pgmoneta_create_node_string(mf1->path, mf1->checksum, &n))
+         if (manifest_write(file, ctx, manifest->map + mf->offset, mf->length))
          {
             goto error;
          }
-
-         pgmoneta_append_node(&deleted_files_head, n);
-         n = NULL;
+         continue;
       }
 
-      mf1 = mf1->next;
-   }
-
-   mf2 = m2->files;
-   while (mf2 != NULL)
-   {
-      bool new = true;
+      target = pgmoneta_append(target, path);
+      memmove(target + (name - path), target + (name - path) + strlen(INCREMENTAL_PREFIX),
+              strlen(name) - strlen(INCREMENTAL_PREFIX) + 1);
 
-      mf1 = m1->files;
-      while (mf1 != NULL && new)
+      if (pgmoneta_ends_with(directory, "/"))
       {
-         if (!strcmp(mf1->path, mf2->path))
-         {
-            new = false;
-         }
+         length = snprintf(file_path, MAX_PATH, "%s%s", directory, target);
+      }
+      else
+      {
+         length = snprintf(file_path, MAX_PATH, "%s/%s", directory, target);
+      }
 
-         mf1 = mf1->next;
+      if (length >= MAX_PATH || stat(file_path, &st))
+      {
+         pgmoneta_log_error("Could not find reconstructed file %s", file_path);
+         goto error;
       }
 
-      if (new)
+      checksum_length = 0;
+      if (mf->algorithm != MANIFEST_CHECKSUM_NONE &&
+          manifest_file_hash(mf->algorithm, file_path, checksum, &checksum_length, &bytes, &failed))
       {
-         if (pgmoneta_create_node_string(mf2->path, mf2->checksum, &n))
-         {
-            goto error;
-         }
+         pgmoneta_log_error("Unable to generate hash for file %s", file_path);
+         goto error;
+      }
 
-         pgmoneta_append_node(&new_files_head, n);
-         n = NULL;
+      entry = manifest_entry(target, &st, mf->algorithm, checksum, checksum_length);
+      if (entry == NULL || manifest_write(file, ctx, entry, strlen(entry)))
+      {
+         goto error;
       }
 
-      mf2 = mf2->next;
+      free(entry);
+      free(target);
+      entry = NULL;
+      target = NULL;
    }
 
-   *deleted_files = deleted_files_head;
-   *changed_files = changed_files_head;
-   *new_files = new_files_head;
+   if (manifest_write(file, ctx, manifest->map + position, manifest->content_size - position))
+   {
+      goto error;
+   }
 
-   pgmoneta_manifest_free(m1);
-   pgmoneta_manifest_free(m2);
+   if (!EVP_DigestFinal_ex(ctx, digest, &digest_length))
+   {
+      goto error;
+   }
+
+   trailer = pgmoneta_append(trailer, "\"Manifest-Checksum\": \"");
+   trailer = pgmoneta_append(trailer, manifest_hex_encode(digest, digest_length, checksum_hex));
+   trailer = pgmoneta_append(trailer, "\"}\n");
+
+   if (fwrite(trailer, 1, strlen(trailer), file) != strlen(trailer) || fflush(file) || fsync(fileno(file)))
+   {
+      goto error;
+   }
+
+   fclose(file);
+   file = NULL;
+
+   if (rename(tmp_manifest_path, manifest_path))
+   {
+      pgmoneta_log_error("Could not rename %s to %s", tmp_manifest_path, manifest_path);
+      goto error;
+   }
+
+   EVP_MD_CTX_free(ctx);
+   free(trailer);
 
    return 0;
 
 error:
 
-   pgmoneta_manifest_free(m1);
-   pgmoneta_manifest_free(m2);
+   if (file != NULL)
+   {
+      fclose(file);
+   }
+   if (strlen(tmp_manifest_path) > 0 && pgmoneta_exists(tmp_manifest_path))
+   {
+      pgmoneta_delete_file(tmp_manifest_path, NULL);
+   }
+   EVP_MD_CTX_free(ctx);
+   free(entry);
+   free(target);
+   free(trailer);
 
    return 1;
 }
 
-void
-pgmoneta_manifest_free(struct manifest* manifest)
+int
+pgmoneta_manifest_create_checksum(int algorithm, struct pipeline_stage** stage)
 {
-   if (manifest == NULL)
+   struct pipeline_stage* s = NULL;
+   struct manifest_hash* hash = NULL;
+
+   *stage = NULL;
+
+   s = (struct pipeline_stage*)malloc(sizeof(struct pipeline_stage));
+   hash = (struct manifest_hash*)malloc(sizeof(struct manifest_hash));
+
+   if (s == NULL || hash == NULL)
    {
-      return;
+      goto error;
    }
-   struct manifest_file* file = manifest->files;
-   while (file != NULL)
+
+   memset(s, 0, sizeof(struct pipeline_stage));
+
+   if (manifest_hash_init((uint8_t)algorithm, NULL, hash))
    {
-      struct manifest_file* f = file;
-      file = file->next;
-      manifest_file_free(f);
+      goto error;
    }
-   free(manifest->checksum);
-   free(manifest->content);
-   free(manifest);
-}
 
-static void
-manifest_init(struct manifest** manifest)
-{
-   struct manifest* m = NULL;
-   m = (struct manifest*) malloc(sizeof(struct manifest));
-   m->checksum = NULL;
-   m->content = NULL;
-   m->files = NULL;
-   *manifest = m;
-}
+   s->state = hash;
+   s->process = &manifest_hash_process;
+   s->destroy = &manifest_hash_destroy;
 
-static void
-manifest_file_init(struct manifest_file** file, char* path, char* checksum, char* algorithm, size_t size)
-{
-   struct manifest_file* f = NULL;
-   int checksum_len = strlen(checksum);
-   int path_len = strlen(path);
-   int algorithm_len = strlen(algorithm);
+   *stage = s;
+
+   return 0;
 
-   f = (struct manifest_file*) malloc(sizeof(struct manifest_file));
-   f->next = NULL;
-   f->checksum = (char*)malloc(checksum_len + 1);
-   f->path = (char*)malloc(path_len + 1);
-   f->algorithm = (char*)malloc(algorithm_len + 1);
-   f->size = size;
+error:
 
-   memset(f->checksum, 0, checksum_len + 1);
-   memset(f->path, 0, path_len + 1);
-   memset(f->algorithm, 0, algorithm_len + 1);
+   free(hash);
+   free(s);
 
-   memcpy(f->checksum, checksum, checksum_len);
-   memcpy(f->path, path, path_len);
-   memcpy(f->algorithm, algorithm, algorithm_len);
-   *file = f;
+   return 1;
 }
 
-static void
-manifest_file_free(struct manifest_file* file)
+int
+pgmoneta_manifest_checksum_final(struct pipeline_stage* stage, uint8_t* checksum, size_t* checksum_length, size_t* bytes)
 {
-   if (file == NULL)
-   {
-      return;
-   }
-   free(file->path);
-   free(file->checksum);
-   free(file->algorithm);
-   free(file);
+   struct manifest_hash* hash = (struct manifest_hash*)stage->state;
+
+   *bytes = hash->bytes;
+
+   return manifest_hash_final(hash, checksum, checksum_length);
 }
 
-static int
-manifest_file_hash(char* algorithm, char* file_path, char** hash)
+int
+pgmoneta_manifest_create(char* directory, uint64_t system_identifier, struct manifest_item* items, unsigned long number_of_items,
+                         uint32_t timeline, char* start_lsn, char* end_lsn)
 {
-   int stat = 0;
-   if (pgmoneta_compare_string(algorithm, "SHA256"))
-   {
-      stat = pgmoneta_generate_file_sha256_hash(file_path, hash);
+   FILE* file = NULL;
+   EVP_MD_CTX* ctx = NULL;
+   char manifest_path[MAX_PATH];
+   char tmp_manifest_path[MAX_PATH];
+   char checksum_hex[2 * MANIFEST_CHECKSUM_LENGTH + 1];
+   unsigned char digest[EVP_MAX_MD_SIZE];
+   unsigned int digest_length = 0;
+   char* header = NULL;
+   char* entry = NULL;
+   char* trailer = NULL;
+   struct stat st;
+
+   memset(manifest_path, 0, MAX_PATH);
+   memset(tmp_manifest_path, 0, MAX_PATH);
+
+   if (pgmoneta_ends_with(directory, "/"))
+   {
+      snprintf(manifest_path, MAX_PATH, "%s%s", directory, "backup_manifest");
+   }
+   else
+   {
+      snprintf(manifest_path, MAX_PATH, "%s/%s", directory, "backup_manifest");
+   }
+   if (snprintf(tmp_manifest_path, MAX_PATH, "%s.tmp", manifest_path) >= MAX_PATH)
+   {
+      pgmoneta_log_error("Could not create manifest %s.tmp", manifest_path);
+      memset(tmp_manifest_path, 0, MAX_PATH);
+      goto error;
+   }
+
+   file = fopen(tmp_manifest_path, "wb");
+   if (file == NULL)
+   {
+      pgmoneta_log_error("Could not create manifest %s", tmp_manifest_path);
+      goto error;
+   }
+
+   ctx = EVP_MD_CTX_new();
+   if (ctx == NULL || !EVP_DigestInit_ex(ctx, EVP_sha256(), NULL))
+   {
+      goto error;
+   }
+
+   // the same layout as the manifests of PostgreSQL, version 2 carries the system identifier
+   if (system_identifier != 0)
+   {
+      header = pgmoneta_append(header, "{ \"PostgreSQL-Backup-Manifest-Version\": 2,\n\"System-Identifier\": ");
+      header = pgmoneta_append_ulong(header, (unsigned long)system_identifier);
+      header = pgmoneta_append(header, ",\n\"Files\": [");
+   }
+   else
+   {
+      header = pgmoneta_append(header, "{ \"PostgreSQL-Backup-Manifest-Version\": 1,\n\"Files\": [");
+   }
+
+   if (manifest_write(file, ctx, header, strlen(header)))
+   {
+      goto error;
+   }
+
+   for (unsigned long i = 0; i < number_of_items; i++)
+   {
+      memset(&st, 0, sizeof(struct stat));
+      st.st_size = (off_t)items[i].size;
+      st.st_mtime = items[i].modified;
+
+      entry = manifest_entry(items[i].path, &st, items[i].algorithm, items[i].checksum, items[i].checksum_length);
+      if (entry == NULL ||
+          manifest_write(file, ctx, i == 0 ? "\n" : ",\n", i == 0 ? 1 : 2) ||
+          manifest_write(file, ctx, entry, strlen(entry)))
+      {
+         goto error;
+      }
+
+      free(entry);
+      entry = NULL;
+   }
+
+   trailer = pgmoneta_append(trailer, "\n],\n\"WAL-Ranges\": [\n{ \"Timeline\": ");
+   trailer = pgmoneta_append_ulong(trailer, timeline);
+   trailer = pgmoneta_append(trailer, ", \"Start-LSN\": \"");
+   trailer = pgmoneta_append(trailer, start_lsn);
+   trailer = pgmoneta_append(trailer, "\", \"End-LSN\": \"");
+   trailer = pgmoneta_append(trailer, end_lsn);
+   trailer = pgmoneta_append(trailer, "\" }\n],\n");
+
+   if (manifest_write(file, ctx, trailer, strlen(trailer)))
+   {
+      goto error;
+   }
+
+   if (!EVP_DigestFinal_ex(ctx, digest, &digest_length))
+   {
+      goto error;
+   }
+
+   free(trailer);
+   trailer = NULL;
+
+   trailer = pgmoneta_append(trailer, "\"Manifest-Checksum\": \"");
+   trailer = pgmoneta_append(trailer, manifest_hex_encode(digest, digest_length, checksum_hex));
+   trailer = pgmoneta_append(trailer, "\"}\n");
+
+   if (fwrite(trailer, 1, strlen(trailer), file) != strlen(trailer) || fflush(file) || fsync(fileno(file)))
+   {
+      goto error;
+   }
+
+   fclose(file);
+   file = NULL;
+
+   if (rename(tmp_manifest_path, manifest_path))
+   {
+      pgmoneta_log_error("Could not rename %s to %s", tmp_manifest_path, manifest_path);
+      goto error;
+   }
+
+   EVP_MD_CTX_free(ctx);
+   free(header);
+   free(trailer);
+
+   return 0;
+
+error:
+
+   if (file != NULL)
+   {
+      fclose(file);
+   }
+   if (strlen(tmp_manifest_path) > 0 && pgmoneta_exists(tmp_manifest_path))
+   {
+      pgmoneta_delete_file(tmp_manifest_path, NULL);
+   }
+   EVP_MD_CTX_free(ctx);
+   free(header);
+   free(entry);
+   free(trailer);
+
+   return 1;
+}
+
+int
+pgmoneta_compare_manifests(char* old_manifest, char* new_manifest, struct node** deleted_files, struct node** changed_files, struct node** new_files)
+{
+   struct manifest* m1 = NULL;
+   struct manifest* m2 = NULL;
+   struct manifest_file* mf1 = NULL;
+   struct manifest_file* mf2 = NULL;
+   struct node* deleted_files_head = NULL;
+   struct node* deleted_files_tail = NULL;
+   struct node* changed_files_head = NULL;
+   struct node* changed_files_tail = NULL;
+   struct node* new_files_head = NULL;
+   struct node* new_files_tail = NULL;
+   struct node* n = NULL;
+   char checksum1[2 * MANIFEST_CHECKSUM_LENGTH + 1];
+   char checksum2[2 * MANIFEST_CHECKSUM_LENGTH + 1];
+   char* path = NULL;
+   struct timespec start;
+   struct timespec end;
+   double elapsed;
+
+   *deleted_files = NULL;
+   *changed_files = NULL;
+   *new_files = NULL;
+
+   if (pgmoneta_parse_manifest(old_manifest, &m1))
+   {
+      goto error;
+   }
+
+   if (pgmoneta_parse_manifest(new_manifest, &m2))
+   {
+      goto error;
+   }
+
+   clock_gettime(CLOCK_MONOTONIC, &start);
+
+   for (unsigned long i = 0; i < m1->number_of_files; i++)
+   {
+      mf1 = &m1->files[i];
+      path = pgmoneta_manifest_file_path(m1, mf1);
+      mf2 = manifest_lookup(m2, path, mf1->path_length, mf1->hash);
+
+      if (mf2 == NULL)
+      {
+         if (pgmoneta_create_node_string(path, pgmoneta_manifest_file_checksum(mf1, checksum1), &n))
+         {
+            goto error;
+         }
+
+         if (deleted_files_tail == NULL)
+         {
+            deleted_files_head = n;
+         }
+         else
+         {
+            deleted_files_tail->next = n;
+         }
+         deleted_files_tail = n;
+         n = NULL;
+      }
+      // without a checksum there is no way to tell, so treat the file as changed
+      else if (mf1->algorithm == MANIFEST_CHECKSUM_NONE || mf1->algorithm != mf2->algorithm ||
+               mf1->checksum_length != mf2->checksum_length ||
+               memcmp(mf1->checksum, mf2->checksum, mf1->checksum_length))
+      {
+         pgmoneta_log_trace("%s: %s <-> %s", path,
+                            pgmoneta_manifest_file_checksum(mf1, checksum1),
+                            pgmoneta_manifest_file_checksum(mf2, checksum2));
+
+         if (pgmoneta_create_node_string(path, checksum1, &n))
+         {
+            goto error;
+         }
+
+         if (changed_files_tail == NULL)
+         {
+            changed_files_head = n;
+         }
+         else
+         {
+            changed_files_tail->next = n;
+         }
+         changed_files_tail = n;
+         n = NULL;
+      }
+   }
+
+   for (unsigned long i = 0; i < m2->number_of_files; i++)
+   {
+      mf2 = &m2->files[i];
+      path = pgmoneta_manifest_file_path(m2, mf2);
+
+      if (manifest_lookup(m1, path, mf2->path_length, mf2->hash) == NULL)
+      {
+         if (pgmoneta_create_node_string(path, pgmoneta_manifest_file_checksum(mf2, checksum2), &n))
+         {
+            goto error;
+         }
+
+         if (new_files_tail == NULL)
+         {
+            new_files_head = n;
+         }
+         else
+         {
+            new_files_tail->next = n;
+         }
+         new_files_tail = n;
+         n = NULL;
+      }
+   }
+
+   clock_gettime(CLOCK_MONOTONIC, &end);
+   elapsed = (end.tv_sec - start.tv_sec) * 1000.0 + (end.tv_nsec - start.tv_nsec) / 1000000.0;
+
+   pgmoneta_log_debug("Manifest compare: %lu/%lu files in %.3f ms", m1->number_of_files, m2->number_of_files, elapsed);
+
+   *deleted_files = deleted_files_head;
+   *changed_files = changed_files_head;
+   *new_files = new_files_head;
+
+   pgmoneta_manifest_free(m1);
+   pgmoneta_manifest_free(m2);
+
+   return 0;
+
+error:
+
+   pgmoneta_free_nodes(deleted_files_head);
+   pgmoneta_free_nodes(changed_files_head);
+   pgmoneta_free_nodes(new_files_head);
+
+   pgmoneta_manifest_free(m1);
+   pgmoneta_manifest_free(m2);
+
+   return 1;
+}
+
+void
+pgmoneta_manifest_free(struct manifest* manifest)
+{
+   if (manifest == NULL)
+   {
+      return;
+   }
+   if (manifest->map != NULL)
+   {
+      munmap(manifest->map, manifest->map_size);
+   }
+   free(manifest->strings);
+   free(manifest->files);
+   free(manifest->index);
+   free(manifest);
+}
+
+static void
+manifest_init(struct manifest** manifest)
+{
+   struct manifest* m = NULL;
+
+   m = (struct manifest*) malloc(sizeof(struct manifest));
+   if (m != NULL)
+   {
+      memset(m, 0, sizeof(struct manifest));
+   }
+   *manifest = m;
+}
+
+static int
+manifest_map(char* manifest_path, struct manifest* manifest)
+{
+   int fd = -1;
+   struct stat st;
+   void* map = NULL;
+
+   fd = open(manifest_path, O_RDONLY);
+   if (fd == -1)
+   {
+      goto error;
+   }
+
+   if (fstat(fd, &st) == -1 || st.st_size == 0)
+   {
+      goto error;
+   }
+
+   map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+   if (map == MAP_FAILED)
+   {
+      goto error;
+   }
+
+   madvise(map, st.st_size, MADV_SEQUENTIAL);
+
+   manifest->map = (char*)map;
+   manifest->map_size = st.st_size;
+
+   close(fd);
+
+   return 0;
+
+error:
+
+   if (fd != -1)
+   {
+      close(fd);
+   }
+
+   return 1;
+}
+
+static int
+manifest_parse_document(struct manifest_parser* parser)
+{
+   struct manifest* m = parser->manifest;
+   char* key = NULL;
+   size_t key_length = 0;
+   size_t key_position = 0;
+   char* value = NULL;
+   size_t value_length = 0;
+   size_t checksum_length = 0;
+   bool escaped = false;
+
+   if (!manifest_expect(parser, '{'))
+   {
+      return 1;
+   }
+
+   manifest_skip_whitespace(parser);
+   if (parser->position < parser->size && parser->data[parser->position] == '}')
+   {
+      parser->position++;
+      return 0;
+   }
+
+   while (true)
+   {
+      manifest_skip_whitespace(parser);
+      key_position = parser->position;
+
+      if (manifest_parse_string(parser, &key, &key_length, &escaped) || !manifest_expect(parser, ':'))
+      {
+         return 1;
+      }
+
+      if (manifest_key(key, key_length, "Files"))
+      {
+         if (manifest_parse_files(parser))
+         {
+            return 1;
+         }
+      }
+      else if (manifest_key(key, key_length, "Manifest-Checksum"))
+      {
+         // the manifest checksum covers everything preceding this field
+         m->content_size = key_position;
+
+         manifest_skip_whitespace(parser);
+         if (manifest_parse_string(parser, &value, &value_length, &escaped) ||
+             manifest_hex_decode(value, value_length, m->checksum, sizeof(m->checksum), &checksum_length))
+         {
+            return 1;
+         }
+         m->checksum_length = checksum_length;
+      }
+      else if (manifest_skip_value(parser, 1))
+      {
+         return 1;
+      }
+
+      if (manifest_expect(parser, ','))
+      {
+         continue;
+      }
+      if (manifest_expect(parser, '}'))
+      {
+         return 0;
+      }
+      return 1;
+   }
+}
+
+static int
+manifest_parse_files(struct manifest_parser* parser)
+{
+   if (!manifest_expect(parser, '['))
+   {
+      return 1;
+   }
+
+   manifest_skip_whitespace(parser);
+   if (parser->position < parser->size && parser->data[parser->position] == ']')
+   {
+      parser->position++;
+      return 0;
+   }
+
+   while (true)
+   {
+      if (manifest_parse_file(parser))
+      {
+         return 1;
+      }
+
+      if (manifest_expect(parser, ','))
+      {
+         continue;
+      }
+      if (manifest_expect(parser, ']'))
+      {
+         return 0;
+      }
+      return 1;
+   }
+}
+
+static int
+manifest_parse_file(struct manifest_parser* parser)
+{
+   struct manifest* m = parser->manifest;
+   struct manifest_file* file = NULL;
+   struct manifest_file* files = NULL;
+   char* key = NULL;
+   size_t key_length = 0;
+   char* value = NULL;
+   size_t value_length = 0;
+   size_t checksum_length = 0;
+   bool escaped = false;
+   bool has_path = false;
+   bool has_size = false;
+   bool has_checksum = false;
+
+   if (m->number_of_files == m->files_capacity)
+   {
+      if (m->files_capacity >= UINT32_MAX / 2)
+      {
+         return 1;
+      }
+
+      files = (struct manifest_file*)realloc(m->files, 2 * m->files_capacity * sizeof(struct manifest_file));
+      if (files == NULL)
+      {
+         return 1;
+      }
+      m->files = files;
+      m->files_capacity *= 2;
+   }
+
+   file = &m->files[m->number_of_files];
+   memset(file, 0, sizeof(struct manifest_file));
+
+   if (!manifest_expect(parser, '{'))
+   {
+      return 1;
+   }
+   file->offset = parser->position - 1;
+
+   manifest_skip_whitespace(parser);
+   if (parser->position < parser->size && parser->data[parser->position] == '}')
+   {
+      return 1;
+   }
+
+   while (true)
+   {
+      manifest_skip_whitespace(parser);
+
+      if (manifest_parse_string(parser, &key, &key_length, &escaped) || !manifest_expect(parser, ':'))
+      {
+         return 1;
+      }
+
+      manifest_skip_whitespace(parser);
+
+      if (manifest_key(key, key_length, "Path") || manifest_key(key, key_length, "Encoded-Path"))
+      {
+         if (has_path || manifest_parse_string(parser, &value, &value_length, &escaped) ||
+             manifest_intern(m, value, value_length, escaped, key_length == strlen("Encoded-Path"), file))
+         {
+            return 1;
+         }
+         has_path = true;
+      }
+      else if (manifest_key(key, key_length, "Size"))
+      {
+         if (manifest_parse_number(parser, &file->size))
+         {
+            return 1;
+         }
+         has_size = true;
+      }
+      else if (manifest_key(key, key_length, "Checksum-Algorithm"))
+      {
+         if (manifest_parse_string(parser, &value, &value_length, &escaped) ||
+             manifest_algorithm(value, value_length, &file->algorithm))
+         {
+            return 1;
+         }
+      }
+      else if (manifest_key(key, key_length, "Checksum"))
+      {
+         if (manifest_parse_string(parser, &value, &value_length, &escaped) ||
+             manifest_hex_decode(value, value_length, file->checksum, sizeof(file->checksum), &checksum_length))
+         {
+            return 1;
+         }
+         file->checksum_length = checksum_length;
+         has_checksum = true;
+      }
+      else if (manifest_skip_value(parser, 2))
+      {
+         return 1;
+      }
+
+      if (manifest_expect(parser, ','))
+      {
+         continue;
+      }
+      if (manifest_expect(parser, '}'))
+      {
+         break;
+      }
+      return 1;
+   }
+   file->length = parser->position - file->offset;
+
+   if (!has_path || !has_size || (file->algorithm != MANIFEST_CHECKSUM_NONE && !has_checksum))
+   {
+      return 1;
+   }
+
+   file->hash = manifest_path_hash(m->strings + file->path, file->path_length);
+   m->number_of_files++;
+
+   return 0;
+}
+
+static int
+manifest_parse_string(struct manifest_parser* parser, char** value, size_t* length, bool* escaped)
+{
+   size_t start = 0;
+   unsigned char c;
+
+   *value = NULL;
+   *length = 0;
+   *escaped = false;
+
+   if (parser->position >= parser->size || parser->data[parser->position] != '"')
+   {
+      return 1;
+   }
+
+   parser->position++;
+   start = parser->position;
+
+   while (parser->position < parser->size)
+   {
+      c = (unsigned char)parser->data[parser->position];
+
+      if (c == '"')
+      {
+         *value = parser->data + start;
+         *length = parser->position - start;
+         parser->position++;
+         return 0;
+      }
+      else if (c == '\\')
+      {
+         *escaped = true;
+         parser->position += 2;
+      }
+      else if (c < 0x20)
+      {
+         return 1;
+      }
+      else
+      {
+         parser->position++;
+      }
+   }
+
+   return 1;
+}
+
+static int
+manifest_parse_number(struct manifest_parser* parser, size_t* value)
+{
+   size_t start = parser->position;
+   size_t v = 0;
+   char c;
+
+   while (parser->position < parser->size)
+   {
+      c = parser->data[parser->position];
+      if (c < '0' || c > '9')
+      {
+         break;
+      }
+      if (v > (SIZE_MAX - (c - '0')) / 10)
+      {
+         return 1;
+      }
+      v = v * 10 + (c - '0');
+      parser->position++;
+   }
+
+   if (parser->position == start)
+   {
+      return 1;
+   }
+
+   *value = v;
+
+   return 0;
+}
+
+static int
+manifest_skip_value(struct manifest_parser* parser, int depth)
+{
+   char* value = NULL;
+   size_t length = 0;
+   bool escaped = false;
+   char c;
+
+   if (depth > MANIFEST_MAX_DEPTH)
+   {
+      return 1;
+   }
+
+   manifest_skip_whitespace(parser);
+   if (parser->position >= parser->size)
+   {
+      return 1;
+   }
+
+   c = parser->data[parser->position];
+
+   if (c == '"')
+   {
+      return manifest_parse_string(parser, &value, &length, &escaped);
+   }
+   else if (c == '{' || c == '[')
+   {
+      char close = c == '{' ? '}' : ']';
+
+      parser->position++;
+      if (manifest_expect(parser, close))
+      {
+         return 0;
+      }
+
+      while (true)
+      {
+         if (c == '{')
+         {
+            manifest_skip_whitespace(parser);
+            if (manifest_parse_string(parser, &value, &length, &escaped) || !manifest_expect(parser, ':'))
+            {
+               return 1;
+            }
+         }
+
+         if (manifest_skip_value(parser, depth + 1))
+         {
+            return 1;
+         }
+
+         if (manifest_expect(parser, ','))
+         {
+            continue;
+         }
+         if (manifest_expect(parser, close))
+         {
+            return 0;
+         }
+         return 1;
+      }
+   }
+   else
+   {
+      // numbers and the true, false and null literals
+      size_t start = parser->position;
+
+      while (parser->position < parser->size && strchr("+-.0123456789eEtruefalsn", parser->data[parser->position]) != NULL &&
+             parser->data[parser->position] != '\0')
+      {
+         parser->position++;
+      }
+
+      return parser->position == start;
+   }
+}
+
+static bool
+manifest_expect(struct manifest_parser* parser, char c)
+{
+   manifest_skip_whitespace(parser);
+
+   if (parser->position < parser->size && parser->data[parser->position] == c)
+   {
+      parser->position++;
+      return true;
+   }
+
+   return false;
+}
+
+static void
+manifest_skip_whitespace(struct manifest_parser* parser)
+{
+   char c;
+
+   while (parser->position < parser->size)
+   {
+      c = parser->data[parser->position];
+      if (c != ' ' && c != '\t' && c != '\n' && c != '\r')
+      {
+         return;
+      }
+      parser->position++;
+   }
+}
+
+static bool
+manifest_key(char* value, size_t length, char* key)
+{
+   return strlen(key) == length && !memcmp(value, key, length);
+}
+
+static int
+manifest_intern(struct manifest* manifest, char* value, size_t length, bool escaped, bool encoded, struct manifest_file* file)
+{
+   size_t size = 0;
+   size_t capacity = 0;
+   char* strings = NULL;
+   char* out = NULL;
+
+   // unescaped and decoded strings never grow, so the raw length is enough
+   if (manifest->strings_size + length + 1 > manifest->strings_capacity)
+   {
+      capacity = manifest->strings_capacity;
+      while (manifest->strings_size + length + 1 > capacity)
+      {
+         capacity *= 2;
+      }
+
+      if (capacity > UINT32_MAX)
+      {
+         return 1;
+      }
+
+      strings = (char*)realloc(manifest->strings, capacity);
+      if (strings == NULL)
+      {
+         return 1;
+      }
+      manifest->strings = strings;
+      manifest->strings_capacity = capacity;
+   }
+
+   out = manifest->strings + manifest->strings_size;
+
+   if (encoded)
+   {
+      if (escaped || manifest_hex_decode(value, length, (uint8_t*)out, length, &size))
+      {
+         return 1;
+      }
+   }
+   else if (escaped)
+   {
+      if (manifest_unescape(value, length, out, &size))
+      {
+         return 1;
+      }
+   }
+   else
+   {
+      memcpy(out, value, length);
+      size = length;
+   }
+
+   out[size] = '\0';
+
+   file->path = manifest->strings_size;
+   file->path_length = size;
+   manifest->strings_size += size + 1;
+
+   return 0;
+}
+
+static int
+manifest_unescape(char* value, size_t length, char* out, size_t* out_length)
+{
+   size_t i = 0;
+   size_t o = 0;
+   uint32_t cp = 0;
+   uint32_t low = 0;
+   uint8_t digits[2];
+   size_t n = 0;
+
+   *out_length = 0;
+
+   while (i < length)
+   {
+      if (value[i] != '\\')
+      {
+         out[o++] = value[i++];
+         continue;
+      }
+
+      if (i + 1 >= length)
+      {
+         return 1;
+      }
+
+      switch (value[i + 1])
+      {
+         case '"':
+         case '\\':
+         case '/':
+            out[o++] = value[i + 1];
+            break;
+         case 'b':
+            out[o++] = '\b';
+            break;
+         case 'f':
+            out[o++] = '\f';
+            break;
+         case 'n':
+            out[o++] = '\n';
+            break;
+         case 'r':
+            out[o++] = '\r';
+            break;
+         case 't':
+            out[o++] = '\t';
+            break;
+         case 'u':
+            if (i + 6 > length || manifest_hex_decode(value + i + 2, 4, digits, sizeof(digits), &n))
+            {
+               return 1;
+            }
+            cp = ((uint32_t)digits[0] << 8) | digits[1];
+
+            if (cp >= 0xD800 && cp <= 0xDBFF)
+            {
+               if (i + 12 > length || value[i + 6] != '\\' || value[i + 7] != 'u' ||
+                   manifest_hex_decode(value + i + 8, 4, digits, sizeof(digits), &n))
+               {
+                  return 1;
+               }
+               low = ((uint32_t)digits[0] << 8) | digits[1];
+               if (low < 0xDC00 || low > 0xDFFF)
+               {
+                  return 1;
+               }
+               cp = 0x10000 + ((cp - 0xD800) << 10) + (low - 0xDC00);
+               i += 6;
+            }
+
+            if (cp < 0x80)
+            {
+               out[o++] = (char)cp;
+            }
+            else if (cp < 0x800)
+            {
+               out[o++] = (char)(0xC0 | (cp >> 6));
+               out[o++] = (char)(0x80 | (cp & 0x3F));
+            }
+            else if (cp < 0x10000)
+            {
+               out[o++] = (char)(0xE0 | (cp >> 12));
+               out[o++] = (char)(0x80 | ((cp >> 6) & 0x3F));
+               out[o++] = (char)(0x80 | (cp & 0x3F));
+            }
+            else
+            {
+               out[o++] = (char)(0xF0 | (cp >> 18));
+               out[o++] = (char)(0x80 | ((cp >> 12) & 0x3F));
+               out[o++] = (char)(0x80 | ((cp >> 6) & 0x3F));
+               out[o++] = (char)(0x80 | (cp & 0x3F));
+            }
+            i += 4;
+            break;
+         default:
+            return 1;
+      }
+
+      i += 2;
+   }
+
+   *out_length = o;
+
+   return 0;
+}
+
+static int
+manifest_hex_decode(char* value, size_t length, uint8_t* out, size_t capacity, size_t* out_length)
+{
+   uint8_t nibble[2];
+
+   *out_length = 0;
+
+   if (length % 2 != 0 || length / 2 > capacity)
+   {
+      return 1;
+   }
+
+   for (size_t i = 0; i < length; i += 2)
+   {
+      for (int j = 0; j < 2; j++)
+      {
+         char c = value[i + j];
+
+         if (c >= '0' && c <= '9')
+         {
+            nibble[j] = c - '0';
+         }
+         else if (c >= 'a' && c <= 'f')
+         {
+            nibble[j] = c - 'a' + 10;
+         }
+         else if (c >= 'A' && c <= 'F')
+         {
+            nibble[j] = c - 'A' + 10;
+         }
+         else
+         {
+            return 1;
+         }
+      }
+
+      out[i / 2] = (nibble[0] << 4) | nibble[1];
+   }
+
+   *out_length = length / 2;
+
+   return 0;
+}
+
+static char*
+manifest_hex_encode(uint8_t* value, size_t length, char* buffer)
+{
+   static const char hex[] = "0123456789abcdef";
+
+   for (size_t i = 0; i < length; i++)
+   {
+      buffer[2 * i] = hex[value[i] >> 4];
+      buffer[2 * i + 1] = hex[value[i] & 0x0F];
+   }
+   buffer[2 * length] = '\0';
+
+   return buffer;
+}
+
+static int
+manifest_algorithm(char* value, size_t length, uint8_t* algorithm)
+{
+   if (manifest_key(value, length, "NONE"))
+   {
+      *algorithm = MANIFEST_CHECKSUM_NONE;
+   }
+   else if (manifest_key(value, length, "CRC32C"))
+   {
+      *algorithm = MANIFEST_CHECKSUM_CRC32C;
+   }
+   else if (manifest_key(value, length, "SHA224"))
+   {
+      *algorithm = MANIFEST_CHECKSUM_SHA224;
+   }
+   else if (manifest_key(value, length, "SHA256"))
+   {
+      *algorithm = MANIFEST_CHECKSUM_SHA256;
+   }
+   else if (manifest_key(value, length, "SHA384"))
+   {
+      *algorithm = MANIFEST_CHECKSUM_SHA384;
+   }
+   else if (manifest_key(value, length, "SHA512"))
+   {
+      *algorithm = MANIFEST_CHECKSUM_SHA512;
+   }
+   else
+   {
+      pgmoneta_log_error("Unrecognized hash algorithm: %.*s", (int)length, value);
+      return 1;
+   }
+
+   return 0;
+}
+
+static uint32_t
+manifest_path_hash(char* path, size_t length)
+{
+   uint32_t hash = 2166136261u;
+
+   for (size_t i = 0; i < length; i++)
+   {
+      hash ^= (unsigned char)path[i];
+      hash *= 16777619u;
+   }
+
+   return hash;
+}
+
+static struct manifest_file*
+manifest_lookup(struct manifest* manifest, char* path, size_t length, uint32_t hash)
+{
+   struct manifest_file* file = NULL;
+   uint32_t slot = 0;
+
+   if (manifest->index == NULL)
+   {
+      return NULL;
+   }
+
+   slot = hash & manifest->index_mask;
+   while (manifest->index[slot] != 0)
+   {
+      file = &manifest->files[manifest->index[slot] - 1];
+      if (file->hash == hash && file->path_length == length &&
+          !memcmp(manifest->strings + file->path, path, length))
+      {
+         return file;
+      }
+      slot = (slot + 1) & manifest->index_mask;
+   }
+
+   return NULL;
+}
+
+static void
+manifest_verify_file(void* arg)
+{
+   struct manifest_verify_task* task = (struct manifest_verify_task*)arg;
+   struct manifest_verify* verify = task->verify;
+   struct manifest_file* file = task->file;
+   char file_path[MAX_PATH];
+   char expected[2 * MANIFEST_CHECKSUM_LENGTH + 1];
+   char actual[2 * MANIFEST_CHECKSUM_LENGTH + 1];
+   uint8_t checksum[MANIFEST_CHECKSUM_LENGTH];
+   size_t checksum_length = 0;
+   size_t file_size = 0;
+   size_t bytes = 0;
+   bool stored = false;
+   struct timespec start;
+   struct timespec end;
+
+   // another file already failed, there is no point in continuing
+   if (atomic_load(&verify->failed))
+   {
+      return;
+   }
+
+   clock_gettime(CLOCK_MONOTONIC, &start);
+
+   memset(file_path, 0, MAX_PATH);
+   if (pgmoneta_ends_with(verify->root, "/"))
+   {
+      snprintf(file_path, MAX_PATH, "%s%s", verify->root, pgmoneta_manifest_file_path(verify->manifest, file));
+   }
+   else
+   {
+      snprintf(file_path, MAX_PATH, "%s/%s", verify->root, pgmoneta_manifest_file_path(verify->manifest, file));
+   }
+
+   // a stored file only reveals its size once it is decoded
+   stored = !pgmoneta_exists(file_path);
+
+   if (!stored)
+   {
+      file_size = pgmoneta_get_file_size(file_path);
+      if (file_size != file->size)
+      {
+         pgmoneta_log_error("File size mismatch: %s, getting %lu, should be %lu", file_path, file_size, file->size);
+         goto error;
+      }
+   }
+
+   if (file->algorithm != MANIFEST_CHECKSUM_NONE || stored)
+   {
+      if (manifest_file_hash(file->algorithm, file_path, checksum, &checksum_length, &bytes, &verify->failed))
+      {
+         if (!atomic_load(&verify->failed))
+         {
+            pgmoneta_log_error("Unable to generate hash for file %s with algorithm %s", file_path, pgmoneta_manifest_algorithm_name(file->algorithm));
+            goto error;
+         }
+         return;
+      }
+
+      if (stored && bytes != file->size)
+      {
+         pgmoneta_log_error("File size mismatch: %s, getting %lu, should be %lu", file_path, bytes, file->size);
+         goto error;
+      }
+   }
+
+   if (file->algorithm != MANIFEST_CHECKSUM_NONE)
+   {
+      if (checksum_length != file->checksum_length || memcmp(checksum, file->checksum, checksum_length))
+      {
+         pgmoneta_log_error("File checksum mismatch, path: %s. Getting %s, should be %s", file_path,
+                            manifest_hex_encode(checksum, checksum_length, actual),
+                            pgmoneta_manifest_file_checksum(file, expected));
+         goto error;
+      }
+   }
+
+   clock_gettime(CLOCK_MONOTONIC, &end);
+
+   atomic_fetch_add(&verify->bytes, bytes);
+   atomic_fetch_add(&verify->files, 1);
+
+   pgmoneta_log_trace("Manifest verify: %s (%lu bytes in %.3f ms)", file_path, bytes,
+                      (end.tv_sec - start.tv_sec) * 1000.0 + (end.tv_nsec - start.tv_nsec) / 1000000.0);
+
+   return;
+
+error:
+
+   atomic_store(&verify->failed, true);
+}
+
+static int
+manifest_file_hash(uint8_t algorithm, char* file_path, uint8_t* checksum, size_t* checksum_length, size_t* bytes, atomic_bool* failed)
+{
+   int fd = -1;
+   ssize_t r = 0;
+   void* buffer = NULL;
+   char* stored = NULL;
+   struct manifest_hash hash;
+   struct pipeline_stage* pipeline = NULL;
+   struct pipeline_stage* stage = NULL;
+
+   *checksum_length = 0;
+   *bytes = 0;
+
+   if (manifest_hash_init(algorithm, failed, &hash))
+   {
+      goto error;
+   }
+
+   // the file may already be compressed and encrypted, then the stored form is decoded on the fly
+   if (!pgmoneta_exists(file_path))
+   {
+      stored = pgmoneta_stored_file(file_path);
+      if (stored == NULL || pgmoneta_pipeline_create_decoder(stored, &pipeline))
+      {
+         goto error;
+      }
+
+      stage = (struct pipeline_stage*)malloc(sizeof(struct pipeline_stage));
+      if (stage == NULL)
+      {
+         goto error;
+      }
+      memset(stage, 0, sizeof(struct pipeline_stage));
+      stage->process = &manifest_hash_process;
+      stage->state = &hash;
+      pgmoneta_pipeline_append(&pipeline, stage);
+
+      if (pgmoneta_pipeline_file(pipeline, stored))
+      {
+         goto error;
+      }
+   }
+   else
+   {
+      if (posix_memalign(&buffer, MANIFEST_READ_ALIGNMENT, MANIFEST_READ_BUFFER_SIZE))
+      {
+         buffer = NULL;
+         goto error;
+      }
+
+      fd = open(file_path, O_RDONLY);
+      if (fd == -1)
+      {
+         goto error;
+      }
+
+      posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+
+      while ((r = read(fd, buffer, MANIFEST_READ_BUFFER_SIZE)) > 0)
+      {
+         if (manifest_hash_update(&hash, buffer, r))
+         {
+            goto error;
+         }
+      }
+
+      if (r < 0)
+      {
+         goto error;
+      }
+   }
+
+   if (manifest_hash_final(&hash, checksum, checksum_length))
+   {
+      goto error;
+   }
+
+   *bytes = hash.bytes;
+
+   pgmoneta_pipeline_destroy(pipeline);
+   free(stored);
+   if (fd != -1)
+   {
+      close(fd);
+   }
+   free(buffer);
+
+   return 0;
+
+error:
+
+   EVP_MD_CTX_free(hash.ctx);
+   pgmoneta_pipeline_destroy(pipeline);
+   free(stored);
+   if (fd != -1)
+   {
+      close(fd);
+   }
+   free(buffer);
+
+   return 1;
+}
+
+static int
+manifest_hash_init(uint8_t algorithm, atomic_bool* failed, struct manifest_hash* hash)
+{
+   const EVP_MD* md = NULL;
+
+   memset(hash, 0, sizeof(struct manifest_hash));
+   hash->algorithm = algorithm;
+   hash->failed = failed;
+
+   switch (algorithm)
+   {
+      case MANIFEST_CHECKSUM_NONE:
+      case MANIFEST_CHECKSUM_CRC32C:
+         return 0;
+      case MANIFEST_CHECKSUM_SHA224:
+         md = EVP_sha224();
+         break;
+      case MANIFEST_CHECKSUM_SHA256:
+         md = EVP_sha256();
+         break;
+      case MANIFEST_CHECKSUM_SHA384:
+         md = EVP_sha384();
+         break;
+      case MANIFEST_CHECKSUM_SHA512:
+         md = EVP_sha512();
+         break;
+      default:
+         pgmoneta_log_error("Unsupported hash algorithm: %s", pgmoneta_manifest_algorithm_name(algorithm));
+         return 1;
+   }
+
+   hash->ctx = EVP_MD_CTX_new();
+   if (hash->ctx == NULL || !EVP_DigestInit_ex(hash->ctx, md, NULL))
+   {
+      EVP_MD_CTX_free(hash->ctx);
+      hash->ctx = NULL;
+      return 1;
+   }
+
+   return 0;
+}
+
+static int
+manifest_hash_update(struct manifest_hash* hash, void* data, size_t length)
+{
+   if (hash->algorithm == MANIFEST_CHECKSUM_CRC32C)
+   {
+      hash->crc = pgmoneta_crc32c(hash->crc, data, length);
+   }
+   else if (hash->ctx != NULL && !EVP_DigestUpdate(hash->ctx, data, length))
+   {
+      return 1;
+   }
+   hash->bytes += length;
+
+   // another file already failed, there is no point in continuing
+   if (hash->failed != NULL && atomic_load(hash->failed))
+   {
+      return 1;
+   }
+
+   return 0;
+}
+
+static int
+manifest_hash_final(struct manifest_hash* hash, uint8_t* checksum, size_t* checksum_length)
+{
+   unsigned int length = 0;
+
+   if (hash->algorithm == MANIFEST_CHECKSUM_CRC32C)
+   {
+      // PostgreSQL stores the CRC in native byte order
+      memcpy(checksum, &hash->crc, sizeof(hash->crc));
+      length = sizeof(hash->crc);
+   }
+   else if (hash->ctx != NULL)
+   {
+      if (!EVP_DigestFinal_ex(hash->ctx, checksum, &length))
+      {
+         return 1;
+      }
+
+      EVP_MD_CTX_free(hash->ctx);
+      hash->ctx = NULL;
+   }
+
+   *checksum_length = length;
+
+   return 0;
+}
+
+static int
+manifest_hash_process(struct pipeline_stage* stage, void* buffer, size_t size, bool last)
+{
+   if (size > 0 && manifest_hash_update((struct manifest_hash*)stage->state, buffer, size))
+   {
+      return 1;
+   }
+
+   return pgmoneta_pipeline_write(stage->next, buffer, size, last);
+}
+
+static void
+manifest_hash_destroy(struct pipeline_stage* stage)
+{
+   struct manifest_hash* hash = (struct manifest_hash*)stage->state;
+
+   if (hash != NULL)
+   {
+      EVP_MD_CTX_free(hash->ctx);
+      free(hash);
+   }
+}
+
+static int
+manifest_build_index(struct manifest* manifest)
+{
+   uint32_t size = 16;
+   uint32_t slot = 0;
+
+   /* Keep the load factor at or below 50% to limit probing */
+   while (size < 2 * manifest->number_of_files)
+   {
+      size <<= 1;
+   }
+
+   manifest->index = (uint32_t*)calloc(size, sizeof(uint32_t));
+   if (manifest->index == NULL)
+   {
+      return 1;
+   }
+   manifest->index_mask = size - 1;
+
+   for (unsigned long i = 0; i < manifest->number_of_files; i++)
+   {
+      slot = manifest->files[i].hash & manifest->index_mask;
+      while (manifest->index[slot] != 0)
+      {
+         slot = (slot + 1) & manifest->index_mask;
+      }
+      manifest->index[slot] = i + 1;
+   }
+
+   return 0;
+}
+
+static int
+manifest_write(FILE* file, EVP_MD_CTX* ctx, char* data, size_t length)
+{
+   if (length == 0)
+   {
+      return 0;
+   }
+
+   if (fwrite(data, 1, length, file) != length || !EVP_DigestUpdate(ctx, data, length))
+   {
+      return 1;
    }
-   else if (pgmoneta_compare_string(algorithm, "CRC32C") || pgmoneta_compare_string(algorithm, "SHA224") ||
-            pgmoneta_compare_string(algorithm, "SHA384") || pgmoneta_compare_string(algorithm, "SHA512"))
+
+   return 0;
+}
+
+static char*
+manifest_entry(char* path, struct stat* st, uint8_t algorithm, uint8_t* checksum, size_t checksum_length)
+{
+   char* entry = NULL;
+   char buffer[2 * MANIFEST_CHECKSUM_LENGTH + 1];
+   char escape[8];
+   char modified[64];
+   bool encode = false;
+   struct tm tm;
+
+   for (char* c = path; *c != '\0'; c++)
+   {
+      // plain ASCII is always valid UTF-8, anything else is hex encoded
+      if ((unsigned char)*c >= 0x80)
+      {
+         encode = true;
+         break;
+      }
+   }
+
+   if (encode)
    {
-      pgmoneta_log_error("Unsupported hash algorithm: %s", algorithm);
-      stat = 1;
+      entry = pgmoneta_append(entry, "{ \"Encoded-Path\": \"");
+      for (char* c = path; *c != '\0'; c += 32)
+      {
+         size_t n = MIN(strlen(c), (size_t)32);
+
+         entry = pgmoneta_append(entry, manifest_hex_encode((uint8_t*)c, n, buffer));
+         if (n < 32)
+         {
+            break;
+         }
+      }
    }
    else
    {
-      pgmoneta_log_error("Unrecognized hash algorithm: %s", algorithm);
-      stat = 1;
+      entry = pgmoneta_append(entry, "{ \"Path\": \"");
+      for (char* c = path; *c != '\0'; c++)
+      {
+         if (*c == '"' || *c == '\\')
+         {
+            snprintf(escape, sizeof(escape), "\\%c", *c);
+         }
+         else if ((unsigned char)*c < 0x20)
+         {
+            snprintf(escape, sizeof(escape), "\\u%04x", (unsigned char)*c);
+         }
+         else
+         {
+            snprintf(escape, sizeof(escape), "%c", *c);
+         }
+         entry = pgmoneta_append(entry, escape);
+      }
    }
-   return stat;
+
+   entry = pgmoneta_append(entry, "\", \"Size\": ");
+   entry = pgmoneta_append_ulong(entry, (unsigned long)st->st_size);
+
+   gmtime_r(&st->st_mtime, &tm);
+   strftime(modified, sizeof(modified), "%Y-%m-%d %H:%M:%S GMT", &tm);
+
+   entry = pgmoneta_append(entry, ", \"Last-Modified\": \"");
+   entry = pgmoneta_append(entry, modified);
+   entry = pgmoneta_append(entry, "\"");
+
+   if (algorithm != MANIFEST_CHECKSUM_NONE)
+   {
+      entry = pgmoneta_append(entry, ", \"Checksum-Algorithm\": \"");
+      entry = pgmoneta_append(entry, pgmoneta_manifest_algorithm_name(algorithm));
+      entry = pgmoneta_append(entry, "\", \"Checksum\": \"");
+      entry = pgmoneta_append(entry, manifest_hex_encode(checksum, checksum_length, buffer));
+      entry = pgmoneta_append(entry, "\"");
+   }
+
+   entry = pgmoneta_append(entry, " }");
+
+   return entry;
 }
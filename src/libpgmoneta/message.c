@@ -34,11 +34,14 @@
 #include <memory.h>
 #include <message.h>
 #include <network.h>
+#include <pipeline.h>
+#include <prometheus.h>
 #include <security.h>
 #include <utils.h>
 
 #include <assert.h>
 #include <errno.h>
+#include <stdatomic.h>
 #include <string.h>
 #include <unistd.h>
 #include <openssl/err.h>
@@ -46,6 +49,22 @@
 #include <sys/time.h>
 #include <stdio.h>
 
+#define STORE_PENDING_PER_WORKER (1024UL * 1024UL * 1024UL)
+
+struct stream_store
+{
+   struct workers* workers; /**< The workers */
+   atomic_ulong pending;    /**< The bytes received but not stored yet */
+   unsigned long window;    /**< The number of pending bytes before the receive waits */
+};
+
+struct stream_store_file
+{
+   char path[MAX_PATH];        /**< The file path */
+   unsigned long size;         /**< The file size */
+   struct stream_store* store; /**< The store */
+};
+
 static int read_message(int socket, bool block, int timeout, struct message** msg);
 static int write_message(int socket, struct message* msg);
 
@@ -57,6 +76,10 @@ static int get_number_of_columns(struct message* msg);
 static int get_column_name(struct message* msg, int index, char** name);
 
 static bool is_server_side_compression(void);
+static int start_archive_extraction(char* directory, struct stream_store* store, struct pipeline_stage** pipeline);
+static int finish_archive_extraction(struct pipeline_stage** pipeline);
+static void stream_store_completed(char* path, void* data);
+static void do_stream_store(void* arg);
 
 int
 pgmoneta_read_block_message(SSL* ssl, int socket, struct message** msg)
@@ -837,7 +860,7 @@ pgmoneta_create_standby_status_update_message(int64_t received, int64_t flushed,
 
 int
 pgmoneta_create_base_backup_message(int server_version, char* label, bool include_wal, char* checksum_algorithm,
-                                    int compression, int compression_level,
+                                    int compression, int compression_level, bool incremental,
                                     struct message** msg)
 {
    bool use_new_format = server_version >= 15;
@@ -889,6 +912,11 @@ pgmoneta_create_base_backup_message(int server_version, char* label, bool includ
 
       options = pgmoneta_append(options, "CHECKPOINT 'fast', ");
 
+      if (incremental && server_version >= 17)
+      {
+         options = pgmoneta_append(options, "INCREMENTAL, ");
+      }
+
       options = pgmoneta_append(options, "MANIFEST 'yes', ");
 
       options = pgmoneta_append(options, "MANIFEST_CHECKSUMS '");
@@ -1044,6 +1072,142 @@ error:
    return 1;
 }
 
+int
+pgmoneta_upload_manifest(SSL* ssl, int socket, struct manifest* manifest)
+{
+   int status;
+   size_t offset = 0;
+   size_t n;
+   size_t size;
+   size_t data_size;
+   void* data = NULL;
+   struct message* query_msg = NULL;
+   struct message* reply = NULL;
+   struct message* copy_msg = NULL;
+
+   data = pgmoneta_memory_dynamic_create(&data_size);
+
+   pgmoneta_create_query_message("UPLOAD_MANIFEST", &query_msg);
+
+   status = pgmoneta_write_message(ssl, socket, query_msg);
+   if (status != MESSAGE_STATUS_OK)
+   {
+      goto error;
+   }
+
+   /* The server answers with CopyInResponse, or with an error followed by ReadyForQuery */
+   while (!pgmoneta_has_message('G', data, data_size) && !pgmoneta_has_message('Z', data, data_size))
+   {
+      status = pgmoneta_read_block_message(ssl, socket, &reply);
+
+      if (status == MESSAGE_STATUS_OK)
+      {
+         data = pgmoneta_memory_dynamic_append(data, data_size, reply->data, reply->length, &data_size);
+      }
+      else if (status == MESSAGE_STATUS_ZERO)
+      {
+         SLEEP(1000000L);
+      }
+      else
+      {
+         goto error;
+      }
+
+      pgmoneta_free_message(reply);
+      reply = NULL;
+   }
+
+   if (pgmoneta_has_message('E', data, data_size) || !pgmoneta_has_message('G', data, data_size))
+   {
+      pgmoneta_log_error("UPLOAD_MANIFEST was rejected by the server");
+      goto error;
+   }
+
+   copy_msg = (struct message*)malloc(sizeof(struct message));
+   if (copy_msg == NULL)
+   {
+      goto error;
+   }
+   memset(copy_msg, 0, sizeof(struct message));
+
+   copy_msg->data = malloc(1 + 4 + MANIFEST_UPLOAD_CHUNK_SIZE);
+   if (copy_msg->data == NULL)
+   {
+      goto error;
+   }
+
+   while (offset < manifest->map_size)
+   {
+      n = MIN(manifest->map_size - offset, (size_t)MANIFEST_UPLOAD_CHUNK_SIZE);
+      size = 1 + 4 + n;
+
+      copy_msg->kind = 'd';
+      copy_msg->length = size;
+
+      pgmoneta_write_byte(copy_msg->data, 'd');
+      pgmoneta_write_int32(copy_msg->data + 1, size - 1);
+      memcpy(copy_msg->data + 5, manifest->map + offset, n);
+
+      if (pgmoneta_write_message(ssl, socket, copy_msg) != MESSAGE_STATUS_OK)
+      {
+         pgmoneta_log_error("Could not send the manifest");
+         goto error;
+      }
+
+      offset += n;
+   }
+
+   if (pgmoneta_send_copy_done_message(ssl, socket))
+   {
+      goto error;
+   }
+
+   pgmoneta_memory_dynamic_destroy(data);
+   data = pgmoneta_memory_dynamic_create(&data_size);
+
+   while (!pgmoneta_has_message('Z', data, data_size))
+   {
+      status = pgmoneta_read_block_message(ssl, socket, &reply);
+
+      if (status == MESSAGE_STATUS_OK)
+      {
+         data = pgmoneta_memory_dynamic_append(data, data_size, reply->data, reply->length, &data_size);
+      }
+      else if (status == MESSAGE_STATUS_ZERO)
+      {
+         SLEEP(1000000L);
+      }
+      else
+      {
+         goto error;
+      }
+
+      pgmoneta_free_message(reply);
+      reply = NULL;
+   }
+
+   if (pgmoneta_has_message('E', data, data_size))
+   {
+      pgmoneta_log_error("The server could not use the manifest");
+      goto error;
+   }
+
+   pgmoneta_free_copy_message(copy_msg);
+   pgmoneta_free_copy_message(query_msg);
+   pgmoneta_memory_dynamic_destroy(data);
+
+   return 0;
+
+error:
+
+   pgmoneta_free_message(reply);
+   pgmoneta_free_copy_message(copy_msg);
+   pgmoneta_free_copy_message(query_msg);
+   pgmoneta_memory_dynamic_destroy(data);
+
+   return 1;
+}
+
 int
 pgmoneta_create_query_message(char* query, struct message** msg)
 {
@@ -1314,6 +1478,109 @@ is_server_side_compression(void)
    return config->compression_type == COMPRESSION_SERVER_GZIP || config->compression_type == COMPRESSION_SERVER_LZ4 || config->compression_type == COMPRESSION_SERVER_ZSTD;
 }
 
+static int
+start_archive_extraction(char* directory, struct stream_store* store, struct pipeline_stage** pipeline)
+{
+   struct pipeline_stage* stage = NULL;
+   struct configuration* config;
+
+   config = (struct configuration*)shmem;
+
+   *pipeline = NULL;
+
+   // server side compressed archives are decompressed on the way in
+   if (is_server_side_compression())
+   {
+      if (pgmoneta_pipeline_create_decompressor(config->compression_type, &stage))
+      {
+         goto error;
+      }
+      pgmoneta_pipeline_append(pipeline, stage);
+   }
+
+   if (pgmoneta_pipeline_create_tar_extractor(directory, store->workers != NULL ? &stream_store_completed : NULL, store, &stage))
+   {
+      goto error;
+   }
+   pgmoneta_pipeline_append(pipeline, stage);
+
+   return 0;
+
+error:
+
+   pgmoneta_pipeline_destroy(*pipeline);
+   *pipeline = NULL;
+
+   return 1;
+}
+
+static int
+finish_archive_extraction(struct pipeline_stage** pipeline)
+{
+   int ret;
+
+   if (*pipeline == NULL)
+   {
+      return 0;
+   }
+
+   ret = pgmoneta_pipeline_write(*pipeline, NULL, 0, true);
+
+   pgmoneta_pipeline_destroy(*pipeline);
+   *pipeline = NULL;
+
+   return ret;
+}
+
+static void
+stream_store_completed(char* path, void* data)
+{
+   struct stream_store* store = (struct stream_store*)data;
+   struct stream_store_file* f = NULL;
+
+   // the backup reads the label and the WAL once the receive is done
+   if (pgmoneta_ends_with(path, "/backup_label") || pgmoneta_ends_with(path, "/backup_label.old") ||
+       pgmoneta_ends_with(path, "/tablespace_map") || strstr(path, "/pg_wal/") != NULL)
+   {
+      return;
+   }
+
+   f = (struct stream_store_file*)malloc(sizeof(struct stream_store_file));
+   if (f == NULL)
+   {
+      return;
+   }
+
+   memset(f, 0, sizeof(struct stream_store_file));
+   snprintf(&f->path[0], sizeof(f->path), "%s", path);
+   f->size = pgmoneta_get_file_size(path);
+   f->store = store;
+
+   atomic_fetch_add(&store->pending, f->size);
+
+   if (pgmoneta_workers_add(store->workers, do_stream_store, f))
+   {
+      do_stream_store(f);
+   }
+}
+
+static void
+do_stream_store(void* arg)
+{
+   struct stream_store_file* f = (struct stream_store_file*)arg;
+   struct stream_store* store = f->store;
+
+   // a file that fails here stays plain and is stored by the workflow
+   if (pgmoneta_store_file(&f->path[0]))
+   {
+      pgmoneta_log_warn("Could not store %s during the backup", &f->path[0]);
+   }
+
+   atomic_fetch_sub(&store->pending, f->size);
+
+   free(f);
+}
+
 static int
 create_D_tuple(int number_of_columns, struct message* msg, struct tuple** tuple)
 {
@@ -1733,6 +2000,7 @@ pgmoneta_read_copy_stream(SSL* ssl, int socket, struct stream_buffer* buffer)
    int numbytes = 0;
    bool keep_read = false;
    int err;
+   uint64_t start;
    struct configuration* config;
 
    config = (struct configuration*)shmem;
@@ -1754,6 +2022,7 @@ pgmoneta_read_copy_stream(SSL* ssl, int socket, struct stream_buffer* buffer)
       pgmoneta_log_error("Not enough space to read new copy-out data");
       goto error;
    }
+   start = pgmoneta_prometheus_timer();
    do
    {
       if (ssl != NULL)
@@ -1768,6 +2037,7 @@ pgmoneta_read_copy_stream(SSL* ssl, int socket, struct stream_buffer* buffer)
       if (likely(numbytes > 0))
       {
          buffer->end += numbytes;
+         pgmoneta_prometheus_observe(HISTOGRAM_NETWORK_READ, start);
          return MESSAGE_STATUS_OK;
       }
       else if (numbytes == 0)
@@ -2164,12 +2434,13 @@ error:
 }
 
 int
-pgmoneta_receive_archive_files(SSL* ssl, int socket, struct stream_buffer* buffer, char* basedir, struct tablespace* tablespaces, int version, struct token_bucket* bucket, struct token_bucket* network_bucket)
+pgmoneta_receive_archive_files(SSL* ssl, int socket, struct stream_buffer* buffer, char* basedir, struct tablespace* tablespaces, int version, struct token_bucket* bucket, struct token_bucket* network_bucket, struct workers* workers)
 {
    char directory[MAX_PATH];
    char link_path[MAX_PATH];
    char null_buffer[2 * 512]; // 2 tar block size of terminator null bytes
    FILE* file = NULL;
+   uint64_t start;
    struct query_response* response = NULL;
    struct message* msg = (struct message*)malloc(sizeof (struct message));
    struct tuple* tup = NULL;
@@ -2278,6 +2549,7 @@ pgmoneta_receive_archive_files(SSL* ssl, int socket, struct stream_buffer* buffe
             }
 
             // copy data
+            start = pgmoneta_prometheus_timer();
             if (fwrite(msg->data, msg->length, 1, file) != 1)
             {
                pgmoneta_log_error("could not write to file %s", file_path);
@@ -2285,6 +2557,7 @@ pgmoneta_receive_archive_files(SSL* ssl, int socket, struct stream_buffer* buffe
                fclose(file);
                goto error;
             }
+            pgmoneta_prometheus_observe(HISTOGRAM_FILE_WRITE, start);
          }
          pgmoneta_consume_copy_stream_end(buffer, msg);
       }
@@ -2348,7 +2621,7 @@ pgmoneta_receive_archive_files(SSL* ssl, int socket, struct stream_buffer* buffe
       snprintf(directory, sizeof(directory), "%s/data", basedir);
    }
 
-   if (pgmoneta_manifest_checksum_verify(directory))
+   if (pgmoneta_manifest_checksum_verify(directory, workers))
    {
       pgmoneta_log_error("Manifest verification failed");
       goto error;
@@ -2370,29 +2643,37 @@ error:
 }
 
 int
-pgmoneta_receive_archive_stream(SSL* ssl, int socket, struct stream_buffer* buffer, char* basedir, struct tablespace* tablespaces, struct token_bucket* bucket, struct token_bucket* network_bucket)
+pgmoneta_receive_archive_stream(SSL* ssl, int socket, struct stream_buffer* buffer, char* basedir, struct tablespace* tablespaces, struct token_bucket* bucket, struct token_bucket* network_bucket, struct workers* workers, bool store)
 {
    struct query_response* response = NULL;
    struct message* msg = (struct message*)malloc(sizeof (struct message));
    struct tuple* tup = NULL;
    struct tablespace* tblspc = NULL;
-   char null_buffer[2 * 512];
-   char file_path[MAX_PATH];
+   struct pipeline_stage* pipeline = NULL;
+   struct stream_store files;
    char directory[MAX_PATH];
    char link_path[MAX_PATH];
    char tmp_manifest_file_path[MAX_PATH];
    char manifest_file_path[MAX_PATH];
-   memset(file_path, 0, sizeof(file_path));
    memset(directory, 0, sizeof(directory));
    memset(link_path, 0, sizeof(link_path));
    memset(manifest_file_path, 0, sizeof(manifest_file_path));
    memset(tmp_manifest_file_path, 0, sizeof(tmp_manifest_file_path));
-   memset(null_buffer, 0, 2 * 512);
    char type;
    FILE* file = NULL;
+   uint64_t start;
 
    memset(msg, 0, sizeof(struct message));
 
+   // the completed files are compressed and encrypted by the workers while the rest streams in
+   memset(&files, 0, sizeof(struct stream_store));
+   atomic_init(&files.pending, 0);
+   if (store && workers != NULL)
+   {
+      files.workers = workers;
+      files.window = workers->number_of_workers * STORE_PENDING_PER_WORKER;
+   }
+
    // Receive the second result set
    if (pgmoneta_consume_data_row_messages(ssl, socket, buffer, &response))
    {
@@ -2426,28 +2707,15 @@ pgmoneta_receive_archive_stream(SSL* ssl, int socket, struct stream_buffer* buff
          {
             case 'n':
             {
-               // append two blocks of null buffer and extract the tar file
-               if (file != NULL)
+               // finish off the previous tar stream
+               if (finish_archive_extraction(&pipeline))
                {
-                  if ((!is_server_side_compression()) && fwrite(null_buffer, 2 * 512, 1, file) != 1)
-                  {
-                     pgmoneta_log_error("could not write to file %s", file_path);
-                     fflush(file);
-                     fclose(file);
-                     file = NULL;
-                     goto error;
-                  }
-                  fflush(file);
-                  fclose(file);
-                  file = NULL;
-                  pgmoneta_extract_tar_file(file_path, directory);
-                  remove(file_path);
+                  goto error;
                }
                // new tablespace or main directory tar file
                char* archive_name = pgmoneta_read_string(msg->data + 1);
                char* archive_path = pgmoneta_read_string(msg->data + 1 + strlen(archive_name) + 1);
 
-               memset(file_path, 0, sizeof(file_path));
                memset(directory, 0, sizeof(directory));
                // The tablespace order in the second result set is presumably the same as the order in which the server sends tablespaces
                tblspc = tablespaces;
@@ -2464,12 +2732,10 @@ pgmoneta_receive_archive_stream(SSL* ssl, int socket, struct stream_buffer* buff
                   // main data directory
                   if (pgmoneta_ends_with(basedir, "/"))
                   {
-                     snprintf(file_path, sizeof(file_path), "%sdata/%s", basedir, "base.tar");
                      snprintf(directory, sizeof(directory), "%sdata/", basedir);
                   }
                   else
                   {
-                     snprintf(file_path, sizeof(file_path), "%s/data/%s", basedir, "base.tar");
                      snprintf(directory, sizeof(directory), "%s/data/", basedir);
                   }
                }
@@ -2488,20 +2754,17 @@ pgmoneta_receive_archive_stream(SSL* ssl, int socket, struct stream_buffer* buff
                   }
                   if (pgmoneta_ends_with(basedir, "/"))
                   {
-                     snprintf(file_path, sizeof(file_path), "%s%s/%s.tar", basedir, tblspc->name, tblspc->name);
                      snprintf(directory, sizeof(directory), "%s%s/", basedir, tblspc->name);
                   }
                   else
                   {
-                     snprintf(file_path, sizeof(file_path), "%s/%s/%s.tar", basedir, tblspc->name, tblspc->name);
                      snprintf(directory, sizeof(directory), "%s/%s/", basedir, tblspc->name);
                   }
                }
-               pgmoneta_mkdir(directory);
-               file = fopen(file_path, "wb");
-               if (file == NULL)
+               // the tar stream is extracted as it arrives
+               if (start_archive_extraction(directory, &files, &pipeline))
                {
-                  pgmoneta_log_error("Could not create archive tar file");
+                  pgmoneta_log_error("Could not extract archive %s", directory);
                   goto error;
                }
                break;
@@ -2509,21 +2772,9 @@ pgmoneta_receive_archive_stream(SSL* ssl, int socket, struct stream_buffer* buff
             case 'm':
             {
                // start of manifest, finish off previous data archive receiving
-               if (file != NULL)
+               if (finish_archive_extraction(&pipeline))
                {
-                  if ((!is_server_side_compression()) && fwrite(null_buffer, 2 * 512, 1, file) != 1)
-                  {
-                     pgmoneta_log_error("could not write to file %s", file_path);
-                     fflush(file);
-                     fclose(file);
-                     file = NULL;
-                     goto error;
-                  }
-                  fflush(file);
-                  fclose(file);
-                  file = NULL;
-                  pgmoneta_extract_tar_file(file_path, directory);
-                  remove(file_path);
+                  goto error;
                }
                if (pgmoneta_ends_with(basedir, "/"))
                {
@@ -2561,11 +2812,29 @@ pgmoneta_receive_archive_stream(SSL* ssl, int socket, struct stream_buffer* buff
                   }
                }
 
+               if (pipeline != NULL)
+               {
+                  // the workers lag behind, so stop reading until they catch up
+                  while (files.workers != NULL && atomic_load(&files.pending) > files.window)
+                  {
+                     SLEEP(10000000L)
+                  }
+
+                  if (pgmoneta_pipeline_write(pipeline, msg->data + 1, msg->length - 1, false))
+                  {
+                     pgmoneta_log_error("could not extract archive %s", directory);
+                     goto error;
+                  }
+                  break;
+               }
+
+               start = pgmoneta_prometheus_timer();
                if (fwrite(msg->data + 1, msg->length - 1, 1, file) != 1)
                {
-                  pgmoneta_log_error("could not write to file %s", file_path);
+                  pgmoneta_log_error("could not write to file %s", tmp_manifest_file_path);
                   goto error;
                }
+               pgmoneta_prometheus_observe(HISTOGRAM_FILE_WRITE, start);
                break;
             }
             case 'p':
@@ -2584,6 +2853,16 @@ pgmoneta_receive_archive_stream(SSL* ssl, int socket, struct stream_buffer* buff
       pgmoneta_consume_copy_stream_end(buffer, msg);
    }
 
+   if (finish_archive_extraction(&pipeline))
+   {
+      goto error;
+   }
+
+   if (files.workers != NULL)
+   {
+      pgmoneta_workers_wait(files.workers);
+   }
+
    if (file != NULL)
    {
       if (rename(tmp_manifest_file_path, manifest_file_path) != 0)
@@ -2629,7 +2908,7 @@ pgmoneta_receive_archive_stream(SSL* ssl, int socket, struct stream_buffer* buff
    {
       snprintf(dir, sizeof(dir), "%s/data", basedir);
    }
-   if (pgmoneta_manifest_checksum_verify(dir))
+   if (pgmoneta_manifest_checksum_verify(dir, workers))
    {
       pgmoneta_log_error("Manifest verification failed");
       goto error;
@@ -2650,6 +2929,11 @@ error:
       fflush(file);
       fclose(file);
    }
+   pgmoneta_pipeline_destroy(pipeline);
+   if (files.workers != NULL)
+   {
+      pgmoneta_workers_wait(files.workers);
+   }
    pgmoneta_free_query_response(response);
    pgmoneta_free_copy_message(msg);
    return 1;
@@ -2661,6 +2945,7 @@ pgmoneta_receive_manifest_file(SSL* ssl, int socket, struct stream_buffer* buffe
    char tmp_file_path[MAX_PATH];
    char file_path[MAX_PATH];
    FILE* file = NULL;
+   uint64_t start;
    struct message* msg = (struct message*)malloc(sizeof (struct message));
    memset(msg, 0, sizeof (struct message));
 
@@ -2720,11 +3005,13 @@ pgmoneta_receive_manifest_file(SSL* ssl, int socket, struct stream_buffer* buffe
          }
 
          // copy data
+         start = pgmoneta_prometheus_timer();
          if (fwrite(msg->data, msg->length, 1, file) != 1)
          {
             pgmoneta_log_error("could not write to file %s", file_path);
             goto error;
          }
+         pgmoneta_prometheus_observe(HISTOGRAM_FILE_WRITE, start);
       }
       pgmoneta_consume_copy_stream_end(buffer, msg);
    }
@@ -0,0 +1,1171 @@
+/*
+ * Copyright (C) 2024 The pgmoneta community
+ *
+ * Redistribution and use in source and binary forms, with or without modification,
+ * are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, this list
+ * of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice, this
+ * list of conditions and the following disclaimer in the documentation and/or other
+ * materials provided with the distribution.
+ *
+ * 3. Neither the name of the copyright holder nor the names of its contributors may
+ * be used to endorse or promote products derived from this software without specific
+ * prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL
+ * THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT
+ * OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR
+ * TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/* pgmoneta */
+#include <pgmoneta.h>
+#include <backup.h>
+#include <logging.h>
+#include <manifest.h>
+#include <memory.h>
+#include <message.h>
+#include <network.h>
+#include <parallel.h>
+#include <pipeline.h>
+#include <security.h>
+#include <shmem.h>
+#include <utils.h>
+
+/* system */
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+
+#define COPY_SIGNATURE_SIZE 11
+#define COPY_HEADER_SIZE    19
+
+#define COPY_STATE_HEADER 0
+#define COPY_STATE_FIELDS 1
+#define COPY_STATE_LENGTH 2
+#define COPY_STATE_DATA   3
+#define COPY_STATE_END    4
+
+struct parallel_file
+{
+   struct manifest_item item; /**< The manifest entry, the path lives in the shared memory */
+   bool missing;              /**< The file was removed while the backup was taken */
+};
+
+struct parallel_state
+{
+   atomic_ulong next;             /**< The next file to copy */
+   atomic_bool failed;            /**< Set on the first failure */
+   atomic_ulong bytes;            /**< The number of bytes copied */
+   struct token_bucket bucket;    /**< The rate limit shared by all connections */
+   bool limit;                    /**< Is the rate limited */
+   bool store;                    /**< Compress and encrypt the copied files */
+   int algorithm;                 /**< The manifest checksum algorithm */
+   unsigned long number_of_files; /**< The number of files */
+   struct parallel_file* files;   /**< The files, largest first */
+};
+
+struct copy_parser
+{
+   int state;                    /**< The state */
+   char fixed[COPY_HEADER_SIZE]; /**< The fixed size field being read */
+   size_t have;                  /**< The number of bytes read of the fixed size field */
+   size_t remaining;             /**< The number of bytes left of the current value */
+   bool null;                    /**< A NULL value was read */
+};
+
+static char copy_signature[COPY_SIGNATURE_SIZE] = {'P', 'G', 'C', 'O', 'P', 'Y', '\n', '\377', '\r', '\n', '\0'};
+
+// the same files and directory contents that BASE_BACKUP leaves out
+static char* excluded_contents[] = {"pg_wal", "pg_stat_tmp", "pg_replslot", "pg_dynshmem", "pg_notify",
+                                    "pg_serial", "pg_snapshots", "pg_subtrans", NULL};
+static char* excluded_files[] = {"postmaster.pid", "postmaster.opts", "backup_label", "tablespace_map", "backup_manifest",
+                                 "postgresql.auto.conf.tmp", "current_logfiles.tmp", NULL};
+
+static int parallel_connect(int server, int usr, SSL** ssl, int* socket);
+static int parallel_query(SSL* ssl, int socket, char* query, struct query_response** response);
+static char* parallel_quote(char* orig, char* s);
+static int parallel_unlogged(struct tuple* tuples, char*** unlogged, unsigned long* number_of_unlogged);
+static int parallel_compare_string(const void* a, const void* b);
+static bool parallel_excluded(char* path, char** unlogged, unsigned long number_of_unlogged);
+static int parallel_segment(char* lsn, int wal_size, uint64_t* segno);
+static int parallel_directory(char* basedir, char* directory, char* path, struct tablespace* tablespaces);
+static int parallel_compare(const void* a, const void* b);
+static int parallel_worker(int server, int usr, struct parallel_state* state, char* directory);
+static int parallel_copy_file(SSL* ssl, int socket, struct stream_buffer* buffer, struct parallel_state* state, char* directory, struct parallel_file* file, bool store);
+static int parallel_copy_data(struct copy_parser* parser, struct pipeline_stage* pipeline, char* data, size_t size);
+static int parallel_write_file(char* directory, char* name, char* content, int algorithm, struct manifest_item* item);
+
+bool
+pgmoneta_parallel_backup_supported(SSL* ssl, int socket, int version)
+{
+   bool supported = false;
+   char* query = NULL;
+   struct query_response* response = NULL;
+
+   query = pgmoneta_append(query, "SELECT NOT pg_is_in_recovery()");
+   query = pgmoneta_append(query, " AND has_function_privilege('pg_ls_dir(text,boolean,boolean)', 'EXECUTE')");
+   query = pgmoneta_append(query, " AND has_function_privilege('pg_stat_file(text,boolean)', 'EXECUTE')");
+   query = pgmoneta_append(query, " AND has_function_privilege('pg_read_binary_file(text,bigint,bigint,boolean)', 'EXECUTE')");
+   if (version >= 15)
+   {
+      query = pgmoneta_append(query, " AND has_function_privilege('pg_backup_start(text,boolean)', 'EXECUTE')");
+      query = pgmoneta_append(query, " AND has_function_privilege('pg_backup_stop(boolean)', 'EXECUTE');");
+   }
+   else
+   {
+      query = pgmoneta_append(query, " AND has_function_privilege('pg_start_backup(text,boolean,boolean)', 'EXECUTE')");
+      query = pgmoneta_append(query, " AND has_function_privilege('pg_stop_backup(boolean,boolean)', 'EXECUTE');");
+   }
+
+   if (!parallel_query(ssl, socket, query, &response) && response->tuples != NULL &&
+       response->tuples->data[0] != NULL && !strcmp(response->tuples->data[0], "t"))
+   {
+      supported = true;
+   }
+
+   pgmoneta_free_query_response(response);
+   free(query);
+
+   return supported;
+}
+
+int
+pgmoneta_parallel_backup(int server, int usr, char* label, char* basedir, struct tablespace* tablespaces, int connections, bool store,
+                         char* startpos, uint32_t* start_timeline, char* endpos, uint32_t* end_timeline)
+{
+   SSL* ssl = NULL;
+   int socket = -1;
+   int status;
+   int backup_max_rate;
+   int number_of_children = 0;
+   bool label_written = false;
+   char directory[MAX_PATH];
+   char* query = NULL;
+   char* labelfile = NULL;
+   char* timeline = NULL;
+   char* strings = NULL;
+   char** unlogged = NULL;
+   void* shm = NULL;
+   size_t shm_size = 0;
+   size_t strings_size = 0;
+   uint64_t system_identifier = 0;
+   unsigned long number_of_files = 0;
+   unsigned long number_of_wal = 0;
+   unsigned long number_of_segments = 0;
+   unsigned long number_of_unlogged = 0;
+   uint64_t start_segno = 0;
+   uint64_t end_segno = 0;
+   unsigned long number_of_items = 0;
+   unsigned long n = 0;
+   pid_t pid;
+   pid_t* children = NULL;
+   struct parallel_state* state = NULL;
+   struct parallel_file* wal = NULL;
+   struct manifest_item* items = NULL;
+   struct query_response* response = NULL;
+   struct tuple* tup = NULL;
+   struct stream_buffer* buffer = NULL;
+   struct configuration* config;
+
+   config = (struct configuration*)shmem;
+
+   memset(directory, 0, sizeof(directory));
+   if (pgmoneta_ends_with(basedir, "/"))
+   {
+      snprintf(directory, sizeof(directory), "%sdata", basedir);
+   }
+   else
+   {
+      snprintf(directory, sizeof(directory), "%s/data", basedir);
+   }
+
+   if (parallel_connect(server, usr, &ssl, &socket))
+   {
+      goto error;
+   }
+
+   // version 2 manifests carry the system identifier
+   if (config->servers[server].version >= 17)
+   {
+      if (parallel_query(ssl, socket, "SELECT system_identifier FROM pg_control_system();", &response) ||
+          response->tuples == NULL || response->tuples->data[0] == NULL)
+      {
+         goto error;
+      }
+      system_identifier = strtoull(response->tuples->data[0], NULL, 10);
+      pgmoneta_free_query_response(response);
+      response = NULL;
+   }
+
+   // the backup stays open as long as this session
+   query = pgmoneta_append(query, config->servers[server].version >= 15 ? "SELECT pg_backup_start(" : "SELECT pg_start_backup(");
+   query = parallel_quote(query, label);
+   query = pgmoneta_append(query, config->servers[server].version >= 15 ? ", true);" : ", true, false);");
+
+   if (parallel_query(ssl, socket, query, &response) || response->tuples == NULL || response->tuples->data[0] == NULL)
+   {
+      pgmoneta_log_error("Backup: Could not start the backup of %s", config->servers[server].name);
+      goto error;
+   }
+   snprintf(startpos, 20, "%s", response->tuples->data[0]);
+   pgmoneta_free_query_response(response);
+   response = NULL;
+   free(query);
+   query = NULL;
+
+   // list the data directory, the tablespaces are reached through pg_tblspc
+   query = pgmoneta_append(query, "WITH RECURSIVE files(path, size, modified, isdir) AS (");
+   query = pgmoneta_append(query, "SELECT d.name, s.size, extract(epoch FROM s.modification)::bigint, s.isdir ");
+   query = pgmoneta_append(query, "FROM pg_ls_dir('.', true, false) AS d(name), pg_stat_file(d.name, true) AS s ");
+   query = pgmoneta_append(query, "WHERE d.name NOT LIKE 'pgsql_tmp%' ");
+   query = pgmoneta_append(query, "UNION ALL ");
+   query = pgmoneta_append(query, "SELECT f.path || '/' || d.name, s.size, extract(epoch FROM s.modification)::bigint, s.isdir ");
+   query = pgmoneta_append(query, "FROM files f, pg_ls_dir(f.path, true, false) AS d(name), pg_stat_file(f.path || '/' || d.name, true) AS s ");
+   query = pgmoneta_append(query, "WHERE f.isdir AND d.name NOT LIKE 'pgsql_tmp%' AND f.path NOT IN (");
+   for (int i = 0; excluded_contents[i] != NULL; i++)
+   {
+      query = pgmoneta_append(query, i > 0 ? ", " : "");
+      query = parallel_quote(query, excluded_contents[i]);
+   }
+   query = pgmoneta_append(query, ")) SELECT path, size, modified, isdir FROM files WHERE isdir IS NOT NULL;");
+
+   if (parallel_query(ssl, socket, query, &response))
+   {
+      pgmoneta_log_error("Backup: Could not list the files of %s", config->servers[server].name);
+      goto error;
+   }
+   free(query);
+   query = NULL;
+
+   if (pgmoneta_mkdir(directory))
+   {
+      goto error;
+   }
+
+   if (parallel_unlogged(response->tuples, &unlogged, &number_of_unlogged))
+   {
+      goto error;
+   }
+
+   tup = response->tuples;
+   while (tup != NULL)
+   {
+      if (tup->data[0] != NULL && tup->data[3] != NULL)
+      {
+         if (!strcmp(tup->data[3], "t"))
+         {
+            if (parallel_directory(basedir, directory, tup->data[0], tablespaces))
+            {
+               goto error;
+            }
+         }
+         else if (!parallel_excluded(tup->data[0], unlogged, number_of_unlogged))
+         {
+            number_of_files++;
+            strings_size += strlen(tup->data[0]) + 1;
+         }
+      }
+      tup = tup->next;
+   }
+
+   if (parallel_directory(basedir, directory, "pg_wal/archive_status", tablespaces))
+   {
+      goto error;
+   }
+
+   // the files and their paths are shared with the children
+   shm_size = sizeof(struct parallel_state) + number_of_files * sizeof(struct parallel_file) + strings_size;
+   if (pgmoneta_create_shared_memory(shm_size, config->hugepage, &shm))
+   {
+      goto error;
+   }
+   memset(shm, 0, shm_size);
+
+   state = (struct parallel_state*)shm;
+   state->files = (struct parallel_file*)((char*)shm + sizeof(struct parallel_state));
+   strings = (char*)state->files + number_of_files * sizeof(struct parallel_file);
+
+   atomic_init(&state->next, 0);
+   atomic_init(&state->failed, false);
+   atomic_init(&state->bytes, 0);
+   state->store = store;
+   state->algorithm = pgmoneta_get_manifest_checksum(server);
+   state->number_of_files = number_of_files;
+
+   backup_max_rate = pgmoneta_get_backup_max_rate(server);
+   if (backup_max_rate)
+   {
+      if (pgmoneta_token_bucket_init(&state->bucket, backup_max_rate))
+      {
+         goto error;
+      }
+      state->limit = true;
+   }
+
+   tup = response->tuples;
+   while (tup != NULL)
+   {
+      if (tup->data[0] != NULL && tup->data[3] != NULL && strcmp(tup->data[3], "t") && !parallel_excluded(tup->data[0], unlogged, number_of_unlogged))
+      {
+         memcpy(strings, tup->data[0], strlen(tup->data[0]) + 1);
+
+         state->files[n].item.path = strings;
+         state->files[n].item.size = tup->data[1] != NULL ? strtoull(tup->data[1], NULL, 10) : 0;
+         state->files[n].item.modified = tup->data[2] != NULL ? (time_t)strtoll(tup->data[2], NULL, 10) : 0;
+         state->files[n].item.algorithm = (uint8_t)state->algorithm;
+
+         strings += strlen(tup->data[0]) + 1;
+         n++;
+      }
+      tup = tup->next;
+   }
+   pgmoneta_free_query_response(response);
+   response = NULL;
+
+   // the large files first, so the connections finish at about the same time
+   qsort(state->files, number_of_files, sizeof(struct parallel_file), parallel_compare);
+
+   pgmoneta_log_debug("Backup: Copying %lu files of %s using %d connections", number_of_files, config->servers[server].name, connections);
+
+   children = (pid_t*)calloc(connections, sizeof(pid_t));
+   if (children == NULL)
+   {
+      goto error;
+   }
+
+   for (int i = 0; i < connections; i++)
+   {
+      pid = fork();
+      if (pid == -1)
+      {
+         pgmoneta_log_warn("Backup: Could only start %d of %d connections for %s", i, connections, config->servers[server].name);
+         break;
+      }
+      else if (pid == 0)
+      {
+         exit(parallel_worker(server, usr, state, directory));
+      }
+
+      children[number_of_children++] = pid;
+   }
+
+   for (int i = 0; i < number_of_children; i++)
+   {
+      if (waitpid(children[i], &status, 0) == -1 || !WIFEXITED(status) || WEXITSTATUS(status) != 0)
+      {
+         atomic_store(&state->failed, true);
+      }
+   }
+
+   if (number_of_children == 0 || atomic_load(&state->failed))
+   {
+      pgmoneta_log_error("Backup: Could not copy the files of %s", config->servers[server].name);
+      goto error;
+   }
+
+   // don't wait for the archiver, the WAL is copied below
+   if (parallel_query(ssl, socket, config->servers[server].version >= 15 ?
+                      "SELECT lsn, labelfile FROM pg_backup_stop(false);" :
+                      "SELECT lsn, labelfile FROM pg_stop_backup(false, false);", &response) ||
+       response->tuples == NULL || response->tuples->data[0] == NULL || response->tuples->data[1] == NULL)
+   {
+      pgmoneta_log_error("Backup: Could not stop the backup of %s", config->servers[server].name);
+      goto error;
+   }
+   snprintf(endpos, 20, "%s", response->tuples->data[0]);
+   labelfile = pgmoneta_append(labelfile, response->tuples->data[1]);
+   pgmoneta_free_query_response(response);
+   response = NULL;
+
+   timeline = strstr(labelfile, "START TIMELINE: ");
+   if (timeline == NULL)
+   {
+      pgmoneta_log_error("Backup: Invalid backup label for %s", config->servers[server].name);
+      goto error;
+   }
+   *start_timeline = (uint32_t)strtoul(timeline + strlen("START TIMELINE: "), NULL, 10);
+   // the backup is taken from a primary, so the timeline can't change
+   *end_timeline = *start_timeline;
+
+   // the WAL from the start to the end of the backup, and the timeline history
+   query = pgmoneta_append(query, "WITH r AS (SELECT pg_walfile_name(");
+   query = parallel_quote(query, startpos);
+   query = pgmoneta_append(query, ") AS first, pg_walfile_name(");
+   query = parallel_quote(query, endpos);
+   query = pgmoneta_append(query, ") AS last) ");
+   query = pgmoneta_append(query, "SELECT 'pg_wal/' || d.name, s.size, extract(epoch FROM s.modification)::bigint ");
+   query = pgmoneta_append(query, "FROM r, pg_ls_dir('pg_wal') AS d(name), pg_stat_file('pg_wal/' || d.name, true) AS s ");
+   query = pgmoneta_append(query, "WHERE NOT s.isdir AND ((length(d.name) = 24 AND d.name BETWEEN r.first AND r.last) OR d.name LIKE '%.history');");
+
+   if (parallel_query(ssl, socket, query, &response))
+   {
+      pgmoneta_log_error("Backup: Could not list the WAL of %s", config->servers[server].name);
+      goto error;
+   }
+   free(query);
+   query = NULL;
+
+   tup = response->tuples;
+   while (tup != NULL)
+   {
+      number_of_wal++;
+      if (tup->data[0] != NULL && !pgmoneta_ends_with(tup->data[0], ".history"))
+      {
+         number_of_segments++;
+      }
+      tup = tup->next;
+   }
+
+   // the names are unique and between the first and the last segment, so the count finds any gap
+   if (parallel_segment(startpos, config->servers[server].wal_size, &start_segno) ||
+       parallel_segment(endpos, config->servers[server].wal_size, &end_segno) ||
+       end_segno < start_segno || number_of_segments != end_segno - start_segno + 1)
+   {
+      pgmoneta_log_error("Backup: Missing WAL between %s and %s for %s", startpos, endpos, config->servers[server].name);
+      goto error;
+   }
+
+   wal = (struct parallel_file*)calloc(number_of_wal + 1, sizeof(struct parallel_file));
+   items = (struct manifest_item*)calloc(number_of_files + number_of_wal + 1, sizeof(struct manifest_item));
+   if (wal == NULL || items == NULL)
+   {
+      goto error;
+   }
+
+   pgmoneta_memory_stream_buffer_init(&buffer);
+
+   n = 0;
+   tup = response->tuples;
+   while (tup != NULL)
+   {
+      wal[n].item.path = pgmoneta_append(NULL, tup->data[0]);
+      wal[n].item.size = tup->data[1] != NULL ? strtoull(tup->data[1], NULL, 10) : 0;
+      wal[n].item.modified = tup->data[2] != NULL ? (time_t)strtoll(tup->data[2], NULL, 10) : 0;
+      wal[n].item.algorithm = (uint8_t)state->algorithm;
+
+      if (parallel_copy_file(ssl, socket, buffer, state, directory, &wal[n], false) || wal[n].missing)
+      {
+         pgmoneta_log_error("Backup: Could not copy %s of %s", wal[n].item.path, config->servers[server].name);
+         goto error;
+      }
+
+      items[number_of_items++] = wal[n].item;
+      n++;
+      tup = tup->next;
+   }
+   pgmoneta_free_query_response(response);
+   response = NULL;
+
+   for (unsigned long i = 0; i < number_of_files; i++)
+   {
+      if (!state->files[i].missing)
+      {
+         items[number_of_items++] = state->files[i].item;
+      }
+   }
+
+   if (parallel_write_file(directory, "backup_label", labelfile, state->algorithm, &items[number_of_items]))
+   {
+      goto error;
+   }
+   number_of_items++;
+   label_written = true;
+
+   if (pgmoneta_manifest_create(directory, system_identifier, &items[0], number_of_items, *start_timeline, startpos, endpos))
+   {
+      pgmoneta_log_error("Backup: Could not create the manifest for %s", config->servers[server].name);
+      goto error;
+   }
+
+   pgmoneta_log_debug("Backup: Copied %lu bytes of %s", atomic_load(&state->bytes), config->servers[server].name);
+
+   pgmoneta_close_ssl(ssl);
+   pgmoneta_disconnect(socket);
+
+   for (unsigned long i = 0; i < number_of_wal; i++)
+   {
+      free(wal[i].item.path);
+   }
+   free(wal);
+   free(items[number_of_items - 1].path);
+   free(items);
+   free(children);
+   free(labelfile);
+   for (unsigned long i = 0; i < number_of_unlogged; i++)
+   {
+      free(unlogged[i]);
+   }
+   free(unlogged);
+   pgmoneta_memory_stream_buffer_free(buffer);
+   pgmoneta_destroy_shared_memory(shm, shm_size);
+
+   return 0;
+
+error:
+
+   pgmoneta_close_ssl(ssl);
+   if (socket != -1)
+   {
+      pgmoneta_disconnect(socket);
+   }
+
+   if (wal != NULL)
+   {
+      for (unsigned long i = 0; i < number_of_wal; i++)
+      {
+         free(wal[i].item.path);
+      }
+   }
+   free(wal);
+   if (label_written)
+   {
+      free(items[number_of_items - 1].path);
+   }
+   free(items);
+   free(children);
+   free(labelfile);
+   free(query);
+   for (unsigned long i = 0; i < number_of_unlogged; i++)
+   {
+      free(unlogged[i]);
+   }
+   free(unlogged);
+   pgmoneta_free_query_response(response);
+   pgmoneta_memory_stream_buffer_free(buffer);
+   if (shm != NULL)
+   {
+      pgmoneta_destroy_shared_memory(shm, shm_size);
+   }
+
+   return 1;
+}
+
+static int
+parallel_connect(int server, int usr, SSL** ssl, int* socket)
+{
+   struct configuration* config;
+
+   config = (struct configuration*)shmem;
+
+   *ssl = NULL;
+   *socket = -1;
+
+   if (pgmoneta_server_authenticate(server, "postgres", config->users[usr].username, config->users[usr].password, false, ssl, socket) != AUTH_SUCCESS)
+   {
+      pgmoneta_log_info("Invalid credentials for %s", config->users[usr].username);
+      return 1;
+   }
+
+   return 0;
+}
+
+static int
+parallel_query(SSL* ssl, int socket, char* query, struct query_response** response)
+{
+   int result;
+   struct message* msg = NULL;
+
+   *response = NULL;
+
+   if (pgmoneta_create_query_message(query, &msg))
+   {
+      return 1;
+   }
+
+   result = pgmoneta_query_execute(ssl, socket, msg, response);
+
+   pgmoneta_free_copy_message(msg);
+
+   if (result != 0)
+   {
+      pgmoneta_free_query_response(*response);
+      *response = NULL;
+   }
+
+   return result;
+}
+
+static char*
+parallel_quote(char* orig, char* s)
+{
+   char c[2];
+
+   orig = pgmoneta_append(orig, "'");
+   for (char* p = s; *p != '\0'; p++)
+   {
+      c[0] = *p;
+      c[1] = '\0';
+
+      orig = pgmoneta_append(orig, *p == '\'' ? "''" : c);
+   }
+   orig = pgmoneta_append(orig, "'");
+
+   return orig;
+}
+
+static int
+parallel_unlogged(struct tuple* tuples, char*** unlogged, unsigned long* number_of_unlogged)
+{
+   size_t length;
+   unsigned long n = 0;
+   char** u = NULL;
+   struct tuple* tup = NULL;
+
+   *unlogged = NULL;
+   *number_of_unlogged = 0;
+
+   tup = tuples;
+   while (tup != NULL)
+   {
+      if (tup->data[0] != NULL && tup->data[3] != NULL && strcmp(tup->data[3], "t") && pgmoneta_ends_with(tup->data[0], "_init"))
+      {
+         n++;
+      }
+      tup = tup->next;
+   }
+
+   if (n == 0)
+   {
+      return 0;
+   }
+
+   u = (char**)calloc(n, sizeof(char*));
+   if (u == NULL)
+   {
+      goto error;
+   }
+
+   n = 0;
+   tup = tuples;
+   while (tup != NULL)
+   {
+      if (tup->data[0] != NULL && tup->data[3] != NULL && strcmp(tup->data[3], "t") && pgmoneta_ends_with(tup->data[0], "_init"))
+      {
+         // the relation without the fork suffix
+         length = strlen(tup->data[0]) - strlen("_init");
+         u[n] = (char*)malloc(length + 1);
+         if (u[n] == NULL)
+         {
+            goto error;
+         }
+         memcpy(u[n], tup->data[0], length);
+         u[n][length] = '\0';
+         n++;
+      }
+      tup = tup->next;
+   }
+
+   qsort(u, n, sizeof(char*), parallel_compare_string);
+
+   *unlogged = u;
+   *number_of_unlogged = n;
+
+   return 0;
+
+error:
+
+   for (unsigned long i = 0; u != NULL && i < n; i++)
+   {
+      free(u[i]);
+   }
+   free(u);
+
+   return 1;
+}
+
+static int
+parallel_compare_string(const void* a, const void* b)
+{
+   return strcmp(*(char**)a, *(char**)b);
+}
+
+static bool
+parallel_excluded(char* path, char** unlogged, unsigned long number_of_unlogged)
+{
+   char* name = NULL;
+   char* key = NULL;
+   char relation[MAX_PATH];
+   size_t length;
+
+   name = strrchr(path, '/');
+   name = name != NULL ? name + 1 : path;
+
+   if (!strcmp(name, "pg_internal.init"))
+   {
+      return true;
+   }
+
+   // only the init fork of an unlogged relation is kept, the same as for BASE_BACKUP
+   if (number_of_unlogged > 0 && strspn(name, "0123456789") > 0 && !pgmoneta_ends_with(name, "_init"))
+   {
+      length = (name - path) + strspn(name, "0123456789");
+      if (length < sizeof(relation) && (path[length] == '\0' || path[length] == '_' || path[length] == '.'))
+      {
+         memset(relation, 0, sizeof(relation));
+         memcpy(relation, path, length);
+         key = &relation[0];
+
+         if (bsearch(&key, unlogged, number_of_unlogged, sizeof(char*), parallel_compare_string) != NULL)
+         {
+            return true;
+         }
+      }
+   }
+
+   // the excluded files only live at the top of the data directory
+   if (strchr(path, '/') == NULL)
+   {
+      for (int i = 0; excluded_files[i] != NULL; i++)
+      {
+         if (!strcmp(path, excluded_files[i]))
+         {
+            return true;
+         }
+      }
+   }
+
+   return false;
+}
+
+static int
+parallel_segment(char* lsn, int wal_size, uint64_t* segno)
+{
+   unsigned int hi = 0;
+   unsigned int lo = 0;
+   uint64_t position;
+
+   if (wal_size <= 0 || sscanf(lsn, "%X/%X", &hi, &lo) != 2)
+   {
+      return 1;
+   }
+
+   position = ((uint64_t)hi << 32) | lo;
+
+   // a position at a segment boundary belongs to the segment before, the same as for pg_walfile_name
+   if (position > 0)
+   {
+      position--;
+   }
+
+   *segno = position / (uint64_t)wal_size;
+
+   return 0;
+}
+
+static int
+parallel_directory(char* basedir, char* directory, char* path, struct tablespace* tablespaces)
+{
+   char dir[MAX_PATH];
+   char link_path[MAX_PATH];
+   char* end = NULL;
+   unsigned long oid;
+   struct tablespace* tblspc = NULL;
+
+   memset(dir, 0, sizeof(dir));
+   memset(link_path, 0, sizeof(link_path));
+
+   // a user level tablespace is kept next to the data directory, the same as for BASE_BACKUP
+   if (!strncmp(path, "pg_tblspc/", strlen("pg_tblspc/")))
+   {
+      oid = strtoul(path + strlen("pg_tblspc/"), &end, 10);
+      if (end != NULL && *end == '\0')
+      {
+         tblspc = tablespaces;
+         while (tblspc != NULL && tblspc->oid != oid)
+         {
+            tblspc = tblspc->next;
+         }
+      }
+   }
+
+   if (tblspc != NULL)
+   {
+      if (pgmoneta_ends_with(basedir, "/"))
+      {
+         snprintf(dir, sizeof(dir), "%s%s/", basedir, tblspc->name);
+      }
+      else
+      {
+         snprintf(dir, sizeof(dir), "%s/%s/", basedir, tblspc->name);
+      }
+      snprintf(link_path, sizeof(link_path), "%s/%s", directory, path);
+
+      if (pgmoneta_mkdir(dir))
+      {
+         pgmoneta_log_error("Backup: Could not create %s", dir);
+         return 1;
+      }
+
+      unlink(link_path);
+      return pgmoneta_symlink_file(link_path, dir);
+   }
+
+   snprintf(dir, sizeof(dir), "%s/%s", directory, path);
+
+   if (pgmoneta_mkdir(dir))
+   {
+      pgmoneta_log_error("Backup: Could not create %s", dir);
+      return 1;
+   }
+
+   return 0;
+}
+
+static int
+parallel_compare(const void* a, const void* b)
+{
+   struct parallel_file* f1 = (struct parallel_file*)a;
+   struct parallel_file* f2 = (struct parallel_file*)b;
+
+   if (f1->item.size == f2->item.size)
+   {
+      return 0;
+   }
+
+   return f1->item.size > f2->item.size ? -1 : 1;
+}
+
+static int
+parallel_worker(int server, int usr, struct parallel_state* state, char* directory)
+{
+   SSL* ssl = NULL;
+   int socket = -1;
+   unsigned long i;
+   struct stream_buffer* buffer = NULL;
+
+   if (parallel_connect(server, usr, &ssl, &socket))
+   {
+      goto error;
+   }
+
+   pgmoneta_memory_stream_buffer_init(&buffer);
+
+   while (!atomic_load(&state->failed))
+   {
+      i = atomic_fetch_add(&state->next, 1);
+      if (i >= state->number_of_files)
+      {
+         break;
+      }
+
+      if (parallel_copy_file(ssl, socket, buffer, state, directory, &state->files[i], state->store))
+      {
+         pgmoneta_log_error("Backup: Could not copy %s", state->files[i].item.path);
+         goto error;
+      }
+   }
+
+   pgmoneta_write_terminate(ssl, socket);
+   pgmoneta_close_ssl(ssl);
+   pgmoneta_disconnect(socket);
+   pgmoneta_memory_stream_buffer_free(buffer);
+
+   return 0;
+
+error:
+
+   atomic_store(&state->failed, true);
+
+   pgmoneta_close_ssl(ssl);
+   if (socket != -1)
+   {
+      pgmoneta_disconnect(socket);
+   }
+   pgmoneta_memory_stream_buffer_free(buffer);
+
+   return 1;
+}
+
+static int
+parallel_copy_file(SSL* ssl, int socket, struct stream_buffer* buffer, struct parallel_state* state, char* directory, struct parallel_file* file, bool store)
+{
+   char path[MAX_PATH];
+   char number[32];
+   char* query = NULL;
+   size_t checksum_length = 0;
+   size_t bytes = 0;
+   bool done = false;
+   struct copy_parser parser;
+   struct message msg;
+   struct message* query_msg = NULL;
+   struct pipeline_stage* pipeline = NULL;
+   struct pipeline_stage* stage = NULL;
+
+   memset(path, 0, sizeof(path));
+   memset(&parser, 0, sizeof(struct copy_parser));
+   memset(&msg, 0, sizeof(struct message));
+
+   if (snprintf(path, sizeof(path), "%s/%s", directory, file->item.path) >= (int)sizeof(path))
+   {
+      pgmoneta_log_error("Backup: The path of %s is too long", file->item.path);
+      goto error;
+   }
+
+   // the file is read in chunks, a whole relation segment doesn't fit in a bytea
+   query = pgmoneta_append(query, "COPY (SELECT pg_read_binary_file(");
+   query = parallel_quote(query, file->item.path);
+   query = pgmoneta_append(query, ", o, ");
+   query = pgmoneta_append_int(query, PARALLEL_CHUNK_SIZE);
+   query = pgmoneta_append(query, ", true) FROM generate_series(0::bigint, ");
+   snprintf(number, sizeof(number), "%lld", (long long)file->item.size - 1);
+   query = pgmoneta_append(query, number);
+   query = pgmoneta_append(query, ", ");
+   query = pgmoneta_append_int(query, PARALLEL_CHUNK_SIZE);
+   query = pgmoneta_append(query, ") AS o) TO STDOUT (FORMAT binary);");
+
+   if (pgmoneta_create_query_message(query, &query_msg) ||
+       pgmoneta_write_message(ssl, socket, query_msg) != MESSAGE_STATUS_OK)
+   {
+      goto error;
+   }
+
+   if (pgmoneta_manifest_create_checksum(state->algorithm, &pipeline) ||
+       pgmoneta_pipeline_create_file_writer(path, &stage))
+   {
+      goto error;
+   }
+   pgmoneta_pipeline_append(&pipeline, stage);
+   stage = NULL;
+
+   while (!done)
+   {
+      if (pgmoneta_consume_copy_stream_start(ssl, socket, buffer, &msg, NULL) != MESSAGE_STATUS_OK)
+      {
+         goto error;
+      }
+
+      switch (msg.kind)
+      {
+         case 'E':
+         case 'f':
+            pgmoneta_log_copyfail_message(&msg);
+            pgmoneta_log_error_response_message(&msg);
+            pgmoneta_consume_copy_stream_end(buffer, &msg);
+            goto error;
+         case 'd':
+            if (state->limit)
+            {
+               while (pgmoneta_token_bucket_consume(&state->bucket, msg.length))
+               {
+                  SLEEP(500000000L)
+               }
+            }
+
+            if (parallel_copy_data(&parser, pipeline, msg.data, msg.length))
+            {
+               pgmoneta_consume_copy_stream_end(buffer, &msg);
+               goto error;
+            }
+            break;
+         case 'C':
+            done = true;
+            break;
+         default:
+            break;
+      }
+
+      pgmoneta_consume_copy_stream_end(buffer, &msg);
+   }
+
+   if (parser.state != COPY_STATE_END)
+   {
+      pgmoneta_log_error("Backup: Incomplete copy of %s", file->item.path);
+      goto error;
+   }
+
+   if (pgmoneta_pipeline_write(pipeline, NULL, 0, true) ||
+       pgmoneta_manifest_checksum_final(pipeline, file->item.checksum, &checksum_length, &bytes))
+   {
+      goto error;
+   }
+   file->item.checksum_length = (uint8_t)checksum_length;
+   file->item.size = bytes;
+
+   pgmoneta_pipeline_destroy(pipeline);
+   pipeline = NULL;
+
+   atomic_fetch_add(&state->bytes, bytes);
+
+   // the file was removed while the backup was taken, WAL replay takes care of it
+   if (parser.null)
+   {
+      file->missing = true;
+      pgmoneta_delete_file(path, NULL);
+   }
+   else if (store && pgmoneta_store_file(path))
+   {
+      pgmoneta_log_warn("Backup: Could not compress and encrypt %s", path);
+   }
+
+   pgmoneta_free_copy_message(query_msg);
+   free(query);
+
+   return 0;
+
+error:
+
+   pgmoneta_pipeline_destroy(stage);
+   pgmoneta_pipeline_destroy(pipeline);
+   pgmoneta_free_copy_message(query_msg);
+   free(query);
+
+   return 1;
+}
+
+static int
+parallel_copy_data(struct copy_parser* parser, struct pipeline_stage* pipeline, char* data, size_t size)
+{
+   size_t needed;
+   size_t n;
+   int16_t fields;
+   int32_t length;
+
+   while (size > 0)
+   {
+      if (parser->state == COPY_STATE_DATA)
+      {
+         n = MIN(size, parser->remaining);
+         if (pgmoneta_pipeline_write(pipeline, data, n, false))
+         {
+            return 1;
+         }
+
+         data += n;
+         size -= n;
+         parser->remaining -= n;
+
+         if (parser->remaining == 0)
+         {
+            parser->state = COPY_STATE_FIELDS;
+         }
+         continue;
+      }
+
+      if (parser->state == COPY_STATE_END)
+      {
+         pgmoneta_log_error("Backup: Unexpected data after the end of a copy");
+         return 1;
+      }
+
+      needed = parser->state == COPY_STATE_HEADER ? COPY_HEADER_SIZE : (parser->state == COPY_STATE_FIELDS ? 2 : 4);
+      n = MIN(size, needed - parser->have);
+      memcpy(parser->fixed + parser->have, data, n);
+      parser->have += n;
+      data += n;
+      size -= n;
+
+      if (parser->have < needed)
+      {
+         continue;
+      }
+      parser->have = 0;
+
+      switch (parser->state)
+      {
+         case COPY_STATE_HEADER:
+            // no header extension is ever sent
+            if (memcmp(parser->fixed, copy_signature, COPY_SIGNATURE_SIZE) || pgmoneta_read_int32(parser->fixed + 15) != 0)
+            {
+               pgmoneta_log_error("Backup: Invalid copy header");
+               return 1;
+            }
+            parser->state = COPY_STATE_FIELDS;
+            break;
+         case COPY_STATE_FIELDS:
+            fields = pgmoneta_read_int16(parser->fixed);
+            if (fields == -1)
+            {
+               parser->state = COPY_STATE_END;
+            }
+            else if (fields == 1)
+            {
+               parser->state = COPY_STATE_LENGTH;
+            }
+            else
+            {
+               pgmoneta_log_error("Backup: Invalid copy tuple");
+               return 1;
+            }
+            break;
+         case COPY_STATE_LENGTH:
+            length = pgmoneta_read_int32(parser->fixed);
+            if (length < 0)
+            {
+               parser->null = true;
+               parser->state = COPY_STATE_FIELDS;
+            }
+            else
+            {
+               parser->remaining = (size_t)length;
+               parser->state = length > 0 ? COPY_STATE_DATA : COPY_STATE_FIELDS;
+            }
+            break;
+         default:
+            break;
+      }
+   }
+
+   return 0;
+}
+
+static int
+parallel_write_file(char* directory, char* name, char* content, int algorithm, struct manifest_item* item)
+{
+   char path[MAX_PATH];
+   size_t checksum_length = 0;
+   size_t bytes = 0;
+   struct pipeline_stage* pipeline = NULL;
+   struct pipeline_stage* stage = NULL;
+
+   memset(path, 0, sizeof(path));
+   if (snprintf(path, sizeof(path), "%s/%s", directory, name) >= (int)sizeof(path))
+   {
+      pgmoneta_log_error("Backup: The path of %s is too long", name);
+      goto error;
+   }
+
+   if (pgmoneta_manifest_create_checksum(algorithm, &pipeline) ||
+       pgmoneta_pipeline_create_file_writer(path, &stage))
+   {
+      goto error;
+   }
+   pgmoneta_pipeline_append(&pipeline, stage);
+   stage = NULL;
+
+   if (pgmoneta_pipeline_write(pipeline, content, strlen(content), true) ||
+       pgmoneta_manifest_checksum_final(pipeline, item->checksum, &checksum_length, &bytes))
+   {
+      goto error;
+   }
+
+   item->path = pgmoneta_append(NULL, name);
+   item->size = bytes;
+   item->modified = time(NULL);
+   item->algorithm = (uint8_t)algorithm;
+   item->checksum_length = (uint8_t)checksum_length;
+
+   pgmoneta_pipeline_destroy(pipeline);
+
+   return 0;
+
+error:
+
+   pgmoneta_log_error("Backup: Could not write %s", path);
+   pgmoneta_pipeline_destroy(stage);
+   pgmoneta_pipeline_destroy(pipeline);
+
+   return 1;
+}
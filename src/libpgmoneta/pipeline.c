@@ -0,0 +1,2860 @@
+/*
+ * Copyright (C) 2024 The pgmoneta community
+ *
+ * Redistribution and use in source and binary forms, with or without modification,
+ * are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, this list
+ * of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice, this
+ * list of conditions and the following disclaimer in the documentation and/or other
+ * materials provided with the distribution.
+ *
+ * 3. Neither the name of the copyright holder nor the names of its contributors may
+ * be used to endorse or promote products derived from this software without specific
+ * prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL
+ * THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT
+ * OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR
+ * TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/* pgmoneta */
+#include <pgmoneta.h>
+#include <aes.h>
+#include <logging.h>
+#include <lz4_compression.h>
+#include <pipeline.h>
+#include <prometheus.h>
+#include <security.h>
+#include <utils.h>
+#include <workers.h>
+
+/* system */
+#include <bzlib.h>
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <lz4.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <zlib.h>
+#include <zstd.h>
+#include <openssl/evp.h>
+#include <openssl/sha.h>
+
+#define TAR_BLOCK_SIZE 512
+
+#define WAL_CODEC_MAGIC         "PGMW"
+#define WAL_CODEC_VERSION       1
+#define WAL_CODEC_HEADER_SIZE   12
+#define WAL_CODEC_MAX_PAGE      (64 * 1024)
+
+#define WAL_CODEC_START  0
+#define WAL_CODEC_PAGES  1
+#define WAL_CODEC_TAG    2
+#define WAL_CODEC_COUNT  3
+#define WAL_CODEC_LENGTH 4
+#define WAL_CODEC_PAGE   5
+#define WAL_CODEC_TAIL   6
+#define WAL_CODEC_END    7
+#define WAL_CODEC_RAW    8
+
+/* The items of an encoded segment */
+#define WAL_ITEM_PAGE    'P'
+#define WAL_ITEM_HEADERS 'H'
+#define WAL_ITEM_ZEROS   'Z'
+#define WAL_ITEM_TAIL    'T'
+#define WAL_ITEM_END     'X'
+
+/* The long page header that starts a segment */
+#define WAL_LONG_HEADER_SIZE    40
+#define WAL_PAGE_INFO           2
+#define WAL_PAGE_TIMELINE       4
+#define WAL_PAGE_ADDRESS        8
+#define WAL_PAGE_SEGMENT_SIZE   32
+#define WAL_PAGE_BLOCK_SIZE     36
+#define WAL_FIRST_IS_CONTRECORD 0x0001
+#define WAL_LONG_HEADER         0x0002
+
+struct compressor
+{
+   int type;                                         /**< The compression type */
+   z_stream gzip;                                    /**< The GZIP stream */
+   bz_stream bzip2;                                  /**< The BZip2 stream */
+   ZSTD_CCtx* zstd;                                  /**< The Zstandard context */
+   LZ4_stream_t* lz4;                                /**< The LZ4 stream */
+   char lz4_in[2][BLOCK_BYTES];                      /**< The LZ4 input blocks */
+   int lz4_index;                                    /**< The current LZ4 input block */
+   size_t lz4_fill;                                  /**< The bytes in the current LZ4 input block */
+   size_t out_size;                                  /**< The size of the output buffer */
+   unsigned char* out;                               /**< The output buffer */
+};
+
+struct decompressor
+{
+   int type;                                         /**< The compression type */
+   z_stream gzip;                                    /**< The GZIP stream */
+   bz_stream bzip2;                                  /**< The BZip2 stream */
+   ZSTD_DCtx* zstd;                                  /**< The Zstandard context */
+   LZ4_streamDecode_t lz4;                           /**< The LZ4 stream */
+   char lz4_in[sizeof(int) + LZ4_COMPRESSBOUND(BLOCK_BYTES)]; /**< The current LZ4 frame */
+   size_t lz4_fill;                                  /**< The bytes in the current LZ4 frame */
+   char lz4_out[2][BLOCK_BYTES];                     /**< The LZ4 output blocks */
+   int lz4_index;                                    /**< The current LZ4 output block */
+   bool finished;                                    /**< Has the end of the stream been seen */
+   size_t out_size;                                  /**< The size of the output buffer */
+   unsigned char* out;                               /**< The output buffer */
+};
+
+struct cipher
+{
+   EVP_CIPHER_CTX* ctx;  /**< The cipher context */
+   unsigned char* out;   /**< The output buffer */
+   int histogram;        /**< The latency histogram */
+};
+
+struct file_writer
+{
+   int fd;              /**< The file descriptor */
+   char path[MAX_PATH]; /**< The file path */
+   SHA256_CTX* sha256;  /**< The SHA256 of the file, when it is recorded */
+};
+
+struct wal_codec
+{
+   int state;                   /**< The state */
+   size_t page_size;            /**< The size of a WAL page */
+   unsigned char* page;         /**< The current page or item */
+   size_t fill;                 /**< The bytes in the current page or item */
+   size_t need;                 /**< The size of the current item */
+   uint64_t index;              /**< The number of the current page in the segment */
+   unsigned char prefix[8];     /**< The magic, info and timeline expected on every page */
+   uint64_t address;            /**< The address of the first page */
+   uint32_t segment_size;       /**< The size of the segment, from the first page */
+   char run;                    /**< The kind of the current run of pages */
+   uint32_t run_length;         /**< The number of pages in the current run */
+   unsigned char* out;          /**< The output buffer */
+   size_t out_fill;             /**< The bytes in the output buffer */
+};
+
+struct tar_extractor
+{
+   char directory[MAX_PATH];       /**< The target directory */
+   char header[TAR_BLOCK_SIZE];    /**< The current header block */
+   size_t header_fill;             /**< The bytes in the current header block */
+   char path[MAX_PATH];            /**< The path of the current member */
+   int fd;                         /**< The file descriptor of the current member */
+   char* meta;                     /**< The GNU long name being read */
+   size_t meta_fill;               /**< The bytes in the GNU long name */
+   char meta_type;                 /**< The type of the GNU long name */
+   char* long_name;                /**< The GNU long name of the next member */
+   char* long_link;                /**< The GNU long link name of the next member */
+   size_t remaining;               /**< The data bytes left of the current member */
+   size_t padding;                 /**< The padding bytes left of the current member */
+   bool end;                       /**< Has the end of the archive been seen */
+   pipeline_completed completed;   /**< The function called for each completed file */
+   void* data;                     /**< The data for the completed function */
+   SHA256_CTX* sha256;             /**< The SHA256 of the current member, when it is recorded */
+};
+
+static int gzip_process(struct pipeline_stage* stage, void* buffer, size_t size, bool last);
+static int bzip2_process(struct pipeline_stage* stage, void* buffer, size_t size, bool last);
+static int zstd_process(struct pipeline_stage* stage, void* buffer, size_t size, bool last);
+static int lz4_process(struct pipeline_stage* stage, void* buffer, size_t size, bool last);
+static int lz4_block(struct pipeline_stage* stage);
+static void compressor_destroy(struct pipeline_stage* stage);
+
+static int gunzip_process(struct pipeline_stage* stage, void* buffer, size_t size, bool last);
+static int bunzip2_process(struct pipeline_stage* stage, void* buffer, size_t size, bool last);
+static int zstdd_process(struct pipeline_stage* stage, void* buffer, size_t size, bool last);
+static int lz4d_process(struct pipeline_stage* stage, void* buffer, size_t size, bool last);
+static void decompressor_destroy(struct pipeline_stage* stage);
+static int compression_from_suffix(char* path, int* compression_type);
+
+static int cipher_process(struct pipeline_stage* stage, void* buffer, size_t size, bool last);
+static void cipher_destroy(struct pipeline_stage* stage);
+
+static int file_writer_process(struct pipeline_stage* stage, void* buffer, size_t size, bool last);
+static void file_writer_destroy(struct pipeline_stage* stage);
+
+static int wal_codec_create(pipeline_process process, struct pipeline_stage** stage);
+static int wal_encoder_process(struct pipeline_stage* stage, void* buffer, size_t size, bool last);
+static int wal_encoder_page(struct pipeline_stage* stage);
+static int wal_encoder_run(struct pipeline_stage* stage);
+static int wal_decoder_process(struct pipeline_stage* stage, void* buffer, size_t size, bool last);
+static int wal_decoder_item(struct pipeline_stage* stage);
+static void wal_codec_destroy(struct pipeline_stage* stage);
+static bool wal_codec_start(struct wal_codec* c);
+static void wal_codec_transform(struct wal_codec* c, unsigned char* page);
+static bool wal_codec_zero(unsigned char* data, size_t size);
+static int wal_codec_output(struct pipeline_stage* stage, void* data, size_t size);
+static int wal_codec_flush(struct pipeline_stage* stage);
+static uint32_t wal_codec_read32(unsigned char* data);
+static void wal_codec_write32(unsigned char* data, uint32_t value);
+
+static int tar_extractor_process(struct pipeline_stage* stage, void* buffer, size_t size, bool last);
+static void tar_extractor_destroy(struct pipeline_stage* stage);
+static int tar_header(struct tar_extractor* t);
+static int tar_member_done(struct tar_extractor* t);
+static size_t tar_number(char* field, size_t length);
+static bool tar_safe_name(char* name);
+
+static int emit(struct pipeline_stage* stage, void* buffer, size_t size);
+static void do_compress_encrypt(void* arg);
+static void do_decrypt_decompress(void* arg);
+
+int
+pgmoneta_pipeline_create_compressor(int compression_type, int level, struct pipeline_stage** stage)
+{
+   struct pipeline_stage* s = NULL;
+   struct compressor* c = NULL;
+
+   *stage = NULL;
+
+   s = (struct pipeline_stage*)malloc(sizeof(struct pipeline_stage));
+   c = (struct compressor*)malloc(sizeof(struct compressor));
+
+   if (s == NULL || c == NULL)
+   {
+      goto error;
+   }
+
+   memset(s, 0, sizeof(struct pipeline_stage));
+   memset(c, 0, sizeof(struct compressor));
+
+   s->state = c;
+   s->destroy = &compressor_destroy;
+
+   switch (compression_type)
+   {
+      case COMPRESSION_CLIENT_GZIP:
+      case COMPRESSION_SERVER_GZIP:
+         c->type = COMPRESSION_CLIENT_GZIP;
+         level = MIN(MAX(level, 1), 9);
+         if (deflateInit2(&c->gzip, level, Z_DEFLATED, 15 + 16, 8, Z_DEFAULT_STRATEGY) != Z_OK)
+         {
+            goto error;
+         }
+         c->out_size = PIPELINE_BUFFER_SIZE;
+         s->process = &gzip_process;
+         break;
+      case COMPRESSION_CLIENT_ZSTD:
+      case COMPRESSION_SERVER_ZSTD:
+         c->type = COMPRESSION_CLIENT_ZSTD;
+         level = MIN(MAX(level, 1), 19);
+         c->zstd = ZSTD_createCCtx();
+         if (c->zstd == NULL)
+         {
+            goto error;
+         }
+         ZSTD_CCtx_setParameter(c->zstd, ZSTD_c_compressionLevel, level);
+         ZSTD_CCtx_setParameter(c->zstd, ZSTD_c_checksumFlag, 1);
+         c->out_size = ZSTD_CStreamOutSize();
+         s->process = &zstd_process;
+         break;
+      case COMPRESSION_CLIENT_LZ4:
+      case COMPRESSION_SERVER_LZ4:
+         c->type = COMPRESSION_CLIENT_LZ4;
+         c->lz4 = LZ4_createStream();
+         if (c->lz4 == NULL)
+         {
+            goto error;
+         }
+         c->out_size = sizeof(int) + LZ4_COMPRESSBOUND(BLOCK_BYTES);
+         s->process = &lz4_process;
+         break;
+      case COMPRESSION_CLIENT_BZIP2:
+         c->type = COMPRESSION_CLIENT_BZIP2;
+         level = MIN(MAX(level, 1), 9);
+         if (BZ2_bzCompressInit(&c->bzip2, level, 0, 0) != BZ_OK)
+         {
+            goto error;
+         }
+         c->out_size = PIPELINE_BUFFER_SIZE;
+         s->process = &bzip2_process;
+         break;
+      default:
+         pgmoneta_log_error("Pipeline: Unknown compression type %d", compression_type);
+         c->type = COMPRESSION_NONE;
+         goto error;
+   }
+
+   c->out = (unsigned char*)malloc(c->out_size);
+   if (c->out == NULL)
+   {
+      goto error;
+   }
+
+   *stage = s;
+
+   return 0;
+
+error:
+
+   if (s != NULL && c != NULL)
+   {
+      compressor_destroy(s);
+   }
+   else
+   {
+      free(c);
+   }
+   free(s);
+
+   return 1;
+}
+
+int
+pgmoneta_pipeline_create_decompressor(int compression_type, struct pipeline_stage** stage)
+{
+   struct pipeline_stage* s = NULL;
+   struct decompressor* d = NULL;
+
+   *stage = NULL;
+
+   s = (struct pipeline_stage*)malloc(sizeof(struct pipeline_stage));
+   d = (struct decompressor*)malloc(sizeof(struct decompressor));
+
+   if (s == NULL || d == NULL)
+   {
+      goto error;
+   }
+
+   memset(s, 0, sizeof(struct pipeline_stage));
+   memset(d, 0, sizeof(struct decompressor));
+
+   s->state = d;
+   s->destroy = &decompressor_destroy;
+
+   switch (compression_type)
+   {
+      case COMPRESSION_CLIENT_GZIP:
+      case COMPRESSION_SERVER_GZIP:
+         d->type = COMPRESSION_CLIENT_GZIP;
+         /* Automatic detection of the GZIP or ZLIB header */
+         if (inflateInit2(&d->gzip, 15 + 32) != Z_OK)
+         {
+            goto error;
+         }
+         d->out_size = PIPELINE_BUFFER_SIZE;
+         s->process = &gunzip_process;
+         break;
+      case COMPRESSION_CLIENT_ZSTD:
+      case COMPRESSION_SERVER_ZSTD:
+         d->type = COMPRESSION_CLIENT_ZSTD;
+         d->zstd = ZSTD_createDCtx();
+         if (d->zstd == NULL)
+         {
+            goto error;
+         }
+         d->out_size = ZSTD_DStreamOutSize();
+         s->process = &zstdd_process;
+         break;
+      case COMPRESSION_CLIENT_LZ4:
+      case COMPRESSION_SERVER_LZ4:
+         d->type = COMPRESSION_CLIENT_LZ4;
+         LZ4_setStreamDecode(&d->lz4, NULL, 0);
+         d->out_size = 0;
+         s->process = &lz4d_process;
+         break;
+      case COMPRESSION_CLIENT_BZIP2:
+         d->type = COMPRESSION_CLIENT_BZIP2;
+         if (BZ2_bzDecompressInit(&d->bzip2, 0, 0) != BZ_OK)
+         {
+            goto error;
+         }
+         d->out_size = PIPELINE_BUFFER_SIZE;
+         s->process = &bunzip2_process;
+         break;
+      default:
+         pgmoneta_log_error("Pipeline: Unknown compression type %d", compression_type);
+         d->type = COMPRESSION_NONE;
+         goto error;
+   }
+
+   if (d->out_size > 0)
+   {
+      d->out = (unsigned char*)malloc(d->out_size);
+      if (d->out == NULL)
+      {
+         goto error;
+      }
+   }
+
+   *stage = s;
+
+   return 0;
+
+error:
+
+   if (s != NULL && d != NULL)
+   {
+      decompressor_destroy(s);
+   }
+   else
+   {
+      free(d);
+   }
+   free(s);
+
+   return 1;
+}
+
+int
+pgmoneta_pipeline_create_cipher(bool encrypt, struct pipeline_stage** stage)
+{
+   struct pipeline_stage* s = NULL;
+   struct cipher* c = NULL;
+
+   *stage = NULL;
+
+   s = (struct pipeline_stage*)malloc(sizeof(struct pipeline_stage));
+   c = (struct cipher*)malloc(sizeof(struct cipher));
+
+   if (s == NULL || c == NULL)
+   {
+      goto error;
+   }
+
+   memset(s, 0, sizeof(struct pipeline_stage));
+   memset(c, 0, sizeof(struct cipher));
+
+   if (pgmoneta_create_encryption_context(encrypt, &c->ctx))
+   {
+      goto error;
+   }
+
+   c->histogram = encrypt ? HISTOGRAM_ENCRYPT : HISTOGRAM_DECRYPT;
+
+   c->out = (unsigned char*)malloc(PIPELINE_BUFFER_SIZE + EVP_MAX_BLOCK_LENGTH);
+   if (c->out == NULL)
+   {
+      goto error;
+   }
+
+   s->state = c;
+   s->process = &cipher_process;
+   s->destroy = &cipher_destroy;
+
+   *stage = s;
+
+   return 0;
+
+error:
+
+   if (c != NULL)
+   {
+      if (c->ctx != NULL)
+      {
+         EVP_CIPHER_CTX_free(c->ctx);
+      }
+      free(c->out);
+   }
+   free(c);
+   free(s);
+
+   return 1;
+}
+
+int
+pgmoneta_pipeline_create_file_writer(char* path, struct pipeline_stage** stage)
+{
+   struct pipeline_stage* s = NULL;
+   struct file_writer* w = NULL;
+
+   *stage = NULL;
+
+   s = (struct pipeline_stage*)malloc(sizeof(struct pipeline_stage));
+   w = (struct file_writer*)malloc(sizeof(struct file_writer));
+
+   if (s == NULL || w == NULL)
+   {
+      goto error;
+   }
+
+   memset(s, 0, sizeof(struct pipeline_stage));
+   memset(w, 0, sizeof(struct file_writer));
+
+   snprintf(&w->path[0], sizeof(w->path), "%s", path);
+
+   w->fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+   if (w->fd == -1)
+   {
+      pgmoneta_log_error("Pipeline: Could not open %s: %s", path, strerror(errno));
+      goto error;
+   }
+
+   if (pgmoneta_sha256_registry_active())
+   {
+      w->sha256 = (SHA256_CTX*)malloc(sizeof(SHA256_CTX));
+      if (w->sha256 != NULL)
+      {
+         SHA256_Init(w->sha256);
+      }
+   }
+
+   s->state = w;
+   s->process = &file_writer_process;
+   s->destroy = &file_writer_destroy;
+
+   *stage = s;
+
+   return 0;
+
+error:
+
+   free(w);
+   free(s);
+
+   return 1;
+}
+
+int
+pgmoneta_pipeline_create_tar_extractor(char* directory, pipeline_completed completed, void* data, struct pipeline_stage** stage)
+{
+   struct pipeline_stage* s = NULL;
+   struct tar_extractor* t = NULL;
+
+   *stage = NULL;
+
+   s = (struct pipeline_stage*)malloc(sizeof(struct pipeline_stage));
+   t = (struct tar_extractor*)malloc(sizeof(struct tar_extractor));
+
+   if (s == NULL || t == NULL)
+   {
+      goto error;
+   }
+
+   memset(s, 0, sizeof(struct pipeline_stage));
+   memset(t, 0, sizeof(struct tar_extractor));
+
+   if (pgmoneta_ends_with(directory, "/"))
+   {
+      snprintf(&t->directory[0], sizeof(t->directory), "%s", directory);
+   }
+   else
+   {
+      snprintf(&t->directory[0], sizeof(t->directory), "%s/", directory);
+   }
+
+   if (pgmoneta_mkdir(&t->directory[0]))
+   {
+      pgmoneta_log_error("Pipeline: Could not create %s: %s", &t->directory[0], strerror(errno));
+      goto error;
+   }
+
+   t->fd = -1;
+   t->completed = completed;
+   t->data = data;
+
+   // a completed file is handed on, so it is recorded by whoever writes it last
+   if (completed == NULL && pgmoneta_sha256_registry_active())
+   {
+      t->sha256 = (SHA256_CTX*)malloc(sizeof(SHA256_CTX));
+   }
+
+   s->state = t;
+   s->process = &tar_extractor_process;
+   s->destroy = &tar_extractor_destroy;
+
+   *stage = s;
+
+   return 0;
+
+error:
+
+   free(t);
+   free(s);
+
+   return 1;
+}
+
+int
+pgmoneta_pipeline_create_wal_encoder(struct pipeline_stage** stage)
+{
+   return wal_codec_create(&wal_encoder_process, stage);
+}
+
+int
+pgmoneta_pipeline_create_wal_decoder(struct pipeline_stage** stage)
+{
+   return wal_codec_create(&wal_decoder_process, stage);
+}
+
+int
+pgmoneta_pipeline_append(struct pipeline_stage** pipeline, struct pipeline_stage* stage)
+{
+   struct pipeline_stage* current = NULL;
+
+   if (stage == NULL)
+   {
+      return 1;
+   }
+
+   if (*pipeline == NULL)
+   {
+      *pipeline = stage;
+      return 0;
+   }
+
+   current = *pipeline;
+   while (current->next != NULL)
+   {
+      current = current->next;
+   }
+
+   current->next = stage;
+
+   return 0;
+}
+
+int
+pgmoneta_pipeline_write(struct pipeline_stage* pipeline, void* buffer, size_t size, bool last)
+{
+   if (pipeline == NULL)
+   {
+      return 0;
+   }
+
+   return pipeline->process(pipeline, buffer, size, last);
+}
+
+int
+pgmoneta_pipeline_file(struct pipeline_stage* pipeline, char* from)
+{
+   int fd = -1;
+   ssize_t r;
+   void* buffer = NULL;
+
+   buffer = malloc(PIPELINE_BUFFER_SIZE);
+   if (buffer == NULL)
+   {
+      goto error;
+   }
+
+   fd = open(from, O_RDONLY);
+   if (fd == -1)
+   {
+      pgmoneta_log_error("Pipeline: Could not open %s: %s", from, strerror(errno));
+      goto error;
+   }
+
+#if defined(HAVE_LINUX) || defined(HAVE_FREEBSD)
+   posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+#endif
+
+   for (;;)
+   {
+      r = read(fd, buffer, PIPELINE_BUFFER_SIZE);
+
+      if (r < 0)
+      {
+         if (errno == EINTR)
+         {
+            continue;
+         }
+
+         pgmoneta_log_error("Pipeline: Could not read %s: %s", from, strerror(errno));
+         goto error;
+      }
+
+      if (r == 0)
+      {
+         break;
+      }
+
+      if (pgmoneta_pipeline_write(pipeline, buffer, (size_t)r, false))
+      {
+         goto error;
+      }
+   }
+
+   if (pgmoneta_pipeline_write(pipeline, NULL, 0, true))
+   {
+      goto error;
+   }
+
+   close(fd);
+   free(buffer);
+
+   return 0;
+
+error:
+
+   if (fd != -1)
+   {
+      close(fd);
+   }
+   free(buffer);
+
+   return 1;
+}
+
+void
+pgmoneta_pipeline_destroy(struct pipeline_stage* pipeline)
+{
+   struct pipeline_stage* next = NULL;
+
+   while (pipeline != NULL)
+   {
+      next = pipeline->next;
+
+      if (pipeline->destroy != NULL)
+      {
+         pipeline->destroy(pipeline);
+      }
+      free(pipeline);
+
+      pipeline = next;
+   }
+}
+
+char*
+pgmoneta_compression_suffix(int compression_type)
+{
+   switch (compression_type)
+   {
+      case COMPRESSION_CLIENT_GZIP:
+      case COMPRESSION_SERVER_GZIP:
+         return ".gz";
+      case COMPRESSION_CLIENT_ZSTD:
+      case COMPRESSION_SERVER_ZSTD:
+         return ".zstd";
+      case COMPRESSION_CLIENT_LZ4:
+      case COMPRESSION_SERVER_LZ4:
+         return ".lz4";
+      case COMPRESSION_CLIENT_BZIP2:
+         return ".bz2";
+      default:
+         break;
+   }
+
+   return "";
+}
+
+char*
+pgmoneta_stored_file(char* path)
+{
+   char* candidate = NULL;
+   char* suffixes[] = {"", ".gz", ".zstd", ".lz4", ".bz2"};
+
+   for (int i = 0; i < (int)(sizeof(suffixes) / sizeof(suffixes[0])); i++)
+   {
+      for (int encrypted = 0; encrypted < 2; encrypted++)
+      {
+         candidate = pgmoneta_append(NULL, path);
+         candidate = pgmoneta_append(candidate, suffixes[i]);
+         if (encrypted)
+         {
+            candidate = pgmoneta_append(candidate, ".aes");
+         }
+
+         if (pgmoneta_exists(candidate))
+         {
+            return candidate;
+         }
+
+         free(candidate);
+         candidate = NULL;
+      }
+   }
+
+   return NULL;
+}
+
+int
+pgmoneta_pipeline_create_decoder(char* path, struct pipeline_stage** pipeline)
+{
+   char* name = NULL;
+   int compression_type = COMPRESSION_NONE;
+   struct pipeline_stage* stage = NULL;
+
+   *pipeline = NULL;
+
+   name = pgmoneta_append(NULL, path);
+   if (name == NULL)
+   {
+      goto error;
+   }
+
+   if (pgmoneta_ends_with(name, ".aes"))
+   {
+      name[strlen(name) - strlen(".aes")] = '\0';
+
+      if (pgmoneta_pipeline_create_cipher(false, &stage))
+      {
+         goto error;
+      }
+      pgmoneta_pipeline_append(pipeline, stage);
+   }
+
+   if (!compression_from_suffix(name, &compression_type))
+   {
+      if (pgmoneta_pipeline_create_decompressor(compression_type, &stage))
+      {
+         goto error;
+      }
+      pgmoneta_pipeline_append(pipeline, stage);
+
+      name[strlen(name) - strlen(pgmoneta_compression_suffix(compression_type))] = '\0';
+
+      if (pgmoneta_is_wal_segment(name))
+      {
+         if (pgmoneta_pipeline_create_wal_decoder(&stage))
+         {
+            goto error;
+         }
+         pgmoneta_pipeline_append(pipeline, stage);
+      }
+   }
+
+   free(name);
+
+   return 0;
+
+error:
+
+   pgmoneta_pipeline_destroy(*pipeline);
+   *pipeline = NULL;
+   free(name);
+
+   return 1;
+}
+
+int
+pgmoneta_decrypt_decompress_file(char* from, char* to)
+{
+   struct pipeline_stage* pipeline = NULL;
+   struct pipeline_stage* stage = NULL;
+
+   if (pgmoneta_pipeline_create_decoder(from, &pipeline))
+   {
+      goto error;
+   }
+
+   if (pgmoneta_pipeline_create_file_writer(to, &stage))
+   {
+      goto error;
+   }
+   pgmoneta_pipeline_append(&pipeline, stage);
+
+   if (pgmoneta_pipeline_file(pipeline, from))
+   {
+      pgmoneta_log_error("Pipeline: Could not decrypt and decompress %s", from);
+      pgmoneta_pipeline_destroy(pipeline);
+      pgmoneta_delete_file(to, NULL);
+      return 1;
+   }
+
+   pgmoneta_pipeline_destroy(pipeline);
+
+   return 0;
+
+error:
+
+   pgmoneta_pipeline_destroy(pipeline);
+
+   return 1;
+}
+
+char*
+pgmoneta_restored_file_name(char* path)
+{
+   char* name = NULL;
+   int compression_type = COMPRESSION_NONE;
+
+   name = pgmoneta_append(NULL, path);
+   if (name == NULL)
+   {
+      return NULL;
+   }
+
+   if (pgmoneta_ends_with(name, ".aes"))
+   {
+      name[strlen(name) - strlen(".aes")] = '\0';
+   }
+
+   if (!compression_from_suffix(name, &compression_type))
+   {
+      name[strlen(name) - strlen(pgmoneta_compression_suffix(compression_type))] = '\0';
+   }
+
+   return name;
+}
+
+int
+pgmoneta_restore_stored_file(char* from, char* to, struct workers* workers)
+{
+   int compression_type = COMPRESSION_NONE;
+   struct worker_input* wi = NULL;
+
+   if (!pgmoneta_ends_with(from, ".aes") && compression_from_suffix(from, &compression_type))
+   {
+      return pgmoneta_copy_file(from, to, workers);
+   }
+
+   if (workers != NULL)
+   {
+      if (pgmoneta_create_worker_input(NULL, from, to, 0, workers, &wi))
+      {
+         return 1;
+      }
+
+      if (!pgmoneta_workers_add(workers, do_decrypt_decompress, (void*)wi))
+      {
+         return 0;
+      }
+
+      free(wi);
+   }
+
+   if (pgmoneta_decrypt_decompress_file(from, to))
+   {
+      pgmoneta_log_error("Could not restore %s", from);
+      return 1;
+   }
+
+   return 0;
+}
+
+int
+pgmoneta_compress_encrypt_file(char* from, char* to)
+{
+   struct pipeline_stage* pipeline = NULL;
+   struct pipeline_stage* stage = NULL;
+   struct configuration* config;
+
+   config = (struct configuration*)shmem;
+
+   /* Files that already are archives are only encrypted */
+   if (!pgmoneta_is_file_archive(from))
+   {
+      if (pgmoneta_is_wal_segment(from))
+      {
+         if (pgmoneta_pipeline_create_wal_encoder(&stage))
+         {
+            goto error;
+         }
+         pgmoneta_pipeline_append(&pipeline, stage);
+      }
+
+      if (pgmoneta_pipeline_create_compressor(config->compression_type, config->compression_level, &stage))
+      {
+         goto error;
+      }
+      pgmoneta_pipeline_append(&pipeline, stage);
+   }
+
+   if (pgmoneta_pipeline_create_cipher(true, &stage))
+   {
+      goto error;
+   }
+   pgmoneta_pipeline_append(&pipeline, stage);
+
+   if (pgmoneta_pipeline_create_file_writer(to, &stage))
+   {
+      goto error;
+   }
+   pgmoneta_pipeline_append(&pipeline, stage);
+
+   if (pgmoneta_pipeline_file(pipeline, from))
+   {
+      pgmoneta_log_error("Pipeline: Could not compress and encrypt %s", from);
+      pgmoneta_pipeline_destroy(pipeline);
+      pgmoneta_delete_file(to, NULL);
+      return 1;
+   }
+
+   pgmoneta_pipeline_destroy(pipeline);
+   pgmoneta_delete_file(from, NULL);
+
+   return 0;
+
+error:
+
+   pgmoneta_pipeline_destroy(pipeline);
+
+   return 1;
+}
+
+int
+pgmoneta_store_file(char* from)
+{
+   char* to = NULL;
+   struct pipeline_stage* pipeline = NULL;
+   struct pipeline_stage* stage = NULL;
+   struct configuration* config;
+
+   config = (struct configuration*)shmem;
+
+   to = pgmoneta_append(NULL, from);
+
+   if (config->compression_type != COMPRESSION_NONE && !pgmoneta_is_file_archive(from))
+   {
+      if (pgmoneta_is_wal_segment(from))
+      {
+         if (pgmoneta_pipeline_create_wal_encoder(&stage))
+         {
+            goto error;
+         }
+         pgmoneta_pipeline_append(&pipeline, stage);
+      }
+
+      if (pgmoneta_pipeline_create_compressor(config->compression_type, config->compression_level, &stage))
+      {
+         goto error;
+      }
+      pgmoneta_pipeline_append(&pipeline, stage);
+
+      to = pgmoneta_append(to, pgmoneta_compression_suffix(config->compression_type));
+   }
+
+   if (config->encryption != ENCRYPTION_NONE && !pgmoneta_ends_with(from, ".aes"))
+   {
+      if (pgmoneta_pipeline_create_cipher(true, &stage))
+      {
+         goto error;
+      }
+      pgmoneta_pipeline_append(&pipeline, stage);
+
+      to = pgmoneta_append(to, ".aes");
+   }
+
+   if (pipeline == NULL)
+   {
+      free(to);
+      return 0;
+   }
+
+   if (pgmoneta_pipeline_create_file_writer(to, &stage))
+   {
+      goto error;
+   }
+   pgmoneta_pipeline_append(&pipeline, stage);
+
+   if (pgmoneta_pipeline_file(pipeline, from))
+   {
+      pgmoneta_log_error("Pipeline: Could not store %s", from);
+      pgmoneta_pipeline_destroy(pipeline);
+      pgmoneta_delete_file(to, NULL);
+      free(to);
+      return 1;
+   }
+
+   pgmoneta_pipeline_destroy(pipeline);
+   pgmoneta_delete_file(from, NULL);
+   free(to);
+
+   return 0;
+
+error:
+
+   pgmoneta_pipeline_destroy(pipeline);
+   free(to);
+
+   return 1;
+}
+
+int
+pgmoneta_compress_encrypt_data(char* d, struct workers* workers)
+{
+   char* from = NULL;
+   char* to = NULL;
+   char* suffix = NULL;
+   int result = 0;
+   DIR* dir;
+   struct dirent* entry;
+   struct configuration* config;
+
+   config = (struct configuration*)shmem;
+
+   if (!(dir = opendir(d)))
+   {
+      return 1;
+   }
+
+   suffix = pgmoneta_compression_suffix(config->compression_type);
+
+   while ((entry = readdir(dir)) != NULL)
+   {
+      if (entry->d_type == DT_DIR)
+      {
+         char path[1024];
+
+         if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0 || strcmp(entry->d_name, "pg_tblspc") == 0)
+         {
+            continue;
+         }
+
+         if (snprintf(path, sizeof(path), "%s/%s", d, entry->d_name) >= (int)sizeof(path) ||
+             pgmoneta_compress_encrypt_data(path, workers))
+         {
+            result = 1;
+         }
+      }
+      else if (entry->d_type == DT_REG)
+      {
+         if (!pgmoneta_ends_with(entry->d_name, ".aes"))
+         {
+            struct worker_input* wi = NULL;
+
+            from = NULL;
+
+            from = pgmoneta_append(from, d);
+            from = pgmoneta_append(from, "/");
+            from = pgmoneta_append(from, entry->d_name);
+
+            to = NULL;
+
+            to = pgmoneta_append(to, d);
+            to = pgmoneta_append(to, "/");
+            to = pgmoneta_append(to, entry->d_name);
+            if (!pgmoneta_is_file_archive(entry->d_name))
+            {
+               to = pgmoneta_append(to, suffix);
+            }
+            to = pgmoneta_append(to, ".aes");
+
+            if (pgmoneta_create_worker_input(NULL, from, to, 0, workers, &wi))
+            {
+               result = 1;
+            }
+            else if (workers == NULL || pgmoneta_workers_add(workers, do_compress_encrypt, (void*)wi))
+            {
+               free(wi);
+
+               if (pgmoneta_compress_encrypt_file(from, to))
+               {
+                  pgmoneta_log_error("Could not compress and encrypt %s", from);
+                  result = 1;
+               }
+            }
+
+            free(from);
+            free(to);
+         }
+      }
+   }
+
+   closedir(dir);
+   return result;
+}
+
+int
+pgmoneta_compress_encrypt_tablespaces(char* root, struct workers* workers)
+{
+   int result = 0;
+   DIR* dir;
+   struct dirent* entry;
+
+   if (!(dir = opendir(root)))
+   {
+      return 1;
+   }
+
+   while ((entry = readdir(dir)) != NULL)
+   {
+      if (entry->d_type == DT_DIR)
+      {
+         char path[1024];
+
+         if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0 || strcmp(entry->d_name, "data") == 0)
+         {
+            continue;
+         }
+
+         if (snprintf(path, sizeof(path), "%s/%s", root, entry->d_name) >= (int)sizeof(path) ||
+             pgmoneta_compress_encrypt_data(path, workers))
+         {
+            result = 1;
+         }
+      }
+   }
+
+   closedir(dir);
+   return result;
+}
+
+static void
+do_compress_encrypt(void* arg)
+{
+   struct worker_input* wi = NULL;
+
+   wi = (struct worker_input*)arg;
+
+   if (pgmoneta_compress_encrypt_file(wi->from, wi->to))
+   {
+      pgmoneta_log_error("Could not compress and encrypt %s", wi->from);
+      if (wi->workers != NULL)
+      {
+         atomic_store(&wi->workers->outcome, false);
+      }
+   }
+
+   free(wi);
+}
+
+static void
+do_decrypt_decompress(void* arg)
+{
+   struct worker_input* wi = NULL;
+
+   wi = (struct worker_input*)arg;
+
+   if (pgmoneta_decrypt_decompress_file(wi->from, wi->to))
+   {
+      pgmoneta_log_error("Could not restore %s", wi->from);
+      if (wi->workers != NULL)
+      {
+         atomic_store(&wi->workers->outcome, false);
+      }
+   }
+
+   free(wi);
+}
+
+static int
+gzip_process(struct pipeline_stage* stage, void* buffer, size_t size, bool last)
+{
+   struct compressor* c = (struct compressor*)stage->state;
+   uint64_t start;
+   int ret;
+
+   c->gzip.next_in = (Bytef*)buffer;
+   c->gzip.avail_in = (uInt)size;
+
+   for (;;)
+   {
+      c->gzip.next_out = c->out;
+      c->gzip.avail_out = (uInt)c->out_size;
+
+      start = pgmoneta_prometheus_timer();
+      ret = deflate(&c->gzip, last ? Z_FINISH : Z_NO_FLUSH);
+      pgmoneta_prometheus_observe(HISTOGRAM_COMPRESS, start);
+      if (ret == Z_STREAM_ERROR)
+      {
+         pgmoneta_log_error("Pipeline: GZIP compression failed");
+         return 1;
+      }
+
+      if (emit(stage, c->out, c->out_size - c->gzip.avail_out))
+      {
+         return 1;
+      }
+
+      if (last ? ret == Z_STREAM_END : c->gzip.avail_out != 0)
+      {
+         break;
+      }
+   }
+
+   return last ? pgmoneta_pipeline_write(stage->next, NULL, 0, true) : 0;
+}
+
+static int
+bzip2_process(struct pipeline_stage* stage, void* buffer, size_t size, bool last)
+{
+   struct compressor* c = (struct compressor*)stage->state;
+   uint64_t start;
+   int ret;
+
+   c->bzip2.next_in = (char*)buffer;
+   c->bzip2.avail_in = (unsigned int)size;
+
+   for (;;)
+   {
+      c->bzip2.next_out = (char*)c->out;
+      c->bzip2.avail_out = (unsigned int)c->out_size;
+
+      start = pgmoneta_prometheus_timer();
+      ret = BZ2_bzCompress(&c->bzip2, last ? BZ_FINISH : BZ_RUN);
+      pgmoneta_prometheus_observe(HISTOGRAM_COMPRESS, start);
+      if (ret < 0)
+      {
+         pgmoneta_log_error("Pipeline: BZip2 compression failed: %d", ret);
+         return 1;
+      }
+
+      if (emit(stage, c->out, c->out_size - c->bzip2.avail_out))
+      {
+         return 1;
+      }
+
+      if (last ? ret == BZ_STREAM_END : c->bzip2.avail_in == 0)
+      {
+         break;
+      }
+   }
+
+   return last ? pgmoneta_pipeline_write(stage->next, NULL, 0, true) : 0;
+}
+
+static int
+zstd_process(struct pipeline_stage* stage, void* buffer, size_t size, bool last)
+{
+   struct compressor* c = (struct compressor*)stage->state;
+   ZSTD_inBuffer input = {buffer, size, 0};
+   size_t remaining;
+   uint64_t start;
+   bool finished = false;
+
+   while (!finished)
+   {
+      ZSTD_outBuffer output = {c->out, c->out_size, 0};
+
+      start = pgmoneta_prometheus_timer();
+      remaining = ZSTD_compressStream2(c->zstd, &output, &input, last ? ZSTD_e_end : ZSTD_e_continue);
+      pgmoneta_prometheus_observe(HISTOGRAM_COMPRESS, start);
+      if (ZSTD_isError(remaining))
+      {
+         pgmoneta_log_error("Pipeline: Zstandard compression failed: %s", ZSTD_getErrorName(remaining));
+         return 1;
+      }
+
+      if (emit(stage, c->out, output.pos))
+      {
+         return 1;
+      }
+
+      finished = last ? remaining == 0 : input.pos == input.size;
+   }
+
+   return last ? pgmoneta_pipeline_write(stage->next, NULL, 0, true) : 0;
+}
+
+static int
+lz4_process(struct pipeline_stage* stage, void* buffer, size_t size, bool last)
+{
+   struct compressor* c = (struct compressor*)stage->state;
+   char* in = (char*)buffer;
+   size_t n;
+
+   /* Same framing as lz4_compress(): blocks of BLOCK_BYTES prefixed by their compressed size */
+   while (size > 0)
+   {
+      n = MIN(size, (size_t)(BLOCK_BYTES) - c->lz4_fill);
+
+      memcpy(&c->lz4_in[c->lz4_index][c->lz4_fill], in, n);
+      c->lz4_fill += n;
+      in += n;
+      size -= n;
+
+      if (c->lz4_fill == (size_t)(BLOCK_BYTES) && lz4_block(stage))
+      {
+         return 1;
+      }
+   }
+
+   if (last)
+   {
+      if (c->lz4_fill > 0 && lz4_block(stage))
+      {
+         return 1;
+      }
+
+      return pgmoneta_pipeline_write(stage->next, NULL, 0, true);
+   }
+
+   return 0;
+}
+
+static int
+lz4_block(struct pipeline_stage* stage)
+{
+   struct compressor* c = (struct compressor*)stage->state;
+   uint64_t start;
+   int compression;
+
+   start = pgmoneta_prometheus_timer();
+   compression = LZ4_compress_fast_continue(c->lz4, c->lz4_in[c->lz4_index], (char*)c->out + sizeof(int),
+                                            (int)c->lz4_fill, (int)(c->out_size - sizeof(int)), 1);
+   pgmoneta_prometheus_observe(HISTOGRAM_COMPRESS, start);
+   if (compression <= 0)
+   {
+      pgmoneta_log_error("Pipeline: LZ4 compression failed");
+      return 1;
+   }
+
+   memcpy(c->out, &compression, sizeof(int));
+
+   if (emit(stage, c->out, sizeof(int) + (size_t)compression))
+   {
+      return 1;
+   }
+
+   c->lz4_index = (c->lz4_index + 1) % 2;
+   c->lz4_fill = 0;
+
+   return 0;
+}
+
+static void
+compressor_destroy(struct pipeline_stage* stage)
+{
+   struct compressor* c = (struct compressor*)stage->state;
+
+   if (c == NULL)
+   {
+      return;
+   }
+
+   switch (c->type)
+   {
+      case COMPRESSION_CLIENT_GZIP:
+         deflateEnd(&c->gzip);
+         break;
+      case COMPRESSION_CLIENT_ZSTD:
+         ZSTD_freeCCtx(c->zstd);
+         break;
+      case COMPRESSION_CLIENT_LZ4:
+         LZ4_freeStream(c->lz4);
+         break;
+      case COMPRESSION_CLIENT_BZIP2:
+         BZ2_bzCompressEnd(&c->bzip2);
+         break;
+      default:
+         break;
+   }
+
+   free(c->out);
+   free(c);
+
+   stage->state = NULL;
+}
+
+static int
+gunzip_process(struct pipeline_stage* stage, void* buffer, size_t size, bool last)
+{
+   struct decompressor* d = (struct decompressor*)stage->state;
+   uint64_t start;
+   int ret;
+
+   d->gzip.next_in = (Bytef*)buffer;
+   d->gzip.avail_in = (uInt)size;
+
+   while (!d->finished && (d->gzip.avail_in > 0 || last))
+   {
+      d->gzip.next_out = d->out;
+      d->gzip.avail_out = (uInt)d->out_size;
+
+      start = pgmoneta_prometheus_timer();
+      ret = inflate(&d->gzip, Z_NO_FLUSH);
+      pgmoneta_prometheus_observe(HISTOGRAM_DECOMPRESS, start);
+      if (ret != Z_OK && ret != Z_STREAM_END && ret != Z_BUF_ERROR)
+      {
+         pgmoneta_log_error("Pipeline: GZIP decompression failed: %d", ret);
+         return 1;
+      }
+
+      if (emit(stage, d->out, d->out_size - d->gzip.avail_out))
+      {
+         return 1;
+      }
+
+      d->finished = ret == Z_STREAM_END;
+
+      if (d->gzip.avail_out != 0 && (d->gzip.avail_in == 0 || ret == Z_BUF_ERROR))
+      {
+         break;
+      }
+   }
+
+   if (last)
+   {
+      if (!d->finished)
+      {
+         pgmoneta_log_error("Pipeline: GZIP stream is truncated");
+         return 1;
+      }
+
+      return pgmoneta_pipeline_write(stage->next, NULL, 0, true);
+   }
+
+   return 0;
+}
+
+static int
+bunzip2_process(struct pipeline_stage* stage, void* buffer, size_t size, bool last)
+{
+   struct decompressor* d = (struct decompressor*)stage->state;
+   uint64_t start;
+   int ret;
+
+   d->bzip2.next_in = (char*)buffer;
+   d->bzip2.avail_in = (unsigned int)size;
+
+   while (!d->finished && (d->bzip2.avail_in > 0 || last))
+   {
+      d->bzip2.next_out = (char*)d->out;
+      d->bzip2.avail_out = (unsigned int)d->out_size;
+
+      start = pgmoneta_prometheus_timer();
+      ret = BZ2_bzDecompress(&d->bzip2);
+      pgmoneta_prometheus_observe(HISTOGRAM_DECOMPRESS, start);
+      if (ret != BZ_OK && ret != BZ_STREAM_END)
+      {
+         pgmoneta_log_error("Pipeline: BZip2 decompression failed: %d", ret);
+         return 1;
+      }
+
+      if (emit(stage, d->out, d->out_size - d->bzip2.avail_out))
+      {
+         return 1;
+      }
+
+      d->finished = ret == BZ_STREAM_END;
+
+      if (d->bzip2.avail_out != 0 && d->bzip2.avail_in == 0)
+      {
+         break;
+      }
+   }
+
+   if (last)
+   {
+      if (!d->finished)
+      {
+         pgmoneta_log_error("Pipeline: BZip2 stream is truncated");
+         return 1;
+      }
+
+      return pgmoneta_pipeline_write(stage->next, NULL, 0, true);
+   }
+
+   return 0;
+}
+
+static int
+zstdd_process(struct pipeline_stage* stage, void* buffer, size_t size, bool last)
+{
+   struct decompressor* d = (struct decompressor*)stage->state;
+   ZSTD_inBuffer input = {buffer, size, 0};
+   size_t remaining = 0;
+   size_t position;
+   uint64_t start;
+   bool flushed = false;
+
+   while (input.pos < input.size || !flushed)
+   {
+      ZSTD_outBuffer output = {d->out, d->out_size, 0};
+
+      position = input.pos;
+      start = pgmoneta_prometheus_timer();
+      remaining = ZSTD_decompressStream(d->zstd, &output, &input);
+      pgmoneta_prometheus_observe(HISTOGRAM_DECOMPRESS, start);
+      if (ZSTD_isError(remaining))
+      {
+         pgmoneta_log_error("Pipeline: Zstandard decompression failed: %s", ZSTD_getErrorName(remaining));
+         return 1;
+      }
+
+      if (emit(stage, d->out, output.pos))
+      {
+         return 1;
+      }
+
+      /* A frame is complete when a call returns 0, new input starts another frame */
+      if (remaining == 0)
+      {
+         d->finished = true;
+      }
+      else if (input.pos > position)
+      {
+         d->finished = false;
+      }
+
+      /* A full output buffer may still hold data in the context */
+      flushed = output.pos < output.size;
+   }
+
+   if (last)
+   {
+      if (!d->finished)
+      {
+         pgmoneta_log_error("Pipeline: Zstandard stream is truncated");
+         return 1;
+      }
+
+      return pgmoneta_pipeline_write(stage->next, NULL, 0, true);
+   }
+
+   return 0;
+}
+
+static int
+lz4d_process(struct pipeline_stage* stage, void* buffer, size_t size, bool last)
+{
+   struct decompressor* d = (struct decompressor*)stage->state;
+   char* in = (char*)buffer;
+   int compression = 0;
+   int decompression;
+   uint64_t start;
+   size_t frame;
+   size_t n;
+
+   /* Same framing as lz4_compress(): blocks of BLOCK_BYTES prefixed by their compressed size */
+   while (size > 0)
+   {
+      frame = sizeof(int);
+      if (d->lz4_fill >= sizeof(int))
+      {
+         memcpy(&compression, d->lz4_in, sizeof(int));
+         if (compression <= 0 || compression > LZ4_COMPRESSBOUND(BLOCK_BYTES))
+         {
+            pgmoneta_log_error("Pipeline: LZ4 block size %d is invalid", compression);
+            return 1;
+         }
+         frame += (size_t)compression;
+      }
+
+      n = MIN(size, frame - d->lz4_fill);
+
+      memcpy(&d->lz4_in[d->lz4_fill], in, n);
+      d->lz4_fill += n;
+      in += n;
+      size -= n;
+
+      if (d->lz4_fill > sizeof(int) && d->lz4_fill == frame)
+      {
+         start = pgmoneta_prometheus_timer();
+         decompression = LZ4_decompress_safe_continue(&d->lz4, d->lz4_in + sizeof(int), d->lz4_out[d->lz4_index],
+                                                      compression, BLOCK_BYTES);
+         pgmoneta_prometheus_observe(HISTOGRAM_DECOMPRESS, start);
+         if (decompression <= 0)
+         {
+            pgmoneta_log_error("Pipeline: LZ4 decompression failed");
+            return 1;
+         }
+
+         if (emit(stage, d->lz4_out[d->lz4_index], (size_t)decompression))
+         {
+            return 1;
+         }
+
+         d->lz4_index = (d->lz4_index + 1) % 2;
+         d->lz4_fill = 0;
+      }
+   }
+
+   if (last)
+   {
+      if (d->lz4_fill > 0)
+      {
+         pgmoneta_log_error("Pipeline: LZ4 stream is truncated");
+         return 1;
+      }
+
+      return pgmoneta_pipeline_write(stage->next, NULL, 0, true);
+   }
+
+   return 0;
+}
+
+static void
+decompressor_destroy(struct pipeline_stage* stage)
+{
+   struct decompressor* d = (struct decompressor*)stage->state;
+
+   if (d == NULL)
+   {
+      return;
+   }
+
+   switch (d->type)
+   {
+      case COMPRESSION_CLIENT_GZIP:
+         inflateEnd(&d->gzip);
+         break;
+      case COMPRESSION_CLIENT_ZSTD:
+         ZSTD_freeDCtx(d->zstd);
+         break;
+      case COMPRESSION_CLIENT_BZIP2:
+         BZ2_bzDecompressEnd(&d->bzip2);
+         break;
+      default:
+         break;
+   }
+
+   free(d->out);
+   free(d);
+
+   stage->state = NULL;
+}
+
+static int
+compression_from_suffix(char* path, int* compression_type)
+{
+   if (pgmoneta_ends_with(path, ".gz"))
+   {
+      *compression_type = COMPRESSION_CLIENT_GZIP;
+   }
+   else if (pgmoneta_ends_with(path, ".zstd"))
+   {
+      *compression_type = COMPRESSION_CLIENT_ZSTD;
+   }
+   else if (pgmoneta_ends_with(path, ".lz4"))
+   {
+      *compression_type = COMPRESSION_CLIENT_LZ4;
+   }
+   else if (pgmoneta_ends_with(path, ".bz2"))
+   {
+      *compression_type = COMPRESSION_CLIENT_BZIP2;
+   }
+   else
+   {
+      *compression_type = COMPRESSION_NONE;
+      return 1;
+   }
+
+   return 0;
+}
+
+static int
+cipher_process(struct pipeline_stage* stage, void* buffer, size_t size, bool last)
+{
+   struct cipher* c = (struct cipher*)stage->state;
+   unsigned char* in = (unsigned char*)buffer;
+   uint64_t start;
+   size_t n;
+   int outl = 0;
+
+   while (size > 0)
+   {
+      n = MIN(size, (size_t)PIPELINE_BUFFER_SIZE);
+
+      start = pgmoneta_prometheus_timer();
+      if (EVP_CipherUpdate(c->ctx, c->out, &outl, in, (int)n) == 0)
+      {
+         pgmoneta_log_error("EVP_CipherUpdate: failed to process block");
+         return 1;
+      }
+      pgmoneta_prometheus_observe(c->histogram, start);
+
+      if (emit(stage, c->out, (size_t)outl))
+      {
+         return 1;
+      }
+
+      in += n;
+      size -= n;
+   }
+
+   if (last)
+   {
+      if (EVP_CipherFinal_ex(c->ctx, c->out, &outl) == 0)
+      {
+         pgmoneta_log_error("EVP_CipherFinal_ex: failed to process final cipher block");
+         return 1;
+      }
+
+      if (emit(stage, c->out, (size_t)outl))
+      {
+         return 1;
+      }
+
+      return pgmoneta_pipeline_write(stage->next, NULL, 0, true);
+   }
+
+   return 0;
+}
+
+static void
+cipher_destroy(struct pipeline_stage* stage)
+{
+   struct cipher* c = (struct cipher*)stage->state;
+
+   if (c != NULL)
+   {
+      EVP_CIPHER_CTX_free(c->ctx);
+      free(c->out);
+      free(c);
+   }
+
+   stage->state = NULL;
+}
+
+static int
+file_writer_process(struct pipeline_stage* stage, void* buffer, size_t size, bool last)
+{
+   struct file_writer* w = (struct file_writer*)stage->state;
+   char* p = (char*)buffer;
+   unsigned char hash[SHA256_DIGEST_LENGTH];
+   uint64_t start;
+   ssize_t written;
+
+   if (w->sha256 != NULL && size > 0)
+   {
+      SHA256_Update(w->sha256, buffer, size);
+   }
+
+   while (size > 0)
+   {
+      start = pgmoneta_prometheus_timer();
+      written = write(w->fd, p, size);
+      pgmoneta_prometheus_observe(HISTOGRAM_FILE_WRITE, start);
+      if (written < 0)
+      {
+         if (errno == EINTR)
+         {
+            continue;
+         }
+
+         pgmoneta_log_error("Pipeline: Could not write %s: %s", w->path, strerror(errno));
+         return 1;
+      }
+
+      p += written;
+      size -= (size_t)written;
+   }
+
+   if (last)
+   {
+      if (w->sha256 != NULL)
+      {
+         SHA256_Final(&hash[0], w->sha256);
+         pgmoneta_sha256_registry_add(w->path, w->fd, &hash[0]);
+      }
+
+      if (close(w->fd) != 0)
+      {
+         w->fd = -1;
+         pgmoneta_log_error("Pipeline: Could not close %s: %s", w->path, strerror(errno));
+         return 1;
+      }
+      w->fd = -1;
+
+      return pgmoneta_pipeline_write(stage->next, NULL, 0, true);
+   }
+
+   return 0;
+}
+
+static void
+file_writer_destroy(struct pipeline_stage* stage)
+{
+   struct file_writer* w = (struct file_writer*)stage->state;
+
+   if (w != NULL)
+   {
+      if (w->fd != -1)
+      {
+         close(w->fd);
+      }
+      free(w->sha256);
+      free(w);
+   }
+
+   stage->state = NULL;
+}
+
+static int
+wal_codec_create(pipeline_process process, struct pipeline_stage** stage)
+{
+   struct pipeline_stage* s = NULL;
+   struct wal_codec* c = NULL;
+
+   *stage = NULL;
+
+   s = (struct pipeline_stage*)malloc(sizeof(struct pipeline_stage));
+   c = (struct wal_codec*)malloc(sizeof(struct wal_codec));
+
+   if (s == NULL || c == NULL)
+   {
+      goto error;
+   }
+
+   memset(s, 0, sizeof(struct pipeline_stage));
+   memset(c, 0, sizeof(struct wal_codec));
+
+   c->page = (unsigned char*)malloc(WAL_CODEC_MAX_PAGE);
+   c->out = (unsigned char*)malloc(PIPELINE_BUFFER_SIZE);
+
+   if (c->page == NULL || c->out == NULL)
+   {
+      goto error;
+   }
+
+   c->state = WAL_CODEC_START;
+
+   s->state = c;
+   s->process = process;
+   s->destroy = &wal_codec_destroy;
+
+   *stage = s;
+
+   return 0;
+
+error:
+
+   if (c != NULL)
+   {
+      free(c->page);
+      free(c->out);
+   }
+   free(c);
+   free(s);
+
+   return 1;
+}
+
+static int
+wal_encoder_process(struct pipeline_stage* stage, void* buffer, size_t size, bool last)
+{
+   struct wal_codec* c = (struct wal_codec*)stage->state;
+   unsigned char* p = (unsigned char*)buffer;
+   unsigned char header[WAL_CODEC_HEADER_SIZE];
+   unsigned char item[1 + 4];
+   size_t target;
+   size_t n;
+
+   while (size > 0)
+   {
+      if (c->state == WAL_CODEC_RAW)
+      {
+         if (emit(stage, p, size))
+         {
+            return 1;
+         }
+         break;
+      }
+
+      target = c->state == WAL_CODEC_START ? WAL_LONG_HEADER_SIZE : c->page_size;
+      n = MIN(target - c->fill, size);
+
+      memcpy(c->page + c->fill, p, n);
+      c->fill += n;
+      p += n;
+      size -= n;
+
+      if (c->fill < target)
+      {
+         continue;
+      }
+
+      if (c->state == WAL_CODEC_START)
+      {
+         if (wal_codec_start(c))
+         {
+            memcpy(&header[0], WAL_CODEC_MAGIC, 4);
+            header[4] = WAL_CODEC_VERSION;
+            header[5] = 0;
+            header[6] = 0;
+            header[7] = 0;
+            wal_codec_write32(&header[8], (uint32_t)c->page_size);
+
+            if (wal_codec_output(stage, &header[0], sizeof(header)))
+            {
+               return 1;
+            }
+
+            c->state = WAL_CODEC_PAGES;
+         }
+         else
+         {
+            // not a segment, so nothing is encoded
+            c->state = WAL_CODEC_RAW;
+            if (emit(stage, c->page, c->fill))
+            {
+               return 1;
+            }
+            c->fill = 0;
+         }
+      }
+      else
+      {
+         if (wal_encoder_page(stage))
+         {
+            return 1;
+         }
+         c->fill = 0;
+         c->index++;
+      }
+   }
+
+   if (!last)
+   {
+      return 0;
+   }
+
+   if (c->state == WAL_CODEC_START)
+   {
+      if (emit(stage, c->page, c->fill))
+      {
+         return 1;
+      }
+   }
+   else if (c->state == WAL_CODEC_PAGES)
+   {
+      if (wal_encoder_run(stage))
+      {
+         return 1;
+      }
+
+      if (c->fill > 0)
+      {
+         item[0] = WAL_ITEM_TAIL;
+         wal_codec_write32(&item[1], (uint32_t)c->fill);
+         if (wal_codec_output(stage, &item[0], sizeof(item)) ||
+             wal_codec_output(stage, c->page, c->fill))
+         {
+            return 1;
+         }
+      }
+
+      item[0] = WAL_ITEM_END;
+      if (wal_codec_output(stage, &item[0], 1) || wal_codec_flush(stage))
+      {
+         return 1;
+      }
+   }
+
+   c->state = WAL_CODEC_END;
+
+   return pgmoneta_pipeline_write(stage->next, NULL, 0, true);
+}
+
+static int
+wal_encoder_page(struct pipeline_stage* stage)
+{
+   struct wal_codec* c = (struct wal_codec*)stage->state;
+   unsigned char item = WAL_ITEM_PAGE;
+   char kind = WAL_ITEM_PAGE;
+
+   if (c->index > 0)
+   {
+      if (wal_codec_zero(c->page, c->page_size))
+      {
+         kind = WAL_ITEM_ZEROS;
+      }
+      else
+      {
+         // a page without records is only its header, which then becomes zeros
+         wal_codec_transform(c, c->page);
+         if (wal_codec_zero(c->page, c->page_size))
+         {
+            kind = WAL_ITEM_HEADERS;
+         }
+      }
+   }
+
+   if (c->run != kind && wal_encoder_run(stage))
+   {
+      return 1;
+   }
+
+   if (kind != WAL_ITEM_PAGE)
+   {
+      c->run = kind;
+      c->run_length++;
+      return 0;
+   }
+
+   if (wal_codec_output(stage, &item, 1) || wal_codec_output(stage, c->page, c->page_size))
+   {
+      return 1;
+   }
+
+   return 0;
+}
+
+static int
+wal_encoder_run(struct pipeline_stage* stage)
+{
+   struct wal_codec* c = (struct wal_codec*)stage->state;
+   unsigned char item[1 + 4];
+
+   if (c->run_length == 0)
+   {
+      c->run = 0;
+      return 0;
+   }
+
+   item[0] = (unsigned char)c->run;
+   wal_codec_write32(&item[1], c->run_length);
+
+   c->run = 0;
+   c->run_length = 0;
+
+   return wal_codec_output(stage, &item[0], sizeof(item));
+}
+
+static int
+wal_decoder_process(struct pipeline_stage* stage, void* buffer, size_t size, bool last)
+{
+   struct wal_codec* c = (struct wal_codec*)stage->state;
+   unsigned char* p = (unsigned char*)buffer;
+   size_t target;
+   size_t n;
+
+   while (size > 0)
+   {
+      if (c->state == WAL_CODEC_RAW)
+      {
+         if (emit(stage, p, size))
+         {
+            return 1;
+         }
+         break;
+      }
+
+      if (c->state == WAL_CODEC_END)
+      {
+         pgmoneta_log_error("Pipeline: Data after the end of the WAL segment");
+         return 1;
+      }
+
+      target = c->state == WAL_CODEC_START ? WAL_CODEC_HEADER_SIZE : c->need;
+      n = MIN(target - c->fill, size);
+
+      memcpy(c->page + c->fill, p, n);
+      c->fill += n;
+      p += n;
+      size -= n;
+
+      if (c->state == WAL_CODEC_START && c->fill >= 4 && memcmp(c->page, WAL_CODEC_MAGIC, 4))
+      {
+         // stored before the encoding, or not a segment
+         c->state = WAL_CODEC_RAW;
+         if (emit(stage, c->page, c->fill))
+         {
+            return 1;
+         }
+         c->fill = 0;
+         continue;
+      }
+
+      if (c->fill < target)
+      {
+         continue;
+      }
+
+      if (wal_decoder_item(stage))
+      {
+         return 1;
+      }
+      c->fill = 0;
+   }
+
+   if (!last)
+   {
+      return 0;
+   }
+
+   if (c->state == WAL_CODEC_START && (c->fill < 4 || memcmp(c->page, WAL_CODEC_MAGIC, 4)))
+   {
+      if (emit(stage, c->page, c->fill))
+      {
+         return 1;
+      }
+   }
+   else if (c->state != WAL_CODEC_RAW && c->state != WAL_CODEC_END)
+   {
+      pgmoneta_log_error("Pipeline: Truncated WAL segment");
+      return 1;
+   }
+
+   if (wal_codec_flush(stage))
+   {
+      return 1;
+   }
+
+   c->state = WAL_CODEC_END;
+
+   return pgmoneta_pipeline_write(stage->next, NULL, 0, true);
+}
+
+static int
+wal_decoder_item(struct pipeline_stage* stage)
+{
+   struct wal_codec* c = (struct wal_codec*)stage->state;
+   size_t page_size;
+   uint32_t count;
+
+   switch (c->state)
+   {
+      case WAL_CODEC_START:
+         page_size = wal_codec_read32(c->page + 8);
+         if (c->page[4] != WAL_CODEC_VERSION || page_size < 1024 || page_size > WAL_CODEC_MAX_PAGE ||
+             (page_size & (page_size - 1)) != 0)
+         {
+            pgmoneta_log_error("Pipeline: Unsupported WAL encoding");
+            return 1;
+         }
+         c->page_size = page_size;
+         c->state = WAL_CODEC_TAG;
+         c->need = 1;
+         break;
+      case WAL_CODEC_TAG:
+         switch (c->page[0])
+         {
+            case WAL_ITEM_PAGE:
+               c->state = WAL_CODEC_PAGE;
+               c->need = c->page_size;
+               break;
+            case WAL_ITEM_HEADERS:
+            case WAL_ITEM_ZEROS:
+               if (c->index == 0)
+               {
+                  goto corrupt;
+               }
+               c->run = (char)c->page[0];
+               c->state = WAL_CODEC_COUNT;
+               c->need = 4;
+               break;
+            case WAL_ITEM_TAIL:
+               c->state = WAL_CODEC_LENGTH;
+               c->need = 4;
+               break;
+            case WAL_ITEM_END:
+               c->state = WAL_CODEC_END;
+               break;
+            default:
+               goto corrupt;
+         }
+         break;
+      case WAL_CODEC_COUNT:
+         count = wal_codec_read32(c->page);
+         if (count > c->segment_size / c->page_size - c->index)
+         {
+            goto corrupt;
+         }
+         for (uint32_t i = 0; i < count; i++)
+         {
+            memset(c->page, 0, c->page_size);
+            if (c->run == WAL_ITEM_HEADERS)
+            {
+               wal_codec_transform(c, c->page);
+            }
+            if (wal_codec_output(stage, c->page, c->page_size))
+            {
+               return 1;
+            }
+            c->index++;
+         }
+         c->state = WAL_CODEC_TAG;
+         c->need = 1;
+         break;
+      case WAL_CODEC_LENGTH:
+         c->need = wal_codec_read32(c->page);
+         if (c->need == 0 || c->need >= c->page_size)
+         {
+            goto corrupt;
+         }
+         c->state = WAL_CODEC_TAIL;
+         break;
+      case WAL_CODEC_PAGE:
+         if (c->index == 0)
+         {
+            if (!wal_codec_start(c))
+            {
+               goto corrupt;
+            }
+         }
+         else if (c->index >= c->segment_size / c->page_size)
+         {
+            goto corrupt;
+         }
+         else
+         {
+            wal_codec_transform(c, c->page);
+         }
+         if (wal_codec_output(stage, c->page, c->page_size))
+         {
+            return 1;
+         }
+         c->index++;
+         c->state = WAL_CODEC_TAG;
+         c->need = 1;
+         break;
+      case WAL_CODEC_TAIL:
+         if (wal_codec_output(stage, c->page, c->need))
+         {
+            return 1;
+         }
+         c->state = WAL_CODEC_TAG;
+         c->need = 1;
+         break;
+      default:
+         goto corrupt;
+   }
+
+   return 0;
+
+corrupt:
+
+   pgmoneta_log_error("Pipeline: Corrupted WAL segment");
+
+   return 1;
+}
+
+static void
+wal_codec_destroy(struct pipeline_stage* stage)
+{
+   struct wal_codec* c = (struct wal_codec*)stage->state;
+
+   if (c != NULL)
+   {
+      free(c->page);
+      free(c->out);
+      free(c);
+   }
+
+   stage->state = NULL;
+}
+
+static bool
+wal_codec_start(struct wal_codec* c)
+{
+   uint16_t info;
+   uint32_t segment_size;
+   uint32_t block_size;
+   uint64_t address = 0;
+
+   info = (uint16_t)(c->page[WAL_PAGE_INFO] | (c->page[WAL_PAGE_INFO + 1] << 8));
+   segment_size = wal_codec_read32(c->page + WAL_PAGE_SEGMENT_SIZE);
+   block_size = wal_codec_read32(c->page + WAL_PAGE_BLOCK_SIZE);
+   for (int i = 7; i >= 0; i--)
+   {
+      address = (address << 8) | c->page[WAL_PAGE_ADDRESS + i];
+   }
+
+   if (!(info & WAL_LONG_HEADER) ||
+       block_size < 1024 || block_size > WAL_CODEC_MAX_PAGE || (block_size & (block_size - 1)) != 0 ||
+       segment_size < 1024 * 1024 || segment_size > 1024 * 1024 * 1024 || (segment_size & (segment_size - 1)) != 0 ||
+       address % segment_size != 0)
+   {
+      return false;
+   }
+
+   if (c->page_size != 0 && c->page_size != block_size)
+   {
+      return false;
+   }
+
+   // every page repeats the magic, the timeline and mostly the info of the first one
+   info &= ~(WAL_LONG_HEADER | WAL_FIRST_IS_CONTRECORD);
+
+   memcpy(&c->prefix[0], c->page, sizeof(c->prefix));
+   c->prefix[WAL_PAGE_INFO] = (unsigned char)(info & 0xFF);
+   c->prefix[WAL_PAGE_INFO + 1] = (unsigned char)(info >> 8);
+
+   c->page_size = block_size;
+   c->address = address;
+   c->segment_size = segment_size;
+
+   return true;
+}
+
+static void
+wal_codec_transform(struct wal_codec* c, unsigned char* page)
+{
+   uint64_t address = c->address + c->index * c->page_size;
+
+   // applying the same mask again restores the page
+   for (int i = 0; i < (int)sizeof(c->prefix); i++)
+   {
+      page[i] ^= c->prefix[i];
+   }
+
+   for (int i = 0; i < 8; i++)
+   {
+      page[WAL_PAGE_ADDRESS + i] ^= (unsigned char)(address >> (8 * i));
+   }
+}
+
+static bool
+wal_codec_zero(unsigned char* data, size_t size)
+{
+   return data[0] == 0 && memcmp(data, data + 1, size - 1) == 0;
+}
+
+static int
+wal_codec_output(struct pipeline_stage* stage, void* data, size_t size)
+{
+   struct wal_codec* c = (struct wal_codec*)stage->state;
+   unsigned char* p = (unsigned char*)data;
+   size_t n;
+
+   while (size > 0)
+   {
+      n = MIN(PIPELINE_BUFFER_SIZE - c->out_fill, size);
+
+      memcpy(c->out + c->out_fill, p, n);
+      c->out_fill += n;
+      p += n;
+      size -= n;
+
+      if (c->out_fill == PIPELINE_BUFFER_SIZE && wal_codec_flush(stage))
+      {
+         return 1;
+      }
+   }
+
+   return 0;
+}
+
+static int
+wal_codec_flush(struct pipeline_stage* stage)
+{
+   struct wal_codec* c = (struct wal_codec*)stage->state;
+   size_t n = c->out_fill;
+
+   c->out_fill = 0;
+
+   return emit(stage, c->out, n);
+}
+
+static uint32_t
+wal_codec_read32(unsigned char* data)
+{
+   return (uint32_t)data[0] | ((uint32_t)data[1] << 8) | ((uint32_t)data[2] << 16) | ((uint32_t)data[3] << 24);
+}
+
+static void
+wal_codec_write32(unsigned char* data, uint32_t value)
+{
+   data[0] = (unsigned char)(value & 0xFF);
+   data[1] = (unsigned char)((value >> 8) & 0xFF);
+   data[2] = (unsigned char)((value >> 16) & 0xFF);
+   data[3] = (unsigned char)((value >> 24) & 0xFF);
+}
+
+static int
+tar_extractor_process(struct pipeline_stage* stage, void* buffer, size_t size, bool last)
+{
+   struct tar_extractor* t = (struct tar_extractor*)stage->state;
+   char* p = (char*)buffer;
+   uint64_t start;
+   uint64_t write_start;
+   ssize_t written;
+   size_t n;
+
+   start = pgmoneta_prometheus_timer();
+
+   while (size > 0 && !t->end)
+   {
+      if (t->remaining > 0)
+      {
+         n = MIN(size, t->remaining);
+
+         if (t->fd != -1)
+         {
+            write_start = pgmoneta_prometheus_timer();
+            written = write(t->fd, p, n);
+            pgmoneta_prometheus_observe(HISTOGRAM_FILE_WRITE, write_start);
+
+            if (written < 0)
+            {
+               if (errno == EINTR)
+               {
+                  continue;
+               }
+
+               pgmoneta_log_error("Pipeline: Could not write %s: %s", &t->path[0], strerror(errno));
+               return 1;
+            }
+
+            n = (size_t)written;
+
+            if (t->sha256 != NULL)
+            {
+               SHA256_Update(t->sha256, p, n);
+            }
+         }
+         else if (t->meta != NULL)
+         {
+            memcpy(t->meta + t->meta_fill, p, n);
+            t->meta_fill += n;
+         }
+
+         p += n;
+         size -= n;
+         t->remaining -= n;
+
+         if (t->remaining == 0 && tar_member_done(t))
+         {
+            return 1;
+         }
+      }
+      else if (t->padding > 0)
+      {
+         n = MIN(size, t->padding);
+
+         p += n;
+         size -= n;
+         t->padding -= n;
+      }
+      else
+      {
+         n = MIN(size, TAR_BLOCK_SIZE - t->header_fill);
+
+         memcpy(&t->header[t->header_fill], p, n);
+         t->header_fill += n;
+         p += n;
+         size -= n;
+
+         if (t->header_fill == TAR_BLOCK_SIZE)
+         {
+            t->header_fill = 0;
+
+            if (tar_header(t))
+            {
+               return 1;
+            }
+         }
+      }
+   }
+
+   pgmoneta_prometheus_observe(HISTOGRAM_TAR_EXTRACT, start);
+
+   if (last)
+   {
+      /* PostgreSQL 15+ leaves out the end of archive blocks, so only a member cut short is an error */
+      if (t->remaining > 0 || t->header_fill > 0)
+      {
+         pgmoneta_log_error("Pipeline: The tar stream for %s is truncated", &t->directory[0]);
+         return 1;
+      }
+
+      return pgmoneta_pipeline_write(stage->next, NULL, 0, true);
+   }
+
+   return 0;
+}
+
+static void
+tar_extractor_destroy(struct pipeline_stage* stage)
+{
+   struct tar_extractor* t = (struct tar_extractor*)stage->state;
+
+   if (t != NULL)
+   {
+      if (t->fd != -1)
+      {
+         close(t->fd);
+      }
+      free(t->meta);
+      free(t->long_name);
+      free(t->long_link);
+      free(t->sha256);
+      free(t);
+   }
+
+   stage->state = NULL;
+}
+
+static int
+tar_header(struct tar_extractor* t)
+{
+   char* h = &t->header[0];
+   char name[MAX_PATH];
+   char linkname[MAX_PATH];
+   char target[MAX_PATH];
+   char* slash = NULL;
+   unsigned long checksum = 0;
+   size_t size;
+   mode_t mode;
+   char type;
+   bool zero = true;
+
+   for (int i = 0; i < TAR_BLOCK_SIZE; i++)
+   {
+      if (h[i] != 0)
+      {
+         zero = false;
+      }
+
+      /* The checksum field itself counts as spaces */
+      checksum += (i >= 148 && i < 156) ? ' ' : (unsigned char)h[i];
+   }
+
+   if (zero)
+   {
+      t->end = true;
+      return 0;
+   }
+
+   if (checksum != tar_number(h + 148, 8))
+   {
+      pgmoneta_log_error("Pipeline: Invalid tar header in %s", &t->directory[0]);
+      goto error;
+   }
+
+   size = tar_number(h + 124, 12);
+   mode = (mode_t)tar_number(h + 100, 8) & 0777;
+   type = h[156];
+
+   t->remaining = size;
+   t->padding = (TAR_BLOCK_SIZE - size % TAR_BLOCK_SIZE) % TAR_BLOCK_SIZE;
+
+   if (type == 'L' || type == 'K')
+   {
+      if (size >= MAX_PATH)
+      {
+         pgmoneta_log_error("Pipeline: Tar member name too long in %s", &t->directory[0]);
+         goto error;
+      }
+
+      t->meta = (char*)malloc(size + 1);
+      if (t->meta == NULL)
+      {
+         goto error;
+      }
+      memset(t->meta, 0, size + 1);
+      t->meta_fill = 0;
+      t->meta_type = type;
+
+      return size == 0 ? tar_member_done(t) : 0;
+   }
+
+   memset(&name[0], 0, sizeof(name));
+   memset(&linkname[0], 0, sizeof(linkname));
+
+   if (t->long_name != NULL)
+   {
+      snprintf(&name[0], sizeof(name), "%s", t->long_name);
+   }
+   else if (!strncmp(h + 257, "ustar", 5) && h[345] != '\0')
+   {
+      snprintf(&name[0], sizeof(name), "%.155s/%.100s", h + 345, h);
+   }
+   else
+   {
+      snprintf(&name[0], sizeof(name), "%.100s", h);
+   }
+
+   if (t->long_link != NULL)
+   {
+      snprintf(&linkname[0], sizeof(linkname), "%s", t->long_link);
+   }
+   else
+   {
+      snprintf(&linkname[0], sizeof(linkname), "%.100s", h + 157);
+   }
+
+   free(t->long_name);
+   t->long_name = NULL;
+   free(t->long_link);
+   t->long_link = NULL;
+
+   if (!tar_safe_name(&name[0]))
+   {
+      pgmoneta_log_error("Pipeline: Unsafe tar member %s in %s", &name[0], &t->directory[0]);
+      goto error;
+   }
+
+   memset(&t->path[0], 0, sizeof(t->path));
+   if (snprintf(&t->path[0], sizeof(t->path), "%s%s", &t->directory[0], &name[0]) >= (int)sizeof(t->path))
+   {
+      pgmoneta_log_error("Pipeline: Tar member name too long in %s", &t->directory[0]);
+      goto error;
+   }
+
+   switch (type)
+   {
+      case '0':
+      case '\0':
+      case '7':
+         t->fd = open(&t->path[0], O_WRONLY | O_CREAT | O_TRUNC, mode != 0 ? mode : 0600);
+         if (t->fd == -1 && errno == ENOENT)
+         {
+            slash = strrchr(&t->path[0], '/');
+            *slash = '\0';
+            pgmoneta_mkdir(&t->path[0]);
+            *slash = '/';
+
+            t->fd = open(&t->path[0], O_WRONLY | O_CREAT | O_TRUNC, mode != 0 ? mode : 0600);
+         }
+
+         if (t->fd == -1)
+         {
+            pgmoneta_log_error("Pipeline: Could not open %s: %s", &t->path[0], strerror(errno));
+            goto error;
+         }
+
+         if (t->sha256 != NULL)
+         {
+            SHA256_Init(t->sha256);
+         }
+
+         return size == 0 ? tar_member_done(t) : 0;
+      case '5':
+         if (pgmoneta_mkdir(&t->path[0]))
+         {
+            pgmoneta_log_error("Pipeline: Could not create %s: %s", &t->path[0], strerror(errno));
+            goto error;
+         }
+         break;
+      case '2':
+         unlink(&t->path[0]);
+         if (symlink(&linkname[0], &t->path[0]))
+         {
+            pgmoneta_log_error("Pipeline: Could not link %s: %s", &t->path[0], strerror(errno));
+            goto error;
+         }
+         break;
+      case '1':
+         if (!tar_safe_name(&linkname[0]))
+         {
+            pgmoneta_log_error("Pipeline: Unsafe tar link %s in %s", &linkname[0], &t->directory[0]);
+            goto error;
+         }
+
+         memset(&target[0], 0, sizeof(target));
+         if (snprintf(&target[0], sizeof(target), "%s%s", &t->directory[0], &linkname[0]) >= (int)sizeof(target))
+         {
+            pgmoneta_log_error("Pipeline: Tar link name too long in %s", &t->directory[0]);
+            goto error;
+         }
+
+         unlink(&t->path[0]);
+         if (link(&target[0], &t->path[0]))
+         {
+            pgmoneta_log_error("Pipeline: Could not link %s: %s", &t->path[0], strerror(errno));
+            goto error;
+         }
+         break;
+      default:
+         /* PAX headers and special files carry nothing a backup needs, skip their data */
+         pgmoneta_log_debug("Pipeline: Skipping tar member %s of type %c", &name[0], type);
+         break;
+   }
+
+   return 0;
+
+error:
+
+   errno = 0;
+
+   return 1;
+}
+
+static int
+tar_member_done(struct tar_extractor* t)
+{
+   unsigned char hash[SHA256_DIGEST_LENGTH];
+
+   if (t->meta != NULL)
+   {
+      if (t->meta_type == 'L')
+      {
+         free(t->long_name);
+         t->long_name = t->meta;
+      }
+      else
+      {
+         free(t->long_link);
+         t->long_link = t->meta;
+      }
+
+      t->meta = NULL;
+      t->meta_fill = 0;
+
+      return 0;
+   }
+
+   if (t->fd != -1)
+   {
+      if (t->sha256 != NULL)
+      {
+         SHA256_Final(&hash[0], t->sha256);
+         pgmoneta_sha256_registry_add(&t->path[0], t->fd, &hash[0]);
+      }
+
+      if (close(t->fd) != 0)
+      {
+         t->fd = -1;
+         pgmoneta_log_error("Pipeline: Could not close %s: %s", &t->path[0], strerror(errno));
+         return 1;
+      }
+      t->fd = -1;
+
+      if (t->completed != NULL)
+      {
+         t->completed(&t->path[0], t->data);
+      }
+   }
+
+   return 0;
+}
+
+static size_t
+tar_number(char* field, size_t length)
+{
+   size_t value = 0;
+   size_t i = 0;
+
+   /* GNU base-256 encoding, used by PostgreSQL for files of 8GB and more */
+   if ((unsigned char)field[0] & 0x80)
+   {
+      value = (unsigned char)field[0] & 0x7F;
+
+      for (i = 1; i < length; i++)
+      {
+         value = (value << 8) | (unsigned char)field[i];
+      }
+
+      return value;
+   }
+
+   while (i < length && field[i] == ' ')
+   {
+      i++;
+   }
+
+   while (i < length && field[i] >= '0' && field[i] <= '7')
+   {
+      value = (value * 8) + (size_t)(field[i] - '0');
+      i++;
+   }
+
+   return value;
+}
+
+static bool
+tar_safe_name(char* name)
+{
+   char* p = name;
+
+   if (*name == '\0' || *name == '/')
+   {
+      return false;
+   }
+
+   while (p != NULL)
+   {
+      if (!strncmp(p, "..", 2) && (p[2] == '/' || p[2] == '\0'))
+      {
+         return false;
+      }
+
+      p = strchr(p, '/');
+      if (p != NULL)
+      {
+         p++;
+      }
+   }
+
+   return true;
+}
+
+static int
+emit(struct pipeline_stage* stage, void* buffer, size_t size)
+{
+   if (size == 0)
+   {
+      return 0;
+   }
+
+   return pgmoneta_pipeline_write(stage->next, buffer, size, false);
+}
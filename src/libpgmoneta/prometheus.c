@@ -28,6 +28,7 @@
 
 /* pgmoneta */
 #include <pgmoneta.h>
+#include <catalog.h>
 #include <info.h>
 #include <logging.h>
 #include <memory.h>
@@ -39,11 +40,15 @@
 #include <wal.h>
 
 /* system */
+#include <errno.h>
 #include <ev.h>
+#include <stdatomic.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <strings.h>
 #include <unistd.h>
+#include <zlib.h>
 #include <sys/types.h>
 
 #define CHUNK_SIZE 32768
@@ -59,18 +64,59 @@ static int home_page(int client_fd);
 static int metrics_page(int client_fd);
 static int bad_request(int client_fd);
 
-static void general_information(int client_fd);
-static void backup_information(int client_fd);
-static void size_information(int client_fd);
+static void home_information(char** body);
+
+static void general_information(char** body);
+static void backup_information(char** body);
+static void size_information(char** body);
+static void histogram_information(char** body);
+
+static int histogram_bucket(uint64_t value);
+static uint64_t histogram_bound(int bucket);
 
 static int send_chunk(int client_fd, char* data);
 
-static bool is_metrics_cache_configured(void);
-static bool is_metrics_cache_valid(void);
-static bool metrics_cache_append(char* data);
-static bool metrics_cache_finalize(void);
 static size_t metrics_cache_size_to_alloc(void);
-static void metrics_cache_invalidate(void);
+static int gzip_body(char* body, size_t length, size_t max, char** gzip, size_t* gzip_length);
+static int snapshot_copy(bool gzip, char** body, size_t* length, bool* compressed);
+
+/** @struct
+ * Defines a metrics connection served from the main loop
+ */
+struct prometheus_client
+{
+   struct ev_io io;                           /**< The descriptor watcher */
+   struct ev_timer timeout;                   /**< The idle timer */
+   char request[PROMETHEUS_MAX_REQUEST_SIZE]; /**< The request data */
+   size_t request_length;                     /**< The length of the request data */
+   char* response;                            /**< The response being written */
+   size_t response_length;                    /**< The length of the response */
+   size_t response_offset;                    /**< The amount of the response written */
+   bool close;                                /**< Close the connection after the response */
+   struct prometheus_client* next;            /**< The next connection */
+};
+
+static void client_read_cb(struct ev_loop* loop, struct ev_io* watcher, int revents);
+static void client_write_cb(struct ev_loop* loop, struct ev_io* watcher, int revents);
+static void client_timeout_cb(struct ev_loop* loop, struct ev_timer* watcher, int revents);
+static void client_process(struct ev_loop* loop, struct prometheus_client* client);
+static void client_request(struct prometheus_client* client);
+static void client_response(struct prometheus_client* client, char* status, char* content_type, bool gzip, char* body, size_t length, bool head);
+static void client_close(struct ev_loop* loop, struct prometheus_client* client);
+
+static struct prometheus_client* clients = NULL;
+
+static char* histogram_names[NUMBER_OF_HISTOGRAMS] = {
+   "network_read",
+   "tar_extract",
+   "file_write",
+   "compress",
+   "encrypt",
+   "fsync",
+   "upload",
+   "decompress",
+   "decrypt"
+};
 
 void
 pgmoneta_prometheus(int client_fd)
@@ -130,24 +176,33 @@ error:
 void
 pgmoneta_prometheus_reset(void)
 {
-   signed char cache_is_free;
+   struct histogram* h;
    struct prometheus_cache* cache;
+   struct configuration* config;
 
    cache = (struct prometheus_cache*)prometheus_cache_shmem;
+   config = (struct configuration*)shmem;
 
-retry_cache_locking:
-   cache_is_free = STATE_FREE;
-   if (atomic_compare_exchange_strong(&cache->lock, &cache_is_free, STATE_IN_USE))
+   for (int i = 0; i < NUMBER_OF_HISTOGRAMS; i++)
    {
-      metrics_cache_invalidate();
+      h = &config->prometheus.histograms[i];
 
-      atomic_store(&cache->lock, STATE_FREE);
+      for (int j = 0; j < HISTOGRAM_BUCKETS; j++)
+      {
+         atomic_store(&h->bucket[j], 0);
+      }
+      atomic_store(&h->count, 0);
+      atomic_store(&h->sum, 0);
    }
-   else
+
+   if (cache == NULL)
    {
-      /* Sleep for 1ms */
-      SLEEP_AND_GOTO(1000000L, retry_cache_locking);
+      return;
    }
+
+   /* Serve the scrapes from their own process until the next snapshot */
+   atomic_store(&cache->active, -1);
+   atomic_store(&cache->requested, (long)time(NULL));
 }
 
 static int
@@ -257,6 +312,35 @@ home_page(int client_fd)
    free(data);
    data = NULL;
 
+   home_information(&data);
+
+   send_chunk(client_fd, data);
+   free(data);
+   data = NULL;
+
+   /* Footer */
+   data = pgmoneta_append(data, "0\r\n\r\n");
+
+   msg.kind = 0;
+   msg.length = strlen(data);
+   msg.data = data;
+
+   status = pgmoneta_write_message(NULL, client_fd, &msg);
+
+done:
+   if (data != NULL)
+   {
+      free(data);
+   }
+
+   return status;
+}
+
+static void
+home_information(char** body)
+{
+   char* data = NULL;
+
    data = pgmoneta_append(data, "<html>\n");
    data = pgmoneta_append(data, "<head>\n");
    data = pgmoneta_append(data, "  <title>pgmoneta exporter</title>\n");
@@ -331,6 +415,9 @@ home_page(int client_fd)
    data = pgmoneta_append(data, "  <h2>pgmoneta_wal_streaming</h2>\n");
    data = pgmoneta_append(data, "  The WAL streaming status of a server\n");
    data = pgmoneta_append(data, "  <p>\n");
+   data = pgmoneta_append(data, "  <h2>pgmoneta_wal_status_replies</h2>\n");
+   data = pgmoneta_append(data, "  The number of WAL status replies sent to a server\n");
+   data = pgmoneta_append(data, "  <p>\n");
    data = pgmoneta_append(data, "  <h2>pgmoneta_server_operation_count</h2>\n");
    data = pgmoneta_append(data, "  The count of client operations of a server\n");
    data = pgmoneta_append(data, "  <p>\n");
@@ -770,133 +857,108 @@ home_page(int client_fd)
    data = pgmoneta_append(data, "    </tbody>\n");
    data = pgmoneta_append(data, "  </table>\n");
    data = pgmoneta_append(data, "  <p>\n");
+   data = pgmoneta_append(data, "  <h2>pgmoneta_latency_seconds</h2>\n");
+   data = pgmoneta_append(data, "  The latency of the backup, WAL and restore stages (histogram)\n");
+   data = pgmoneta_append(data, "  <table border=\"1\">\n");
+   data = pgmoneta_append(data, "    <tbody>\n");
+   data = pgmoneta_append(data, "      <tr>\n");
+   data = pgmoneta_append(data, "        <td>stage</td>\n");
+   data = pgmoneta_append(data, "        <td>network_read|tar_extract|file_write|compress|encrypt|fsync|upload|decompress|decrypt</td>\n");
+   data = pgmoneta_append(data, "      </tr>\n");
+   data = pgmoneta_append(data, "    </tbody>\n");
+   data = pgmoneta_append(data, "  </table>\n");
+   data = pgmoneta_append(data, "  <p>\n");
    data = pgmoneta_append(data, "  <a href=\"https://pgmoneta.github.io/\">pgmoneta.github.io/</a>\n");
    data = pgmoneta_append(data, "</body>\n");
    data = pgmoneta_append(data, "</html>\n");
 
-   send_chunk(client_fd, data);
+   *body = pgmoneta_append(*body, data);
    free(data);
-   data = NULL;
-
-   /* Footer */
-   data = pgmoneta_append(data, "0\r\n\r\n");
-
-   msg.kind = 0;
-   msg.length = strlen(data);
-   msg.data = data;
-
-   status = pgmoneta_write_message(NULL, client_fd, &msg);
-
-done:
-   if (data != NULL)
-   {
-      free(data);
-   }
-
-   return status;
 }
 
 static int
 metrics_page(int client_fd)
 {
    char* data = NULL;
+   char* body = NULL;
    time_t now;
    char time_buf[32];
    int status;
    struct message msg;
    struct prometheus_cache* cache;
-   signed char cache_is_free;
 
    cache = (struct prometheus_cache*)prometheus_cache_shmem;
 
    memset(&msg, 0, sizeof(struct message));
 
-retry_cache_locking:
-   cache_is_free = STATE_FREE;
-   if (atomic_compare_exchange_strong(&cache->lock, &cache_is_free, STATE_IN_USE))
+   /* Keep the snapshot rendered for the next scrapes */
+   if (cache != NULL)
    {
-      // can serve the message out of cache?
-      if (is_metrics_cache_configured() && is_metrics_cache_valid())
-      {
-         // serve the message directly out of the cache
-         pgmoneta_log_debug("Serving metrics out of cache (%d/%d bytes valid until %lld)",
-                            strlen(cache->data),
-                            cache->size,
-                            cache->valid_until);
-
-         msg.kind = 0;
-         msg.length = strlen(cache->data);
-         msg.data = cache->data;
-      }
-      else
-      {
-         // build the message without the cache
-         metrics_cache_invalidate();
-
-         now = time(NULL);
-
-         memset(&time_buf, 0, sizeof(time_buf));
-         ctime_r(&now, &time_buf[0]);
-         time_buf[strlen(time_buf) - 1] = 0;
-
-         data = pgmoneta_append(data, "HTTP/1.1 200 OK\r\n");
-         data = pgmoneta_append(data, "Content-Type: text/plain; version=0.0.1; charset=utf-8\r\n");
-         data = pgmoneta_append(data, "Date: ");
-         data = pgmoneta_append(data, &time_buf[0]);
-         data = pgmoneta_append(data, "\r\n");
-         data = pgmoneta_append(data, "Transfer-Encoding: chunked\r\n");
-         data = pgmoneta_append(data, "\r\n");
-         metrics_cache_append(data);
+      atomic_store(&cache->requested, (long)time(NULL));
+   }
 
-         msg.kind = 0;
-         msg.length = strlen(data);
-         msg.data = data;
+   now = time(NULL);
 
-         status = pgmoneta_write_message(NULL, client_fd, &msg);
-         if (status != MESSAGE_STATUS_OK)
-         {
-            goto error;
-         }
+   memset(&time_buf, 0, sizeof(time_buf));
+   ctime_r(&now, &time_buf[0]);
+   time_buf[strlen(time_buf) - 1] = 0;
 
-         free(data);
-         data = NULL;
+   data = pgmoneta_append(data, "HTTP/1.1 200 OK\r\n");
+   data = pgmoneta_append(data, "Content-Type: text/plain; version=0.0.1; charset=utf-8\r\n");
+   data = pgmoneta_append(data, "Date: ");
+   data = pgmoneta_append(data, &time_buf[0]);
+   data = pgmoneta_append(data, "\r\n");
+   data = pgmoneta_append(data, "Transfer-Encoding: chunked\r\n");
+   data = pgmoneta_append(data, "\r\n");
 
-         general_information(client_fd);
-         backup_information(client_fd);
-         size_information(client_fd);
+   msg.kind = 0;
+   msg.length = strlen(data);
+   msg.data = data;
 
-         /* Footer */
-         data = pgmoneta_append(data, "0\r\n\r\n");
-         metrics_cache_append(data);
+   status = pgmoneta_write_message(NULL, client_fd, &msg);
+   if (status != MESSAGE_STATUS_OK)
+   {
+      goto error;
+   }
 
-         msg.kind = 0;
-         msg.length = strlen(data);
-         msg.data = data;
+   free(data);
+   data = NULL;
 
-         metrics_cache_finalize();
-      }
+   general_information(&body);
+   backup_information(&body);
+   size_information(&body);
+   histogram_information(&body);
 
-      // free the cache
-      atomic_store(&cache->lock, STATE_FREE);
-   }
-   else
+   if (body != NULL)
    {
-      /* Sleep for 1ms */
-      SLEEP_AND_GOTO(1000000L, retry_cache_locking)
+      status = send_chunk(client_fd, body);
+      if (status != MESSAGE_STATUS_OK)
+      {
+         goto error;
+      }
    }
 
+   /* Footer */
+   data = pgmoneta_append(data, "0\r\n\r\n");
+
+   msg.kind = 0;
+   msg.length = strlen(data);
+   msg.data = data;
+
    status = pgmoneta_write_message(NULL, client_fd, &msg);
    if (status != MESSAGE_STATUS_OK)
    {
       goto error;
    }
 
+   free(body);
    free(data);
 
    return 0;
 
 error:
 
+   free(body);
    free(data);
 
    return 1;
@@ -937,7 +999,7 @@ bad_request(int client_fd)
 }
 
 static void
-general_information(int client_fd)
+general_information(char** body)
 {
    char* d;
    unsigned long size;
@@ -1061,12 +1123,7 @@ general_information(int client_fd)
    data = pgmoneta_append_bool(data, config->link);
    data = pgmoneta_append(data, "\n\n");
 
-   d = NULL;
-
-   d = pgmoneta_append(d, config->base_dir);
-   d = pgmoneta_append(d, "/");
-
-   size = pgmoneta_directory_size(d);
+   size = pgmoneta_catalog_used_space();
 
    data = pgmoneta_append(data, "#HELP pgmoneta_used_space The disk space used for pgmoneta\n");
    data = pgmoneta_append(data, "#TYPE pgmoneta_used_space gauge\n");
@@ -1074,8 +1131,6 @@ general_information(int client_fd)
    data = pgmoneta_append_ulong(data, size);
    data = pgmoneta_append(data, "\n\n");
 
-   free(d);
-
    d = NULL;
 
    d = pgmoneta_append(d, config->base_dir);
@@ -1118,22 +1173,10 @@ general_information(int client_fd)
       data = pgmoneta_append(data, config->servers[i].name);
       data = pgmoneta_append(data, "\"} ");
 
-      d = pgmoneta_get_server_wal_shipping_wal(i);
-
-      if (d != NULL)
-      {
-         size = pgmoneta_directory_size(d);
-         data = pgmoneta_append_ulong(data, size);
-      }
-      else
-      {
-         data = pgmoneta_append_ulong(data, 0);
-      }
+      size = pgmoneta_catalog_size(i, CATALOG_SIZE_WAL_SHIPPING);
+      data = pgmoneta_append_ulong(data, size);
 
       data = pgmoneta_append(data, "\n");
-
-      free(d);
-      d = NULL;
    }
    data = pgmoneta_append(data, "\n");
 
@@ -1147,21 +1190,10 @@ general_information(int client_fd)
       data = pgmoneta_append(data, config->servers[i].name);
       data = pgmoneta_append(data, "\"} ");
 
-      d = pgmoneta_get_server_wal_shipping(i);
-      if (d != NULL)
-      {
-         size = pgmoneta_directory_size(d);
-         data = pgmoneta_append_ulong(data, size);
-      }
-      else
-      {
-         data = pgmoneta_append_ulong(data, 0);
-      }
+      size = pgmoneta_catalog_wal_shipping_server_size(i);
+      data = pgmoneta_append_ulong(data, size);
 
       data = pgmoneta_append(data, "\n");
-
-      free(d);
-      d = NULL;
    }
    data = pgmoneta_append(data, "\n");
 
@@ -1391,6 +1423,22 @@ general_information(int client_fd)
    }
    data = pgmoneta_append(data, "\n");
 
+   data = pgmoneta_append(data, "#HELP pgmoneta_wal_status_replies The number of WAL status replies sent to a server\n");
+   data = pgmoneta_append(data, "#TYPE pgmoneta_wal_status_replies counter\n");
+   for (int i = 0; i < config->number_of_servers; i++)
+   {
+      data = pgmoneta_append(data, "pgmoneta_wal_status_replies{");
+
+      data = pgmoneta_append(data, "name=\"");
+      data = pgmoneta_append(data, config->servers[i].name);
+      data = pgmoneta_append(data, "\"} ");
+
+      data = pgmoneta_append_ulong(data, atomic_load(&config->servers[i].wal_status_replies));
+
+      data = pgmoneta_append(data, "\n");
+   }
+   data = pgmoneta_append(data, "\n");
+
    data = pgmoneta_append(data, "#HELP pgmoneta_server_operation_count The count of client operations of a server\n");
    data = pgmoneta_append(data, "#TYPE pgmoneta_server_operation_count gauge\n");
    for (int i = 0; i < config->number_of_servers; i++)
@@ -1471,15 +1519,14 @@ general_information(int client_fd)
 
    if (data != NULL)
    {
-      send_chunk(client_fd, data);
-      metrics_cache_append(data);
+      *body = pgmoneta_append(*body, data);
       free(data);
       data = NULL;
    }
 }
 
 static void
-backup_information(int client_fd)
+backup_information(char** body)
 {
    char* d;
    int number_of_backups;
@@ -1537,8 +1584,7 @@ backup_information(int client_fd)
 
    if (data != NULL)
    {
-      send_chunk(client_fd, data);
-      metrics_cache_append(data);
+      *body = pgmoneta_append(*body, data);
       free(data);
       data = NULL;
    }
@@ -1629,8 +1675,7 @@ backup_information(int client_fd)
 
    if (data != NULL)
    {
-      send_chunk(client_fd, data);
-      metrics_cache_append(data);
+      *body = pgmoneta_append(*body, data);
       free(data);
       data = NULL;
    }
@@ -1689,8 +1734,7 @@ backup_information(int client_fd)
 
    if (data != NULL)
    {
-      send_chunk(client_fd, data);
-      metrics_cache_append(data);
+      *body = pgmoneta_append(*body, data);
       free(data);
       data = NULL;
    }
@@ -1751,8 +1795,7 @@ backup_information(int client_fd)
 
    if (data != NULL)
    {
-      send_chunk(client_fd, data);
-      metrics_cache_append(data);
+      *body = pgmoneta_append(*body, data);
       free(data);
       data = NULL;
    }
@@ -2094,15 +2137,14 @@ backup_information(int client_fd)
 
    if (data != NULL)
    {
-      send_chunk(client_fd, data);
-      metrics_cache_append(data);
+      *body = pgmoneta_append(*body, data);
       free(data);
       data = NULL;
    }
 }
 
 static void
-size_information(int client_fd)
+size_information(char** body)
 {
    char* d;
    int number_of_backups;
@@ -2160,8 +2202,7 @@ size_information(int client_fd)
 
    if (data != NULL)
    {
-      send_chunk(client_fd, data);
-      metrics_cache_append(data);
+      *body = pgmoneta_append(*body, data);
       free(data);
       data = NULL;
    }
@@ -2212,8 +2253,7 @@ size_information(int client_fd)
 
    if (data != NULL)
    {
-      send_chunk(client_fd, data);
-      metrics_cache_append(data);
+      *body = pgmoneta_append(*body, data);
       free(data);
       data = NULL;
    }
@@ -2272,8 +2312,7 @@ size_information(int client_fd)
 
    if (data != NULL)
    {
-      send_chunk(client_fd, data);
-      metrics_cache_append(data);
+      *body = pgmoneta_append(*body, data);
       free(data);
       data = NULL;
    }
@@ -2339,8 +2378,7 @@ size_information(int client_fd)
 
    if (data != NULL)
    {
-      send_chunk(client_fd, data);
-      metrics_cache_append(data);
+      *body = pgmoneta_append(*body, data);
       free(data);
       data = NULL;
    }
@@ -2399,8 +2437,7 @@ size_information(int client_fd)
 
    if (data != NULL)
    {
-      send_chunk(client_fd, data);
-      metrics_cache_append(data);
+      *body = pgmoneta_append(*body, data);
       free(data);
       data = NULL;
    }
@@ -2466,8 +2503,7 @@ size_information(int client_fd)
 
    if (data != NULL)
    {
-      send_chunk(client_fd, data);
-      metrics_cache_append(data);
+      *body = pgmoneta_append(*body, data);
       free(data);
       data = NULL;
    }
@@ -2532,8 +2568,7 @@ size_information(int client_fd)
 
    if (data != NULL)
    {
-      send_chunk(client_fd, data);
-      metrics_cache_append(data);
+      *body = pgmoneta_append(*body, data);
       free(data);
       data = NULL;
    }
@@ -2592,8 +2627,7 @@ size_information(int client_fd)
 
    if (data != NULL)
    {
-      send_chunk(client_fd, data);
-      metrics_cache_append(data);
+      *body = pgmoneta_append(*body, data);
       free(data);
       data = NULL;
    }
@@ -2602,9 +2636,7 @@ size_information(int client_fd)
    data = pgmoneta_append(data, "#TYPE pgmoneta_backup_total_size gauge\n");
    for (int i = 0; i < config->number_of_servers; i++)
    {
-      d = pgmoneta_get_server_backup(i);
-
-      size = pgmoneta_directory_size(d);
+      size = pgmoneta_catalog_size(i, CATALOG_SIZE_BACKUP);
 
       data = pgmoneta_append(data, "pgmoneta_backup_total_size{");
 
@@ -2615,15 +2647,12 @@ size_information(int client_fd)
       data = pgmoneta_append_ulong(data, size);
 
       data = pgmoneta_append(data, "\n");
-
-      free(d);
    }
    data = pgmoneta_append(data, "\n");
 
    if (data != NULL)
    {
-      send_chunk(client_fd, data);
-      metrics_cache_append(data);
+      *body = pgmoneta_append(*body, data);
       free(data);
       data = NULL;
    }
@@ -2632,19 +2661,8 @@ size_information(int client_fd)
    data = pgmoneta_append(data, "#TYPE pgmoneta_wal_total_size gauge\n");
    for (int i = 0; i < config->number_of_servers; i++)
    {
-      d = pgmoneta_get_server_wal(i);
-
-      size = pgmoneta_directory_size(d);
-
-      free(d);
-
-      d = pgmoneta_get_server_wal_shipping_wal(i);
-
-      if (d != NULL)
-      {
-
-         size += pgmoneta_directory_size(d);
-      }
+      size = pgmoneta_catalog_size(i, CATALOG_SIZE_WAL) +
+             pgmoneta_catalog_size(i, CATALOG_SIZE_WAL_SHIPPING);
 
       data = pgmoneta_append(data, "pgmoneta_wal_total_size{");
 
@@ -2655,15 +2673,12 @@ size_information(int client_fd)
       data = pgmoneta_append_ulong(data, size);
 
       data = pgmoneta_append(data, "\n");
-
-      free(d);
    }
    data = pgmoneta_append(data, "\n");
 
    if (data != NULL)
    {
-      send_chunk(client_fd, data);
-      metrics_cache_append(data);
+      *body = pgmoneta_append(*body, data);
       free(data);
       data = NULL;
    }
@@ -2672,18 +2687,8 @@ size_information(int client_fd)
    data = pgmoneta_append(data, "#TYPE pgmoneta_total_size gauge\n");
    for (int i = 0; i < config->number_of_servers; i++)
    {
-      d = pgmoneta_get_server(i);
-
-      size = pgmoneta_directory_size(d);
-
-      free(d);
-
-      d = pgmoneta_get_server_wal_shipping(i);
-
-      if (d != NULL)
-      {
-         size += pgmoneta_directory_size(d);
-      }
+      size = pgmoneta_catalog_server_size(i) +
+             pgmoneta_catalog_wal_shipping_server_size(i);
 
       data = pgmoneta_append(data, "pgmoneta_total_size{");
 
@@ -2694,8 +2699,6 @@ size_information(int client_fd)
       data = pgmoneta_append_ulong(data, size);
 
       data = pgmoneta_append(data, "\n");
-
-      free(d);
    }
    data = pgmoneta_append(data, "\n");
 
@@ -2765,89 +2768,162 @@ size_information(int client_fd)
 
    if (data != NULL)
    {
-      send_chunk(client_fd, data);
-      metrics_cache_append(data);
+      *body = pgmoneta_append(*body, data);
       free(data);
       data = NULL;
    }
 }
 
-static int
-send_chunk(int client_fd, char* data)
+static void
+histogram_information(char** body)
 {
-   int status;
-   char* m = NULL;
-   struct message msg;
+   unsigned long count;
+   char* data = NULL;
+   struct histogram* h;
+   struct configuration* config;
 
-   memset(&msg, 0, sizeof(struct message));
+   config = (struct configuration*)shmem;
 
-   m = malloc(20);
-   memset(m, 0, 20);
+   data = pgmoneta_append(data, "#HELP pgmoneta_latency_seconds The latency of the backup, WAL and restore stages\n");
+   data = pgmoneta_append(data, "#TYPE pgmoneta_latency_seconds histogram\n");
+   for (int i = 0; i < NUMBER_OF_HISTOGRAMS; i++)
+   {
+      h = &config->prometheus.histograms[i];
+      count = 0;
 
-   sprintf(m, "%zX\r\n", strlen(data));
+      for (int j = 0; j < HISTOGRAM_BUCKETS - 1; j++)
+      {
+         count += atomic_load_explicit(&h->bucket[j], memory_order_relaxed);
 
-   m = pgmoneta_append(m, data);
-   m = pgmoneta_append(m, "\r\n");
+         data = pgmoneta_append(data, "pgmoneta_latency_seconds_bucket{");
 
-   msg.kind = 0;
-   msg.length = strlen(m);
-   msg.data = m;
+         data = pgmoneta_append(data, "stage=\"");
+         data = pgmoneta_append(data, histogram_names[i]);
+         data = pgmoneta_append(data, "\",le=\"");
+         data = pgmoneta_append_double(data, histogram_bound(j) / 1000000.0);
+         data = pgmoneta_append(data, "\"} ");
 
-   status = pgmoneta_write_message(NULL, client_fd, &msg);
+         data = pgmoneta_append_ulong(data, count);
 
-   free(m);
+         data = pgmoneta_append(data, "\n");
+      }
 
-   return status;
+      count += atomic_load_explicit(&h->bucket[HISTOGRAM_BUCKETS - 1], memory_order_relaxed);
+
+      data = pgmoneta_append(data, "pgmoneta_latency_seconds_bucket{");
+      data = pgmoneta_append(data, "stage=\"");
+      data = pgmoneta_append(data, histogram_names[i]);
+      data = pgmoneta_append(data, "\",le=\"+Inf\"} ");
+      data = pgmoneta_append_ulong(data, count);
+      data = pgmoneta_append(data, "\n");
+
+      data = pgmoneta_append(data, "pgmoneta_latency_seconds_sum{");
+      data = pgmoneta_append(data, "stage=\"");
+      data = pgmoneta_append(data, histogram_names[i]);
+      data = pgmoneta_append(data, "\"} ");
+      data = pgmoneta_append_double(data, atomic_load_explicit(&h->sum, memory_order_relaxed) / 1000000.0);
+      data = pgmoneta_append(data, "\n");
+
+      data = pgmoneta_append(data, "pgmoneta_latency_seconds_count{");
+      data = pgmoneta_append(data, "stage=\"");
+      data = pgmoneta_append(data, histogram_names[i]);
+      data = pgmoneta_append(data, "\"} ");
+      data = pgmoneta_append_ulong(data, count);
+      data = pgmoneta_append(data, "\n");
+   }
+   data = pgmoneta_append(data, "\n");
+
+   if (data != NULL)
+   {
+      *body = pgmoneta_append(*body, data);
+      free(data);
+      data = NULL;
+   }
 }
 
 /**
- * Checks if the Prometheus cache configuration setting
- * (`metrics_cache`) has a non-zero value, that means there
- * are seconds to cache the response.
+ * Provides the histogram bucket of a value.
  *
- * @return true if there is a cache configuration,
- *         false if no cache is active
+ * The bucket is the power of two of the value,
+ * split in two by the next bit. A value equal to
+ * the upper bound of a bucket is in that bucket.
+ *
+ * @param value The value in microseconds
+ * @return The bucket
  */
-static bool
-is_metrics_cache_configured(void)
+static int
+histogram_bucket(uint64_t value)
 {
-   struct configuration* config;
+   int octave;
+   int index;
 
-   config = (struct configuration*)shmem;
+   /* The le bound of Prometheus is inclusive */
+   if (value > 0)
+   {
+      value--;
+   }
 
-   // cannot have caching if not set metrics!
-   if (config->metrics == 0)
+   if (value < 2)
    {
-      return false;
+      return (int)value;
    }
 
-   return config->metrics_cache_max_age != PGMONETA_PROMETHEUS_CACHE_DISABLED;
+   octave = 63 - __builtin_clzll(value);
+   index = 2 * octave + (int)((value >> (octave - 1)) & 1);
+
+   return MIN(index, HISTOGRAM_BUCKETS - 1);
 }
 
 /**
- * Checks if the cache is still valid, and therefore can be
- * used to serve as a response.
- * A cache is considred valid if it has non-empty payload and
- * a timestamp in the future.
+ * Provides the upper bound of a histogram bucket.
  *
- * @return true if the cache is still valid
+ * @param bucket The bucket
+ * @return The upper bound in microseconds
  */
-static bool
-is_metrics_cache_valid(void)
+static uint64_t
+histogram_bound(int bucket)
 {
-   time_t now;
+   int next = bucket + 1;
 
-   struct prometheus_cache* cache;
+   if (next < 2)
+   {
+      return (uint64_t)next;
+   }
 
-   cache = (struct prometheus_cache*)prometheus_cache_shmem;
+   return (uint64_t)(2 + next % 2) << (next / 2 - 1);
+}
+
+uint64_t
+pgmoneta_prometheus_timer(void)
+{
+   struct timespec ts;
+
+   clock_gettime(CLOCK_MONOTONIC, &ts);
 
-   if (cache->valid_until == 0 || strlen(cache->data) == 0)
+   return (uint64_t)ts.tv_sec * 1000000000UL + (uint64_t)ts.tv_nsec;
+}
+
+void
+pgmoneta_prometheus_observe(int histogram, uint64_t start)
+{
+   uint64_t elapsed;
+   struct histogram* h;
+   struct configuration* config;
+
+   config = (struct configuration*)shmem;
+
+   if (config == NULL || histogram < 0 || histogram >= NUMBER_OF_HISTOGRAMS)
    {
-      return false;
+      return;
    }
 
-   now = time(NULL);
-   return now <= cache->valid_until;
+   elapsed = (pgmoneta_prometheus_timer() - start) / 1000;
+
+   h = &config->prometheus.histograms[histogram];
+
+   atomic_fetch_add_explicit(&h->bucket[histogram_bucket(elapsed)], 1, memory_order_relaxed);
+   atomic_fetch_add_explicit(&h->sum, elapsed, memory_order_relaxed);
+   atomic_fetch_add_explicit(&h->count, 1, memory_order_relaxed);
 }
 
 int
@@ -2864,24 +2940,28 @@ pgmoneta_init_prometheus_cache(size_t* p_size, void** p_shmem)
    cache_size = metrics_cache_size_to_alloc();
    struct_size = sizeof(struct prometheus_cache);
 
-   if (pgmoneta_create_shared_memory(struct_size + cache_size, config->hugepage, (void*) &cache))
+   if (pgmoneta_create_shared_memory(struct_size + 2 * cache_size, config->hugepage, (void*) &cache))
    {
       goto error;
    }
 
-   memset(cache, 0, struct_size + cache_size);
-   cache->valid_until = 0;
+   memset(cache, 0, struct_size + 2 * cache_size);
+   atomic_init(&cache->rendering, 0);
+   atomic_init(&cache->requested, (long)time(NULL));
+   atomic_init(&cache->overflow, false);
+   atomic_init(&cache->active, -1);
+   atomic_init(&cache->sequence[0], 0);
+   atomic_init(&cache->sequence[1], 0);
    cache->size = cache_size;
-   atomic_init(&cache->lock, STATE_FREE);
 
    // success! do the memory swap
    *p_shmem = cache;
-   *p_size = cache_size + struct_size;
+   *p_size = struct_size + 2 * cache_size;
    return 0;
 
 error:
-   // disable caching
-   config->metrics_cache_max_age = config->metrics_cache_max_size = PGMONETA_PROMETHEUS_CACHE_DISABLED;
+   // disable the snapshot
+   config->metrics_cache_max_age = PGMONETA_PROMETHEUS_CACHE_DISABLED;
    pgmoneta_log_error("Cannot allocate shared memory for the Prometheus cache!");
    *p_size = 0;
    *p_shmem = NULL;
@@ -2889,133 +2969,790 @@ error:
    return 1;
 }
 
-/**
- * Provides the size of the cache to allocate.
- *
- * It checks if the metrics cache is configured, and
- * computers the right minimum value between the
- * user configured requested size and the default
- * cache size.
- *
- * @return the cache size to allocate
- */
+bool
+pgmoneta_prometheus_snapshot_due(void)
+{
+   int active;
+   long rendering;
+   time_t now;
+   struct prometheus_cache* cache;
+   struct configuration* config;
+
+   cache = (struct prometheus_cache*)prometheus_cache_shmem;
+   config = (struct configuration*)shmem;
+
+   if (cache == NULL || config->metrics <= 0 || config->metrics_cache_max_age <= PGMONETA_PROMETHEUS_CACHE_DISABLED)
+   {
+      return false;
+   }
+
+   now = time(NULL);
+
+   // nobody is scraping, so don't render
+   if (now - atomic_load(&cache->requested) > PROMETHEUS_IDLE_TIMEOUT)
+   {
+      return false;
+   }
+
+   active = atomic_load(&cache->active);
+   if (active >= 0 && now - cache->created[active] < config->metrics_cache_max_age)
+   {
+      return false;
+   }
+
+   rendering = atomic_load(&cache->rendering);
+   if (rendering != 0 && now - rendering < PROMETHEUS_RENDER_TIMEOUT)
+   {
+      return false;
+   }
+
+   return atomic_compare_exchange_strong(&cache->rendering, &rendering, (long)now);
+}
+
+void
+pgmoneta_prometheus_snapshot(void)
+{
+   int active;
+   int index;
+   char* buffer = NULL;
+   char* body = NULL;
+   char* gzip = NULL;
+   size_t length = 0;
+   size_t gzip_length = 0;
+   struct prometheus_cache* cache;
+
+   cache = (struct prometheus_cache*)prometheus_cache_shmem;
+
+   if (cache == NULL)
+   {
+      return;
+   }
+
+   pgmoneta_memory_init();
+
+   general_information(&body);
+   backup_information(&body);
+   size_information(&body);
+   histogram_information(&body);
+
+   if (body != NULL)
+   {
+      length = strlen(body);
+   }
+
+   if (length > cache->size)
+   {
+      if (!atomic_exchange(&cache->overflow, true))
+      {
+         pgmoneta_log_warn("Prometheus: %zu bytes of metrics exceed the snapshot size of %zu bytes. HINT: try adjusting `metrics_cache_max_size`",
+                           length, cache->size);
+      }
+
+      // serve the scrapes from their own process
+      atomic_store(&cache->active, -1);
+      goto done;
+   }
+
+   atomic_store(&cache->overflow, false);
+
+   if (gzip_body(body, length, cache->size - length, &gzip, &gzip_length))
+   {
+      gzip_length = 0;
+   }
+
+   active = atomic_load(&cache->active);
+   index = active == 0 ? 1 : 0;
+   buffer = cache->data + index * cache->size;
+
+   atomic_fetch_add(&cache->sequence[index], 1);
+
+   if (length > 0)
+   {
+      memcpy(buffer, body, length);
+   }
+   if (gzip_length > 0)
+   {
+      memcpy(buffer + length, gzip, gzip_length);
+   }
+   cache->created[index] = time(NULL);
+   cache->length[index] = length;
+   cache->gzip_length[index] = gzip_length;
+
+   atomic_fetch_add(&cache->sequence[index], 1);
+
+   atomic_store(&cache->active, index);
+
+   pgmoneta_log_debug("Prometheus snapshot: %zu bytes (%zu bytes gzip)", length, gzip_length);
+
+done:
+
+   atomic_store(&cache->rendering, 0);
+
+   free(body);
+   free(gzip);
+
+   pgmoneta_memory_destroy();
+}
+
+bool
+pgmoneta_prometheus_snapshot_valid(void)
+{
+   int active;
+   struct prometheus_cache* cache;
+   struct configuration* config;
+
+   cache = (struct prometheus_cache*)prometheus_cache_shmem;
+   config = (struct configuration*)shmem;
+
+   if (cache == NULL || config->metrics_cache_max_age <= PGMONETA_PROMETHEUS_CACHE_DISABLED)
+   {
+      return false;
+   }
+
+   active = atomic_load(&cache->active);
+   if (active < 0)
+   {
+      return false;
+   }
+
+   // allow for the rendering time, but don't serve a snapshot left behind while idle
+   return time(NULL) - cache->created[active] <= 2 * config->metrics_cache_max_age;
+}
+
+int
+pgmoneta_prometheus_serve(struct ev_loop* loop, int client_fd)
+{
+   struct prometheus_client* client = NULL;
+
+   if (pgmoneta_socket_nonblocking(client_fd, true))
+   {
+      goto error;
+   }
+
+   client = (struct prometheus_client*)calloc(1, sizeof(struct prometheus_client));
+   if (client == NULL)
+   {
+      goto error;
+   }
+
+   ev_io_init(&client->io, client_read_cb, client_fd, EV_READ);
+   client->io.data = client;
+
+   ev_timer_init(&client->timeout, client_timeout_cb, 0., PROMETHEUS_KEEP_ALIVE_TIMEOUT);
+   client->timeout.data = client;
+
+   client->next = clients;
+   clients = client;
+
+   ev_io_start(loop, &client->io);
+   ev_timer_again(loop, &client->timeout);
+
+   return 0;
+
+error:
+
+   pgmoneta_disconnect(client_fd);
+
+   return 1;
+}
+
+void
+pgmoneta_prometheus_close_clients(struct ev_loop* loop)
+{
+   while (clients != NULL)
+   {
+      client_close(loop, clients);
+   }
+}
+
+static int
+send_chunk(int client_fd, char* data)
+{
+   int status;
+   char* m = NULL;
+   struct message msg;
+
+   memset(&msg, 0, sizeof(struct message));
+
+   m = malloc(20);
+   memset(m, 0, 20);
+
+   sprintf(m, "%zX\r\n", strlen(data));
+
+   m = pgmoneta_append(m, data);
+   m = pgmoneta_append(m, "\r\n");
+
+   msg.kind = 0;
+   msg.length = strlen(m);
+   msg.data = m;
+
+   status = pgmoneta_write_message(NULL, client_fd, &msg);
+
+   free(m);
+
+   return status;
+}
+
+/**
+ * Provides the size of each snapshot buffer to allocate.
+ *
+ * It computes the right minimum value between the
+ * user configured requested size and the maximum
+ * size, or uses the default size.
+ *
+ * @return the buffer size to allocate
+ */
 static size_t
 metrics_cache_size_to_alloc(void)
 {
    struct configuration* config;
-   size_t cache_size = 0;
 
    config = (struct configuration*)shmem;
 
    // which size to use ?
    // either the configured (i.e., requested by user) if lower than the max size
    // or the default value
-   if (is_metrics_cache_configured())
+   return config->metrics_cache_max_size > 0
+          ? MIN(config->metrics_cache_max_size, PROMETHEUS_MAX_CACHE_SIZE)
+          : PROMETHEUS_DEFAULT_CACHE_SIZE;
+}
+
+/**
+ * Compresses the metrics with gzip.
+ *
+ * @param body The metrics
+ * @param length The length of the metrics
+ * @param max The maximum size of the result
+ * @param gzip The resulting buffer
+ * @param gzip_length The length of the resulting buffer
+ * @return 0 upon success, otherwise 1
+ */
+static int
+gzip_body(char* body, size_t length, size_t max, char** gzip, size_t* gzip_length)
+{
+   z_stream zs;
+   char* out = NULL;
+   size_t bound;
+
+   *gzip = NULL;
+   *gzip_length = 0;
+
+   memset(&zs, 0, sizeof(z_stream));
+
+   if (deflateInit2(&zs, Z_DEFAULT_COMPRESSION, Z_DEFLATED, 15 + 16, 8, Z_DEFAULT_STRATEGY) != Z_OK)
+   {
+      goto error;
+   }
+
+   bound = deflateBound(&zs, length);
+
+   out = (char*)malloc(bound);
+   if (out == NULL)
    {
-      cache_size = config->metrics_cache_max_size > 0
-            ? MIN(config->metrics_cache_max_size, PROMETHEUS_MAX_CACHE_SIZE)
-            : PROMETHEUS_DEFAULT_CACHE_SIZE;
+      deflateEnd(&zs);
+      goto error;
+   }
+
+   zs.next_in = (Bytef*)body;
+   zs.avail_in = length;
+   zs.next_out = (Bytef*)out;
+   zs.avail_out = bound;
+
+   if (deflate(&zs, Z_FINISH) != Z_STREAM_END)
+   {
+      deflateEnd(&zs);
+      goto error;
    }
 
-   return cache_size;
+   deflateEnd(&zs);
+
+   if (zs.total_out > max)
+   {
+      goto error;
+   }
+
+   *gzip = out;
+   *gzip_length = zs.total_out;
+
+   return 0;
+
+error:
+
+   free(out);
+
+   return 1;
 }
 
 /**
- * Invalidates the cache.
+ * Copies the snapshot being served.
  *
- * Requires the caller to hold the lock on the cache!
+ * The copy is retried if the buffer was written meanwhile.
  *
- * Invalidating the cache means that the payload is zero-filled
- * and that the valid_until field is set to zero too.
+ * @param gzip Does the client accept gzip
+ * @param body The resulting copy
+ * @param length The length of the copy
+ * @param compressed Is the copy compressed with gzip
+ * @return 0 upon success, otherwise 1
  */
-static void
-metrics_cache_invalidate(void)
+static int
+snapshot_copy(bool gzip, char** body, size_t* length, bool* compressed)
 {
+   int active;
+   int retries = 0;
+   unsigned long sequence;
+   size_t offset;
+   size_t size;
+   char* copy = NULL;
    struct prometheus_cache* cache;
 
    cache = (struct prometheus_cache*)prometheus_cache_shmem;
 
-   memset(cache->data, 0, cache->size);
-   cache->valid_until = 0;
+   *body = NULL;
+   *length = 0;
+   *compressed = false;
+
+   while (retries < 8)
+   {
+      retries++;
+
+      active = atomic_load(&cache->active);
+      if (active < 0)
+      {
+         return 1;
+      }
+
+      sequence = atomic_load(&cache->sequence[active]);
+      if (sequence & 1)
+      {
+         continue;
+      }
+
+      *compressed = gzip && cache->gzip_length[active] > 0;
+      offset = *compressed ? cache->length[active] : 0;
+      size = *compressed ? cache->gzip_length[active] : cache->length[active];
+
+      if (offset + size > cache->size)
+      {
+         continue;
+      }
+
+      copy = (char*)malloc(size + 1);
+      if (copy == NULL)
+      {
+         return 1;
+      }
+
+      memcpy(copy, cache->data + active * cache->size + offset, size);
+
+      /* Order the copy before the sequence check */
+      atomic_thread_fence(memory_order_acquire);
+
+      if (atomic_load(&cache->sequence[active]) == sequence)
+      {
+         *body = copy;
+         *length = size;
+
+         return 0;
+      }
+
+      free(copy);
+      copy = NULL;
+   }
+
+   return 1;
+}
+
+static void
+client_read_cb(struct ev_loop* loop, struct ev_io* watcher, int revents)
+{
+   ssize_t n;
+   struct prometheus_client* client;
+
+   client = (struct prometheus_client*)watcher->data;
+
+   if (EV_ERROR & revents)
+   {
+      client_close(loop, client);
+      return;
+   }
+
+   while (client->request_length < sizeof(client->request))
+   {
+      n = read(watcher->fd, client->request + client->request_length, sizeof(client->request) - client->request_length);
+
+      if (n > 0)
+      {
+         client->request_length += n;
+      }
+      else if (n == 0)
+      {
+         client_close(loop, client);
+         return;
+      }
+      else if (errno == EINTR)
+      {
+         continue;
+      }
+      else if (errno == EAGAIN || errno == EWOULDBLOCK)
+      {
+         errno = 0;
+         break;
+      }
+      else
+      {
+         errno = 0;
+         client_close(loop, client);
+         return;
+      }
+   }
+
+   ev_timer_again(loop, &client->timeout);
+
+   client_process(loop, client);
+}
+
+static void
+client_write_cb(struct ev_loop* loop, struct ev_io* watcher, int revents)
+{
+   ssize_t n;
+   struct prometheus_client* client;
+
+   client = (struct prometheus_client*)watcher->data;
+
+   if (EV_ERROR & revents)
+   {
+      client_close(loop, client);
+      return;
+   }
+
+   while (client->response_offset < client->response_length)
+   {
+      n = write(watcher->fd, client->response + client->response_offset, client->response_length - client->response_offset);
+
+      if (n > 0)
+      {
+         client->response_offset += n;
+      }
+      else if (n == -1 && errno == EINTR)
+      {
+         continue;
+      }
+      else if (n == -1 && (errno == EAGAIN || errno == EWOULDBLOCK))
+      {
+         errno = 0;
+         ev_timer_again(loop, &client->timeout);
+         return;
+      }
+      else
+      {
+         errno = 0;
+         client_close(loop, client);
+         return;
+      }
+   }
+
+   free(client->response);
+   client->response = NULL;
+   client->response_length = 0;
+   client->response_offset = 0;
+
+   if (client->close)
+   {
+      client_close(loop, client);
+      return;
+   }
+
+   ev_io_stop(loop, &client->io);
+   ev_set_cb(&client->io, client_read_cb);
+   ev_io_set(&client->io, client->io.fd, EV_READ);
+   ev_io_start(loop, &client->io);
+
+   ev_timer_again(loop, &client->timeout);
+
+   /* A pipelined request may be waiting */
+   client_process(loop, client);
+}
+
+static void
+client_timeout_cb(struct ev_loop* loop, struct ev_timer* watcher, int revents)
+{
+   client_close(loop, (struct prometheus_client*)watcher->data);
 }
 
 /**
- * Appends data to the cache.
- *
- * Requires the caller to hold the lock on the cache!
+ * Answers the next complete request of a client, if any.
  *
- * If the input data is empty, nothing happens.
- * The data is appended only if the cache does not overflows, that
- * means the current size of the cache plus the size of the data
- * to append does not exceed the current cache size.
- * If the cache overflows, the cache is flushed and marked
- * as invalid.
- * This makes safe to call this method along the workflow of
- * building the Prometheus response.
+ * @param loop The loop
+ * @param client The client
+ */
+static void
+client_process(struct ev_loop* loop, struct prometheus_client* client)
+{
+   char* end = NULL;
+   size_t length;
+
+   if (client->response != NULL)
+   {
+      return;
+   }
+
+   end = memmem(client->request, client->request_length, "\r\n\r\n", 4);
+   if (end == NULL)
+   {
+      if (client->request_length == sizeof(client->request))
+      {
+         pgmoneta_log_debug("Prometheus: Request too large");
+         client->close = true;
+         client_response(client, "400 Bad Request", NULL, false, NULL, 0, false);
+      }
+      else
+      {
+         return;
+      }
+   }
+   else
+   {
+      *end = '\0';
+      length = end - client->request + 4;
+
+      client_request(client);
+
+      memmove(client->request, client->request + length, client->request_length - length);
+      client->request_length -= length;
+   }
+
+   if (client->response == NULL)
+   {
+      client_close(loop, client);
+      return;
+   }
+
+   ev_io_stop(loop, &client->io);
+   ev_set_cb(&client->io, client_write_cb);
+   ev_io_set(&client->io, client->io.fd, EV_WRITE);
+   ev_io_start(loop, &client->io);
+}
+
+/**
+ * Builds the response for the request at the start
+ * of the request buffer, which is zero terminated.
  *
- * @param data the string to append to the cache
- * @return true on success
+ * @param client The client
  */
-static bool
-metrics_cache_append(char* data)
+static void
+client_request(struct prometheus_client* client)
 {
-   int origin_length = 0;
-   int append_length = 0;
+   char* line = NULL;
+   char* saveptr = NULL;
+   char* method = NULL;
+   char* target = NULL;
+   char* version = NULL;
+   char* value = NULL;
+   char* body = NULL;
+   size_t length = 0;
+   bool head = false;
+   bool gzip = false;
+   bool compressed = false;
    struct prometheus_cache* cache;
 
    cache = (struct prometheus_cache*)prometheus_cache_shmem;
 
-   if (!is_metrics_cache_configured())
+   line = strtok_r(client->request, "\r\n", &saveptr);
+   if (line != NULL)
    {
-      return false;
+      method = strtok_r(line, " ", &value);
+      target = strtok_r(NULL, " ", &value);
+      version = strtok_r(NULL, " ", &value);
    }
 
-   origin_length = strlen(cache->data);
-   append_length = strlen(data);
-   // need to append the data to the cache
-   if (origin_length + append_length >= cache->size)
+   if (method == NULL || target == NULL || version == NULL || strncmp(version, "HTTP/1.", 7) != 0)
    {
-      // cannot append new data, so invalidate cache
-      pgmoneta_log_debug("Cannot append %d bytes to the Prometheus cache because it will overflow the size of %d bytes (currently at %d bytes). HINT: try adjusting `metrics_cache_max_size`",
-                         append_length,
-                         cache->size,
-                         origin_length);
-      metrics_cache_invalidate();
-      return false;
+      pgmoneta_log_debug("Promethus: Not a HTTP request");
+      client->close = true;
+      client_response(client, "400 Bad Request", NULL, false, NULL, 0, false);
+      return;
    }
 
-   // append the data to the data field
-   memcpy(cache->data + origin_length, data, append_length);
-   cache->data[origin_length + append_length + 1] = '\0';
-   return true;
+   /* HTTP/1.0 closes the connection by default */
+   client->close = strcmp(version, "HTTP/1.1") != 0;
+
+   while ((line = strtok_r(NULL, "\r\n", &saveptr)) != NULL)
+   {
+      value = strchr(line, ':');
+      if (value == NULL)
+      {
+         continue;
+      }
+
+      *value = '\0';
+      value++;
+
+      if (!strcasecmp(line, "Connection"))
+      {
+         if (strcasestr(value, "close") != NULL)
+         {
+            client->close = true;
+         }
+         else if (strcasestr(value, "keep-alive") != NULL)
+         {
+            client->close = false;
+         }
+      }
+      else if (!strcasecmp(line, "Accept-Encoding"))
+      {
+         gzip = strcasestr(value, "gzip") != NULL;
+      }
+   }
+
+   if (!strcmp(method, "HEAD"))
+   {
+      head = true;
+   }
+   else if (strcmp(method, "GET"))
+   {
+      pgmoneta_log_debug("Promethus: Not a GET request");
+      client->close = true;
+      client_response(client, "400 Bad Request", NULL, false, NULL, 0, false);
+      return;
+   }
+
+   value = strchr(target, '?');
+   if (value != NULL)
+   {
+      *value = '\0';
+   }
+
+   if (strcmp(target, "/") == 0 || strcmp(target, "/index.html") == 0)
+   {
+      home_information(&body);
+
+      client_response(client, "200 OK", "text/html; charset=utf-8", false, body, strlen(body), head);
+   }
+   else if (strcmp(target, "/metrics") == 0)
+   {
+      atomic_store(&cache->requested, (long)time(NULL));
+
+      if (snapshot_copy(gzip, &body, &length, &compressed))
+      {
+         client->close = true;
+         client_response(client, "503 Service Unavailable", NULL, false, NULL, 0, false);
+      }
+      else
+      {
+         client_response(client, "200 OK", "text/plain; version=0.0.1; charset=utf-8", compressed, body, length, head);
+      }
+   }
+   else
+   {
+      client_response(client, "403 Forbidden", NULL, false, NULL, 0, false);
+   }
+
+   free(body);
 }
 
 /**
- * Finalizes the cache.
- *
- * Requires the caller to hold the lock on the cache!
- *
- * This method should be invoked when the cache is complete
- * and therefore can be served.
+ * Builds a response for a client.
  *
- * @return true if the cache has a validity
+ * @param client The client
+ * @param status The status
+ * @param content_type The content type, or NULL
+ * @param gzip Is the body compressed with gzip
+ * @param body The body, or NULL
+ * @param length The length of the body
+ * @param head Leave out the body
  */
-static bool
-metrics_cache_finalize(void)
+static void
+client_response(struct prometheus_client* client, char* status, char* content_type, bool gzip, char* body, size_t length, bool head)
 {
-   struct configuration* config;
-   struct prometheus_cache* cache;
+   char* data = NULL;
+   char number[32];
    time_t now;
+   char time_buf[32];
+   size_t header_length;
 
-   cache = (struct prometheus_cache*)prometheus_cache_shmem;
-   config = (struct configuration*)shmem;
+   now = time(NULL);
 
-   if (!is_metrics_cache_configured())
+   memset(&time_buf, 0, sizeof(time_buf));
+   ctime_r(&now, &time_buf[0]);
+   time_buf[strlen(time_buf) - 1] = 0;
+
+   memset(&number, 0, sizeof(number));
+   snprintf(&number[0], sizeof(number), "%zu", length);
+
+   data = pgmoneta_append(data, "HTTP/1.1 ");
+   data = pgmoneta_append(data, status);
+   data = pgmoneta_append(data, "\r\n");
+   if (content_type != NULL)
    {
-      return false;
+      data = pgmoneta_append(data, "Content-Type: ");
+      data = pgmoneta_append(data, content_type);
+      data = pgmoneta_append(data, "\r\n");
    }
+   if (gzip)
+   {
+      data = pgmoneta_append(data, "Content-Encoding: gzip\r\n");
+   }
+   data = pgmoneta_append(data, "Date: ");
+   data = pgmoneta_append(data, &time_buf[0]);
+   data = pgmoneta_append(data, "\r\n");
+   data = pgmoneta_append(data, "Content-Length: ");
+   data = pgmoneta_append(data, &number[0]);
+   data = pgmoneta_append(data, "\r\n");
+   data = pgmoneta_append(data, client->close ? "Connection: close\r\n" : "Connection: keep-alive\r\n");
+   data = pgmoneta_append(data, "\r\n");
 
-   now = time(NULL);
-   cache->valid_until = now + config->metrics_cache_max_age;
-   return cache->valid_until > now;
+   header_length = strlen(data);
+
+   if (head || body == NULL)
+   {
+      length = 0;
+   }
+
+   client->response = (char*)malloc(header_length + length);
+   if (client->response == NULL)
+   {
+      free(data);
+      return;
+   }
+
+   memcpy(client->response, data, header_length);
+   if (length > 0)
+   {
+      memcpy(client->response + header_length, body, length);
+   }
+
+   client->response_length = header_length + length;
+   client->response_offset = 0;
+
+   free(data);
+}
+
+/**
+ * Closes a client and releases its resources.
+ *
+ * @param loop The loop
+ * @param client The client
+ */
+static void
+client_close(struct ev_loop* loop, struct prometheus_client* client)
+{
+   struct prometheus_client** p = &clients;
+
+   while (*p != NULL && *p != client)
+   {
+      p = &(*p)->next;
+   }
+
+   if (*p != NULL)
+   {
+      *p = client->next;
+   }
+
+   ev_io_stop(loop, &client->io);
+   ev_timer_stop(loop, &client->timeout);
+
+   pgmoneta_disconnect(client->io.fd);
+
+   free(client->response);
+   free(client);
 }
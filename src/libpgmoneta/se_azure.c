@@ -28,10 +28,12 @@
 
 /* pgmoneta */
 #include <pgmoneta.h>
+#include <catalog.h>
 #include <dirent.h>
 #include <http.h>
 #include <info.h>
 #include <logging.h>
+#include <prometheus.h>
 #include <security.h>
 #include <stdio.h>
 #include <storage.h>
@@ -114,14 +116,19 @@ static int
 azure_storage_teardown(int server, char* identifier, struct node* i_nodes, struct node** o_nodes)
 {
    char* root = NULL;
+   char* d = NULL;
 
    root = pgmoneta_get_server_backup_identifier_data(server, identifier);
 
    pgmoneta_delete_directory(root);
 
+   d = pgmoneta_get_server_backup_identifier(server, identifier);
+   pgmoneta_catalog_refresh(d);
+
    curl_easy_cleanup(curl);
 
    free(root);
+   free(d);
 
    return 0;
 }
@@ -239,6 +246,7 @@ azure_send_upload_request(char* local_root, char* azure_root, char* relative_pat
    unsigned char* signature_hex = NULL;
    int hmac_length = 0;
    int signing_key_length = 0;
+   uint64_t start;
    FILE* file = NULL;
    struct stat file_info;
    CURLcode res = -1;
@@ -337,12 +345,14 @@ azure_send_upload_request(char* local_root, char* azure_root, char* relative_pat
 
    curl_easy_setopt(curl, CURLOPT_INFILESIZE_LARGE, (curl_off_t)file_info.st_size);
 
+   start = pgmoneta_prometheus_timer();
    res = curl_easy_perform(curl);
    if (res != CURLE_OK)
    {
       fprintf(stderr, "curl_easy_perform() failed: %s\n", curl_easy_strerror(res));
       goto error;
    }
+   pgmoneta_prometheus_observe(HISTOGRAM_UPLOAD, start);
 
    free(local_path);
    free(azure_path);
@@ -28,10 +28,12 @@
 
 /* pgmoneta */
 #include <pgmoneta.h>
+#include <catalog.h>
 #include <dirent.h>
 #include <http.h>
 #include <info.h>
 #include <logging.h>
+#include <prometheus.h>
 #include <security.h>
 #include <stdio.h>
 #include <storage.h>
@@ -114,14 +116,19 @@ static int
 s3_storage_teardown(int server, char* identifier, struct node* i_nodes, struct node** o_nodes)
 {
    char* root = NULL;
+   char* d = NULL;
 
    root = pgmoneta_get_server_backup_identifier_data(server, identifier);
 
    pgmoneta_delete_directory(root);
 
+   d = pgmoneta_get_server_backup_identifier(server, identifier);
+   pgmoneta_catalog_refresh(d);
+
    curl_easy_cleanup(curl);
 
    free(root);
+   free(d);
 
    return 0;
 }
@@ -212,6 +219,7 @@ s3_send_upload_request(char* local_root, char* s3_root, char* relative_path)
    unsigned char* signature_hmac = NULL;
    unsigned char* signature_hex = NULL;
    int hmac_length = 0;
+   uint64_t start;
    FILE* file = NULL;
    struct stat file_info;
    CURLcode res = -1;
@@ -342,12 +350,14 @@ s3_send_upload_request(char* local_root, char* s3_root, char* relative_path)
 
    curl_easy_setopt(curl, CURLOPT_VERBOSE, 1L);
 
+   start = pgmoneta_prometheus_timer();
    res = curl_easy_perform(curl);
    if (res != CURLE_OK)
    {
       fprintf(stderr, "curl_easy_perform() failed: %s\n", curl_easy_strerror(res));
       goto error;
    }
+   pgmoneta_prometheus_observe(HISTOGRAM_UPLOAD, start);
 
    free(s3_url);
    free(s3_host);
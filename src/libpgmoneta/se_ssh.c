@@ -30,37 +30,99 @@
 
 /* pgmoneta */
 #include <pgmoneta.h>
+#include <catalog.h>
 #include <hashmap.h>
 #include <info.h>
 #include <logging.h>
+#include <prometheus.h>
 #include <string.h>
 #include <utils.h>
 #include <security.h>
 #include <storage.h>
+#include <workers.h>
 
 /* system */
 #include <dirent.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <unistd.h>
 #include <libssh/libssh.h>
 #include <libssh/sftp.h>
 
+#define SFTP_CHUNK_SIZE      262144
+#define SFTP_SYNC_CHUNK_SIZE  32768
+#define SFTP_IN_FLIGHT           32
+#define SFTP_RETRIES              3
+
+#if defined(LIBSSH_VERSION_INT) && LIBSSH_VERSION_INT >= SSH_VERSION_INT(0, 11, 0)
+#define HAVE_SFTP_AIO
+#define HAVE_SFTP_HARDLINK
+#endif
+
+struct sftp_connection
+{
+   ssh_session session;    /**< The SSH session */
+   sftp_session sftp;      /**< The SFTP session */
+   size_t chunk_size;      /**< The size of a single write request */
+   unsigned long files;    /**< The number of files uploaded */
+   unsigned long links;    /**< The number of files linked to the previous backup */
+   unsigned long bytes;    /**< The number of bytes uploaded */
+   unsigned long retries;  /**< The number of retried uploads */
+   uint64_t elapsed;       /**< The time spent uploading in nanoseconds */
+};
+
+struct sftp_pool
+{
+   struct sftp_connection* connections; /**< The connections */
+   int number_of_connections;           /**< The number of connections */
+   bool* busy;                          /**< Is the connection in use */
+   pthread_mutex_t lock;                /**< The lock */
+   pthread_cond_t available;            /**< Signaled when a connection is released */
+   atomic_bool failed;                  /**< Set on the first failed upload */
+   atomic_ulong skipped;                /**< The number of files already in the journal */
+};
+
+struct sftp_upload
+{
+   char local_root[MAX_PATH];    /**< The local root */
+   char remote_root[MAX_PATH];   /**< The remote root */
+   char relative_path[MAX_PATH]; /**< The path relative to the roots */
+};
+
 static int ssh_storage_setup(int, char*, struct node*, struct node**);
 static int ssh_storage_backup_execute(int, char*, struct node*, struct node**);
 static int ssh_storage_wal_shipping_execute(int, char*, struct node*, struct node**);
 static int ssh_storage_backup_teardown(int, char*, struct node*, struct node**);
 static int ssh_storage_wal_shipping_teardown(int, char*, struct node*, struct node**);
 
+static void ssh_resume_backups(int server, char* identifier, struct sftp_connection* control);
+static int ssh_upload_backup(int server, char* identifier, struct sftp_connection* control);
+
 static char* get_remote_server_basepath(int server);
 static char* get_remote_server_backup(int server);
 static char* get_remote_server_backup_identifier(int server, char* identifier);
 static char* get_remote_server_wal(int server);
 
-static int read_latest_backup_sha256(char* path);
-
+static int read_backup_sha256(char* path, struct hashmap* map);
+static void free_backup_sha256(struct hashmap* map);
+static int journal_append(char* relative_path, char* sha256);
+
+static int sftp_connect(ssh_session* s, sftp_session* f, size_t* chunk_size);
+static void sftp_disconnect(struct sftp_connection* connection);
+static int sftp_reconnect(struct sftp_connection* connection);
+static int sftp_pool_create(int number, struct sftp_pool** pool);
+static struct sftp_connection* sftp_pool_acquire(struct sftp_pool* pool);
+static void sftp_pool_release(struct sftp_pool* pool, struct sftp_connection* connection);
+static void sftp_pool_destroy(struct sftp_pool* pool);
 static int sftp_make_directory(char* local_dir, char* remote_dir);
-static int sftp_copy_directory(char* local_root, char* remote_root, char* relative_path);
-static int sftp_copy_file(char* local_root, char* remote_root, char* relative_path);
+static int sftp_copy_directory(struct sftp_connection* connection, char* local_root, char* remote_root, char* relative_path, struct workers* workers);
+static void do_sftp_copy_file(void* arg);
+static int sftp_upload_file(struct sftp_connection* connection, char* local_root, char* remote_root, char* relative_path, char* sha256);
+static int sftp_copy_file(struct sftp_connection* connection, char* local_root, char* remote_root, char* relative_path, char* sha256, size_t* offset);
+static int sftp_link_file(struct sftp_connection* connection, char* from, char* to);
+static int sftp_write_file(struct sftp_connection* connection, FILE* sfile, sftp_file dfile, size_t* written);
 static int sftp_wal_prepare(sftp_file* file, int segsize);
 static bool sftp_exists(char* path);
 static int sftp_get_file_size(char* file_path, size_t* file_size);
@@ -68,13 +130,19 @@ static int sftp_permission(char* path, int user, int group, int all);
 
 static ssh_session session = NULL;
 static sftp_session sftp = NULL;
+static size_t sftp_chunk_size = SFTP_SYNC_CHUNK_SIZE;
+
+static struct sftp_pool* sftp_pool = NULL;
 
 static struct hashmap* hash_map = NULL;
+static struct hashmap* backup_hash_map = NULL;
+static struct hashmap* journal_map = NULL;
+
+static FILE* journal = NULL;
+static pthread_mutex_t journal_lock = PTHREAD_MUTEX_INITIALIZER;
 
 static bool is_error = false;
 
-static char** file_paths = NULL;
-static char** hashes = NULL;
 static char* latest_remote_root = NULL;
 
 struct workflow*
@@ -107,6 +175,468 @@ pgmoneta_storage_create_ssh(int workflow_type)
 static int
 ssh_storage_setup(int server, char* identifier, struct node* i_nodes,
                   struct node** o_nodes)
+{
+   if (sftp_connect(&session, &sftp, &sftp_chunk_size))
+   {
+      goto error;
+   }
+
+   is_error = false;
+
+   return 0;
+
+error:
+
+   is_error = true;
+
+   return 1;
+}
+
+static int
+ssh_storage_backup_execute(int server, char* identifier,
+                           struct node* i_nodes, struct node** o_nodes)
+{
+   struct sftp_connection control;
+
+   memset(&control, 0, sizeof(struct sftp_connection));
+   control.session = session;
+   control.sftp = sftp;
+   control.chunk_size = sftp_chunk_size;
+
+   ssh_resume_backups(server, identifier, &control);
+
+   if (ssh_upload_backup(server, identifier, &control))
+   {
+      goto error;
+   }
+
+   session = control.session;
+   sftp = control.sftp;
+
+   is_error = false;
+
+   return 0;
+
+error:
+
+   is_error = true;
+
+   session = control.session;
+   sftp = control.sftp;
+
+   return 1;
+}
+
+static void
+ssh_resume_backups(int server, char* identifier, struct sftp_connection* control)
+{
+   char* server_path = NULL;
+   char* root = NULL;
+   char* data = NULL;
+   char* journal_path = NULL;
+   int number_of_backups = 0;
+   struct backup** backups = NULL;
+   struct configuration* config;
+
+   config = (struct configuration*)shmem;
+
+   server_path = pgmoneta_get_server_backup(server);
+
+   pgmoneta_get_backups(server_path, &number_of_backups, &backups);
+
+   for (int i = 0; i < number_of_backups; i++)
+   {
+      if (!strcmp(backups[i]->label, identifier))
+      {
+         continue;
+      }
+
+      root = pgmoneta_get_server_backup_identifier(server, backups[i]->label);
+      data = pgmoneta_get_server_backup_identifier_data(server, backups[i]->label);
+
+      journal_path = pgmoneta_append(journal_path, root);
+      journal_path = pgmoneta_append(journal_path, "backup.transfer");
+
+      /* A failed backup stays on disk with its journal, so its upload is done now */
+      if (pgmoneta_exists(journal_path) && pgmoneta_exists(data))
+      {
+         pgmoneta_log_info("SSH: Resuming the upload of %s/%s", config->servers[server].name, backups[i]->label);
+
+         if (ssh_upload_backup(server, backups[i]->label, control))
+         {
+            pgmoneta_log_warn("SSH: Could not resume the upload of %s/%s", config->servers[server].name, backups[i]->label);
+         }
+         else
+         {
+            pgmoneta_delete_directory(data);
+            pgmoneta_catalog_refresh(root);
+         }
+
+         session = control->session;
+         sftp = control->sftp;
+      }
+
+      free(root);
+      free(data);
+      free(journal_path);
+
+      root = NULL;
+      data = NULL;
+      journal_path = NULL;
+   }
+
+   for (int i = 0; i < number_of_backups; i++)
+   {
+      free(backups[i]);
+   }
+   free(backups);
+
+   free(server_path);
+}
+
+static int
+ssh_upload_backup(int server, char* identifier, struct sftp_connection* control)
+{
+   char* server_path = NULL;
+   char* local_root = NULL;
+   char* remote_root = NULL;
+   char* local_data = NULL;
+   char* remote_data = NULL;
+   char* latest_backup_sha256 = NULL;
+   char* backup_sha256 = NULL;
+   char* journal_path = NULL;
+   char* transfer = NULL;
+   int current = -1;
+   int next_newest = -1;
+   int number_of_backups = 0;
+   int number_of_workers = 0;
+   uint64_t start;
+   double elapsed;
+   double seconds;
+   unsigned long files = 0;
+   unsigned long links = 0;
+   unsigned long bytes = 0;
+   struct backup** backups = NULL;
+   struct sftp_connection* connection = NULL;
+   struct workers* workers = NULL;
+   struct configuration* config;
+
+   config = (struct configuration*)shmem;
+
+   remote_root = get_remote_server_backup_identifier(server, identifier);
+
+   local_root = pgmoneta_get_server_backup_identifier(server, identifier);
+
+   if (sftp_make_directory(local_root, remote_root) == 1)
+   {
+      pgmoneta_log_error("could not create the backup directory: %s in the remote server: %s", remote_root, strerror(errno));
+      goto error;
+   }
+
+   server_path = pgmoneta_get_server_backup(server);
+
+   pgmoneta_get_backups(server_path, &number_of_backups, &backups);
+
+   current = number_of_backups;
+   for (int j = 0; j < number_of_backups; j++)
+   {
+      if (!strcmp(backups[j]->label, identifier))
+      {
+         current = j;
+      }
+   }
+
+   /* The newest valid backup before this one, unless its upload is incomplete */
+   for (int j = current - 1; j >= 0 && next_newest == -1; j--)
+   {
+      if (backups[j]->valid == VALID_TRUE)
+      {
+         transfer = pgmoneta_get_server_backup_identifier(server, backups[j]->label);
+         transfer = pgmoneta_append(transfer, "backup.transfer");
+
+         if (!pgmoneta_exists(transfer))
+         {
+            next_newest = j;
+         }
+
+         free(transfer);
+         transfer = NULL;
+      }
+   }
+
+   if (pgmoneta_hashmap_create(16384, &hash_map) ||
+       pgmoneta_hashmap_create(16384, &backup_hash_map) ||
+       pgmoneta_hashmap_create(1024, &journal_map))
+   {
+      goto error;
+   }
+
+   if (next_newest != -1)
+   {
+      latest_remote_root = get_remote_server_backup_identifier(server, backups[next_newest]->label);
+      latest_remote_root = pgmoneta_append(latest_remote_root, "/data");
+
+      latest_backup_sha256 = pgmoneta_get_server_backup_identifier(server, backups[next_newest]->label);
+      latest_backup_sha256 = pgmoneta_append(latest_backup_sha256, "backup.sha256");
+
+      if (read_backup_sha256(latest_backup_sha256, hash_map))
+      {
+         goto error;
+      }
+   }
+
+   /* The hashes of this backup, so the files aren't read twice */
+   backup_sha256 = pgmoneta_append(backup_sha256, local_root);
+   backup_sha256 = pgmoneta_append(backup_sha256, "backup.sha256");
+
+   if (read_backup_sha256(backup_sha256, backup_hash_map))
+   {
+      pgmoneta_log_debug("SSH: No hashes in %s", backup_sha256);
+   }
+
+   /* The files of this backup uploaded by an earlier attempt */
+   journal_path = pgmoneta_append(journal_path, local_root);
+   journal_path = pgmoneta_append(journal_path, "backup.transfer");
+
+   if (pgmoneta_exists(journal_path))
+   {
+      read_backup_sha256(journal_path, journal_map);
+
+      pgmoneta_log_info("SSH: %u files of %s/%s already uploaded",
+                        pgmoneta_hashmap_size(journal_map), config->servers[server].name, identifier);
+   }
+
+   journal = fopen(journal_path, "a");
+   if (journal == NULL)
+   {
+      pgmoneta_log_error("SSH: Could not open %s: %s", journal_path, strerror(errno));
+      goto error;
+   }
+
+   number_of_workers = pgmoneta_get_number_of_workers(server);
+
+   if (sftp_pool_create(number_of_workers, &sftp_pool))
+   {
+      goto error;
+   }
+
+   if (number_of_workers > 0)
+   {
+      pgmoneta_workers_initialize(number_of_workers, &workers);
+   }
+
+   start = pgmoneta_prometheus_timer();
+
+   local_data = pgmoneta_append(local_data, local_root);
+   local_data = pgmoneta_append(local_data, "/data");
+   remote_data = pgmoneta_append(remote_data, remote_root);
+   remote_data = pgmoneta_append(remote_data, "/data");
+
+   if (sftp_copy_directory(control, local_data, remote_data, "", workers) != 0)
+   {
+      pgmoneta_log_error("failed to transfer the backup directory from the local host to the remote server: %s", strerror(errno));
+      goto error;
+   }
+
+   if (workers != NULL)
+   {
+      pgmoneta_workers_wait(workers);
+   }
+
+   if (atomic_load(&sftp_pool->failed))
+   {
+      goto error;
+   }
+
+   /* backup.info goes last, so a remote backup that has it is complete */
+   connection = sftp_pool_acquire(sftp_pool);
+
+   if (sftp_upload_file(connection, local_root, remote_root, "/backup.sha256", NULL) ||
+       sftp_upload_file(connection, local_root, remote_root, "/backup.info", NULL))
+   {
+      sftp_pool_release(sftp_pool, connection);
+      pgmoneta_log_error("SSH: Could not upload the backup information to %s", remote_root);
+      goto error;
+   }
+
+   sftp_pool_release(sftp_pool, connection);
+
+   elapsed = (pgmoneta_prometheus_timer() - start) / 1000000000.0;
+
+   for (int i = 0; i < sftp_pool->number_of_connections; i++)
+   {
+      connection = &sftp_pool->connections[i];
+      seconds = connection->elapsed / 1000000000.0;
+
+      pgmoneta_log_info("SSH: Session %d: %lu files, %lu links, %lu bytes in %.3f s (%.2f MB/s), %lu retries",
+                        i, connection->files, connection->links, connection->bytes, seconds,
+                        seconds > 0 ? connection->bytes / seconds / (1024 * 1024) : 0.0,
+                        connection->retries);
+
+      files += connection->files;
+      links += connection->links;
+      bytes += connection->bytes;
+   }
+
+   pgmoneta_log_info("SSH: %lu files, %lu links, %lu skipped, %lu bytes over %d sessions in %.3f s (%.2f MB/s)",
+                     files, links, atomic_load(&sftp_pool->skipped), bytes, sftp_pool->number_of_connections, elapsed,
+                     elapsed > 0 ? bytes / elapsed / (1024 * 1024) : 0.0);
+
+   pgmoneta_workers_destroy(workers);
+   sftp_pool_destroy(sftp_pool);
+   sftp_pool = NULL;
+
+   fclose(journal);
+   journal = NULL;
+
+   pgmoneta_delete_file(journal_path, NULL);
+
+   free_backup_sha256(hash_map);
+   free_backup_sha256(backup_hash_map);
+   free_backup_sha256(journal_map);
+   hash_map = NULL;
+   backup_hash_map = NULL;
+   journal_map = NULL;
+
+   free(latest_remote_root);
+   latest_remote_root = NULL;
+
+   for (int i = 0; i < number_of_backups; i++)
+   {
+      free(backups[i]);
+   }
+   free(backups);
+
+   free(latest_backup_sha256);
+   free(backup_sha256);
+   free(journal_path);
+   free(server_path);
+   free(remote_root);
+   free(local_root);
+   free(remote_data);
+   free(local_data);
+
+   return 0;
+
+error:
+
+   if (workers != NULL)
+   {
+      pgmoneta_workers_wait(workers);
+      pgmoneta_workers_destroy(workers);
+   }
+
+   sftp_pool_destroy(sftp_pool);
+   sftp_pool = NULL;
+
+   if (journal != NULL)
+   {
+      fclose(journal);
+      journal = NULL;
+   }
+
+   free_backup_sha256(hash_map);
+   free_backup_sha256(backup_hash_map);
+   free_backup_sha256(journal_map);
+   hash_map = NULL;
+   backup_hash_map = NULL;
+   journal_map = NULL;
+
+   free(latest_remote_root);
+   latest_remote_root = NULL;
+
+   for (int i = 0; i < number_of_backups; i++)
+   {
+      free(backups[i]);
+   }
+   free(backups);
+
+   free(latest_backup_sha256);
+   free(backup_sha256);
+   free(journal_path);
+   free(server_path);
+   free(remote_root);
+   free(local_root);
+   free(remote_data);
+   free(local_data);
+
+   return 1;
+}
+
+static int
+ssh_storage_wal_shipping_execute(int server, char* identifier,
+                                 struct node* i_nodes, struct node** o_nodes)
+{
+   char* local_root = NULL;
+   char* remote_root = NULL;
+
+   remote_root = get_remote_server_wal(server);
+   local_root = pgmoneta_get_server_wal(server);
+
+   if (sftp_make_directory(local_root, remote_root) == 1)
+   {
+      pgmoneta_log_error("could not create the wal-shipping directory: %s in the remote server: %s", remote_root, ssh_get_error(session));
+      goto error;
+   }
+   is_error = false;
+
+   free(remote_root);
+   free(local_root);
+
+   return 0;
+error:
+   is_error = true;
+
+   free(remote_root);
+   free(local_root);
+
+   return 1;
+}
+
+static int
+ssh_storage_backup_teardown(int server, char* identifier,
+                            struct node* i_nodes, struct node** o_nodes)
+{
+   char* root = NULL;
+   char* d = NULL;
+
+   if (!is_error)
+   {
+      root = pgmoneta_get_server_backup_identifier_data(server, identifier);
+   }
+   else
+   {
+      root = pgmoneta_get_server_backup_identifier(server, identifier);
+   }
+
+   pgmoneta_delete_directory(root);
+
+   d = pgmoneta_get_server_backup_identifier(server, identifier);
+   pgmoneta_catalog_refresh(d);
+
+   free(root);
+   free(d);
+
+   sftp_free(sftp);
+
+   ssh_free(session);
+
+   return 0;
+}
+
+static int
+ssh_storage_wal_shipping_teardown(int server, char* identifier,
+                                  struct node* i_nodes, struct node** o_nodes)
+{
+   sftp_free(sftp);
+
+   ssh_free(session);
+
+   return 0;
+}
+
+static int
+sftp_connect(ssh_session* s, sftp_session* f, size_t* chunk_size)
 {
    ssh_key srv_pubkey = NULL;
    ssh_key client_pubkey = NULL;
@@ -121,6 +651,9 @@ ssh_storage_setup(int server, char* identifier, struct node* i_nodes,
    size_t hash_length;
    int rc;
    enum ssh_known_hosts_e state;
+#ifdef HAVE_SFTP_AIO
+   sftp_limits_t limits = NULL;
+#endif
    struct configuration* config;
 
    config = (struct configuration*)shmem;
@@ -129,34 +662,34 @@ ssh_storage_setup(int server, char* identifier, struct node* i_nodes,
    pubkey_path = "/.ssh/id_rsa.pub";
    privkey_path = "/.ssh/id_rsa";
 
-   session = ssh_new();
+   *s = ssh_new();
 
-   if (session == NULL)
+   if (*s == NULL)
    {
       goto error;
    }
 
-   ssh_options_set(session, SSH_OPTIONS_USER, config->ssh_username);
-   ssh_options_set(session, SSH_OPTIONS_HOST, config->ssh_hostname);
+   ssh_options_set(*s, SSH_OPTIONS_USER, config->ssh_username);
+   ssh_options_set(*s, SSH_OPTIONS_HOST, config->ssh_hostname);
 
    if (strlen(config->ssh_ciphers) == 0)
    {
-      ssh_options_set(session, SSH_OPTIONS_CIPHERS_C_S, "aes256-ctr,aes192-ctr,aes128-ctr");
+      ssh_options_set(*s, SSH_OPTIONS_CIPHERS_C_S, "aes256-ctr,aes192-ctr,aes128-ctr");
    }
    else
    {
-      ssh_options_set(session, SSH_OPTIONS_CIPHERS_C_S, config->ssh_ciphers);
+      ssh_options_set(*s, SSH_OPTIONS_CIPHERS_C_S, config->ssh_ciphers);
    }
 
-   rc = ssh_connect(session);
+   rc = ssh_connect(*s);
    if (rc != SSH_OK)
    {
       pgmoneta_log_error("Remote Backup: Error connecting to %s: %s\n",
-                         config->ssh_hostname, ssh_get_error(session));
+                         config->ssh_hostname, ssh_get_error(*s));
       goto error;
    }
 
-   rc = ssh_get_server_publickey(session, &srv_pubkey);
+   rc = ssh_get_server_publickey(*s, &srv_pubkey);
    if (rc < 0)
    {
       goto error;
@@ -169,7 +702,7 @@ ssh_storage_setup(int server, char* identifier, struct node* i_nodes,
       goto error;
    }
 
-   state = ssh_session_is_known_server(session);
+   state = ssh_session_is_known_server(*s);
    switch (state)
    {
       case SSH_KNOWN_HOSTS_OK:
@@ -184,7 +717,7 @@ ssh_storage_setup(int server, char* identifier, struct node* i_nodes,
          pgmoneta_log_error("could not find known host file: %s", strerror(errno));
          goto error;
       case SSH_KNOWN_HOSTS_UNKNOWN:
-         rc = ssh_session_update_known_hosts(session);
+         rc = ssh_session_update_known_hosts(*s);
          if (rc < 0)
          {
             pgmoneta_log_error("could not update known_hosts file: %s", strerror(errno));
@@ -217,29 +750,42 @@ ssh_storage_setup(int server, char* identifier, struct node* i_nodes,
       goto error;
    }
 
-   rc = ssh_userauth_publickey(session, NULL, client_privkey);
+   rc = ssh_userauth_publickey(*s, NULL, client_privkey);
    if (rc != SSH_AUTH_SUCCESS)
    {
       pgmoneta_log_error("could not authenticate with public/private key: %s", strerror(errno));
       goto error;
    }
 
-   sftp = sftp_new(session);
+   *f = sftp_new(*s);
 
-   if (sftp == NULL)
+   if (*f == NULL)
    {
-      pgmoneta_log_error("Error: %s\n", ssh_get_error(session));
+      pgmoneta_log_error("Error: %s\n", ssh_get_error(*s));
       goto error;
    }
 
-   rc = sftp_init(sftp);
+   rc = sftp_init(*f);
    if (rc != SSH_OK)
    {
-      pgmoneta_log_error("Error: %s\n", sftp_get_error(sftp));
+      pgmoneta_log_error("Error: %s\n", sftp_get_error(*f));
       goto error;
    }
 
-   is_error = false;
+   *chunk_size = SFTP_SYNC_CHUNK_SIZE;
+
+#ifdef HAVE_SFTP_AIO
+   limits = sftp_limits(*f);
+   if (limits != NULL)
+   {
+      *chunk_size = MIN(limits->max_write_length, SFTP_CHUNK_SIZE);
+      if (*chunk_size == 0)
+      {
+         *chunk_size = SFTP_SYNC_CHUNK_SIZE;
+      }
+      sftp_limits_free(limits);
+   }
+#endif
 
    ssh_string_free_char(hexa);
    ssh_clean_pubkey_hash(&srv_pubkey_hash);
@@ -254,8 +800,6 @@ ssh_storage_setup(int server, char* identifier, struct node* i_nodes,
 
 error:
 
-   is_error = true;
-
    ssh_string_free_char(hexa);
    ssh_clean_pubkey_hash(&srv_pubkey_hash);
    ssh_key_free(srv_pubkey);
@@ -265,195 +809,158 @@ error:
    free(pubkey_full_path);
    free(privkey_full_path);
 
-   sftp_free(sftp);
-
-   ssh_disconnect(session);
-   ssh_free(session);
-   return 1;
-}
-
-static int
-ssh_storage_backup_execute(int server, char* identifier,
-                           struct node* i_nodes, struct node** o_nodes)
-{
-   char* server_path = NULL;
-   char* local_root = NULL;
-   char* remote_root = NULL;
-   char* latest_backup_sha256 = NULL;
-   int next_newest = -1;
-   int number_of_backups = 0;
-   struct backup** backups = NULL;
-
-   remote_root = get_remote_server_backup_identifier(server, identifier);
-
-   local_root = pgmoneta_get_server_backup_identifier(server, identifier);
+   sftp_free(*f);
+   *f = NULL;
 
-   if (sftp_make_directory(local_root, remote_root) == 1)
+   if (*s != NULL)
    {
-      pgmoneta_log_error("could not create the backup directory: %s in the remote server: %s", remote_root, strerror(errno));
-      goto error;
+      ssh_disconnect(*s);
+      ssh_free(*s);
+      *s = NULL;
    }
 
-   server_path = pgmoneta_get_server_backup(server);
-
-   pgmoneta_get_backups(server_path, &number_of_backups, &backups);
+   return 1;
+}
 
-   if (number_of_backups >= 2)
+static void
+sftp_disconnect(struct sftp_connection* connection)
+{
+   if (connection->sftp != NULL)
    {
-      for (int j = number_of_backups - 2; j >= 0 && next_newest == -1; j--)
-      {
-         if (backups[j]->valid == VALID_TRUE)
-         {
-            if (next_newest == -1)
-            {
-               next_newest = j;
-            }
-         }
-      }
+      sftp_free(connection->sftp);
+      connection->sftp = NULL;
    }
 
-   if (pgmoneta_hashmap_create(16384, &hash_map))
+   if (connection->session != NULL)
    {
-      goto error;
+      ssh_disconnect(connection->session);
+      ssh_free(connection->session);
+      connection->session = NULL;
    }
+}
 
-   if (next_newest != -1)
-   {
-      latest_remote_root = get_remote_server_backup_identifier(server, backups[next_newest]->label);
-
-      latest_backup_sha256 = pgmoneta_get_server_backup_identifier(server, backups[next_newest]->label);
-      latest_backup_sha256 = pgmoneta_append(latest_backup_sha256, "backup.sha256");
+static int
+sftp_reconnect(struct sftp_connection* connection)
+{
+   sftp_disconnect(connection);
 
-      if (read_latest_backup_sha256(latest_backup_sha256))
-      {
-         goto error;
-      }
-   }
+   return sftp_connect(&connection->session, &connection->sftp, &connection->chunk_size);
+}
 
-   sftp_copy_file(local_root, remote_root, "/backup.info");
-   sftp_copy_file(local_root, remote_root, "/backup.sha256");
+static int
+sftp_pool_create(int number, struct sftp_pool** pool)
+{
+   struct sftp_pool* p = NULL;
 
-   local_root = pgmoneta_append(local_root, "/data");
-   remote_root = pgmoneta_append(remote_root, "/data");
+   *pool = NULL;
 
-   if (sftp_copy_directory(local_root, remote_root, "") != 0)
+   p = (struct sftp_pool*)malloc(sizeof(struct sftp_pool));
+   if (p == NULL)
    {
-      pgmoneta_log_error("failed to transfer the backup directory from the local host to the remote server: %s", strerror(errno));
       goto error;
    }
 
-   is_error = false;
-
-   for (int i = 0; i < number_of_backups; i++)
-   {
-      free(backups[i]);
-   }
-   free(backups);
-
-   if (latest_backup_sha256 != NULL)
-   {
-      free(latest_backup_sha256);
-   }
-
-   free(server_path);
-   free(remote_root);
-   free(local_root);
-
-   return 0;
+   memset(p, 0, sizeof(struct sftp_pool));
 
-error:
+   p->number_of_connections = number > 0 ? number : 1;
+   p->connections = (struct sftp_connection*)calloc(p->number_of_connections, sizeof(struct sftp_connection));
+   p->busy = (bool*)calloc(p->number_of_connections, sizeof(bool));
 
-   is_error = true;
+   pthread_mutex_init(&p->lock, NULL);
+   pthread_cond_init(&p->available, NULL);
+   atomic_init(&p->failed, false);
+   atomic_init(&p->skipped, 0);
 
-   for (int i = 0; i < number_of_backups; i++)
+   if (p->connections == NULL || p->busy == NULL)
    {
-      free(backups[i]);
+      goto error;
    }
-   free(backups);
 
-   if (latest_backup_sha256 != NULL)
+   for (int i = 0; i < p->number_of_connections; i++)
    {
-      free(latest_backup_sha256);
-   }
-
-   free(server_path);
-   free(remote_root);
-   free(local_root);
-
-   return 1;
-}
-
-static int
-ssh_storage_wal_shipping_execute(int server, char* identifier,
-                                 struct node* i_nodes, struct node** o_nodes)
-{
-   char* local_root = NULL;
-   char* remote_root = NULL;
-
-   remote_root = get_remote_server_wal(server);
-   local_root = pgmoneta_get_server_wal(server);
-
-   if (sftp_make_directory(local_root, remote_root) == 1)
-   {
-      pgmoneta_log_error("could not create the wal-shipping directory: %s in the remote server: %s", remote_root, ssh_get_error(session));
-      goto error;
+      if (sftp_connect(&p->connections[i].session, &p->connections[i].sftp, &p->connections[i].chunk_size))
+      {
+         pgmoneta_log_error("SSH: Could not open session %d", i);
+         goto error;
+      }
    }
-   is_error = false;
 
-   free(remote_root);
-   free(local_root);
+   *pool = p;
 
    return 0;
+
 error:
-   is_error = true;
 
-   free(remote_root);
-   free(local_root);
+   sftp_pool_destroy(p);
 
    return 1;
 }
 
-static int
-ssh_storage_backup_teardown(int server, char* identifier,
-                            struct node* i_nodes, struct node** o_nodes)
-{
-   char* root = NULL;
-
-   if (!is_error)
-   {
-      root = pgmoneta_get_server_backup_identifier_data(server, identifier);
-   }
-   else
-   {
-      root = pgmoneta_get_server_backup_identifier(server, identifier);
-   }
+static struct sftp_connection*
+sftp_pool_acquire(struct sftp_pool* pool)
+{
+   struct sftp_connection* connection = NULL;
 
-   pgmoneta_delete_directory(root);
+   pthread_mutex_lock(&pool->lock);
 
-   pgmoneta_hashmap_destroy(hash_map);
-   free(hash_map);
+   while (connection == NULL)
+   {
+      for (int i = 0; connection == NULL && i < pool->number_of_connections; i++)
+      {
+         if (!pool->busy[i])
+         {
+            pool->busy[i] = true;
+            connection = &pool->connections[i];
+         }
+      }
 
-   free(root);
+      if (connection == NULL)
+      {
+         pthread_cond_wait(&pool->available, &pool->lock);
+      }
+   }
 
-   free(latest_remote_root);
+   pthread_mutex_unlock(&pool->lock);
 
-   sftp_free(sftp);
+   return connection;
+}
 
-   ssh_free(session);
+static void
+sftp_pool_release(struct sftp_pool* pool, struct sftp_connection* connection)
+{
+   pthread_mutex_lock(&pool->lock);
 
-   return 0;
+   pool->busy[connection - pool->connections] = false;
+   pthread_cond_signal(&pool->available);
+
+   pthread_mutex_unlock(&pool->lock);
 }
 
-static int
-ssh_storage_wal_shipping_teardown(int server, char* identifier,
-                                  struct node* i_nodes, struct node** o_nodes)
+static void
+sftp_pool_destroy(struct sftp_pool* pool)
 {
-   sftp_free(sftp);
+   if (pool == NULL)
+   {
+      return;
+   }
 
-   ssh_free(session);
+   if (pool->connections != NULL)
+   {
+      for (int i = 0; i < pool->number_of_connections; i++)
+      {
+         sftp_disconnect(&pool->connections[i]);
+      }
+   }
 
-   return 0;
+   pthread_cond_destroy(&pool->available);
+   pthread_mutex_destroy(&pool->lock);
+
+   free(pool->connections);
+   free(pool->busy);
+   free(pool);
 }
+
+
 static int
 sftp_make_directory(char* local_dir, char* remote_dir)
 {
@@ -499,15 +1006,15 @@ error:
    return 1;
 }
 
+
 static int
-sftp_copy_directory(char* local_root, char* remote_root, char* relative_path)
+sftp_copy_directory(struct sftp_connection* connection, char* local_root, char* remote_root, char* relative_path, struct workers* workers)
 {
    char* from = NULL;
    char* to = NULL;
-   char* relative_file;
-   int rc;
-   DIR* dir;
+   DIR* dir = NULL;
    struct dirent* entry;
+   struct sftp_upload* upload = NULL;
    mode_t mode = 0;
 
    from = pgmoneta_append(from, local_root);
@@ -523,13 +1030,27 @@ sftp_copy_directory(char* local_root, char* remote_root, char* relative_path)
 
    mode = pgmoneta_get_permission(from);
 
-   rc = sftp_mkdir(sftp, to, mode);
-   if (rc != SSH_OK)
+   for (int attempt = 1; ; attempt++)
    {
-      if (sftp_get_error(sftp) != SSH_FX_FILE_ALREADY_EXISTS)
+      if (connection->sftp != NULL)
+      {
+         if (sftp_mkdir(connection->sftp, to, mode) == SSH_OK ||
+             sftp_get_error(connection->sftp) == SSH_FX_FILE_ALREADY_EXISTS)
+         {
+            break;
+         }
+      }
+
+      if (attempt >= SFTP_RETRIES)
       {
+         pgmoneta_log_error("SSH: Could not create the directory %s", to);
          goto error;
       }
+
+      pgmoneta_log_warn("SSH: Retrying the directory %s", to);
+
+      sleep(attempt);
+      sftp_reconnect(connection);
    }
 
    while ((entry = readdir(dir)) != NULL)
@@ -545,23 +1066,30 @@ sftp_copy_directory(char* local_root, char* remote_root, char* relative_path)
 
          snprintf(relative_dir, sizeof(relative_dir), "%s/%s", relative_path, entry->d_name);
 
-         sftp_copy_directory(local_root, remote_root, relative_dir);
+         if (sftp_copy_directory(connection, local_root, remote_root, relative_dir, workers))
+         {
+            goto error;
+         }
       }
       else
       {
-         relative_file = NULL;
-
-         relative_file = pgmoneta_append(relative_file, relative_path);
-         relative_file = pgmoneta_append(relative_file, "/");
-         relative_file = pgmoneta_append(relative_file, entry->d_name);
+         upload = (struct sftp_upload*)malloc(sizeof(struct sftp_upload));
 
-         if (sftp_copy_file(local_root, remote_root, relative_file))
+         if (upload == NULL)
          {
-            free(relative_file);
             goto error;
          }
 
-         free(relative_file);
+         memset(upload, 0, sizeof(struct sftp_upload));
+
+         snprintf(upload->local_root, sizeof(upload->local_root), "%s", local_root);
+         snprintf(upload->remote_root, sizeof(upload->remote_root), "%s", remote_root);
+         snprintf(upload->relative_path, sizeof(upload->relative_path), "%s/%s", relative_path, entry->d_name);
+
+         if (workers == NULL || pgmoneta_workers_add(workers, do_sftp_copy_file, (void*)upload))
+         {
+            do_sftp_copy_file(upload);
+         }
       }
    }
 
@@ -574,7 +1102,10 @@ sftp_copy_directory(char* local_root, char* remote_root, char* relative_path)
 
 error:
 
-   closedir(dir);
+   if (dir != NULL)
+   {
+      closedir(dir);
+   }
 
    free(from);
    free(to);
@@ -582,20 +1113,108 @@ error:
    return 1;
 }
 
+static void
+do_sftp_copy_file(void* arg)
+{
+   char* sha256 = NULL;
+   char* journal_sha256 = NULL;
+   char* path = NULL;
+   struct sftp_upload* upload = NULL;
+   struct sftp_connection* connection = NULL;
+
+   upload = (struct sftp_upload*)arg;
+
+   if (atomic_load(&sftp_pool->failed))
+   {
+      goto done;
+   }
+
+   if (pgmoneta_hashmap_contains_key(backup_hash_map, upload->relative_path))
+   {
+      sha256 = strdup((char*)pgmoneta_hashmap_get(backup_hash_map, upload->relative_path));
+   }
+   else
+   {
+      path = pgmoneta_append(path, upload->local_root);
+      path = pgmoneta_append(path, upload->relative_path);
+
+      pgmoneta_generate_file_sha256_hash(path, &sha256);
+   }
+
+   if (sha256 == NULL)
+   {
+      pgmoneta_log_error("SSH: Could not calculate the hash of %s%s", upload->local_root, upload->relative_path);
+      atomic_store(&sftp_pool->failed, true);
+      goto done;
+   }
+
+   journal_sha256 = (char*)pgmoneta_hashmap_get(journal_map, upload->relative_path);
+   if (journal_sha256 != NULL && !strcmp(journal_sha256, sha256))
+   {
+      atomic_fetch_add(&sftp_pool->skipped, 1);
+      goto done;
+   }
+
+   connection = sftp_pool_acquire(sftp_pool);
+
+   if (sftp_upload_file(connection, upload->local_root, upload->remote_root, upload->relative_path, sha256))
+   {
+      pgmoneta_log_error("SSH: Could not upload %s%s", upload->local_root, upload->relative_path);
+      atomic_store(&sftp_pool->failed, true);
+   }
+   else
+   {
+      journal_append(upload->relative_path, sha256);
+   }
+
+   sftp_pool_release(sftp_pool, connection);
+
+done:
+
+   free(sha256);
+   free(path);
+   free(upload);
+}
+
+static int
+sftp_upload_file(struct sftp_connection* connection, char* local_root, char* remote_root, char* relative_path, char* sha256)
+{
+   size_t offset = 0;
+
+   for (int attempt = 1; ; attempt++)
+   {
+      if (connection->sftp != NULL &&
+          !sftp_copy_file(connection, local_root, remote_root, relative_path, sha256, &offset))
+      {
+         return 0;
+      }
+
+      if (attempt >= SFTP_RETRIES)
+      {
+         return 1;
+      }
+
+      pgmoneta_log_warn("SSH: Retrying %s%s from byte %zu", local_root, relative_path, offset);
+
+      connection->retries++;
+
+      sleep(attempt);
+      sftp_reconnect(connection);
+   }
+}
+
 static int
-sftp_copy_file(char* local_root, char* remote_root, char* relative_path)
+sftp_copy_file(struct sftp_connection* connection, char* local_root, char* remote_root, char* relative_path, char* sha256, size_t* offset)
 {
    char* s = NULL;
    char* d = NULL;
-   char* sha256 = NULL;
    char* latest_sha256 = NULL;
    char* latest_backup_path = NULL;
-   char buffer[16384];
    FILE* sfile = NULL;
    sftp_file dfile = NULL;
-   unsigned long read_bytes = 0;
+   size_t start_offset = 0;
+   uint64_t start;
    mode_t mode = 0;
-   bool is_link = false;
 
    s = pgmoneta_append(s, local_root);
    s = pgmoneta_append(s, relative_path);
@@ -603,58 +1222,67 @@ sftp_copy_file(char* local_root, char* remote_root, char* relative_path)
    d = pgmoneta_append(d, remote_root);
    d = pgmoneta_append(d, relative_path);
 
-   pgmoneta_generate_file_sha256_hash(s, &sha256);
-
-   if (latest_remote_root != NULL)
+   if (sha256 != NULL && latest_remote_root != NULL && *offset == 0)
    {
-      latest_backup_path = pgmoneta_append(latest_backup_path, latest_remote_root);
-      latest_backup_path = pgmoneta_append(latest_backup_path, relative_path);
+      latest_sha256 = (char*)pgmoneta_hashmap_get(hash_map, relative_path);
 
-      if (pgmoneta_hashmap_contains_key(hash_map, relative_path))
+      if (latest_sha256 != NULL && !strcmp(latest_sha256, sha256))
       {
-         latest_sha256 = pgmoneta_hashmap_get(hash_map, relative_path);
+         latest_backup_path = pgmoneta_append(latest_backup_path, latest_remote_root);
+         latest_backup_path = pgmoneta_append(latest_backup_path, relative_path);
 
-         if (!strcmp(latest_sha256, sha256))
+         if (!sftp_link_file(connection, latest_backup_path, d))
          {
-            is_link = true;
+            connection->links++;
+            goto done;
          }
       }
    }
 
-   if (is_link)
+   mode = pgmoneta_get_permission(s);
+
+   start = pgmoneta_prometheus_timer();
+
+   sfile = fopen(s, "rb");
+
+   if (sfile == NULL)
    {
-      if (sftp_symlink(sftp, latest_backup_path, d) < 0)
-      {
-         pgmoneta_log_error("Failed to link remotely: %s", ssh_get_error(session));
-         goto error;
-      }
+      goto error;
    }
-   else
-   {
-      mode = pgmoneta_get_permission(s);
 
-      sfile = fopen(s, "rb");
-
-      if (sfile == NULL)
-      {
-         goto error;
-      }
+   dfile = sftp_open(connection->sftp, d, O_WRONLY | O_CREAT | (*offset == 0 ? O_TRUNC : 0), mode);
 
-      dfile = sftp_open(sftp, d, O_WRONLY | O_CREAT | O_TRUNC, mode);
+   if (dfile == NULL)
+   {
+      pgmoneta_log_error("Failed to open %s remotely: %s", d, ssh_get_error(connection->session));
+      goto error;
+   }
 
-      if (dfile == NULL)
+   if (*offset > 0)
+   {
+      if (fseeko(sfile, *offset, SEEK_SET) != 0 || sftp_seek64(dfile, *offset) < 0)
       {
          goto error;
       }
+   }
 
-      memset(buffer, 0, sizeof(buffer));
+   start_offset = *offset;
 
-      while ((read_bytes = fread(buffer, 1, sizeof(buffer), sfile)) > 0)
-      {
-         sftp_write(dfile, buffer, read_bytes);
-      }
+   if (sftp_write_file(connection, sfile, dfile, offset))
+   {
+      pgmoneta_log_error("Failed to write %s remotely: %s", d, ssh_get_error(connection->session));
+      connection->bytes += *offset - start_offset;
+      goto error;
    }
 
+   connection->files++;
+   connection->bytes += *offset - start_offset;
+   connection->elapsed += pgmoneta_prometheus_timer() - start;
+
+   pgmoneta_prometheus_observe(HISTOGRAM_UPLOAD, start);
+
+done:
+
    if (sfile != NULL)
    {
       fclose(sfile);
@@ -667,12 +1295,7 @@ sftp_copy_file(char* local_root, char* remote_root, char* relative_path)
 
    free(s);
    free(d);
-   free(sha256);
-
-   if (latest_backup_path != NULL)
-   {
-      free(latest_backup_path);
-   }
+   free(latest_backup_path);
 
    return 0;
 
@@ -690,12 +1313,145 @@ error:
 
    free(s);
    free(d);
-   free(sha256);
+   free(latest_backup_path);
+
+   return 1;
+}
+
+static int
+sftp_link_file(struct sftp_connection* connection, char* from, char* to)
+{
+   int rc;
+
+   for (int attempt = 0; attempt < 2; attempt++)
+   {
+      if (attempt > 0)
+      {
+         /* A file left by an earlier attempt */
+         sftp_unlink(connection->sftp, to);
+      }
+
+#ifdef HAVE_SFTP_HARDLINK
+      if (sftp_extension_supported(connection->sftp, "hardlink@openssh.com", "1"))
+      {
+         rc = sftp_hardlink(connection->sftp, from, to);
+      }
+      else
+      {
+         rc = sftp_symlink(connection->sftp, from, to);
+      }
+#else
+      rc = sftp_symlink(connection->sftp, from, to);
+#endif
+
+      if (rc == SSH_OK)
+      {
+         return 0;
+      }
+   }
+
+   pgmoneta_log_debug("SSH: Could not link %s to %s: %s", to, from, ssh_get_error(connection->session));
+
+   return 1;
+}
+
+static int
+sftp_write_file(struct sftp_connection* connection, FILE* sfile, sftp_file dfile, size_t* written)
+{
+   char* buffer = NULL;
+   size_t read_bytes = 0;
+   ssize_t rc;
+#ifdef HAVE_SFTP_AIO
+   sftp_aio aio[SFTP_IN_FLIGHT];
+   int head = 0;
+   int tail = 0;
+   int in_flight = 0;
+   bool eof = false;
+#endif
+
+   buffer = (char*)malloc(connection->chunk_size);
+   if (buffer == NULL)
+   {
+      goto error;
+   }
+
+#ifdef HAVE_SFTP_AIO
+   /* Keep up to SFTP_IN_FLIGHT write requests outstanding, so the upload
+    * isn't bound by the round trip time of the link */
+   while (!eof || in_flight > 0)
+   {
+      while (!eof && in_flight < SFTP_IN_FLIGHT)
+      {
+         read_bytes = fread(buffer, 1, connection->chunk_size, sfile);
+         if (read_bytes == 0)
+         {
+            if (ferror(sfile))
+            {
+               goto error;
+            }
+            eof = true;
+            break;
+         }
+
+         rc = sftp_aio_begin_write(dfile, buffer, read_bytes, &aio[head]);
+         if (rc < 0)
+         {
+            goto error;
+         }
+
+         head = (head + 1) % SFTP_IN_FLIGHT;
+         in_flight++;
+      }
+
+      if (in_flight > 0)
+      {
+         rc = sftp_aio_wait_write(&aio[tail]);
+
+         tail = (tail + 1) % SFTP_IN_FLIGHT;
+         in_flight--;
+
+         if (rc < 0)
+         {
+            goto error;
+         }
 
-   if (latest_backup_path != NULL)
+         *written += rc;
+      }
+   }
+#else
+   while ((read_bytes = fread(buffer, 1, connection->chunk_size, sfile)) > 0)
+   {
+      rc = sftp_write(dfile, buffer, read_bytes);
+      if (rc < 0 || (size_t)rc != read_bytes)
+      {
+         goto error;
+      }
+
+      *written += rc;
+   }
+
+   if (ferror(sfile))
+   {
+      goto error;
+   }
+#endif
+
+   free(buffer);
+
+   return 0;
+
+error:
+
+#ifdef HAVE_SFTP_AIO
+   while (in_flight > 0)
    {
-      free(latest_backup_path);
+      sftp_aio_free(aio[tail]);
+      tail = (tail + 1) % SFTP_IN_FLIGHT;
+      in_flight--;
    }
+#endif
+
+   free(buffer);
 
    return 1;
 }
@@ -725,11 +1481,12 @@ sftp_wal_prepare(sftp_file* file, int segsize)
 }
 
 static int
-read_latest_backup_sha256(char* path)
+read_backup_sha256(char* path, struct hashmap* map)
 {
    char buffer[4096];
-   int n = 0;
-   int lines = 0;
+   char* key = NULL;
+   char* value = NULL;
+   char* ptr = NULL;
    FILE* file = NULL;
 
    file = fopen(path, "r");
@@ -738,41 +1495,40 @@ read_latest_backup_sha256(char* path)
       goto error;
    }
 
-   while ((fgets(&buffer[0], sizeof(buffer), file)) != NULL)
-   {
-      lines++;
-   }
-
-   fclose(file);
-
-   file = fopen(path, "r");
-
-   file_paths = (char**)malloc(sizeof(char*) * lines);
-   hashes = (char**)malloc(sizeof(char*) * lines);
-
    memset(&buffer[0], 0, sizeof(buffer));
 
    while ((fgets(&buffer[0], sizeof(buffer), file)) != NULL)
    {
-      char* ptr = NULL;
-      ptr = strtok(&buffer[0], ":");
+      buffer[strcspn(&buffer[0], "\n")] = '\0';
 
-      file_paths[n] = (char*)malloc(strlen(ptr) + 1);
-      memset(file_paths[n], 0, strlen(ptr) + 1);
-      memcpy(file_paths[n], ptr, strlen(ptr));
+      ptr = strrchr(&buffer[0], ':');
+      if (ptr == NULL)
+      {
+         continue;
+      }
 
-      ptr = strtok(NULL, ":");
+      *ptr = '\0';
 
-      hashes[n] = (char*)malloc(strlen(ptr));
-      memset(hashes[n], 0, strlen(ptr));
-      memcpy(hashes[n], ptr, strlen(ptr) - 1);
+      key = strdup(&buffer[0]);
+      value = strdup(ptr + 1);
+
+      if (key == NULL || value == NULL)
+      {
+         goto error;
+      }
 
-      if (pgmoneta_hashmap_put(hash_map, file_paths[n], hashes[n]))
+      if (pgmoneta_hashmap_contains_key(map, key))
+      {
+         free(key);
+         free(value);
+      }
+      else if (pgmoneta_hashmap_put(map, key, value))
       {
          goto error;
       }
 
-      n++;
+      key = NULL;
+      value = NULL;
    }
 
    fclose(file);
@@ -781,6 +1537,9 @@ read_latest_backup_sha256(char* path)
 
 error:
 
+   free(key);
+   free(value);
+
    if (file != NULL)
    {
       fclose(file);
@@ -789,6 +1548,56 @@ error:
    return 1;
 }
 
+static void
+free_backup_sha256(struct hashmap* map)
+{
+   char** keys = NULL;
+   unsigned int size;
+
+   if (map == NULL)
+   {
+      return;
+   }
+
+   size = pgmoneta_hashmap_size(map);
+
+   if (size > 0 && !pgmoneta_hashmap_key_set(map, &keys))
+   {
+      for (unsigned int i = 0; i < size; i++)
+      {
+         free(pgmoneta_hashmap_get(map, keys[i]));
+      }
+      for (unsigned int i = 0; i < size; i++)
+      {
+         free(keys[i]);
+      }
+      free(keys);
+   }
+
+   pgmoneta_hashmap_destroy(map);
+   free(map);
+}
+
+static int
+journal_append(char* relative_path, char* sha256)
+{
+   int ret = 0;
+
+   pthread_mutex_lock(&journal_lock);
+
+   if (journal != NULL)
+   {
+      if (fprintf(journal, "%s:%s\n", relative_path, sha256) < 0 || fflush(journal) != 0)
+      {
+         ret = 1;
+      }
+   }
+
+   pthread_mutex_unlock(&journal_lock);
+
+   return ret;
+}
+
 static char*
 get_remote_server_basepath(int server)
 {
@@ -34,6 +34,7 @@
 #include <network.h>
 #include <prometheus.h>
 #include <security.h>
+#include <shmem.h>
 #include <utils.h>
 
 /* system */
@@ -55,6 +56,7 @@
 #include <openssl/ssl.h>
 #include <netinet/in.h>
 #include <sys/socket.h>
+#include <sys/stat.h>
 #include <sys/types.h>
 
 #define SECURITY_INVALID  -2
@@ -68,6 +70,19 @@
 #define NUMBER_OF_SECURITY_MESSAGES    5
 #define SECURITY_BUFFER_SIZE        1024
 
+#define SHA256_REGISTRY_SIZE   (256 * 1024)
+#define SHA256_REGISTRY_PROBES 1024
+
+/* A recorded file, keyed by a hash of its path */
+struct sha256_entry
+{
+   atomic_uint_fast64_t key;                   /**< The key, 0 for a free entry */
+   atomic_bool ready;                          /**< Is the entry complete */
+   off_t size;                                 /**< The size of the file */
+   struct timespec modified;                   /**< The modification time of the file */
+   unsigned char hash[SHA256_DIGEST_LENGTH];   /**< The digest */
+};
+
 static signed char has_security;
 static ssize_t security_lengths[NUMBER_OF_SECURITY_MESSAGES];
 static char security_messages[NUMBER_OF_SECURITY_MESSAGES][SECURITY_BUFFER_SIZE];
@@ -78,6 +93,10 @@ static int generate_md5(char* str, int length, char** md5);
 
 static int client_scram256(SSL* c_ssl, int client_fd, char* username, char* password, int slot);
 
+static uint64_t sha256_registry_key(char* path);
+
+static struct sha256_entry* sha256_registry = NULL;
+
 static int server_trust(void);
 static int server_password(char* username, char* password, SSL* ssl, int server_fd);
 static int server_md5(char* username, char* password, SSL* ssl, int server_fd);
@@ -2859,6 +2878,142 @@ pgmoneta_generate_file_sha256_hash(char* filename, char** sha256)
    return 0;
 }
 
+int
+pgmoneta_sha256_registry_start(void)
+{
+   struct configuration* config;
+
+   config = (struct configuration*)shmem;
+
+   if (sha256_registry != NULL)
+   {
+      return 0;
+   }
+
+   if (pgmoneta_create_shared_memory(SHA256_REGISTRY_SIZE * sizeof(struct sha256_entry), config->hugepage,
+                                     (void**)&sha256_registry))
+   {
+      sha256_registry = NULL;
+      return 1;
+   }
+
+   // the mapping starts out zeroed, so the pages are only touched as files are recorded
+   return 0;
+}
+
+bool
+pgmoneta_sha256_registry_active(void)
+{
+   return sha256_registry != NULL;
+}
+
+void
+pgmoneta_sha256_registry_add(char* path, int fd, unsigned char* hash)
+{
+   uint64_t key;
+   uint_fast64_t expected;
+   struct stat st;
+   struct sha256_entry* entry = NULL;
+
+   if (sha256_registry == NULL || fstat(fd, &st) != 0)
+   {
+      return;
+   }
+
+   key = sha256_registry_key(path);
+
+   for (int i = 0; i < SHA256_REGISTRY_PROBES; i++)
+   {
+      entry = &sha256_registry[(key + i) & (SHA256_REGISTRY_SIZE - 1)];
+
+      expected = 0;
+      if (atomic_compare_exchange_strong(&entry->key, &expected, key) || expected == key)
+      {
+         atomic_store(&entry->ready, false);
+
+         entry->size = st.st_size;
+         entry->modified = st.st_mtim;
+         memcpy(&entry->hash[0], hash, SHA256_DIGEST_LENGTH);
+
+         atomic_store(&entry->ready, true);
+
+         return;
+      }
+   }
+
+   // the registry is full, the file is read again when its hash is needed
+}
+
+int
+pgmoneta_sha256_registry_get(char* path, char** sha256)
+{
+   uint64_t key;
+   uint_fast64_t current;
+   char* sha256_buf = NULL;
+   struct stat st;
+   struct sha256_entry* entry = NULL;
+
+   *sha256 = NULL;
+
+   if (sha256_registry == NULL)
+   {
+      return 1;
+   }
+
+   key = sha256_registry_key(path);
+
+   for (int i = 0; i < SHA256_REGISTRY_PROBES; i++)
+   {
+      entry = &sha256_registry[(key + i) & (SHA256_REGISTRY_SIZE - 1)];
+
+      current = atomic_load(&entry->key);
+      if (current == 0)
+      {
+         return 1;
+      }
+
+      if (current != key)
+      {
+         continue;
+      }
+
+      // a file that was written again or replaced by a link has to be read
+      if (!atomic_load(&entry->ready) || stat(path, &st) != 0 || st.st_size != entry->size ||
+          st.st_mtim.tv_sec != entry->modified.tv_sec || st.st_mtim.tv_nsec != entry->modified.tv_nsec)
+      {
+         return 1;
+      }
+
+      sha256_buf = malloc(65);
+      if (sha256_buf == NULL)
+      {
+         return 1;
+      }
+
+      for (int j = 0; j < SHA256_DIGEST_LENGTH; j++)
+      {
+         sprintf(&sha256_buf[j * 2], "%02x", entry->hash[j]);
+      }
+      sha256_buf[64] = 0;
+
+      *sha256 = sha256_buf;
+
+      return 0;
+   }
+
+   return 1;
+}
+
+void
+pgmoneta_sha256_registry_stop(void)
+{
+   if (sha256_registry != NULL)
+   {
+      pgmoneta_destroy_shared_memory(sha256_registry, SHA256_REGISTRY_SIZE * sizeof(struct sha256_entry));
+      sha256_registry = NULL;
+   }
+}
+
 int
 pgmoneta_generate_string_sha256_hash(char* string, char** sha256)
 {
@@ -2979,3 +3134,25 @@ pgmoneta_close_ssl(SSL* ssl)
       SSL_CTX_free(ctx);
    }
 }
+
+static uint64_t
+sha256_registry_key(char* path)
+{
+   uint64_t key = 14695981039346656037ULL;
+   char previous = '\0';
+
+   // FNV-1a over the path, with repeated slashes counted once
+   for (char* p = path; *p != '\0'; p++)
+   {
+      if (*p == '/' && previous == '/')
+      {
+         continue;
+      }
+
+      key ^= (unsigned char)*p;
+      key *= 1099511628211ULL;
+      previous = *p;
+   }
+
+   return key != 0 ? key : 1;
+}
@@ -37,6 +37,7 @@
 
 void* shmem = NULL;
 void* prometheus_cache_shmem = NULL;
+void* catalog_shmem = NULL;
 
 int
 pgmoneta_create_shared_memory(size_t size, unsigned char hp, void** shmem)
@@ -29,6 +29,7 @@
 /* pgmoneta */
 #include <pgmoneta.h>
 #include <logging.h>
+#include <pipeline.h>
 #include <restore.h>
 #include <utils.h>
 #include <workers.h>
@@ -56,6 +57,14 @@
 #include <sys/stat.h>
 #include <sys/types.h>
 
+#ifdef HAVE_LINUX
+#include <linux/fs.h>
+#include <sys/ioctl.h>
+#include <sys/sendfile.h>
+#endif
+
+#define COPY_BUFFER_SIZE (1024 * 1024)
+
 #ifndef EVBACKEND_LINUXAIO
 #define EVBACKEND_LINUXAIO 0x00000040U
 #endif
@@ -70,6 +79,9 @@ static bool env_changed = false;
 static int max_process_title_size = 0;
 #endif
 
+static atomic_ulong copy_files[NUMBER_OF_COPY_METHODS];
+static atomic_ulong copy_bytes[NUMBER_OF_COPY_METHODS];
+
 static int string_compare(const void* a, const void* b);
 
 static bool is_wal_file(char* file);
@@ -77,10 +89,20 @@ static bool is_wal_file(char* file);
 static char* get_server_basepath(int server);
 
 static int copy_tablespaces(char* from, char* to, char* base, char* server, char* id, struct backup* backup, struct workers* workers);
+static int copy_directory(char* from, char* to, char** restore_last_files_names, bool restore, struct workers* workers);
+static bool is_restore_last_file(char* path, char** restore_last_files_names, bool restore);
+static int restore_file(char* from, char* to, struct workers* workers);
 
 static int get_permissions(char* from, int* permissions);
 
 static void copy_file(void* arg);
+static int copy_file_data(int fd_from, int fd_to, off_t size, int* method);
+#ifdef HAVE_LINUX
+static bool copy_file_clone(int fd_from, int fd_to);
+static bool copy_file_range_all(int fd_from, int fd_to, off_t* copied);
+static bool copy_file_sendfile(int fd_from, int fd_to, off_t* copied);
+#endif
+static int copy_file_read_write(int fd_from, int fd_to, off_t* copied);
 static void delete_file(void* arg);
 
 int32_t
@@ -1117,8 +1139,6 @@ pgmoneta_directory_size(char* directory)
    DIR* dir;
    struct dirent* entry;
    char* p;
-   struct stat st;
-   unsigned long l;
 
    if (!(dir = opendir(directory)))
    {
@@ -1140,7 +1160,7 @@ pgmoneta_directory_size(char* directory)
 
          total_size += pgmoneta_directory_size(path);
       }
-      else if (entry->d_type == DT_REG)
+      else if (entry->d_type == DT_REG || entry->d_type == DT_LNK)
       {
          p = NULL;
 
@@ -1148,42 +1168,55 @@ pgmoneta_directory_size(char* directory)
          p = pgmoneta_append(p, "/");
          p = pgmoneta_append(p, entry->d_name);
 
-         memset(&st, 0, sizeof(struct stat));
+         total_size += pgmoneta_disk_usage(p);
 
-         stat(p, &st);
+         free(p);
+      }
+   }
 
-         l = st.st_size / st.st_blksize;
+   closedir(dir);
 
-         if (st.st_size % st.st_blksize != 0)
-         {
-            l += 1;
-         }
+   return total_size;
+}
 
-         total_size += (l * st.st_blksize);
+unsigned long
+pgmoneta_disk_usage(char* path)
+{
+   struct stat st;
+   unsigned long l;
 
-         free(p);
-      }
-      else if (entry->d_type == DT_LNK)
-      {
-         p = NULL;
+   memset(&st, 0, sizeof(struct stat));
 
-         p = pgmoneta_append(p, directory);
-         p = pgmoneta_append(p, "/");
-         p = pgmoneta_append(p, entry->d_name);
+   if (lstat(path, &st))
+   {
+      errno = 0;
+      return 0;
+   }
 
-         memset(&st, 0, sizeof(struct stat));
+   if (S_ISDIR(st.st_mode))
+   {
+      return pgmoneta_directory_size(path);
+   }
+   else if (S_ISLNK(st.st_mode))
+   {
+      memset(&st, 0, sizeof(struct stat));
+      stat(path, &st);
 
-         stat(p, &st);
+      return st.st_blksize;
+   }
+   else if (!S_ISREG(st.st_mode) || st.st_blksize <= 0)
+   {
+      return 0;
+   }
 
-         total_size += st.st_blksize;
+   l = st.st_size / st.st_blksize;
 
-         free(p);
-      }
+   if (st.st_size % st.st_blksize != 0)
+   {
+      l += 1;
    }
 
-   closedir(dir);
-
-   return total_size;
+   return l * st.st_blksize;
 }
 
 int
@@ -1561,6 +1594,7 @@ pgmoneta_copy_postgresql(char* from, char* to, char* base, char* server, char* i
    struct dirent* entry;
    struct stat statbuf;
    char** restore_last_files_names = NULL;
+   int result = 0;
 
    if (pgmoneta_get_restore_last_files_names(&restore_last_files_names))
    {
@@ -1610,30 +1644,24 @@ pgmoneta_copy_postgresql(char* from, char* to, char* base, char* server, char* i
             {
                if (!strcmp(entry->d_name, "pg_tblspc"))
                {
-                  copy_tablespaces(from, to, base, server, id, backup, workers);
+                  if (copy_tablespaces(from, to, base, server, id, backup, workers))
+                  {
+                     result = 1;
+                  }
                }
                else
                {
-                  pgmoneta_copy_directory(from_buffer, to_buffer, restore_last_files_names, workers);
-               }
-            }
-            else
-            {
-               bool file_is_excluded = false;
-               if (restore_last_files_names != NULL)
-               {
-                  for (int i = 0; restore_last_files_names[i] != NULL; i++)
+                  if (copy_directory(from_buffer, to_buffer, restore_last_files_names, true, workers))
                   {
-                     file_is_excluded = !strcmp(from_buffer, restore_last_files_names[i]);
-                  }
-                  if (!file_is_excluded)
-                  {
-                     pgmoneta_copy_file(from_buffer, to_buffer, workers);
+                     result = 1;
                   }
                }
-               else
+            }
+            else if (!is_restore_last_file(from_buffer, restore_last_files_names, true))
+            {
+               if (restore_file(from_buffer, to_buffer, workers))
                {
-                  pgmoneta_copy_file(from_buffer, to_buffer, workers);
+                  result = 1;
                }
             }
          }
@@ -1660,7 +1688,7 @@ pgmoneta_copy_postgresql(char* from, char* to, char* base, char* server, char* i
       free(restore_last_files_names);
    }
 
-   return 0;
+   return result;
 
 error:
    if (restore_last_files_names != NULL)
@@ -1681,6 +1709,7 @@ copy_tablespaces(char* from, char* to, char* base, char* server, char* id, struc
    char* from_tblspc = NULL;
    char* to_tblspc = NULL;
    int idx = -1;
+   int result = 0;
    DIR* d = NULL;
    ssize_t size;
    struct dirent* entry;
@@ -1785,7 +1814,10 @@ copy_tablespaces(char* from, char* to, char* base, char* server, char* id, struc
             pgmoneta_mkdir(to_directory);
             pgmoneta_symlink_at_file(to_oid, relative_directory);
 
-            pgmoneta_copy_directory(&path[0], to_directory, NULL, workers);
+            if (copy_directory(&path[0], to_directory, NULL, true, workers))
+            {
+               result = 1;
+            }
 
             free(to_oid);
             free(to_directory);
@@ -1809,7 +1841,7 @@ copy_tablespaces(char* from, char* to, char* base, char* server, char* id, struc
    free(from_tblspc);
    free(to_tblspc);
 
-   return 0;
+   return result;
 
 error:
 
@@ -1821,12 +1853,19 @@ error:
 
 int
 pgmoneta_copy_directory(char* from, char* to, char** restore_last_files_names, struct workers* workers)
+{
+   return copy_directory(from, to, restore_last_files_names, false, workers);
+}
+
+static int
+copy_directory(char* from, char* to, char** restore_last_files_names, bool restore, struct workers* workers)
 {
    DIR* d = opendir(from);
    char* from_buffer = NULL;
    char* to_buffer = NULL;
    struct dirent* entry;
    struct stat statbuf;
+   int result = 0;
 
    pgmoneta_mkdir(to);
 
@@ -1851,20 +1890,18 @@ pgmoneta_copy_directory(char* from, char* to, char** restore_last_files_names, s
          {
             if (S_ISDIR(statbuf.st_mode))
             {
-               pgmoneta_copy_directory(from_buffer, to_buffer, restore_last_files_names, workers);
+               if (copy_directory(from_buffer, to_buffer, restore_last_files_names, restore, workers))
+               {
+                  result = 1;
+               }
             }
-            else
+            else if (!is_restore_last_file(from_buffer, restore_last_files_names, restore))
             {
-               bool file_is_excluded = false;
-               if (restore_last_files_names != NULL)
+               if (restore)
                {
-                  for (int i = 0; restore_last_files_names[i] != NULL; i++)
+                  if (restore_file(from_buffer, to_buffer, workers))
                   {
-                     file_is_excluded = !strcmp(from_buffer, restore_last_files_names[i]);
-                  }
-                  if (!file_is_excluded)
-                  {
-                     pgmoneta_copy_file(from_buffer, to_buffer, workers);
+                     result = 1;
                   }
                }
                else
@@ -1887,13 +1924,67 @@ pgmoneta_copy_directory(char* from, char* to, char** restore_last_files_names, s
       goto error;
    }
 
-   return 0;
+   return result;
 
 error:
 
    return 1;
 }
 
+static bool
+is_restore_last_file(char* path, char** restore_last_files_names, bool restore)
+{
+   bool found = false;
+   char* name = NULL;
+
+   if (restore_last_files_names == NULL)
+   {
+      return false;
+   }
+
+   if (restore)
+   {
+      name = pgmoneta_restored_file_name(path);
+   }
+   else
+   {
+      name = pgmoneta_append(NULL, path);
+   }
+
+   if (name == NULL)
+   {
+      return false;
+   }
+
+   for (int i = 0; !found && restore_last_files_names[i] != NULL; i++)
+   {
+      found = !strcmp(name, restore_last_files_names[i]);
+   }
+
+   free(name);
+
+   return found;
+}
+
+static int
+restore_file(char* from, char* to, struct workers* workers)
+{
+   int result;
+   char* name = NULL;
+
+   name = pgmoneta_restored_file_name(to);
+   if (name == NULL)
+   {
+      return 1;
+   }
+
+   result = pgmoneta_restore_stored_file(from, name, workers);
+
+   free(name);
+
+   return result;
+}
+
 static int
 get_permissions(char* from, int* permissions)
 {
@@ -1931,15 +2022,55 @@ pgmoneta_copy_file(char* from, char* to, struct workers* workers)
    return 0;
 }
 
+void
+pgmoneta_reset_copy_statistics(void)
+{
+   for (int i = 0; i < NUMBER_OF_COPY_METHODS; i++)
+   {
+      atomic_store(&copy_files[i], 0);
+      atomic_store(&copy_bytes[i], 0);
+   }
+}
+
+void
+pgmoneta_get_copy_statistics(struct copy_statistics* statistics)
+{
+   for (int i = 0; i < NUMBER_OF_COPY_METHODS; i++)
+   {
+      statistics->files[i] = atomic_load(&copy_files[i]);
+      statistics->bytes[i] = atomic_load(&copy_bytes[i]);
+   }
+}
+
+char*
+pgmoneta_copy_method_name(int method)
+{
+   switch (method)
+   {
+      case COPY_METHOD_CLONE:
+         return "clone";
+      case COPY_METHOD_RANGE:
+         return "copy_file_range";
+      case COPY_METHOD_SENDFILE:
+         return "sendfile";
+      case COPY_METHOD_READ_WRITE:
+         return "read/write";
+      default:
+         break;
+   }
+
+   return "unknown";
+}
+
 static void
 copy_file(void* arg)
 {
    int fd_from = -1;
    int fd_to = -1;
-   char buffer[8192];
-   ssize_t nread = -1;
    int saved_errno = -1;
    int permissions = -1;
+   int method;
+   struct stat from_stat;
    struct worker_input* fi = NULL;
 
    fi = (struct worker_input*)arg;
@@ -1963,10 +2094,187 @@ copy_file(void* arg)
       goto error;
    }
 
-   while ((nread = read(fd_from, buffer, sizeof(buffer))) > 0)
+   if (fstat(fd_from, &from_stat))
+   {
+      goto error;
+   }
+
+   if (copy_file_data(fd_from, fd_to, from_stat.st_size, &method))
+   {
+      goto error;
+   }
+
+   atomic_fetch_add(&copy_files[method], 1);
+
+   if (close(fd_to) < 0)
+   {
+      fd_to = -1;
+      goto error;
+   }
+   close(fd_from);
+
+   free(fi);
+
+   return;
+
+error:
+   saved_errno = errno;
+
+   if (fd_from >= 0)
+   {
+      close(fd_from);
+   }
+   if (fd_to >= 0)
+   {
+      close(fd_to);
+   }
+
+   errno = saved_errno;
+
+   free(fi);
+}
+
+static int
+copy_file_data(int fd_from, int fd_to, off_t size, int* method)
+{
+   off_t copied = 0;
+   off_t before;
+#ifdef HAVE_LINUX
+   bool finished;
+#endif
+
+   // use the cheapest method the file systems support, and continue with the next one where a method stops
+#ifdef HAVE_LINUX
+   *method = COPY_METHOD_CLONE;
+   if (size > 0 && copy_file_clone(fd_from, fd_to))
+   {
+      atomic_fetch_add(&copy_bytes[*method], size);
+      return 0;
+   }
+
+   *method = COPY_METHOD_RANGE;
+   before = copied;
+   finished = copy_file_range_all(fd_from, fd_to, &copied);
+   atomic_fetch_add(&copy_bytes[*method], copied - before);
+   if (finished)
+   {
+      return 0;
+   }
+
+   *method = COPY_METHOD_SENDFILE;
+   before = copied;
+   finished = copy_file_sendfile(fd_from, fd_to, &copied);
+   atomic_fetch_add(&copy_bytes[*method], copied - before);
+   if (finished)
+   {
+      return 0;
+   }
+#endif
+
+   *method = COPY_METHOD_READ_WRITE;
+   before = copied;
+   if (copy_file_read_write(fd_from, fd_to, &copied))
+   {
+      return 1;
+   }
+   atomic_fetch_add(&copy_bytes[*method], copied - before);
+
+   return 0;
+}
+
+#ifdef HAVE_LINUX
+static bool
+copy_file_clone(int fd_from, int fd_to)
+{
+   // share the extents on btrfs and XFS, nothing is read or written
+   return ioctl(fd_to, FICLONE, fd_from) == 0;
+}
+
+static bool
+copy_file_range_all(int fd_from, int fd_to, off_t* copied)
+{
+   ssize_t n;
+   loff_t offset = *copied;
+
+   for (;;)
+   {
+      n = copy_file_range(fd_from, &offset, fd_to, NULL, COPY_BUFFER_SIZE * 64, 0);
+
+      if (n > 0)
+      {
+         *copied = offset;
+      }
+      else if (n == 0)
+      {
+         return true;
+      }
+      else if (errno != EINTR)
+      {
+         // not supported between these files, or an error the next method reports
+         errno = 0;
+         return false;
+      }
+   }
+}
+
+static bool
+copy_file_sendfile(int fd_from, int fd_to, off_t* copied)
+{
+   ssize_t n;
+   off_t offset = *copied;
+
+   for (;;)
+   {
+      n = sendfile(fd_to, fd_from, &offset, COPY_BUFFER_SIZE * 64);
+
+      if (n > 0)
+      {
+         *copied = offset;
+      }
+      else if (n == 0)
+      {
+         return true;
+      }
+      else if (errno != EINTR)
+      {
+         errno = 0;
+         return false;
+      }
+   }
+}
+#endif
+
+static int
+copy_file_read_write(int fd_from, int fd_to, off_t* copied)
+{
+   char* buffer = NULL;
+   char* out = NULL;
+   ssize_t nread;
+   ssize_t nwritten;
+
+   buffer = (char*)malloc(COPY_BUFFER_SIZE);
+   if (buffer == NULL)
+   {
+      goto error;
+   }
+
+   if (lseek(fd_from, *copied, SEEK_SET) == -1)
    {
-      char* out = &buffer[0];
-      ssize_t nwritten;
+      goto error;
+   }
+
+   while ((nread = read(fd_from, buffer, COPY_BUFFER_SIZE)) != 0)
+   {
+      if (nread < 0)
+      {
+         if (errno == EINTR)
+         {
+            continue;
+         }
+         goto error;
+      }
+
+      out = buffer;
 
       do
       {
@@ -1976,6 +2284,7 @@ copy_file(void* arg)
          {
             nread -= nwritten;
             out += nwritten;
+            *copied += nwritten;
          }
          else if (errno != EINTR)
          {
@@ -1985,32 +2294,15 @@ copy_file(void* arg)
       while (nread > 0);
    }
 
-   if (nread == 0)
-   {
-      if (close(fd_to) < 0)
-      {
-         fd_to = -1;
-         goto error;
-      }
-      close(fd_from);
-   }
-
-   free(fi);
+   free(buffer);
 
-   return;
+   return 0;
 
 error:
-   saved_errno = errno;
-
-   close(fd_from);
-   if (fd_to >= 0)
-   {
-      close(fd_to);
-   }
 
-   errno = saved_errno;
+   free(buffer);
 
-   free(fi);
+   return 1;
 }
 
 int
@@ -2324,6 +2616,7 @@ pgmoneta_copy_wal_files(char* from, char* to, char* start, struct workers* worke
    char* basename = NULL;
    char* ff = NULL;
    char* tf = NULL;
+   int result = 0;
 
    pgmoneta_get_files(from, &number_of_wal_files, &wal_files);
 
@@ -2366,7 +2659,10 @@ pgmoneta_copy_wal_files(char* from, char* to, char* start, struct workers* worke
             tf = pgmoneta_append(tf, wal_files[i]);
          }
 
-         pgmoneta_copy_file(ff, tf, workers);
+         if (restore_file(ff, tf, workers))
+         {
+            result = 1;
+         }
       }
 
       free(basename);
@@ -2384,7 +2680,7 @@ pgmoneta_copy_wal_files(char* from, char* to, char* start, struct workers* worke
    }
    free(wal_files);
 
-   return 0;
+   return result;
 }
 
 int
@@ -3096,6 +3392,17 @@ pgmoneta_is_file_archive(char* file_path)
    return false;
 }
 
+bool
+pgmoneta_is_wal_segment(char* file_path)
+{
+   char* name = NULL;
+
+   name = strrchr(file_path, '/');
+   name = name != NULL ? name + 1 : file_path;
+
+   return strlen(name) == 24 && strspn(name, "0123456789ABCDEF") == 24;
+}
+
 /* Parser for pgmoneta-cli amd pgmoneta-admin commands */
 bool
 parse_command(int argc,
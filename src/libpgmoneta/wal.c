@@ -28,15 +28,19 @@
 
 /* pgmoneta */
 #include <pgmoneta.h>
+#include <backup.h>
+#include <catalog.h>
 #include <logging.h>
 #include <management.h>
 #include <memory.h>
 #include <message.h>
 #include <network.h>
+#include <pipeline.h>
 #include <prometheus.h>
 #include <security.h>
 #include <server.h>
 #include <wal.h>
+#include <wal_writer.h>
 #include <workflow.h>
 #include <utils.h>
 #include <storage.h>
@@ -46,26 +50,26 @@
 #include <dirent.h>
 #include <errno.h>
 #include <ev.h>
+#include <stdatomic.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <unistd.h>
 #include <sys/stat.h>
 #include <sys/types.h>
+#include <time.h>
 #include <openssl/ssl.h>
 #include <libssh/libssh.h>
 #include <libssh/sftp.h>
 
 static char* wal_file_name(uint32_t timeline, size_t segno, int segsize);
 static int wal_fetch_history(char* basedir, int timeline, SSL* ssl, int socket);
-static FILE* wal_open(char* root, char* filename, int segsize);
-static int wal_close(char* root, char* filename, bool partial, FILE* file);
-static int wal_prepare(FILE* file, int segsize);
-static int wal_send_status_report(SSL* ssl, int socket, int64_t received, int64_t flushed, int64_t applied);
+static int wal_send_status_report(int srv, SSL* ssl, int socket, int64_t received, int64_t flushed, int64_t applied);
 static int wal_xlog_offset(size_t xlogptr, int segsize);
 static int wal_convert_xlogpos(char* xlogpos, uint32_t* high32, uint32_t* low32, int segsize);
 static int wal_find_streaming_start(char* basedir, uint32_t* timeline, uint32_t* high32, uint32_t* low32, int segsize);
 static int wal_shipping_setup(int srv, char** wal_shipping);
+static void wal_store_segments(int srv, char* basedir);
 static void update_wal_lsn(int srv, size_t xlogptr);
 
 void
@@ -89,18 +93,24 @@ pgmoneta_wal(int srv, char** argv)
    char cmd[MISC_LENGTH];
    size_t xlogpos_size = 0;
    size_t xlogptr = 0;
-   size_t segno;
+   size_t flushptr = 0;
+   size_t segno = 0;
    int xlogoff;
    int curr_xlogoff = 0;
    int segsize;
+   int status_interval;
+   int status_size;
+   time_t status_time;
+   size_t status_xlogptr = 0;
+   bool segment_end;
+   bool reply_requested;
    char* filename = NULL;
    signed char type;
    int ret;
    char date[128];
    time_t current_time;
    struct tm* time_info;
-   FILE* wal_file = NULL;
-   FILE* wal_shipping_file = NULL;
+   struct wal_writer* writer = NULL;
    sftp_file sftp_wal_file = NULL;
    struct message* identify_system_msg = NULL;
    struct query_response* identify_system_response = NULL;
@@ -144,9 +154,20 @@ pgmoneta_wal(int srv, char** argv)
    pgmoneta_server_info(srv);
 
    segsize = config->servers[srv].wal_size;
+   status_interval = pgmoneta_get_wal_status_interval(srv);
+   status_size = pgmoneta_get_wal_status_size(srv);
+   status_time = time(NULL);
+
+   if (pgmoneta_wal_writer_create(srv, segsize, &writer))
+   {
+      goto error;
+   }
    d = pgmoneta_get_server_wal(srv);
    pgmoneta_mkdir(d);
 
+   // segments are stored as they are written, this catches the ones left behind
+   wal_store_segments(srv, d);
+
    if (config->storage_engine & STORAGE_ENGINE_SSH)
    {
       head = pgmoneta_storage_create_ssh(WORKFLOW_TYPE_WAL_SHIPPING);
@@ -275,6 +296,14 @@ pgmoneta_wal(int srv, char** argv)
       // start streaming current timeline's WAL segments
       while (config->running)
       {
+         // the next read waits for the server, so report the received WAL first
+         if (buffer->cursor >= buffer->end && xlogptr != status_xlogptr)
+         {
+            wal_send_status_report(srv, ssl, socket, xlogptr, flushptr, 0);
+            status_xlogptr = xlogptr;
+            status_time = time(NULL);
+         }
+
          ret = pgmoneta_consume_copy_stream_start(ssl, socket, buffer, msg, NULL);
          if (ret == 0)
          {
@@ -314,7 +343,7 @@ pgmoneta_wal(int srv, char** argv)
                   xlogptr = pgmoneta_read_int64(msg->data + 1);
                   xlogoff = wal_xlog_offset(xlogptr, segsize);
 
-                  if (wal_file == NULL)
+                  if (writer->number_of_files == 0)
                   {
                      if (xlogoff != 0 && bytes_left != xlogoff)
                      {
@@ -327,20 +356,25 @@ pgmoneta_wal(int srv, char** argv)
                         segno = xlogptr / segsize;
                         curr_xlogoff = 0;
                         filename = wal_file_name(timeline, segno, segsize);
-                        if ((wal_file = wal_open(d, filename, segsize)) == NULL)
+                        if (pgmoneta_wal_writer_open(writer, d, filename))
                         {
                            pgmoneta_log_error("Could not create or open WAL segment file at %s", d);
                            goto error;
                         }
+                        pgmoneta_catalog_add_size(srv, CATALOG_SIZE_WAL, segsize);
                         memset(config->servers[srv].current_wal_filename, 0, MISC_LENGTH);
                         snprintf(config->servers[srv].current_wal_filename, MISC_LENGTH, "%s.partial", filename);
-                        if ((wal_shipping_file = wal_open(wal_shipping, filename, segsize)) == NULL)
+                        if (pgmoneta_wal_writer_open(writer, wal_shipping, filename))
                         {
                            if (wal_shipping != NULL)
                            {
                               pgmoneta_log_warn("Could not create or open WAL segment file at %s", wal_shipping);
                            }
                         }
+                        else
+                        {
+                           pgmoneta_catalog_add_size(srv, CATALOG_SIZE_WAL_SHIPPING, segsize);
+                        }
                         if (config->storage_engine & STORAGE_ENGINE_SSH)
                         {
                            if (pgmoneta_sftp_wal_open(srv, filename, segsize, &sftp_wal_file) == 1)
@@ -353,14 +387,13 @@ pgmoneta_wal(int srv, char** argv)
                         if (bytes_left > 0)
                         {
                            curr_xlogoff += bytes_left;
-                           fwrite(remain_buffer, 1, bytes_left, wal_file);
-                           if (sftp_wal_file != NULL)
+                           if (pgmoneta_wal_writer_write(writer, remain_buffer, bytes_left))
                            {
-                              sftp_write(sftp_wal_file, remain_buffer, bytes_left);
+                              goto error;
                            }
-                           if (wal_shipping_file != NULL)
+                           if (sftp_wal_file != NULL)
                            {
-                              fwrite(remain_buffer, 1, bytes_left, wal_shipping_file);
+                              sftp_write(sftp_wal_file, remain_buffer, bytes_left);
                            }
                            bytes_left = 0;
                         }
@@ -372,6 +405,7 @@ pgmoneta_wal(int srv, char** argv)
                      goto error;
                   }
                   bytes_left = msg->length - hdrlen;
+                  segment_end = false;
                   int bytes_written = 0;
                   // write to the wal file
                   while (bytes_left > 0)
@@ -386,7 +420,7 @@ pgmoneta_wal(int srv, char** argv)
                      {
                         bytes_to_write = bytes_left;
                      }
-                     if (bytes_to_write != fwrite(msg->data + hdrlen + bytes_written, 1, bytes_to_write, wal_file))
+                     if (pgmoneta_wal_writer_write(writer, msg->data + hdrlen + bytes_written, bytes_to_write))
                      {
                         pgmoneta_log_error("Could not write %d bytes to WAL file %s", bytes_to_write, filename);
                         goto error;
@@ -396,11 +430,6 @@ pgmoneta_wal(int srv, char** argv)
                         sftp_write(sftp_wal_file, msg->data + hdrlen + bytes_written, bytes_to_write);
                      }
 
-                     if (wal_shipping_file != NULL)
-                     {
-                        fwrite(msg->data + hdrlen + bytes_written, 1, bytes_to_write, wal_shipping_file);
-                     }
-
                      bytes_written += bytes_to_write;
                      bytes_left -= bytes_to_write;
                      xlogptr += bytes_written;
@@ -410,21 +439,17 @@ pgmoneta_wal(int srv, char** argv)
                      if (wal_xlog_offset(xlogptr, segsize) == 0)
                      {
                         // the end of WAL segment
-                        fflush(wal_file);
-                        wal_close(d, filename, false, wal_file);
+                        segment_end = true;
+                        if (pgmoneta_wal_writer_close(writer, false))
+                        {
+                           goto error;
+                        }
+                        flushptr = xlogptr;
                         if (sftp_wal_file != NULL)
                         {
                            pgmoneta_sftp_wal_close(srv, filename, false, &sftp_wal_file);
                            sftp_wal_file = NULL;
                         }
-
-                        wal_file = NULL;
-                        if (wal_shipping_file != NULL)
-                        {
-                           fflush(wal_shipping_file);
-                           wal_close(wal_shipping, filename, false, wal_shipping_file);
-                           wal_shipping_file = NULL;
-                        }
                         free(filename);
                         filename = NULL;
 
@@ -453,13 +478,33 @@ pgmoneta_wal(int srv, char** argv)
                   // update LSN after a message data is written to the segment
                   update_wal_lsn(srv, xlogptr);
 
-                  wal_send_status_report(ssl, socket, xlogptr, xlogptr, 0);
+                  if (writer->number_of_files > 0)
+                  {
+                     flushptr = segno * segsize + pgmoneta_wal_writer_flushed(writer);
+                  }
+
+                  // coalesce the status replies, but always report a completed segment
+                  if (segment_end || xlogptr - status_xlogptr >= (size_t)status_size ||
+                      difftime(time(NULL), status_time) >= status_interval)
+                  {
+                     wal_send_status_report(srv, ssl, socket, xlogptr, flushptr, 0);
+                     status_xlogptr = xlogptr;
+                     status_time = time(NULL);
+                  }
                   break;
                }
                case 'k':
                {
-                  // keep alive request
-                  wal_send_status_report(ssl, socket, xlogptr, xlogptr, 0);
+                  // keep alive, the last byte tells if the server asks for a reply
+                  reply_requested = msg->length >= 1 + 8 + 8 + 1 && *((char*)msg->data + 1 + 8 + 8) != 0;
+
+                  if (reply_requested || xlogptr != status_xlogptr ||
+                      difftime(time(NULL), status_time) >= status_interval)
+                  {
+                     wal_send_status_report(srv, ssl, socket, xlogptr, flushptr, 0);
+                     status_xlogptr = xlogptr;
+                     status_time = time(NULL);
+                  }
                   break;
                }
                default:
@@ -470,21 +515,28 @@ pgmoneta_wal(int srv, char** argv)
          }
          else if (msg->kind == 'c')
          {
-            // handle CopyDone
-            pgmoneta_send_copy_done_message(ssl, socket);
-            if (wal_file != NULL)
+            // handle CopyDone, the next file would be at a new timeline, so we treat the current wal file completed
+            if (writer->number_of_files > 0)
             {
-               // Next file would be at a new timeline, so we treat the current wal file completed
-               wal_close(d, filename, false, wal_file);
-               wal_file = NULL;
-               wal_close(wal_shipping, filename, false, wal_shipping_file);
-               wal_shipping_file = NULL;
+               if (pgmoneta_wal_writer_close(writer, false))
+               {
+                  goto error;
+               }
+               flushptr = xlogptr;
                if (sftp_wal_file != NULL)
                {
                   pgmoneta_sftp_wal_close(srv, filename, false, &sftp_wal_file);
                   sftp_wal_file = NULL;
                }
             }
+            // report what is left before ending the stream
+            if (xlogptr != status_xlogptr)
+            {
+               wal_send_status_report(srv, ssl, socket, xlogptr, flushptr, 0);
+               status_xlogptr = xlogptr;
+               status_time = time(NULL);
+            }
+            pgmoneta_send_copy_done_message(ssl, socket);
             pgmoneta_consume_copy_stream_end(buffer, msg);
             break;
          }
@@ -524,11 +576,10 @@ pgmoneta_wal(int srv, char** argv)
    {
       pgmoneta_disconnect(socket);
    }
-   if (wal_file != NULL)
+   if (writer != NULL && writer->number_of_files > 0)
    {
       bool partial = (wal_xlog_offset(xlogptr, segsize) != 0);
-      wal_close(d, filename, partial, wal_file);
-      wal_close(wal_shipping, filename, partial, wal_shipping_file);
+      pgmoneta_wal_writer_close(writer, partial);
       if (sftp_wal_file != NULL)
       {
          pgmoneta_sftp_wal_close(srv, filename, partial, &sftp_wal_file);
@@ -544,6 +595,8 @@ pgmoneta_wal(int srv, char** argv)
       current = current->next;
    }
 
+   pgmoneta_wal_writer_destroy(writer);
+
    pgmoneta_memory_destroy();
    pgmoneta_stop_logging();
 
@@ -573,11 +626,7 @@ error:
       pgmoneta_disconnect(socket);
    }
 
-   if (wal_file != NULL)
-   {
-      wal_close(d, filename, true, wal_file);
-      wal_close(wal_shipping, filename, true, wal_shipping_file);
-   }
+   pgmoneta_wal_writer_close(writer, true);
    if (sftp_wal_file != NULL)
    {
       pgmoneta_sftp_wal_close(srv, filename, true, &sftp_wal_file);
@@ -602,6 +651,8 @@ error:
       current = current->next;
    }
 
+   pgmoneta_wal_writer_destroy(writer);
+
    pgmoneta_memory_destroy();
    pgmoneta_stop_logging();
 
@@ -793,156 +844,19 @@ error:
    return 1;
 }
 
-static FILE*
-wal_open(char* root, char* filename, int segsize)
-{
-   if (root == NULL || strlen(root) == 0 || !pgmoneta_exists(root))
-   {
-      return NULL;
-   }
-   char* path = NULL;
-   FILE* file = NULL;
-   path = pgmoneta_append(path, root);
-   if (!pgmoneta_ends_with(path, "/"))
-   {
-      path = pgmoneta_append(path, "/");
-   }
-
-   path = pgmoneta_append(path, filename);
-   path = pgmoneta_append(path, ".partial");
-
-   if (pgmoneta_exists(path))
-   {
-      // file alreay exists, check if it's padded already
-      size_t size = pgmoneta_get_file_size(path);
-      if (size == segsize)
-      {
-         file = fopen(path, "r+b");
-         if (file == NULL)
-         {
-            pgmoneta_log_error("WAL error: %s", strerror(errno));
-            errno = 0;
-            goto error;
-         }
-         pgmoneta_permission(path, 6, 0, 0);
-
-         free(path);
-         return file;
-      }
-      if (size != 0)
-      {
-         // corrupted file
-         pgmoneta_log_error("WAL file corrupted: %s", path);
-         goto error;
-      }
-   }
-
-   file = fopen(path, "wb");
-
-   if (file == NULL)
-   {
-      pgmoneta_log_error("WAL error: %s", strerror(errno));
-      errno = 0;
-      goto error;
-   }
-
-   if (wal_prepare(file, segsize))
-   {
-      goto error;
-   }
-
-   pgmoneta_permission(path, 6, 0, 0);
-
-   free(path);
-   return file;
-
-error:
-   if (file != NULL)
-   {
-      fclose(file);
-   }
-   free(path);
-   return NULL;
-}
-
-static int
-wal_close(char* root, char* filename, bool partial, FILE* file)
-{
-   if (file == NULL || root == NULL || filename == NULL || strlen(root) == 0 || strlen(filename) == 0)
-   {
-      return 1;
-   }
-   char tmp_file_path[MAX_PATH] = {0};
-   char file_path[MAX_PATH] = {0};
-
-   if (partial)
-   {
-      pgmoneta_log_warn("Not renaming %s.partial, this segment is incomplete", filename);
-      fclose(file);
-      return 0;
-   }
-
-   if (pgmoneta_ends_with(root, "/"))
-   {
-      snprintf(tmp_file_path, sizeof(tmp_file_path), "%s%s.partial", root, filename);
-      snprintf(file_path, sizeof(file_path), "%s%s", root, filename);
-   }
-   else
-   {
-      snprintf(tmp_file_path, sizeof(tmp_file_path), "%s/%s.partial", root, filename);
-      snprintf(file_path, sizeof(file_path), "%s/%s", root, filename);
-   }
-   if (rename(tmp_file_path, file_path) != 0)
-   {
-      pgmoneta_log_error("could not rename file %s to %s", tmp_file_path, file_path);
-      goto error;
-   }
-
-   fclose(file);
-
-   return 0;
-
-error:
-   fclose(file);
-   return 1;
-}
-
-static int
-wal_prepare(FILE* file, int segsize)
-{
-   char buffer[8192] = {0};
-   size_t written = 0;
-
-   if (file == NULL)
-   {
-      return 1;
-   }
-
-   while (written < segsize)
-   {
-      written += fwrite(buffer, 1, sizeof(buffer), file);
-   }
-
-   fflush(file);
-   if (fseek(file, 0, SEEK_SET) != 0)
-   {
-      pgmoneta_log_error("WAL error: %s", strerror(errno));
-      errno = 0;
-      return 1;
-   }
-   return 0;
-}
-
 static int
-wal_send_status_report(SSL* ssl, int socket, int64_t received, int64_t flushed, int64_t applied)
+wal_send_status_report(int srv, SSL* ssl, int socket, int64_t received, int64_t flushed, int64_t applied)
 {
    struct message* status_report_msg = NULL;
+   struct configuration* config = (struct configuration*) shmem;
+
    pgmoneta_create_standby_status_update_message(received, flushed, applied, &status_report_msg);
 
    if (pgmoneta_write_message(ssl, socket, status_report_msg) != MESSAGE_STATUS_OK)
    {
       goto error;
    }
+   atomic_fetch_add(&config->servers[srv].wal_status_replies, 1);
    pgmoneta_free_copy_message(status_report_msg);
    return 0;
 
@@ -1082,3 +996,75 @@ wal_shipping_setup(int srv, char** wal_shipping)
    *wal_shipping = NULL;
    return 0;
 }
+
+static void
+wal_store_segments(int srv, char* basedir)
+{
+   char* from = NULL;
+   char* to = NULL;
+   char* name = NULL;
+   size_t size;
+   DIR* dir;
+   struct dirent* entry;
+   struct configuration* config;
+
+   config = (struct configuration*)shmem;
+
+   if (!(dir = opendir(basedir)))
+   {
+      return;
+   }
+
+   while ((entry = readdir(dir)) != NULL)
+   {
+      if (entry->d_type != DT_REG || pgmoneta_ends_with(entry->d_name, ".history"))
+      {
+         continue;
+      }
+
+      from = pgmoneta_append(NULL, basedir);
+      if (!pgmoneta_ends_with(from, "/"))
+      {
+         from = pgmoneta_append(from, "/");
+      }
+      from = pgmoneta_append(from, entry->d_name);
+
+      if (pgmoneta_ends_with(entry->d_name, ".partial"))
+      {
+         // a stored segment that was not completed, its plain partial segment is streamed again
+         name = pgmoneta_append(NULL, entry->d_name);
+         name[strlen(name) - strlen(".partial")] = '\0';
+         if (pgmoneta_is_file_archive(name))
+         {
+            pgmoneta_delete_file(from, NULL);
+         }
+         free(name);
+         name = NULL;
+      }
+      else if (!pgmoneta_is_file_archive(entry->d_name) && config->compression_type != COMPRESSION_NONE)
+      {
+         size = pgmoneta_get_file_size(from);
+
+         if (pgmoneta_store_file(from))
+         {
+            pgmoneta_log_warn("Could not store WAL segment %s", from);
+         }
+         else
+         {
+            to = pgmoneta_stored_file(from);
+            if (to != NULL)
+            {
+               pgmoneta_catalog_add_size(srv, CATALOG_SIZE_WAL, (long)pgmoneta_get_file_size(to) - (long)size);
+               pgmoneta_permission(to, 6, 0, 0);
+            }
+            free(to);
+            to = NULL;
+         }
+      }
+
+      free(from);
+      from = NULL;
+   }
+
+   closedir(dir);
+}
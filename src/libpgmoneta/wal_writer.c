@@ -0,0 +1,898 @@
+/*
+ * Copyright (C) 2024 The pgmoneta community
+ *
+ * Redistribution and use in source and binary forms, with or without modification,
+ * are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, this list
+ * of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice, this
+ * list of conditions and the following disclaimer in the documentation and/or other
+ * materials provided with the distribution.
+ *
+ * 3. Neither the name of the copyright holder nor the names of its contributors may
+ * be used to endorse or promote products derived from this software without specific
+ * prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL
+ * THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT
+ * OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR
+ * TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/* pgmoneta */
+#include <pgmoneta.h>
+#include <catalog.h>
+#include <logging.h>
+#include <pipeline.h>
+#include <prometheus.h>
+#include <utils.h>
+#include <wal_writer.h>
+
+/* system */
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#define ALIGN_DOWN(x) ((x) & ~((size_t)WAL_WRITER_ALIGNMENT - 1))
+#define ALIGN_UP(x)   ALIGN_DOWN((x) + WAL_WRITER_ALIGNMENT - 1)
+
+static int wal_writer_flush(struct wal_writer* writer, bool all, bool sync);
+static int wal_writer_write_files(struct wal_writer* writer, size_t length, bool sync);
+#ifdef HAVE_LIBURING
+static int wal_writer_submit(struct wal_writer* writer, size_t length, bool sync);
+#endif
+static int wal_writer_pwrite(int fd, char* buffer, size_t length, size_t offset);
+static int wal_writer_prepare(struct wal_writer* writer, int fd);
+static int wal_writer_buffered(struct wal_writer* writer);
+static int wal_writer_sync_directory(char* root);
+static int wal_writer_store_open(struct wal_writer* writer, char* root, char* filename);
+static int wal_writer_store_finish(struct wal_writer* writer, char* root, char* segment);
+static void wal_writer_store_abort(struct wal_writer* writer);
+
+int
+pgmoneta_wal_writer_create(int server, int segsize, struct wal_writer** writer)
+{
+   struct wal_writer* w = NULL;
+   struct configuration* config;
+
+   config = (struct configuration*)shmem;
+
+   *writer = NULL;
+
+   w = (struct wal_writer*)malloc(sizeof(struct wal_writer));
+   if (w == NULL)
+   {
+      goto error;
+   }
+
+   memset(w, 0, sizeof(struct wal_writer));
+
+   if (posix_memalign((void**)&w->buffer, WAL_WRITER_ALIGNMENT, WAL_WRITER_BUFFER_SIZE))
+   {
+      w->buffer = NULL;
+      goto error;
+   }
+
+   memset(w->buffer, 0, WAL_WRITER_BUFFER_SIZE);
+
+   w->server = server;
+   w->segsize = segsize;
+   w->sync = config->wal_sync;
+   w->sync_size = config->wal_sync_size;
+   w->store = config->compression_type != COMPRESSION_NONE;
+
+#ifdef HAVE_LINUX
+   w->direct = config->wal_direct_io;
+#else
+   if (config->wal_direct_io)
+   {
+      pgmoneta_log_debug("WAL writer: Direct I/O is only supported on Linux");
+   }
+#endif
+
+#ifdef HAVE_LIBURING
+   if (io_uring_queue_init(2 * WAL_WRITER_MAX_FILES, &w->ring, 0) == 0)
+   {
+      w->uring = true;
+   }
+   else
+   {
+      pgmoneta_log_debug("WAL writer: io_uring is not available");
+   }
+#endif
+
+   *writer = w;
+
+   return 0;
+
+error:
+
+   pgmoneta_log_error("WAL writer: Out of memory");
+
+   pgmoneta_wal_writer_destroy(w);
+
+   return 1;
+}
+
+int
+pgmoneta_wal_writer_open(struct wal_writer* writer, char* root, char* filename)
+{
+   char path[MAX_PATH];
+   bool exists = false;
+   int flags;
+   int fd = -1;
+   size_t size;
+   struct wal_writer_file* file = NULL;
+
+   if (root == NULL || strlen(root) == 0 || !pgmoneta_exists(root))
+   {
+      return 1;
+   }
+
+   if (writer->number_of_files >= WAL_WRITER_MAX_FILES)
+   {
+      pgmoneta_log_error("WAL writer: Too many files for %s", filename);
+      return 1;
+   }
+
+   if (writer->number_of_files > 0 && writer->position > 0)
+   {
+      pgmoneta_log_error("WAL writer: %s is already being written", filename);
+      return 1;
+   }
+
+   memset(&path[0], 0, sizeof(path));
+   if (pgmoneta_ends_with(root, "/"))
+   {
+      snprintf(&path[0], sizeof(path), "%s%s.partial", root, filename);
+   }
+   else
+   {
+      snprintf(&path[0], sizeof(path), "%s/%s.partial", root, filename);
+   }
+
+   if (pgmoneta_exists(&path[0]))
+   {
+      // file already exists, check if it's preallocated already
+      size = pgmoneta_get_file_size(&path[0]);
+      if (size == writer->segsize)
+      {
+         exists = true;
+      }
+      else if (size != 0)
+      {
+         // corrupted file
+         pgmoneta_log_error("WAL file corrupted: %s", &path[0]);
+         goto error;
+      }
+   }
+
+   flags = O_RDWR | O_CREAT;
+#ifdef HAVE_LINUX
+   if (writer->direct)
+   {
+      flags |= O_DIRECT;
+   }
+#endif
+
+   fd = open(&path[0], flags, 0600);
+
+#ifdef HAVE_LINUX
+   if (fd == -1 && errno == EINVAL && writer->direct)
+   {
+      pgmoneta_log_warn("WAL writer: Direct I/O is not supported for %s", root);
+      errno = 0;
+
+      if (wal_writer_buffered(writer))
+      {
+         goto error;
+      }
+
+      fd = open(&path[0], O_RDWR | O_CREAT, 0600);
+   }
+#endif
+
+   if (fd == -1)
+   {
+      pgmoneta_log_error("WAL error: %s", strerror(errno));
+      errno = 0;
+      goto error;
+   }
+
+   if (!exists)
+   {
+      if (wal_writer_prepare(writer, fd))
+      {
+         goto error;
+      }
+
+      // make the new segment itself durable before WAL is reported in it
+      if (writer->sync != WAL_SYNC_OFF && (fsync(fd) || wal_writer_sync_directory(root)))
+      {
+         pgmoneta_log_error("WAL error: Could not sync %s", &path[0]);
+         goto error;
+      }
+   }
+
+   pgmoneta_permission(&path[0], 6, 0, 0);
+
+   if (writer->number_of_files == 0)
+   {
+      writer->buffer_offset = 0;
+      writer->buffer_length = 0;
+      writer->position = 0;
+      writer->issued = 0;
+      writer->synced = 0;
+
+      if (writer->store && wal_writer_store_open(writer, root, filename))
+      {
+         pgmoneta_log_warn("WAL writer: %s will be stored uncompressed", filename);
+      }
+   }
+
+   file = &writer->files[writer->number_of_files];
+   file->fd = fd;
+   snprintf(&file->root[0], sizeof(file->root), "%s", root);
+   snprintf(&file->filename[0], sizeof(file->filename), "%s", filename);
+
+   writer->number_of_files++;
+
+   return 0;
+
+error:
+
+   if (fd != -1)
+   {
+      close(fd);
+   }
+
+   return 1;
+}
+
+int
+pgmoneta_wal_writer_write(struct wal_writer* writer, void* data, size_t length)
+{
+   char* d = (char*)data;
+   size_t n;
+
+   if (writer->number_of_files == 0)
+   {
+      pgmoneta_log_error("WAL writer: No segment is open");
+      return 1;
+   }
+
+   if (writer->position + length > writer->segsize)
+   {
+      pgmoneta_log_error("WAL writer: Write past the end of %s", writer->files[0].filename);
+      return 1;
+   }
+
+   if (writer->pipeline != NULL && pgmoneta_pipeline_write(writer->pipeline, data, length, false))
+   {
+      pgmoneta_log_warn("WAL writer: %s will be stored uncompressed", writer->files[0].filename);
+      wal_writer_store_abort(writer);
+   }
+
+   while (length > 0)
+   {
+      n = WAL_WRITER_BUFFER_SIZE - writer->buffer_length;
+      if (n > length)
+      {
+         n = length;
+      }
+
+      memcpy(writer->buffer + writer->buffer_length, d, n);
+
+      writer->buffer_length += n;
+      writer->position += n;
+      d += n;
+      length -= n;
+
+      if (writer->buffer_length == WAL_WRITER_BUFFER_SIZE && wal_writer_flush(writer, false, false))
+      {
+         return 1;
+      }
+   }
+
+   if (writer->sync == WAL_SYNC_MESSAGE ||
+       (writer->sync == WAL_SYNC_SIZE && writer->position - writer->synced >= (size_t)writer->sync_size))
+   {
+      return pgmoneta_wal_writer_sync(writer);
+   }
+
+   return 0;
+}
+
+int
+pgmoneta_wal_writer_sync(struct wal_writer* writer)
+{
+   if (writer->number_of_files == 0 || writer->synced == writer->position)
+   {
+      return 0;
+   }
+
+   return wal_writer_flush(writer, true, true);
+}
+
+size_t
+pgmoneta_wal_writer_flushed(struct wal_writer* writer)
+{
+   if (writer->sync == WAL_SYNC_OFF)
+   {
+      return writer->issued;
+   }
+
+   return writer->synced;
+}
+
+int
+pgmoneta_wal_writer_close(struct wal_writer* writer, bool partial)
+{
+   char from[MAX_PATH];
+   char to[MAX_PATH];
+   struct wal_writer_file* file = NULL;
+   int ret = 0;
+
+   if (writer == NULL || writer->number_of_files == 0)
+   {
+      return 0;
+   }
+
+   if (writer->synced != writer->position || writer->issued != writer->position)
+   {
+      ret = wal_writer_flush(writer, true, writer->sync != WAL_SYNC_OFF);
+   }
+
+   for (int i = 0; i < writer->number_of_files; i++)
+   {
+      file = &writer->files[i];
+
+      close(file->fd);
+      file->fd = -1;
+
+      if (partial)
+      {
+         pgmoneta_log_warn("Not renaming %s.partial, this segment is incomplete", file->filename);
+         continue;
+      }
+
+      if (ret)
+      {
+         continue;
+      }
+
+      memset(&from[0], 0, sizeof(from));
+      memset(&to[0], 0, sizeof(to));
+      if (pgmoneta_ends_with(file->root, "/"))
+      {
+         snprintf(&from[0], sizeof(from), "%s%s.partial", file->root, file->filename);
+         snprintf(&to[0], sizeof(to), "%s%s", file->root, file->filename);
+      }
+      else
+      {
+         snprintf(&from[0], sizeof(from), "%s/%s.partial", file->root, file->filename);
+         snprintf(&to[0], sizeof(to), "%s/%s", file->root, file->filename);
+      }
+
+      if (rename(&from[0], &to[0]) != 0)
+      {
+         pgmoneta_log_error("could not rename file %s to %s", &from[0], &to[0]);
+         ret = 1;
+      }
+      else if (writer->sync != WAL_SYNC_OFF && wal_writer_sync_directory(file->root))
+      {
+         ret = 1;
+      }
+      else if (i == 0 && writer->pipeline != NULL)
+      {
+         wal_writer_store_finish(writer, file->root, &to[0]);
+      }
+   }
+
+   wal_writer_store_abort(writer);
+
+   writer->number_of_files = 0;
+   writer->buffer_offset = 0;
+   writer->buffer_length = 0;
+   writer->position = 0;
+   writer->issued = 0;
+   writer->synced = 0;
+
+   return ret;
+}
+
+void
+pgmoneta_wal_writer_destroy(struct wal_writer* writer)
+{
+   if (writer == NULL)
+   {
+      return;
+   }
+
+   for (int i = 0; i < writer->number_of_files; i++)
+   {
+      if (writer->files[i].fd != -1)
+      {
+         close(writer->files[i].fd);
+      }
+   }
+
+   wal_writer_store_abort(writer);
+
+#ifdef HAVE_LIBURING
+   if (writer->uring)
+   {
+      io_uring_queue_exit(&writer->ring);
+   }
+#endif
+
+   free(writer->buffer);
+   free(writer);
+}
+
+static int
+wal_writer_flush(struct wal_writer* writer, bool all, bool sync)
+{
+   size_t advance;
+   size_t length;
+
+   if (writer->direct)
+   {
+      // only whole blocks can be written, the last block is kept and written again later
+      advance = ALIGN_DOWN(writer->buffer_length);
+      length = all ? ALIGN_UP(writer->buffer_length) : advance;
+
+      if (length > writer->buffer_length)
+      {
+         memset(writer->buffer + writer->buffer_length, 0, length - writer->buffer_length);
+      }
+   }
+   else
+   {
+      advance = writer->buffer_length;
+      length = advance;
+   }
+
+   if (length == 0 && !sync)
+   {
+      return 0;
+   }
+
+#ifdef HAVE_LIBURING
+   if (writer->uring)
+   {
+      if (wal_writer_submit(writer, length, sync))
+      {
+         return 1;
+      }
+   }
+   else if (wal_writer_write_files(writer, length, sync))
+   {
+      return 1;
+   }
+#else
+   if (wal_writer_write_files(writer, length, sync))
+   {
+      return 1;
+   }
+#endif
+
+   writer->issued = writer->buffer_offset + (length < writer->buffer_length ? length : writer->buffer_length);
+   if (sync)
+   {
+      writer->synced = writer->issued;
+   }
+
+   memmove(writer->buffer, writer->buffer + advance, writer->buffer_length - advance);
+   writer->buffer_offset += advance;
+   writer->buffer_length -= advance;
+
+   return 0;
+}
+
+static int
+wal_writer_write_files(struct wal_writer* writer, size_t length, bool sync)
+{
+   uint64_t start;
+
+   for (int i = 0; i < writer->number_of_files; i++)
+   {
+      if (length > 0 && wal_writer_pwrite(writer->files[i].fd, writer->buffer, length, writer->buffer_offset))
+      {
+         return 1;
+      }
+
+      if (sync)
+      {
+         start = pgmoneta_prometheus_timer();
+         if (fdatasync(writer->files[i].fd))
+         {
+            pgmoneta_log_error("WAL error: Could not sync %s: %s", writer->files[i].filename, strerror(errno));
+            errno = 0;
+            return 1;
+         }
+         pgmoneta_prometheus_observe(HISTOGRAM_FSYNC, start);
+      }
+   }
+
+   return 0;
+}
+
+#ifdef HAVE_LIBURING
+static int
+wal_writer_submit(struct wal_writer* writer, size_t length, bool sync)
+{
+   bool failed = false;
+   bool resync[WAL_WRITER_MAX_FILES];
+   int submitted = 0;
+   int ret;
+   int idx;
+   int fd;
+   uint64_t start;
+   struct io_uring_sqe* sqe = NULL;
+   struct io_uring_cqe* cqe = NULL;
+
+   // one submission for the writes and syncs of all files, each sync is linked to its write
+   for (int i = 0; i < writer->number_of_files; i++)
+   {
+      resync[i] = false;
+
+      if (length > 0)
+      {
+         sqe = io_uring_get_sqe(&writer->ring);
+         io_uring_prep_write(sqe, writer->files[i].fd, writer->buffer, length, writer->buffer_offset);
+         io_uring_sqe_set_data(sqe, (void*)(uintptr_t)(i * 2));
+         if (sync)
+         {
+            io_uring_sqe_set_flags(sqe, IOSQE_IO_LINK);
+         }
+         submitted++;
+      }
+
+      if (sync)
+      {
+         sqe = io_uring_get_sqe(&writer->ring);
+         io_uring_prep_fsync(sqe, writer->files[i].fd, IORING_FSYNC_DATASYNC);
+         io_uring_sqe_set_data(sqe, (void*)(uintptr_t)(i * 2 + 1));
+         submitted++;
+      }
+   }
+
+   start = pgmoneta_prometheus_timer();
+   ret = io_uring_submit_and_wait(&writer->ring, submitted);
+   if (ret < 0)
+   {
+      pgmoneta_log_error("WAL error: Could not submit writes: %s", strerror(-ret));
+      return 1;
+   }
+
+   for (int i = 0; i < submitted; i++)
+   {
+      ret = io_uring_wait_cqe(&writer->ring, &cqe);
+      if (ret < 0)
+      {
+         pgmoneta_log_error("WAL error: Could not complete writes: %s", strerror(-ret));
+         return 1;
+      }
+
+      idx = (int)(uintptr_t)io_uring_cqe_get_data(cqe);
+      ret = cqe->res;
+      io_uring_cqe_seen(&writer->ring, cqe);
+
+      fd = writer->files[idx / 2].fd;
+
+      if (idx % 2 == 0)
+      {
+         if (ret < 0)
+         {
+            pgmoneta_log_error("WAL error: Could not write %s: %s", writer->files[idx / 2].filename, strerror(-ret));
+            failed = true;
+         }
+         else if ((size_t)ret < length)
+         {
+            // a short write cancels the linked sync, finish both here
+            if (wal_writer_pwrite(fd, writer->buffer + ret, length - ret, writer->buffer_offset + ret))
+            {
+               failed = true;
+            }
+            resync[idx / 2] = sync;
+         }
+      }
+      else if (ret == -ECANCELED)
+      {
+         resync[idx / 2] = true;
+      }
+      else if (ret < 0)
+      {
+         pgmoneta_log_error("WAL error: Could not sync %s: %s", writer->files[idx / 2].filename, strerror(-ret));
+         failed = true;
+      }
+   }
+
+   if (failed)
+   {
+      return 1;
+   }
+
+   // a linked write and sync complete as one unit, so the whole submission counts as a sync
+   pgmoneta_prometheus_observe(sync ? HISTOGRAM_FSYNC : HISTOGRAM_FILE_WRITE, start);
+
+   for (int i = 0; i < writer->number_of_files; i++)
+   {
+      if (resync[i] && fdatasync(writer->files[i].fd))
+      {
+         pgmoneta_log_error("WAL error: Could not sync %s: %s", writer->files[i].filename, strerror(errno));
+         errno = 0;
+         return 1;
+      }
+   }
+
+   return 0;
+}
+#endif
+
+static int
+wal_writer_pwrite(int fd, char* buffer, size_t length, size_t offset)
+{
+   ssize_t written;
+   uint64_t start;
+
+   while (length > 0)
+   {
+      start = pgmoneta_prometheus_timer();
+      written = pwrite(fd, buffer, length, offset);
+      pgmoneta_prometheus_observe(HISTOGRAM_FILE_WRITE, start);
+      if (written < 0)
+      {
+         if (errno == EINTR)
+         {
+            continue;
+         }
+
+         pgmoneta_log_error("WAL error: %s", strerror(errno));
+         errno = 0;
+         return 1;
+      }
+
+      buffer += written;
+      length -= written;
+      offset += written;
+   }
+
+   return 0;
+}
+
+static int
+wal_writer_prepare(struct wal_writer* writer, int fd)
+{
+   size_t length;
+
+#ifdef HAVE_LINUX
+   if (fallocate(fd, 0, 0, writer->segsize) == 0)
+   {
+      return 0;
+   }
+
+   if (errno != EOPNOTSUPP && errno != ENOSYS)
+   {
+      pgmoneta_log_error("WAL error: %s", strerror(errno));
+      errno = 0;
+      return 1;
+   }
+
+   errno = 0;
+#endif
+
+   // no segment is being written, so the buffer can be used for the zero fill
+   memset(writer->buffer, 0, WAL_WRITER_BUFFER_SIZE);
+
+   for (size_t offset = 0; offset < writer->segsize; offset += length)
+   {
+      length = writer->segsize - offset;
+      if (length > WAL_WRITER_BUFFER_SIZE)
+      {
+         length = WAL_WRITER_BUFFER_SIZE;
+      }
+
+      if (wal_writer_pwrite(fd, writer->buffer, length, offset))
+      {
+         return 1;
+      }
+   }
+
+   return 0;
+}
+
+static int
+wal_writer_buffered(struct wal_writer* writer)
+{
+#ifdef HAVE_LINUX
+   int flags;
+
+   for (int i = 0; i < writer->number_of_files; i++)
+   {
+      flags = fcntl(writer->files[i].fd, F_GETFL);
+      if (flags == -1 || fcntl(writer->files[i].fd, F_SETFL, flags & ~O_DIRECT) == -1)
+      {
+         pgmoneta_log_error("WAL error: %s", strerror(errno));
+         errno = 0;
+         return 1;
+      }
+   }
+#endif
+
+   writer->direct = false;
+
+   return 0;
+}
+
+static int
+wal_writer_sync_directory(char* root)
+{
+   int fd;
+
+   fd = open(root, O_RDONLY | O_DIRECTORY);
+   if (fd == -1)
+   {
+      pgmoneta_log_error("WAL error: %s", strerror(errno));
+      errno = 0;
+      return 1;
+   }
+
+   if (fsync(fd))
+   {
+      pgmoneta_log_error("WAL error: Could not sync %s: %s", root, strerror(errno));
+      errno = 0;
+      close(fd);
+      return 1;
+   }
+
+   close(fd);
+
+   return 0;
+}
+
+static int
+wal_writer_store_open(struct wal_writer* writer, char* root, char* filename)
+{
+   struct pipeline_stage* stage = NULL;
+   struct configuration* config;
+
+   config = (struct configuration*)shmem;
+
+   memset(&writer->store_path[0], 0, sizeof(writer->store_path));
+   snprintf(&writer->store_path[0], sizeof(writer->store_path), "%s%s%s%s%s.partial",
+            root, pgmoneta_ends_with(root, "/") ? "" : "/", filename,
+            pgmoneta_compression_suffix(config->compression_type),
+            config->encryption != ENCRYPTION_NONE ? ".aes" : "");
+
+   if (config->compression_type != COMPRESSION_NONE)
+   {
+      if (pgmoneta_pipeline_create_wal_encoder(&stage))
+      {
+         goto error;
+      }
+      pgmoneta_pipeline_append(&writer->pipeline, stage);
+
+      if (pgmoneta_pipeline_create_compressor(config->compression_type, config->compression_level, &stage))
+      {
+         goto error;
+      }
+      pgmoneta_pipeline_append(&writer->pipeline, stage);
+   }
+
+   if (config->encryption != ENCRYPTION_NONE)
+   {
+      if (pgmoneta_pipeline_create_cipher(true, &stage))
+      {
+         goto error;
+      }
+      pgmoneta_pipeline_append(&writer->pipeline, stage);
+   }
+
+   if (pgmoneta_pipeline_create_file_writer(&writer->store_path[0], &stage))
+   {
+      goto error;
+   }
+   pgmoneta_pipeline_append(&writer->pipeline, stage);
+
+   return 0;
+
+error:
+
+   wal_writer_store_abort(writer);
+
+   return 1;
+}
+
+static int
+wal_writer_store_finish(struct wal_writer* writer, char* root, char* segment)
+{
+   char path[MAX_PATH];
+   size_t size;
+   int fd;
+
+   if (pgmoneta_pipeline_write(writer->pipeline, NULL, 0, true))
+   {
+      goto error;
+   }
+
+   pgmoneta_pipeline_destroy(writer->pipeline);
+   writer->pipeline = NULL;
+
+   // the plain segment is removed below, so the stored one must be durable first
+   if (writer->sync != WAL_SYNC_OFF)
+   {
+      fd = open(&writer->store_path[0], O_RDONLY);
+      if (fd == -1 || fsync(fd))
+      {
+         pgmoneta_log_error("WAL error: Could not sync %s: %s", &writer->store_path[0], strerror(errno));
+         errno = 0;
+         if (fd != -1)
+         {
+            close(fd);
+         }
+         goto error;
+      }
+      close(fd);
+   }
+
+   memset(&path[0], 0, sizeof(path));
+   snprintf(&path[0], sizeof(path), "%.*s", (int)(strlen(&writer->store_path[0]) - strlen(".partial")), &writer->store_path[0]);
+
+   if (rename(&writer->store_path[0], &path[0]) != 0)
+   {
+      pgmoneta_log_error("could not rename file %s to %s", &writer->store_path[0], &path[0]);
+      goto error;
+   }
+
+   memset(&writer->store_path[0], 0, sizeof(writer->store_path));
+
+   if (writer->sync != WAL_SYNC_OFF && wal_writer_sync_directory(root))
+   {
+      return 1;
+   }
+
+   size = pgmoneta_get_file_size(&path[0]);
+
+   pgmoneta_delete_file(segment, NULL);
+   pgmoneta_catalog_add_size(writer->server, CATALOG_SIZE_WAL, (long)size - (long)writer->segsize);
+
+   return 0;
+
+error:
+
+   pgmoneta_log_warn("WAL writer: %s will be stored uncompressed", segment);
+   wal_writer_store_abort(writer);
+
+   return 1;
+}
+
+static void
+wal_writer_store_abort(struct wal_writer* writer)
+{
+   pgmoneta_pipeline_destroy(writer->pipeline);
+   writer->pipeline = NULL;
+
+   if (strlen(&writer->store_path[0]) > 0)
+   {
+      if (pgmoneta_exists(&writer->store_path[0]))
+      {
+         pgmoneta_delete_file(&writer->store_path[0], NULL);
+      }
+      memset(&writer->store_path[0], 0, sizeof(writer->store_path));
+   }
+}
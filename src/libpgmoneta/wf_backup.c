@@ -31,13 +31,16 @@
 #include <backup.h>
 #include <info.h>
 #include <logging.h>
+#include <manifest.h>
 #include <memory.h>
 #include <message.h>
 #include <network.h>
+#include <parallel.h>
 #include <security.h>
 #include <server.h>
 #include <tablespace.h>
 #include <utils.h>
+#include <workers.h>
 #include <workflow.h>
 
 /* system */
@@ -48,6 +51,8 @@
 static int basebackup_setup(int, char*, struct node*, struct node**);
 static int basebackup_execute(int, char*, struct node*, struct node**);
 static int basebackup_teardown(int, char*, struct node*, struct node**);
+static char* prior_backup(int server);
+static unsigned long restore_size(char* d);
 
 struct workflow*
 pgmoneta_workflow_create_basebackup(void)
@@ -99,8 +104,17 @@ basebackup_execute(int server, char* identifier, struct node* i_nodes, struct no
    char old_label_path[MAX_PATH];
    int backup_max_rate;
    int network_max_rate;
+   int number_of_workers = 0;
+   int connections;
+   bool parallel = false;
+   bool incremental = false;
+   bool store = false;
+   char* prior = NULL;
+   char* prior_data = NULL;
+   struct manifest* prior_manifest = NULL;
    struct node* o_root = NULL;
    struct node* o_to = NULL;
+   struct node* o_incremental = NULL;
    struct configuration* config;
    struct message* basebackup_msg = NULL;
    struct message* tablespace_msg = NULL;
@@ -111,6 +125,8 @@ basebackup_execute(int server, char* identifier, struct node* i_nodes, struct no
    struct tuple* tup = NULL;
    struct token_bucket* bucket = NULL;
    struct token_bucket* network_bucket = NULL;
+   struct workers* workers = NULL;
+   struct info_transaction* info = NULL;
 
    start_time = time(NULL);
 
@@ -167,7 +183,7 @@ basebackup_execute(int server, char* identifier, struct node* i_nodes, struct no
    memset(minor_version, 0, sizeof(minor_version));
    snprintf(minor_version, sizeof(minor_version), "%d", config->servers[server].minor_version);
 
-   pgmoneta_create_query_message("SELECT spcname, pg_tablespace_location(oid) FROM pg_tablespace;", &tablespace_msg);
+   pgmoneta_create_query_message("SELECT spcname, pg_tablespace_location(oid), oid FROM pg_tablespace;", &tablespace_msg);
    if (pgmoneta_query_execute(ssl, socket, tablespace_msg, &response) || response == NULL)
    {
       goto error;
@@ -180,15 +196,17 @@ basebackup_execute(int server, char* identifier, struct node* i_nodes, struct no
       char* tablespace_path = tup->data[1];
       if (tablespace_name != NULL && tablespace_path != NULL)
       {
+         struct tablespace* append = NULL;
+
+         pgmoneta_create_tablespace(tablespace_name, tablespace_path, &append);
+         append->oid = tup->data[2] != NULL ? (unsigned int)strtoul(tup->data[2], NULL, 10) : 0;
+
          if (tablespaces == NULL)
          {
-            pgmoneta_create_tablespace(tablespace_name, tablespace_path, &tablespaces);
+            tablespaces = append;
          }
          else
          {
-            struct tablespace* append = NULL;
-
-            pgmoneta_create_tablespace(tablespace_name, tablespace_path, &append);
             pgmoneta_append_tablespace(&tablespaces, append);
          }
       }
@@ -196,101 +214,211 @@ basebackup_execute(int server, char* identifier, struct node* i_nodes, struct no
    }
    pgmoneta_free_query_response(response);
    response = NULL;
-   pgmoneta_close_ssl(ssl);
-   pgmoneta_disconnect(socket);
 
-   if (pgmoneta_server_authenticate(server, "postgres", config->users[usr].username, config->users[usr].password, true, &ssl, &socket) != AUTH_SUCCESS)
+   // the files are copied over several connections, an incremental backup needs BASE_BACKUP though
+   connections = pgmoneta_get_backup_connections(server);
+   if (connections > 1 && !config->incremental)
    {
-      pgmoneta_log_info("Invalid credentials for %s", config->users[usr].username);
-      goto error;
+      parallel = pgmoneta_parallel_backup_supported(ssl, socket, config->servers[server].version);
+      if (!parallel)
+      {
+         pgmoneta_log_warn("Backup: %s doesn't allow a parallel backup, using a single connection", config->servers[server].name);
+      }
    }
+
+   pgmoneta_close_ssl(ssl);
+   ssl = NULL;
+   pgmoneta_disconnect(socket);
+   socket = -1;
+
    label = pgmoneta_append(label, "pgmoneta_base_backup_");
    label = pgmoneta_append(label, identifier);
-   pgmoneta_create_base_backup_message(config->servers[server].version, label, true, "SHA256",
-                                       config->compression_type, config->compression_level,
-                                       &basebackup_msg);
 
-   status = pgmoneta_write_message(ssl, socket, basebackup_msg);
-   if (status != MESSAGE_STATUS_OK)
+   if (parallel)
    {
-      goto error;
-   }
+      root = pgmoneta_get_server_backup_identifier(server, identifier);
 
-   pgmoneta_memory_stream_buffer_init(&buffer);
-   // Receive the first result set, which contains the WAL starting point
-   if (pgmoneta_consume_data_row_messages(ssl, socket, buffer, &response))
-   {
-      goto error;
+      pgmoneta_mkdir(root);
+
+      // each connection compresses and encrypts the files it copied when no later step needs them plain
+      store = strlen(config->servers[server].hot_standby) == 0 &&
+              (config->compression_type != COMPRESSION_NONE || config->encryption != ENCRYPTION_NONE);
+
+      if (pgmoneta_parallel_backup(server, usr, label, root, tablespaces, connections, store,
+                                   startpos, &start_timeline, endpos, &end_timeline))
+      {
+         pgmoneta_log_error("Backup: Could not backup %s", config->servers[server].name);
+
+         pgmoneta_create_info(root, identifier, 0);
+
+         goto error;
+      }
    }
    else
    {
+      if (pgmoneta_server_authenticate(server, "postgres", config->users[usr].username, config->users[usr].password, true, &ssl, &socket) != AUTH_SUCCESS)
+      {
+         pgmoneta_log_info("Invalid credentials for %s", config->users[usr].username);
+         goto error;
+      }
+
+      // PostgreSQL 17+ only sends the changed blocks relative to the manifest of the prior backup
+      if (config->incremental && config->servers[server].version >= 17)
+      {
+         prior = prior_backup(server);
+         if (prior != NULL)
+         {
+            prior_data = pgmoneta_get_server_backup_identifier_data(server, prior);
+
+            if (!pgmoneta_manifest_load(prior_data, &prior_manifest) &&
+                !pgmoneta_upload_manifest(ssl, socket, prior_manifest))
+            {
+               incremental = true;
+            }
+            else
+            {
+               pgmoneta_log_warn("Backup: Could not use %s as the base of an incremental backup of %s",
+                                 prior, config->servers[server].name);
+            }
+
+            pgmoneta_manifest_free(prior_manifest);
+            prior_manifest = NULL;
+         }
+      }
+
+      pgmoneta_memory_stream_buffer_init(&buffer);
+
+      while (true)
+      {
+         pgmoneta_create_base_backup_message(config->servers[server].version, label, true,
+                                             pgmoneta_manifest_algorithm_name(pgmoneta_get_manifest_checksum(server)),
+                                             config->compression_type, config->compression_level, incremental,
+                                             &basebackup_msg);
+
+         status = pgmoneta_write_message(ssl, socket, basebackup_msg);
+         if (status != MESSAGE_STATUS_OK)
+         {
+            goto error;
+         }
+
+         // Receive the first result set, which contains the WAL starting point
+         if (!pgmoneta_consume_data_row_messages(ssl, socket, buffer, &response))
+         {
+            break;
+         }
+
+         if (!incremental)
+         {
+            goto error;
+         }
+
+         // typically summarize_wal is off, so start over with a full backup
+         pgmoneta_log_warn("Backup: Incremental backup of %s was refused, taking a full backup", config->servers[server].name);
+
+         incremental = false;
+         pgmoneta_free_query_response(response);
+         response = NULL;
+         pgmoneta_free_copy_message(basebackup_msg);
+         basebackup_msg = NULL;
+         pgmoneta_memory_stream_buffer_free(buffer);
+         buffer = NULL;
+         pgmoneta_memory_stream_buffer_init(&buffer);
+         pgmoneta_close_ssl(ssl);
+         ssl = NULL;
+         pgmoneta_disconnect(socket);
+         socket = -1;
+
+         if (pgmoneta_server_authenticate(server, "postgres", config->users[usr].username, config->users[usr].password, true, &ssl, &socket) != AUTH_SUCCESS)
+         {
+            pgmoneta_log_info("Invalid credentials for %s", config->users[usr].username);
+            goto error;
+         }
+      }
+
       memset(startpos, 0, sizeof(startpos));
       memcpy(startpos, response->tuples[0].data[0], strlen(response->tuples[0].data[0]));
       start_timeline = atoi(response->tuples[0].data[1]);
       pgmoneta_free_query_response(response);
       response = NULL;
-   }
 
-   // create the root dir
-   root = pgmoneta_get_server_backup_identifier(server, identifier);
+      // create the root dir
+      root = pgmoneta_get_server_backup_identifier(server, identifier);
 
-   pgmoneta_mkdir(root);
-   if (config->servers[server].version < 15)
-   {
-      if (pgmoneta_receive_archive_files(ssl, socket, buffer, root, tablespaces, config->servers[server].version, bucket, network_bucket))
+      pgmoneta_mkdir(root);
+
+      number_of_workers = pgmoneta_get_number_of_workers(server);
+      if (number_of_workers > 0)
       {
-         pgmoneta_log_error("Backup: Could not backup %s", config->servers[server].name);
+         pgmoneta_workers_initialize(number_of_workers, &workers);
+      }
 
-         pgmoneta_create_info(root, identifier, 0);
+      if (config->servers[server].version < 15)
+      {
+         if (pgmoneta_receive_archive_files(ssl, socket, buffer, root, tablespaces, config->servers[server].version, bucket, network_bucket, workers))
+         {
+            pgmoneta_log_error("Backup: Could not backup %s", config->servers[server].name);
 
-         goto error;
+            pgmoneta_create_info(root, identifier, 0);
+
+            goto error;
+         }
       }
-   }
-   else
-   {
-      if (pgmoneta_receive_archive_stream(ssl, socket, buffer, root, tablespaces, bucket, network_bucket))
+      else
       {
-         pgmoneta_log_error("Backup: Could not backup %s", config->servers[server].name);
+         // the data files can be compressed and encrypted while streaming when no later step needs them plain
+         store = workers != NULL && !config->incremental && strlen(config->servers[server].hot_standby) == 0 &&
+                 (config->compression_type != COMPRESSION_NONE || config->encryption != ENCRYPTION_NONE);
 
-         pgmoneta_create_info(root, identifier, 0);
+         if (pgmoneta_receive_archive_stream(ssl, socket, buffer, root, tablespaces, bucket, network_bucket, workers, store))
+         {
+            pgmoneta_log_error("Backup: Could not backup %s", config->servers[server].name);
+
+            pgmoneta_create_info(root, identifier, 0);
+
+            goto error;
+         }
+      }
 
+      if (number_of_workers > 0)
+      {
+         pgmoneta_workers_destroy(workers);
+         workers = NULL;
+      }
+
+      // Receive the final result set, which contains the WAL ending point
+      if (pgmoneta_consume_data_row_messages(ssl, socket, buffer, &response))
+      {
          goto error;
       }
-   }
+      else
+      {
+         memset(endpos, 0, sizeof(endpos));
+         memcpy(endpos, response->tuples[0].data[0], strlen(response->tuples[0].data[0]));
+         end_timeline = atoi(response->tuples[0].data[1]);
+         pgmoneta_free_query_response(response);
+         response = NULL;
+      }
 
-   // Receive the final result set, which contains the WAL ending point
-   if (pgmoneta_consume_data_row_messages(ssl, socket, buffer, &response))
-   {
-      goto error;
-   }
-   else
-   {
-      memset(endpos, 0, sizeof(endpos));
-      memcpy(endpos, response->tuples[0].data[0], strlen(response->tuples[0].data[0]));
-      end_timeline = atoi(response->tuples[0].data[1]);
-      pgmoneta_free_query_response(response);
-      response = NULL;
-   }
+      // remove backup_label.old if it exists
+      memset(old_label_path, 0, MAX_PATH);
+      if (pgmoneta_ends_with(root, "/"))
+      {
+         snprintf(old_label_path, MAX_PATH, "%sdata/%s", root, "backup_label.old");
+      }
+      else
+      {
+         snprintf(old_label_path, MAX_PATH, "%s/data/%s", root, "backup_label.old");
+      }
 
-   // remove backup_label.old if it exists
-   memset(old_label_path, 0, MAX_PATH);
-   if (pgmoneta_ends_with(root, "/"))
-   {
-      snprintf(old_label_path, MAX_PATH, "%sdata/%s", root, "backup_label.old");
-   }
-   else
-   {
-      snprintf(old_label_path, MAX_PATH, "%s/data/%s", root, "backup_label.old");
-   }
+      if (pgmoneta_exists(old_label_path))
+      {
+         pgmoneta_delete_file(old_label_path, NULL);
+      }
 
-   if (pgmoneta_exists(old_label_path))
-   {
-      pgmoneta_delete_file(old_label_path, NULL);
+      // receive and ignore the last result set, it's just a summary
+      pgmoneta_consume_data_row_messages(ssl, socket, buffer, &response);
    }
 
-   // receive and ignore the last result set, it's just a summary
-   pgmoneta_consume_data_row_messages(ssl, socket, buffer, &response);
-
    total_seconds = (int) difftime(time(NULL), start_time);
    hours = total_seconds / 3600;
    minutes = (total_seconds % 3600) / 60;
@@ -303,7 +431,14 @@ basebackup_execute(int server, char* identifier, struct node* i_nodes, struct no
 
    d = pgmoneta_get_server_backup_identifier_data(server, identifier);
 
-   size = pgmoneta_directory_size(d);
+   if (store)
+   {
+      size = restore_size(d);
+   }
+   else
+   {
+      size = pgmoneta_directory_size(d);
+   }
    pgmoneta_read_wal(d, &wal);
    pgmoneta_read_checkpoint_info(d, &chkptpos);
 
@@ -319,20 +454,33 @@ basebackup_execute(int server, char* identifier, struct node* i_nodes, struct no
    }
    pgmoneta_append_node(o_nodes, o_to);
 
-   pgmoneta_create_info(root, identifier, 1);
-   pgmoneta_update_info_string(root, INFO_WAL, wal);
-   pgmoneta_update_info_unsigned_long(root, INFO_RESTORE, size);
-   pgmoneta_update_info_string(root, INFO_VERSION, version);
-   pgmoneta_update_info_string(root, INFO_MINOR_VERSION, minor_version);
-   pgmoneta_update_info_bool(root, INFO_KEEP, false);
-   pgmoneta_update_info_string(root, INFO_START_WALPOS, startpos);
-   pgmoneta_update_info_string(root, INFO_END_WALPOS, endpos);
-   pgmoneta_update_info_unsigned_long(root, INFO_START_TIMELINE, start_timeline);
-   pgmoneta_update_info_unsigned_long(root, INFO_END_TIMELINE, end_timeline);
+   if (incremental)
+   {
+      if (pgmoneta_create_node_string(prior, "incremental", &o_incremental))
+      {
+         goto error;
+      }
+      pgmoneta_append_node(o_nodes, o_incremental);
+   }
+
+   if (pgmoneta_info_create(root, identifier, 1, &info))
+   {
+      goto error;
+   }
+
+   pgmoneta_info_set_string(info, INFO_WAL, wal);
+   pgmoneta_info_set_unsigned_long(info, INFO_RESTORE, size);
+   pgmoneta_info_set_string(info, INFO_VERSION, version);
+   pgmoneta_info_set_string(info, INFO_MINOR_VERSION, minor_version);
+   pgmoneta_info_set_bool(info, INFO_KEEP, false);
+   pgmoneta_info_set_string(info, INFO_START_WALPOS, startpos);
+   pgmoneta_info_set_string(info, INFO_END_WALPOS, endpos);
+   pgmoneta_info_set_unsigned_long(info, INFO_START_TIMELINE, start_timeline);
+   pgmoneta_info_set_unsigned_long(info, INFO_END_TIMELINE, end_timeline);
    // in case of parsing error
    if (chkptpos != NULL)
    {
-      pgmoneta_update_info_string(root, INFO_CHKPT_WALPOS, chkptpos);
+      pgmoneta_info_set_string(info, INFO_CHKPT_WALPOS, chkptpos);
    }
 
    current_tablespace = tablespaces;
@@ -341,13 +489,18 @@ basebackup_execute(int server, char* identifier, struct node* i_nodes, struct no
       char key[MISC_LENGTH];
 
       number_of_tablespaces++;
-      pgmoneta_update_info_unsigned_long(root, INFO_TABLESPACES, number_of_tablespaces);
+      pgmoneta_info_set_unsigned_long(info, INFO_TABLESPACES, number_of_tablespaces);
 
       snprintf(key, sizeof(key) - 1, "TABLESPACE%d", number_of_tablespaces);
-      pgmoneta_update_info_string(root, key, current_tablespace->name);
+      pgmoneta_info_set_string(info, key, current_tablespace->name);
 
       current_tablespace = current_tablespace->next;
    }
+
+   if (pgmoneta_info_commit(info))
+   {
+      goto error;
+   }
    pgmoneta_close_ssl(ssl);
    if (socket != -1)
    {
@@ -366,10 +519,16 @@ basebackup_execute(int server, char* identifier, struct node* i_nodes, struct no
    free(label);
    free(d);
    free(wal);
+   free(prior);
+   free(prior_data);
 
    return 0;
 
 error:
+   if (workers != NULL)
+   {
+      pgmoneta_workers_destroy(workers);
+   }
    pgmoneta_close_ssl(ssl);
    if (socket != -1)
    {
@@ -387,6 +546,8 @@ error:
    free(label);
    free(d);
    free(wal);
+   free(prior);
+   free(prior_data);
 
    return 1;
 }
@@ -396,3 +557,63 @@ basebackup_teardown(int server, char* identifier, struct node* i_nodes, struct n
 {
    return 0;
 }
+
+static char*
+prior_backup(int server)
+{
+   char* server_path = NULL;
+   char* label = NULL;
+   int number_of_backups = 0;
+   struct backup** backups = NULL;
+   struct configuration* config;
+
+   config = (struct configuration*)shmem;
+
+   server_path = pgmoneta_get_server_backup(server);
+
+   pgmoneta_get_backups(server_path, &number_of_backups, &backups);
+
+   for (int i = number_of_backups - 1; i >= 0 && label == NULL; i--)
+   {
+      if (backups[i]->valid == VALID_TRUE && backups[i]->version == config->servers[server].version)
+      {
+         label = pgmoneta_append(label, backups[i]->label);
+      }
+   }
+
+   for (int i = 0; i < number_of_backups; i++)
+   {
+      free(backups[i]);
+   }
+   free(backups);
+   free(server_path);
+
+   return label;
+}
+
+static unsigned long
+restore_size(char* d)
+{
+   char path[MAX_PATH];
+   unsigned long size = 0;
+   struct manifest* manifest = NULL;
+
+   memset(path, 0, sizeof(path));
+   snprintf(path, sizeof(path), "%s/backup_manifest", d);
+
+   // the stored files are smaller than what a restore writes, so take the sizes from the manifest
+   if (pgmoneta_parse_manifest(path, &manifest))
+   {
+      return pgmoneta_directory_size(d);
+   }
+
+   size = manifest->map_size;
+   for (unsigned long i = 0; i < manifest->number_of_files; i++)
+   {
+      size += manifest->files[i].size;
+   }
+
+   pgmoneta_manifest_free(manifest);
+
+   return size;
+}
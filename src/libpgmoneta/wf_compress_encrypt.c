@@ -0,0 +1,167 @@
+/*
+ * Copyright (C) 2024 The pgmoneta community
+ *
+ * Redistribution and use in source and binary forms, with or without modification,
+ * are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, this list
+ * of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice, this
+ * list of conditions and the following disclaimer in the documentation and/or other
+ * materials provided with the distribution.
+ *
+ * 3. Neither the name of the copyright holder nor the names of its contributors may
+ * be used to endorse or promote products derived from this software without specific
+ * prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL
+ * THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT
+ * OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR
+ * TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/* pgmoneta */
+#include <pgmoneta.h>
+#include <logging.h>
+#include <node.h>
+#include <pipeline.h>
+#include <utils.h>
+#include <workers.h>
+#include <workflow.h>
+
+/* system */
+#include <stdlib.h>
+
+static int compress_encrypt_setup(int, char*, struct node*, struct node**);
+static int compress_encrypt_execute(int, char*, struct node*, struct node**);
+static int compress_encrypt_teardown(int, char*, struct node*, struct node**);
+
+struct workflow*
+pgmoneta_workflow_create_compress_encrypt(void)
+{
+   struct workflow* wf = NULL;
+
+   wf = (struct workflow*)malloc(sizeof(struct workflow));
+
+   wf->setup = &compress_encrypt_setup;
+   wf->execute = &compress_encrypt_execute;
+   wf->teardown = &compress_encrypt_teardown;
+   wf->next = NULL;
+
+   return wf;
+}
+
+static int
+compress_encrypt_setup(int server, char* identifier, struct node* i_nodes, struct node** o_nodes)
+{
+   return 0;
+}
+
+static int
+compress_encrypt_execute(int server, char* identifier, struct node* i_nodes, struct node** o_nodes)
+{
+   char* d = NULL;
+   char* root = NULL;
+   char* to = NULL;
+   char* tarfile = NULL;
+   time_t start_time;
+   int total_seconds;
+   int hours;
+   int minutes;
+   int seconds;
+   char elapsed[128];
+   int number_of_workers = 0;
+   bool failed = false;
+   struct workers* workers = NULL;
+   struct configuration* config;
+
+   config = (struct configuration*)shmem;
+
+   start_time = time(NULL);
+
+   tarfile = pgmoneta_get_node_string(*o_nodes, "tarfile");
+
+   if (tarfile == NULL)
+   {
+      number_of_workers = pgmoneta_get_number_of_workers(server);
+      if (number_of_workers > 0)
+      {
+         pgmoneta_workers_initialize(number_of_workers, &workers);
+      }
+
+      root = pgmoneta_get_node_string(*o_nodes, "root");
+      to = pgmoneta_get_node_string(*o_nodes, "to");
+
+      d = pgmoneta_append(d, to);
+
+      if (pgmoneta_compress_encrypt_data(d, workers) ||
+          pgmoneta_compress_encrypt_tablespaces(root, workers))
+      {
+         failed = true;
+      }
+
+      if (number_of_workers > 0)
+      {
+         pgmoneta_workers_wait(workers);
+         if (!atomic_load(&workers->outcome))
+         {
+            failed = true;
+         }
+         pgmoneta_workers_destroy(workers);
+      }
+
+      if (failed)
+      {
+         pgmoneta_log_error("Compression/Encryption: Could not compress and encrypt %s/%s", config->servers[server].name, identifier);
+         goto error;
+      }
+   }
+   else
+   {
+      d = pgmoneta_append(d, tarfile);
+      d = pgmoneta_append(d, pgmoneta_compression_suffix(config->compression_type));
+      d = pgmoneta_append(d, ".aes");
+
+      if (pgmoneta_exists(d))
+      {
+         pgmoneta_delete_file(d, NULL);
+      }
+
+      if (pgmoneta_compress_encrypt_file(tarfile, d))
+      {
+         goto error;
+      }
+   }
+
+   total_seconds = (int)difftime(time(NULL), start_time);
+   hours = total_seconds / 3600;
+   minutes = (total_seconds % 3600) / 60;
+   seconds = total_seconds % 60;
+
+   memset(&elapsed[0], 0, sizeof(elapsed));
+   sprintf(&elapsed[0], "%02i:%02i:%02i", hours, minutes, seconds);
+
+   pgmoneta_log_debug("Compression/Encryption: %s/%s (Elapsed: %s)", config->servers[server].name, identifier, &elapsed[0]);
+
+   free(d);
+
+   return 0;
+
+error:
+
+   free(d);
+
+   return 1;
+}
+
+static int
+compress_encrypt_teardown(int server, char* identifier, struct node* i_nodes, struct node** o_nodes)
+{
+   return 0;
+}
@@ -29,6 +29,7 @@
 /* pgmoneta */
 #include <node.h>
 #include <pgmoneta.h>
+#include <catalog.h>
 #include <info.h>
 #include <link.h>
 #include <logging.h>
@@ -184,6 +185,7 @@ delete_backup_execute(int server, char* identifier, struct node* i_nodes, struct
 
          size = pgmoneta_directory_size(d);
          pgmoneta_update_info_unsigned_long(d, INFO_BACKUP, size);
+         pgmoneta_catalog_add_size(server, CATALOG_SIZE_BACKUP, (long)size - (long)backups[next_index]->backup_size);
 
          free(from);
          free(to);
@@ -213,6 +215,7 @@ delete_backup_execute(int server, char* identifier, struct node* i_nodes, struct
 
          size = pgmoneta_directory_size(d);
          pgmoneta_update_info_unsigned_long(d, INFO_BACKUP, size);
+         pgmoneta_catalog_add_size(server, CATALOG_SIZE_BACKUP, (long)size - (long)backups[next_index]->backup_size);
 
          free(from);
          free(to);
@@ -237,6 +240,11 @@ delete_backup_execute(int server, char* identifier, struct node* i_nodes, struct
       pgmoneta_workers_destroy(workers);
    }
 
+   free(d);
+   d = pgmoneta_get_server_backup_identifier(server, backups[backup_index]->label);
+   pgmoneta_catalog_refresh(d);
+   pgmoneta_catalog_add_size(server, CATALOG_SIZE_BACKUP, -(long)backups[backup_index]->backup_size);
+
    pgmoneta_log_info("Delete: %s/%s", config->servers[server].name, backups[backup_index]->label);
 
    for (int i = 0; i < number_of_backups; i++)
@@ -0,0 +1,153 @@
+/*
+ * Copyright (C) 2024 The pgmoneta community
+ *
+ * Redistribution and use in source and binary forms, with or without modification,
+ * are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, this list
+ * of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice, this
+ * list of conditions and the following disclaimer in the documentation and/or other
+ * materials provided with the distribution.
+ *
+ * 3. Neither the name of the copyright holder nor the names of its contributors may
+ * be used to endorse or promote products derived from this software without specific
+ * prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL
+ * THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT
+ * OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR
+ * TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/* pgmoneta */
+#include <pgmoneta.h>
+#include <incremental.h>
+#include <info.h>
+#include <logging.h>
+#include <node.h>
+#include <utils.h>
+#include <workers.h>
+#include <workflow.h>
+
+/* system */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+static int incremental_setup(int, char*, struct node*, struct node**);
+static int incremental_execute(int, char*, struct node*, struct node**);
+static int incremental_teardown(int, char*, struct node*, struct node**);
+
+struct workflow*
+pgmoneta_workflow_create_incremental(void)
+{
+   struct workflow* wf = NULL;
+
+   wf = (struct workflow*)malloc(sizeof(struct workflow));
+
+   wf->setup = &incremental_setup;
+   wf->execute = &incremental_execute;
+   wf->teardown = &incremental_teardown;
+   wf->next = NULL;
+
+   return wf;
+}
+
+static int
+incremental_setup(int server, char* identifier, struct node* i_nodes, struct node** o_nodes)
+{
+   return 0;
+}
+
+static int
+incremental_execute(int server, char* identifier, struct node* i_nodes, struct node** o_nodes)
+{
+   char* prior = NULL;
+   char* prior_data = NULL;
+   char* root = NULL;
+   char* to = NULL;
+   time_t start_time;
+   int total_seconds;
+   int hours;
+   int minutes;
+   int seconds;
+   char elapsed[128];
+   int number_of_workers = 0;
+   struct workers* workers = NULL;
+   struct configuration* config;
+
+   config = (struct configuration*)shmem;
+
+   // the server sent a full backup
+   prior = pgmoneta_get_node_string(*o_nodes, "incremental");
+   if (prior == NULL)
+   {
+      return 0;
+   }
+
+   start_time = time(NULL);
+
+   root = pgmoneta_get_node_string(*o_nodes, "root");
+   to = pgmoneta_get_node_string(*o_nodes, "to");
+
+   prior_data = pgmoneta_get_server_backup_identifier_data(server, prior);
+
+   number_of_workers = pgmoneta_get_number_of_workers(server);
+   if (number_of_workers > 0)
+   {
+      pgmoneta_workers_initialize(number_of_workers, &workers);
+   }
+
+   if (pgmoneta_incremental_combine(to, prior_data, workers))
+   {
+      pgmoneta_log_error("Incremental: Could not reconstruct %s/%s from %s", config->servers[server].name, identifier, prior);
+      goto error;
+   }
+
+   if (number_of_workers > 0)
+   {
+      pgmoneta_workers_destroy(workers);
+      workers = NULL;
+   }
+
+   pgmoneta_update_info_unsigned_long(root, INFO_RESTORE, pgmoneta_directory_size(to));
+
+   total_seconds = (int)difftime(time(NULL), start_time);
+   hours = total_seconds / 3600;
+   minutes = (total_seconds % 3600) / 60;
+   seconds = total_seconds % 60;
+
+   memset(&elapsed[0], 0, sizeof(elapsed));
+   sprintf(&elapsed[0], "%02i:%02i:%02i", hours, minutes, seconds);
+
+   pgmoneta_log_debug("Incremental: %s/%s from %s (Elapsed: %s)", config->servers[server].name, identifier, prior, &elapsed[0]);
+
+   free(prior_data);
+
+   return 0;
+
+error:
+
+   if (workers != NULL)
+   {
+      pgmoneta_workers_destroy(workers);
+   }
+   pgmoneta_update_info_bool(root, INFO_STATUS, false);
+
+   free(prior_data);
+
+   return 1;
+}
+
+static int
+incremental_teardown(int server, char* identifier, struct node* i_nodes, struct node** o_nodes)
+{
+   return 0;
+}
@@ -32,12 +32,15 @@
 #include <info.h>
 #include <link.h>
 #include <logging.h>
+#include <manifest.h>
 #include <utils.h>
 #include <workers.h>
 #include <workflow.h>
 
 /* system */
 #include <stdlib.h>
+#include <string.h>
+#include <time.h>
 
 static int link_setup(int, char*, struct node*, struct node**);
 static int link_execute(int, char*, struct node*, struct node**);
@@ -83,6 +86,11 @@ link_execute(int server, char* identifier, struct node* i_nodes, struct node** o
    char elapsed[128];
    int number_of_workers = 0;
    struct workers* workers = NULL;
+   struct manifest* from_manifest = NULL;
+   struct manifest* to_manifest = NULL;
+   struct link_statistics statistics;
+   struct timespec start;
+   struct timespec end;
    struct configuration* config;
 
    config = (struct configuration*)shmem;
@@ -120,8 +128,42 @@ link_execute(int server, char* identifier, struct node* i_nodes, struct node** o
          from_tablespaces = pgmoneta_get_server_backup_identifier(server, identifier);
          to_tablespaces = pgmoneta_get_server_backup_identifier(server, backups[next_newest]->label);
 
-         pgmoneta_link(from, to, workers);
-         pgmoneta_link_tablespaces(from_tablespaces, workers);
+         clock_gettime(CLOCK_MONOTONIC, &start);
+
+         // the manifests tell which files are unchanged, so only compare files without a manifest
+         if (!pgmoneta_manifest_load(from, &from_manifest) &&
+             !pgmoneta_manifest_load(to, &to_manifest))
+         {
+            memset(&statistics, 0, sizeof(struct link_statistics));
+
+            pgmoneta_link_manifest(from, to, from_manifest, to_manifest, workers, &statistics);
+
+            clock_gettime(CLOCK_MONOTONIC, &end);
+
+            pgmoneta_log_debug("Link: %s/%s %lu files linked by manifest, %lu compared, %lu linked, %lu bytes saved, %lu bytes not read (%.3f s)",
+                               config->servers[server].name, identifier,
+                               statistics.manifest_files, statistics.compared_files, statistics.linked_files,
+                               statistics.bytes_saved, statistics.bytes_not_read,
+                               (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1000000000.0);
+         }
+         else
+         {
+            pgmoneta_log_debug("Link: %s/%s has no manifest to compare against, comparing all files",
+                               config->servers[server].name, identifier);
+
+            pgmoneta_link(from, to, workers);
+            pgmoneta_link_tablespaces(from_tablespaces, workers);
+
+            if (number_of_workers > 0)
+            {
+               pgmoneta_workers_wait(workers);
+            }
+
+            clock_gettime(CLOCK_MONOTONIC, &end);
+
+            pgmoneta_log_debug("Link: %s/%s compared in %.3f s", config->servers[server].name, identifier,
+                               (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1000000000.0);
+         }
 
          if (number_of_workers > 0)
          {
@@ -129,6 +171,9 @@ link_execute(int server, char* identifier, struct node* i_nodes, struct node** o
             pgmoneta_workers_destroy(workers);
          }
 
+         pgmoneta_manifest_free(from_manifest);
+         pgmoneta_manifest_free(to_manifest);
+
          total_seconds = (int)difftime(time(NULL), link_time);
          hours = total_seconds / 3600;
          minutes = (total_seconds % 3600) / 60;
@@ -31,6 +31,7 @@
 #include <pgmoneta.h>
 #include <info.h>
 #include <logging.h>
+#include <pipeline.h>
 #include <restore.h>
 #include <string.h>
 #include <utils.h>
@@ -40,6 +41,7 @@
 /* system */
 #include <fcntl.h>
 #include <stdlib.h>
+#include <time.h>
 #include <unistd.h>
 
 static int restore_setup(int, char*, struct node*, struct node**);
@@ -55,6 +57,7 @@ static int restore_excluded_files_execute(int, char*, struct node*, struct node*
 static int restore_excluded_files_teardown(int, char*, struct node*, struct node**);
 
 static char* get_user_password(char* username);
+static void log_copy_statistics(int server, char* id, struct timespec* start);
 static void create_standby_signal(char* basedir);
 
 struct workflow*
@@ -137,6 +140,7 @@ restore_execute(int server, char* identifier, struct node* i_nodes, struct node*
    struct node* o_primary = NULL;
    struct node* o_recovery_info = NULL;
    struct workers* workers = NULL;
+   struct timespec start;
    struct configuration* config;
 
    config = (struct configuration*)shmem;
@@ -259,6 +263,9 @@ restore_execute(int server, char* identifier, struct node* i_nodes, struct node*
       pgmoneta_workers_initialize(number_of_workers, &workers);
    }
 
+   pgmoneta_reset_copy_statistics();
+   clock_gettime(CLOCK_MONOTONIC, &start);
+
    if (pgmoneta_copy_postgresql(from, to, directory, config->servers[server].name, id, verify, workers))
    {
       pgmoneta_log_error("Restore: Could not restore %s/%s", config->servers[server].name, id);
@@ -359,7 +366,11 @@ restore_execute(int server, char* identifier, struct node* i_nodes, struct node*
             waltarget = pgmoneta_append(waltarget, id);
             waltarget = pgmoneta_append(waltarget, "/pg_wal/");
 
-            pgmoneta_copy_wal_files(waldir, waltarget, &backup->wal[0], workers);
+            if (pgmoneta_copy_wal_files(waldir, waltarget, &backup->wal[0], workers))
+            {
+               pgmoneta_log_error("Restore: Could not restore the WAL of %s/%s", config->servers[server].name, id);
+               goto error;
+            }
          }
       }
 
@@ -375,9 +386,19 @@ restore_execute(int server, char* identifier, struct node* i_nodes, struct node*
    if (number_of_workers > 0)
    {
       pgmoneta_workers_wait(workers);
+
+      if (!atomic_load(&workers->outcome))
+      {
+         pgmoneta_log_error("Restore: Could not restore %s/%s", config->servers[server].name, id);
+         goto error;
+      }
+
       pgmoneta_workers_destroy(workers);
+      number_of_workers = 0;
    }
 
+   log_copy_statistics(server, id, &start);
+
    o = pgmoneta_append(o, directory);
    o = pgmoneta_append(o, "/");
 
@@ -799,8 +820,6 @@ restore_excluded_files_execute(int server, char* identifier, struct node* i_node
    int number_of_backups = 0;
    struct backup** backups = NULL;
    char* d = NULL;
-   struct workers* workers = NULL;
-   int number_of_workers = 0;
    char** restore_last_files_names = NULL;
    char* directory = NULL;
    struct configuration* config = (struct configuration*)shmem;
@@ -867,6 +886,7 @@ restore_excluded_files_execute(int server, char* identifier, struct node* i_node
    {
       char* from_file = NULL;
       char* to_file = NULL;
+      char* stored_file = NULL;
 
       from_file = (char*)malloc((strlen(from) + strlen(restore_last_files_names[i])) * sizeof(char) + 1);
       if (from_file == NULL)
@@ -888,19 +908,25 @@ restore_excluded_files_execute(int server, char* identifier, struct node* i_node
       to_file = strcpy(to_file, to);
       to_file = strcat(to_file, restore_last_files_names[i]);
 
-      number_of_workers = pgmoneta_get_number_of_workers(server);
-      if (number_of_workers > 0)
+      stored_file = pgmoneta_stored_file(from_file);
+      if (stored_file == NULL)
       {
-         pgmoneta_workers_initialize(number_of_workers, &workers);
+         pgmoneta_log_error("Restore: Could not find file %s", from_file);
+         free(from_file);
+         free(to_file);
+         goto error;
       }
 
-      if (pgmoneta_copy_file(from_file, to_file, workers))
+      /* The files are restored last, so do it without the workers */
+      if (pgmoneta_restore_stored_file(stored_file, to_file, NULL))
       {
-         pgmoneta_log_error("Restore: Could not copy file %s to %s", from_file, to_file);
+         pgmoneta_log_error("Restore: Could not copy file %s to %s", stored_file, to_file);
+         free(stored_file);
          free(from_file);
          free(to_file);
          goto error;
       }
+      free(stored_file);
       free(from_file);
       free(to_file);
    }
@@ -988,3 +1014,43 @@ create_standby_signal(char* basedir)
 
    free(f);
 }
+
+static void
+log_copy_statistics(int server, char* id, struct timespec* start)
+{
+   unsigned long files = 0;
+   unsigned long bytes = 0;
+   double seconds;
+   char* methods = NULL;
+   struct timespec end;
+   struct copy_statistics statistics;
+   struct configuration* config;
+
+   config = (struct configuration*)shmem;
+
+   clock_gettime(CLOCK_MONOTONIC, &end);
+   seconds = (end.tv_sec - start->tv_sec) + (end.tv_nsec - start->tv_nsec) / 1000000000.0;
+
+   pgmoneta_get_copy_statistics(&statistics);
+
+   for (int i = 0; i < NUMBER_OF_COPY_METHODS; i++)
+   {
+      files += statistics.files[i];
+      bytes += statistics.bytes[i];
+
+      if (statistics.files[i] > 0)
+      {
+         methods = pgmoneta_append(methods, methods == NULL ? "" : ", ");
+         methods = pgmoneta_append(methods, pgmoneta_copy_method_name(i));
+         methods = pgmoneta_append(methods, " ");
+         methods = pgmoneta_append_ulong(methods, statistics.files[i]);
+      }
+   }
+
+   pgmoneta_log_info("Restore: %s/%s copied %lu files, %.3f GB in %.3f s (%.3f GB/s) using %s",
+                     config->servers[server].name, id, files, bytes / 1000000000.0, seconds,
+                     seconds > 0 ? bytes / 1000000000.0 / seconds : 0.0,
+                     methods != NULL ? methods : "no copies");
+
+   free(methods);
+}
@@ -63,6 +63,12 @@ pgmoneta_workflow_create_sha256(void)
 static int
 sha256_setup(int server, char* identifier, struct node* i_nodes, struct node** o_nodes)
 {
+   // the hashes are taken while the backup is written, so it isn't read again
+   if (pgmoneta_sha256_registry_start())
+   {
+      pgmoneta_log_debug("SHA256: The files of %s will be read", identifier);
+   }
+
    return 0;
 }
 
@@ -118,6 +124,8 @@ error:
 static int
 sha256_teardown(int server, char* identifier, struct node* i_nodes, struct node** o_nodes)
 {
+   pgmoneta_sha256_registry_stop();
+
    return 0;
 }
 
@@ -170,7 +178,10 @@ write_backup_sha256(char* root, char* relative_path)
          absolute_file_path = pgmoneta_append(absolute_file_path, "/");
          absolute_file_path = pgmoneta_append(absolute_file_path, relative_file_path);
 
-         pgmoneta_generate_file_sha256_hash(absolute_file_path, &sha256);
+         if (pgmoneta_sha256_registry_get(absolute_file_path, &sha256))
+         {
+            pgmoneta_generate_file_sha256_hash(absolute_file_path, &sha256);
+         }
 
          buffer = pgmoneta_append(buffer, relative_file_path);
          buffer = pgmoneta_append(buffer, ":");
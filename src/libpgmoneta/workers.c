@@ -31,27 +31,33 @@
 #include <workers.h>
 
 #include <errno.h>
+#include <sched.h>
 #include <signal.h>
+#include <string.h>
 #include <time.h>
 #include <unistd.h>
 
-static volatile int worker_keepalive;
+static _Thread_local struct worker* current_worker = NULL;
 
-static int worker_init(struct workers* workers, struct worker** worker);
+static int worker_init(struct workers* workers, int index, struct worker** worker);
 static void* worker_do(struct worker* worker);
+static struct task* worker_find(struct worker* worker);
+static void worker_park(struct worker* worker);
+static void worker_run(struct worker* worker, struct task* task);
 static void worker_destroy(struct worker* worker);
 
-static int queue_init(struct queue* queue);
-static void queue_clear(struct queue* queue);
-static void queue_push(struct queue* queue, struct task* task);
+static int queue_init(struct queue* queue, size_t size);
+static bool queue_push(struct queue* queue, struct task* task);
 static struct task* queue_pull(struct queue* queue);
 static void queue_destroy(struct queue* queue);
 
-static int semaphore_init(struct semaphore* semaphore, int value);
-static void semaphore_reset(struct semaphore* semaphore);
-static void semaphore_post(struct semaphore* semaphore);
-static void semaphore_post_all(struct semaphore* semaphore);
-static void semaphore_wait(struct semaphore* semaphore);
+static int deque_init(struct deque* deque, long size);
+static bool deque_push(struct deque* deque, struct task* task);
+static struct task* deque_take(struct deque* deque);
+static struct task* deque_steal(struct deque* deque, bool* retry);
+static void deque_destroy(struct deque* deque);
+
+static void wakeup(struct workers* workers);
 
 int
 pgmoneta_workers_initialize(int num, struct workers** workers)
@@ -60,8 +66,6 @@ pgmoneta_workers_initialize(int num, struct workers** workers)
 
    *workers = NULL;
 
-   worker_keepalive = 1;
-
    if (num < 1)
    {
       goto error;
@@ -74,31 +78,52 @@ pgmoneta_workers_initialize(int num, struct workers** workers)
       goto error;
    }
 
-   w->number_of_alive = 0;
-   w->number_of_working = 0;
+   memset(w, 0, sizeof(struct workers));
 
-   if (queue_init(&w->queue))
+   w->number_of_workers = 0;
+   atomic_init(&w->number_of_alive, 0);
+   atomic_init(&w->keepalive, true);
+   atomic_init(&w->pending, 0);
+   atomic_init(&w->outstanding, 0);
+   atomic_init(&w->sleeping, 0);
+   atomic_init(&w->queue_full, 0);
+   atomic_init(&w->outcome, true);
+
+   if (queue_init(&w->queue, WORKERS_QUEUE_SIZE))
    {
       pgmoneta_log_error("Could not allocate memory for queue");
       goto error;
    }
 
-   w->worker = (struct worker**)malloc(num * sizeof(struct worker*));
+   w->worker = (struct worker**)calloc(num, sizeof(struct worker*));
    if (w->worker == NULL)
    {
       pgmoneta_log_error("Could not allocate memory for workers");
       goto error;
    }
 
-   pthread_mutex_init(&(w->worker_lock), NULL);
+   pthread_mutex_init(&w->park_lock, NULL);
+   pthread_cond_init(&w->has_tasks, NULL);
+   pthread_mutex_init(&w->worker_lock, NULL);
    pthread_cond_init(&w->worker_all_idle, NULL);
 
+   /* All deques must exist before any worker starts stealing */
    for (int n = 0; n < num; n++)
    {
-      worker_init(w, &w->worker[n]);
+      if (worker_init(w, n, &w->worker[n]))
+      {
+         goto error;
+      }
+      w->number_of_workers++;
    }
 
-   while (w->number_of_alive != num)
+   for (int n = 0; n < num; n++)
+   {
+      pthread_create(&w->worker[n]->pthread, NULL, (void* (*)(void*)) worker_do, w->worker[n]);
+      pthread_detach(w->worker[n]->pthread);
+   }
+
+   while (atomic_load(&w->number_of_alive) != num)
    {
       SLEEP(10);
    }
@@ -111,6 +136,14 @@ error:
 
    if (w != NULL)
    {
+      if (w->worker != NULL)
+      {
+         for (int n = 0; n < w->number_of_workers; n++)
+         {
+            worker_destroy(w->worker[n]);
+         }
+         free(w->worker);
+      }
       queue_destroy(&w->queue);
       free(w);
    }
@@ -135,7 +168,30 @@ pgmoneta_workers_add(struct workers* workers, void (*function)(void*), void* ap)
       t->function = function;
       t->arg = ap;
 
-      queue_push(&workers->queue, t);
+      atomic_fetch_add(&workers->outstanding, 1);
+      atomic_fetch_add(&workers->pending, 1);
+
+      if (current_worker != NULL && current_worker->workers == workers)
+      {
+         if (!deque_push(&current_worker->deque, t) && !queue_push(&workers->queue, t))
+         {
+            /* Both full, so execute the task directly */
+            atomic_fetch_sub(&workers->pending, 1);
+            worker_run(current_worker, t);
+            return 0;
+         }
+      }
+      else
+      {
+         while (!queue_push(&workers->queue, t))
+         {
+            atomic_fetch_add_explicit(&workers->queue_full, 1, memory_order_relaxed);
+            wakeup(workers);
+            sched_yield();
+         }
+      }
+
+      wakeup(workers);
 
       return 0;
    }
@@ -152,7 +208,7 @@ pgmoneta_workers_wait(struct workers* workers)
    {
       pthread_mutex_lock(&workers->worker_lock);
 
-      while (workers->queue.number_of_tasks || workers->number_of_working)
+      while (atomic_load(&workers->outstanding) > 0)
       {
          pthread_cond_wait(&workers->worker_all_idle, &workers->worker_lock);
       }
@@ -164,43 +220,84 @@ pgmoneta_workers_wait(struct workers* workers)
 void
 pgmoneta_workers_destroy(struct workers* workers)
 {
-   volatile int worker_total;
-   double timeout = 1.0;
-   time_t start;
-   time_t end;
-   double tpassed = 0.0;
+   struct worker_statistics stats;
 
    if (workers != NULL)
    {
-      worker_total = workers->number_of_alive;
-      worker_keepalive = 0;
+      atomic_store(&workers->keepalive, false);
+
+      while (atomic_load(&workers->number_of_alive) > 0)
+      {
+         pthread_mutex_lock(&workers->park_lock);
+         pthread_cond_broadcast(&workers->has_tasks);
+         pthread_mutex_unlock(&workers->park_lock);
+         SLEEP(1000000L);
+      }
+
+      for (int n = 0; n < workers->number_of_workers; n++)
+      {
+         if (!pgmoneta_workers_statistics(workers, n, &stats))
+         {
+            pgmoneta_log_debug("Worker %d: executed=%lu local=%lu submitted=%lu stolen=%lu steal_failures=%lu parks=%lu",
+                               n, stats.executed, stats.local, stats.submitted,
+                               stats.stolen, stats.steal_failures, stats.parks);
+         }
+      }
 
-      time (&start);
-      while (tpassed < timeout && workers->number_of_alive)
+      if (atomic_load(&workers->queue_full) > 0)
       {
-         semaphore_post_all(workers->queue.has_tasks);
-         time(&end);
-         tpassed = difftime(end, start);
+         pgmoneta_log_debug("Workers: submission queue full %lu times", atomic_load(&workers->queue_full));
       }
 
-      while (workers->number_of_alive)
+      /* Tasks left behind are only possible if the pool is destroyed without waiting */
+      for (struct task* t = queue_pull(&workers->queue); t != NULL; t = queue_pull(&workers->queue))
       {
-         semaphore_post_all(workers->queue.has_tasks);
-         SLEEP(1000000000L);
+         free(t);
       }
 
       queue_destroy(&workers->queue);
 
-      for (int n = 0; n < worker_total; n++)
+      for (int n = 0; n < workers->number_of_workers; n++)
       {
          worker_destroy(workers->worker[n]);
       }
 
+      pthread_mutex_destroy(&workers->park_lock);
+      pthread_cond_destroy(&workers->has_tasks);
+      pthread_mutex_destroy(&workers->worker_lock);
+      pthread_cond_destroy(&workers->worker_all_idle);
+
       free(workers->worker);
       free(workers);
    }
 }
 
+int
+pgmoneta_workers_statistics(struct workers* workers, int index, struct worker_statistics* statistics)
+{
+   struct worker* w = NULL;
+
+   if (workers == NULL || statistics == NULL || index < 0 || index >= workers->number_of_workers)
+   {
+      goto error;
+   }
+
+   w = workers->worker[index];
+
+   statistics->executed = atomic_load_explicit(&w->executed, memory_order_relaxed);
+   statistics->local = atomic_load_explicit(&w->local, memory_order_relaxed);
+   statistics->submitted = atomic_load_explicit(&w->submitted, memory_order_relaxed);
+   statistics->stolen = atomic_load_explicit(&w->stolen, memory_order_relaxed);
+   statistics->steal_failures = atomic_load_explicit(&w->steal_failures, memory_order_relaxed);
+   statistics->parks = atomic_load_explicit(&w->parks, memory_order_relaxed);
+
+   return 0;
+
+error:
+
+   return 1;
+}
+
 int
 pgmoneta_get_number_of_workers(int server)
 {
@@ -250,7 +347,7 @@ pgmoneta_create_worker_input(char* directory, char* from, char* to, int level, s
 }
 
 static int
-worker_init(struct workers* workers, struct worker** worker)
+worker_init(struct workers* workers, int index, struct worker** worker)
 {
    struct worker* w = NULL;
 
@@ -263,10 +360,24 @@ worker_init(struct workers* workers, struct worker** worker)
       goto error;
    }
 
+   memset(w, 0, sizeof(struct worker));
+
+   w->index = index;
+   w->seed = (unsigned int)index * 2654435761U + 1;
    w->workers = workers;
 
-   pthread_create(&w->pthread, NULL, (void* (*)(void*)) worker_do, w);
-   pthread_detach(w->pthread);
+   atomic_init(&w->executed, 0);
+   atomic_init(&w->local, 0);
+   atomic_init(&w->submitted, 0);
+   atomic_init(&w->stolen, 0);
+   atomic_init(&w->steal_failures, 0);
+   atomic_init(&w->parks, 0);
+
+   if (deque_init(&w->deque, WORKER_DEQUE_SIZE))
+   {
+      pgmoneta_log_error("Could not allocate memory for worker deque");
+      goto error;
+   }
 
    *worker = w;
 
@@ -274,177 +385,319 @@ worker_init(struct workers* workers, struct worker** worker)
 
 error:
 
+   free(w);
+
    return 1;
 }
 
 static void*
 worker_do(struct worker* worker)
 {
-   void (*func_ref)(void*);
-   void* arg_ref;
-   struct task* t;
+   struct task* t = NULL;
    struct workers* workers = worker->workers;
 
-   pthread_mutex_lock(&workers->worker_lock);
-   workers->number_of_alive += 1;
-   pthread_mutex_unlock(&workers->worker_lock);
+   current_worker = worker;
+
+   atomic_fetch_add(&workers->number_of_alive, 1);
 
-   while (worker_keepalive)
+   while (atomic_load(&workers->keepalive))
    {
-      semaphore_wait(workers->queue.has_tasks);
+      t = worker_find(worker);
 
-      if (worker_keepalive)
+      if (t != NULL)
+      {
+         atomic_fetch_sub(&workers->pending, 1);
+         worker_run(worker, t);
+      }
+      else
       {
-         pthread_mutex_lock(&workers->worker_lock);
-         workers->number_of_working++;
-         pthread_mutex_unlock(&workers->worker_lock);
+         worker_park(worker);
+      }
+   }
 
-         t = queue_pull(&workers->queue);
-         if (t)
+   current_worker = NULL;
+
+   atomic_fetch_sub(&workers->number_of_alive, 1);
+
+   return NULL;
+}
+
+static struct task*
+worker_find(struct worker* worker)
+{
+   struct task* t = NULL;
+   struct task* extra = NULL;
+   struct workers* workers = worker->workers;
+   int number_of_workers = workers->number_of_workers;
+   bool retry = false;
+   int start;
+
+   t = deque_take(&worker->deque);
+   if (t != NULL)
+   {
+      atomic_fetch_add_explicit(&worker->local, 1, memory_order_relaxed);
+      return t;
+   }
+
+   t = queue_pull(&workers->queue);
+   if (t != NULL)
+   {
+      atomic_fetch_add_explicit(&worker->submitted, 1, memory_order_relaxed);
+
+      /* Move a small batch to our deque so idle workers can steal it */
+      for (int i = 1; i < WORKER_BATCH_SIZE; i++)
+      {
+         extra = queue_pull(&workers->queue);
+         if (extra == NULL)
          {
-            func_ref = t->function;
-            arg_ref = t->arg;
-            func_ref(arg_ref);
-            free(t);
+            break;
          }
 
-         pthread_mutex_lock(&workers->worker_lock);
-         workers->number_of_working--;
-         if (!workers->number_of_working)
+         if (!deque_push(&worker->deque, extra))
          {
-            pthread_cond_signal(&workers->worker_all_idle);
+            while (!queue_push(&workers->queue, extra))
+            {
+               sched_yield();
+            }
+            break;
          }
-         pthread_mutex_unlock(&workers->worker_lock);
+      }
+
+      return t;
+   }
+
+   if (number_of_workers > 1)
+   {
+      worker->seed ^= worker->seed << 13;
+      worker->seed ^= worker->seed >> 17;
+      worker->seed ^= worker->seed << 5;
+      start = (int)(worker->seed % (unsigned int)number_of_workers);
 
+      do
+      {
+         retry = false;
+
+         for (int i = 0; i < number_of_workers; i++)
+         {
+            struct worker* victim = workers->worker[(start + i) % number_of_workers];
+
+            if (victim == worker)
+            {
+               continue;
+            }
+
+            t = deque_steal(&victim->deque, &retry);
+            if (t != NULL)
+            {
+               atomic_fetch_add_explicit(&worker->stolen, 1, memory_order_relaxed);
+               return t;
+            }
+         }
       }
+      while (retry);
+
+      atomic_fetch_add_explicit(&worker->steal_failures, 1, memory_order_relaxed);
    }
-   pthread_mutex_lock(&workers->worker_lock);
-   workers->number_of_alive--;
-   pthread_mutex_unlock(&workers->worker_lock);
 
    return NULL;
 }
 
 static void
-worker_destroy(struct worker* w)
-{
-   free(w);
-}
-
-static int
-queue_init(struct queue* queue)
+worker_park(struct worker* worker)
 {
-   queue->number_of_tasks = 0;
-   queue->front = NULL;
-   queue->rear = NULL;
+   struct workers* workers = worker->workers;
 
-   queue->has_tasks = (struct semaphore*)malloc(sizeof(struct semaphore));
-   if (queue->has_tasks == NULL)
+   if (atomic_load(&workers->pending) > 0)
    {
-      return 1;
+      /* A task is in flight between a queue and a deque */
+      sched_yield();
+      return;
    }
 
-   pthread_mutex_init(&(queue->rwmutex), NULL);
-   if (semaphore_init(queue->has_tasks, 0))
+   pthread_mutex_lock(&workers->park_lock);
+   atomic_fetch_add(&workers->sleeping, 1);
+
+   if (atomic_load(&workers->pending) == 0 && atomic_load(&workers->keepalive))
    {
-      goto error;
+      atomic_fetch_add_explicit(&worker->parks, 1, memory_order_relaxed);
+      pthread_cond_wait(&workers->has_tasks, &workers->park_lock);
    }
 
-   return 0;
+   atomic_fetch_sub(&workers->sleeping, 1);
+   pthread_mutex_unlock(&workers->park_lock);
+}
 
-error:
+static void
+worker_run(struct worker* worker, struct task* task)
+{
+   struct workers* workers = worker->workers;
 
-   return 1;
+   task->function(task->arg);
+   free(task);
+
+   atomic_fetch_add_explicit(&worker->executed, 1, memory_order_relaxed);
+
+   if (atomic_fetch_sub(&workers->outstanding, 1) == 1)
+   {
+      pthread_mutex_lock(&workers->worker_lock);
+      pthread_cond_broadcast(&workers->worker_all_idle);
+      pthread_mutex_unlock(&workers->worker_lock);
+   }
 }
 
 static void
-queue_clear(struct queue* queue)
+worker_destroy(struct worker* w)
 {
-   while (queue->number_of_tasks)
+   if (w != NULL)
    {
-      free(queue_pull(queue));
+      deque_destroy(&w->deque);
+      free(w);
    }
+}
 
-   queue->front = NULL;
-   queue->rear = NULL;
-   semaphore_reset(queue->has_tasks);
-   queue->number_of_tasks = 0;
+static void
+wakeup(struct workers* workers)
+{
+   if (atomic_load(&workers->sleeping) > 0)
+   {
+      pthread_mutex_lock(&workers->park_lock);
+      pthread_cond_signal(&workers->has_tasks);
+      pthread_mutex_unlock(&workers->park_lock);
+   }
+}
 
+static int
+queue_init(struct queue* queue, size_t size)
+{
+   queue->slots = (struct slot*)malloc(size * sizeof(struct slot));
+   if (queue->slots == NULL)
+   {
+      goto error;
+   }
+
+   queue->mask = size - 1;
+
+   for (size_t i = 0; i < size; i++)
+   {
+      atomic_init(&queue->slots[i].sequence, i);
+      atomic_init(&queue->slots[i].task, NULL);
+   }
+
+   atomic_init(&queue->enqueue_position, 0);
+   atomic_init(&queue->dequeue_position, 0);
+
+   return 0;
+
+error:
+
+   return 1;
 }
 
-static void
+static bool
 queue_push(struct queue* queue, struct task* task)
 {
+   struct slot* slot = NULL;
+   size_t position;
+   size_t sequence;
+   intptr_t diff;
 
-   pthread_mutex_lock(&queue->rwmutex);
-   task->previous = NULL;
+   position = atomic_load_explicit(&queue->enqueue_position, memory_order_relaxed);
 
-   switch (queue->number_of_tasks)
+   for (;;)
    {
-      case 0:
-         queue->front = task;
-         queue->rear = task;
-         break;
-
-      default:
-         queue->rear->previous = task;
-         queue->rear = task;
+      slot = &queue->slots[position & queue->mask];
+      sequence = atomic_load_explicit(&slot->sequence, memory_order_acquire);
+      diff = (intptr_t)sequence - (intptr_t)position;
 
+      if (diff == 0)
+      {
+         if (atomic_compare_exchange_weak_explicit(&queue->enqueue_position, &position, position + 1,
+                                                   memory_order_relaxed, memory_order_relaxed))
+         {
+            break;
+         }
+      }
+      else if (diff < 0)
+      {
+         return false;
+      }
+      else
+      {
+         position = atomic_load_explicit(&queue->enqueue_position, memory_order_relaxed);
+      }
    }
-   queue->number_of_tasks++;
 
-   semaphore_post(queue->has_tasks);
-   pthread_mutex_unlock(&queue->rwmutex);
+   atomic_store_explicit(&slot->task, task, memory_order_relaxed);
+   atomic_store_explicit(&slot->sequence, position + 1, memory_order_release);
+
+   return true;
 }
 
 static struct task*
 queue_pull(struct queue* queue)
 {
+   struct slot* slot = NULL;
    struct task* task = NULL;
+   size_t position;
+   size_t sequence;
+   intptr_t diff;
 
-   pthread_mutex_lock(&queue->rwmutex);
-   task = queue->front;
+   position = atomic_load_explicit(&queue->dequeue_position, memory_order_relaxed);
 
-   switch (queue->number_of_tasks)
+   for (;;)
    {
-      case 0:
-         break;
-
-      case 1:
-         queue->front = NULL;
-         queue->rear = NULL;
-         queue->number_of_tasks = 0;
-         break;
+      slot = &queue->slots[position & queue->mask];
+      sequence = atomic_load_explicit(&slot->sequence, memory_order_acquire);
+      diff = (intptr_t)sequence - (intptr_t)(position + 1);
 
-      default:
-         queue->front = task->previous;
-         queue->number_of_tasks--;
-         semaphore_post(queue->has_tasks);
+      if (diff == 0)
+      {
+         if (atomic_compare_exchange_weak_explicit(&queue->dequeue_position, &position, position + 1,
+                                                   memory_order_relaxed, memory_order_relaxed))
+         {
+            break;
+         }
+      }
+      else if (diff < 0)
+      {
+         return NULL;
+      }
+      else
+      {
+         position = atomic_load_explicit(&queue->dequeue_position, memory_order_relaxed);
+      }
    }
 
-   pthread_mutex_unlock(&queue->rwmutex);
+   task = atomic_load_explicit(&slot->task, memory_order_relaxed);
+   atomic_store_explicit(&slot->sequence, position + queue->mask + 1, memory_order_release);
+
    return task;
 }
 
 static void
 queue_destroy(struct queue* queue)
 {
-   queue_clear(queue);
-   free(queue->has_tasks);
+   free(queue->slots);
+   queue->slots = NULL;
 }
 
 static int
-semaphore_init(struct semaphore* semaphore, int value)
+deque_init(struct deque* deque, long size)
 {
-   if (value < 0 || value > 1)
+   deque->tasks = (struct task* _Atomic*)malloc(size * sizeof(struct task*));
+   if (deque->tasks == NULL)
    {
-      pgmoneta_log_error("Invalid semaphore value: %d", value);
       goto error;
    }
 
-   pthread_mutex_init(&(semaphore->mutex), NULL);
-   pthread_cond_init(&(semaphore->cond), NULL);
-   semaphore->value = value;
+   for (long i = 0; i < size; i++)
+   {
+      atomic_init(&deque->tasks[i], NULL);
+   }
+
+   deque->mask = size - 1;
+   atomic_init(&deque->top, 0);
+   atomic_init(&deque->bottom, 0);
 
    return 0;
 
@@ -453,40 +706,91 @@ error:
    return 1;
 }
 
-static void
-semaphore_reset(struct semaphore* semaphore)
+static bool
+deque_push(struct deque* deque, struct task* task)
 {
-   pthread_mutex_destroy(&(semaphore->mutex));
-   pthread_cond_destroy(&(semaphore->cond));
-   semaphore_init(semaphore, 0);
+   long b;
+   long t;
+
+   b = atomic_load_explicit(&deque->bottom, memory_order_relaxed);
+   t = atomic_load_explicit(&deque->top, memory_order_acquire);
+
+   if (b - t > deque->mask)
+   {
+      return false;
+   }
+
+   atomic_store_explicit(&deque->tasks[b & deque->mask], task, memory_order_relaxed);
+   atomic_thread_fence(memory_order_release);
+   atomic_store_explicit(&deque->bottom, b + 1, memory_order_relaxed);
+
+   return true;
 }
 
-static void
-semaphore_post(struct semaphore* semaphore)
+static struct task*
+deque_take(struct deque* deque)
 {
-   pthread_mutex_lock(&semaphore->mutex);
-   semaphore->value = 1;
-   pthread_cond_signal(&semaphore->cond);
-   pthread_mutex_unlock(&semaphore->mutex);
+   struct task* task = NULL;
+   long b;
+   long t;
+
+   b = atomic_load_explicit(&deque->bottom, memory_order_relaxed) - 1;
+   atomic_store_explicit(&deque->bottom, b, memory_order_relaxed);
+   atomic_thread_fence(memory_order_seq_cst);
+   t = atomic_load_explicit(&deque->top, memory_order_relaxed);
+
+   if (t <= b)
+   {
+      task = atomic_load_explicit(&deque->tasks[b & deque->mask], memory_order_relaxed);
+
+      if (t == b)
+      {
+         /* Last task, race against thieves */
+         if (!atomic_compare_exchange_strong_explicit(&deque->top, &t, t + 1,
+                                                      memory_order_seq_cst, memory_order_relaxed))
+         {
+            task = NULL;
+         }
+         atomic_store_explicit(&deque->bottom, b + 1, memory_order_relaxed);
+      }
+   }
+   else
+   {
+      atomic_store_explicit(&deque->bottom, b + 1, memory_order_relaxed);
+   }
+
+   return task;
 }
 
-static void
-semaphore_post_all(struct semaphore* semaphore)
+static struct task*
+deque_steal(struct deque* deque, bool* retry)
 {
-   pthread_mutex_lock(&semaphore->mutex);
-   semaphore->value = 1;
-   pthread_cond_broadcast(&semaphore->cond);
-   pthread_mutex_unlock(&semaphore->mutex);
+   struct task* task = NULL;
+   long b;
+   long t;
+
+   t = atomic_load_explicit(&deque->top, memory_order_acquire);
+   atomic_thread_fence(memory_order_seq_cst);
+   b = atomic_load_explicit(&deque->bottom, memory_order_acquire);
+
+   if (t < b)
+   {
+      task = atomic_load_explicit(&deque->tasks[t & deque->mask], memory_order_relaxed);
+
+      if (!atomic_compare_exchange_strong_explicit(&deque->top, &t, t + 1,
+                                                   memory_order_seq_cst, memory_order_relaxed))
+      {
+         *retry = true;
+         return NULL;
+      }
+   }
+
+   return task;
 }
 
 static void
-semaphore_wait(struct semaphore* semaphore)
+deque_destroy(struct deque* deque)
 {
-   pthread_mutex_lock(&semaphore->mutex);
-   while (semaphore->value != 1)
-   {
-      pthread_cond_wait(&semaphore->cond, &semaphore->mutex);
-   }
-   semaphore->value = 0;
-   pthread_mutex_unlock(&semaphore->mutex);
+   free(deque->tasks);
+   deque->tasks = NULL;
 }
@@ -104,13 +104,24 @@ wf_backup(void)
    head = pgmoneta_workflow_create_basebackup();
    current = head;
 
+   if (config->incremental)
+   {
+      current->next = pgmoneta_workflow_create_incremental();
+      current = current->next;
+   }
+
    current->next = pgmoneta_storage_create_local();
    current = current->next;
 
    current->next = pgmoneta_create_hot_standby();
    current = current->next;
 
-   if (config->compression_type == COMPRESSION_CLIENT_GZIP || config->compression_type == COMPRESSION_SERVER_GZIP)
+   if (config->compression_type != COMPRESSION_NONE && config->encryption != ENCRYPTION_NONE)
+   {
+      current->next = pgmoneta_workflow_create_compress_encrypt();
+      current = current->next;
+   }
+   else if (config->compression_type == COMPRESSION_CLIENT_GZIP || config->compression_type == COMPRESSION_SERVER_GZIP)
    {
       current->next = pgmoneta_workflow_create_gzip(true);
       current = current->next;
@@ -131,7 +142,7 @@ wf_backup(void)
       current = current->next;
    }
 
-   if (config->encryption != ENCRYPTION_NONE)
+   if (config->encryption != ENCRYPTION_NONE && config->compression_type == COMPRESSION_NONE)
    {
       current->next = pgmoneta_workflow_encryption(true);
       current = current->next;
@@ -175,40 +186,11 @@ wf_restore(void)
 {
    struct workflow* head = NULL;
    struct workflow* current = NULL;
-   struct configuration* config = NULL;
-
-   config = (struct configuration*)shmem;
 
+   /* The restore decrypts and decompresses the files into the target directly */
    head = pgmoneta_workflow_create_restore();
    current = head;
 
-   if (config->encryption != ENCRYPTION_NONE)
-   {
-      current->next = pgmoneta_workflow_encryption(false);
-      current = current->next;
-   }
-
-   if (config->compression_type == COMPRESSION_CLIENT_GZIP || config->compression_type == COMPRESSION_SERVER_GZIP)
-   {
-      current->next = pgmoneta_workflow_create_gzip(false);
-      current = current->next;
-   }
-   else if (config->compression_type == COMPRESSION_CLIENT_ZSTD || config->compression_type == COMPRESSION_SERVER_ZSTD)
-   {
-      current->next = pgmoneta_workflow_create_zstd(false);
-      current = current->next;
-   }
-   else if (config->compression_type == COMPRESSION_CLIENT_LZ4 || config->compression_type == COMPRESSION_SERVER_LZ4)
-   {
-      current->next = pgmoneta_workflow_create_lz4(false);
-      current = current->next;
-   }
-   else if (config->compression_type == COMPRESSION_CLIENT_BZIP2)
-   {
-      current->next = pgmoneta_workflow_create_bzip2(false);
-      current = current->next;
-   }
-
    current->next = pgmoneta_workflow_create_recovery_info();
    current = current->next;
 
@@ -236,7 +218,12 @@ wf_archive(void)
    head = pgmoneta_workflow_create_archive();
    current = head;
 
-   if (config->compression_type == COMPRESSION_CLIENT_GZIP || config->compression_type == COMPRESSION_SERVER_GZIP)
+   if (config->compression_type != COMPRESSION_NONE && config->encryption != ENCRYPTION_NONE)
+   {
+      current->next = pgmoneta_workflow_create_compress_encrypt();
+      current = current->next;
+   }
+   else if (config->compression_type == COMPRESSION_CLIENT_GZIP || config->compression_type == COMPRESSION_SERVER_GZIP)
    {
       current->next = pgmoneta_workflow_create_gzip(true);
       current = current->next;
@@ -259,7 +246,7 @@ wf_archive(void)
       current = current->next;
    }
 
-   if (config->encryption != ENCRYPTION_NONE)
+   if (config->encryption != ENCRYPTION_NONE && config->compression_type == COMPRESSION_NONE)
    {
       current->next = pgmoneta_workflow_encryption(true);
       current = current->next;
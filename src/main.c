@@ -31,14 +31,12 @@
 #include <aes.h>
 #include <achv.h>
 #include <backup.h>
-#include <bzip2_compression.h>
+#include <catalog.h>
 #include <configuration.h>
 #include <delete.h>
-#include <gzip_compression.h>
 #include <info.h>
 #include <keep.h>
 #include <logging.h>
-#include <lz4_compression.h>
 #include <management.h>
 #include <memory.h>
 #include <message.h>
@@ -52,7 +50,6 @@
 #include <shmem.h>
 #include <utils.h>
 #include <wal.h>
-#include <zstandard_compression.h>
 
 /* system */
 #include <err.h>
@@ -87,10 +84,12 @@ static void accept_management_cb(struct ev_loop* loop, struct ev_io* watcher, in
 static void shutdown_cb(struct ev_loop* loop, ev_signal* w, int revents);
 static void reload_cb(struct ev_loop* loop, ev_signal* w, int revents);
 static void coredump_cb(struct ev_loop* loop, ev_signal* w, int revents);
-static void wal_cb(struct ev_loop* loop, ev_periodic* w, int revents);
 static void retention_cb(struct ev_loop* loop, ev_periodic* w, int revents);
 static void valid_cb(struct ev_loop* loop, ev_periodic* w, int revents);
 static void wal_streaming_cb(struct ev_loop* loop, ev_periodic* w, int revents);
+static void size_cb(struct ev_loop* loop, ev_periodic* w, int revents);
+static void metrics_cb(struct ev_loop* loop, ev_periodic* w, int revents);
+static void reconcile_sizes(void);
 static bool accept_fatal(int error);
 static void reload_configuration(void);
 static void init_receivewals(void);
@@ -169,6 +168,8 @@ shutdown_metrics(void)
       pgmoneta_disconnect(io_metrics[i].socket);
       errno = 0;
    }
+
+   pgmoneta_prometheus_close_clients(main_loop);
 }
 
 static void
@@ -240,12 +241,14 @@ main(int argc, char** argv)
    bool metrics_started = false;
    pid_t pid, sid;
    struct signal_info signal_watcher[5];
-   struct ev_periodic wal;
    struct ev_periodic retention;
    struct ev_periodic valid;
    struct ev_periodic wal_streaming;
+   struct ev_periodic size;
+   struct ev_periodic metrics;
    size_t shmem_size;
    size_t prometheus_cache_shmem_size = 0;
+   size_t catalog_shmem_size = 0;
    struct configuration* config = NULL;
    int ret;
    int c;
@@ -526,6 +529,15 @@ main(int argc, char** argv)
       errx(1, "Error in creating and initializing prometheus cache shared memory");
    }
 
+   if (pgmoneta_init_catalog(&catalog_shmem_size, &catalog_shmem))
+   {
+      pgmoneta_log_warn("Could not create the backup catalog, backups are read from the disk");
+   }
+   else
+   {
+      pgmoneta_catalog_load();
+   }
+
    /* Bind Unix Domain Socket */
    if (pgmoneta_bind_unix_socket(config->unix_socket_dir, MAIN_UDS, &unix_management_socket))
    {
@@ -643,17 +655,19 @@ main(int argc, char** argv)
       ev_periodic_start (main_loop, &wal_streaming);
    }
 
-   /* Start WAL compression */
-   if (config->compression_type != COMPRESSION_NONE)
-   {
-      ev_periodic_init (&wal, wal_cb, 0., 60, 0);
-      ev_periodic_start (main_loop, &wal);
-   }
-
    /* Start backup retention policy */
    ev_periodic_init (&retention, retention_cb, 0., 300, 0);
    ev_periodic_start (main_loop, &retention);
 
+   /* Reconcile the sizes with the disk now and every hour */
+   ev_periodic_init (&size, size_cb, 0., 3600, 0);
+   ev_periodic_start (main_loop, &size);
+   reconcile_sizes();
+
+   /* Render the Prometheus snapshot when it is due */
+   ev_periodic_init (&metrics, metrics_cb, 0., 1, 0);
+   ev_periodic_start (main_loop, &metrics);
+
    if (!offline)
    {
       pgmoneta_log_info("Started on %s", config->host);
@@ -679,6 +693,7 @@ main(int argc, char** argv)
    pgmoneta_log_debug("%s", OpenSSL_version(OPENSSL_VERSION));
 #endif
    pgmoneta_log_debug("Configuration size: %lu", shmem_size);
+   pgmoneta_log_debug("Catalog size: %lu", catalog_shmem_size);
    pgmoneta_log_debug("Known users: %d", config->number_of_users);
    pgmoneta_log_debug("Known admins: %d", config->number_of_admins);
 
@@ -718,6 +733,10 @@ main(int argc, char** argv)
    pgmoneta_stop_logging();
    pgmoneta_destroy_shared_memory(shmem, shmem_size);
    pgmoneta_destroy_shared_memory(prometheus_cache_shmem, prometheus_cache_shmem_size);
+   if (catalog_shmem != NULL)
+   {
+      pgmoneta_destroy_shared_memory(catalog_shmem, catalog_shmem_size);
+   }
 
    if (daemon || stop)
    {
@@ -757,6 +776,10 @@ error:
    pgmoneta_stop_logging();
    pgmoneta_destroy_shared_memory(shmem, shmem_size);
    pgmoneta_destroy_shared_memory(prometheus_cache_shmem, prometheus_cache_shmem_size);
+   if (catalog_shmem != NULL)
+   {
+      pgmoneta_destroy_shared_memory(catalog_shmem, catalog_shmem_size);
+   }
 
    if (daemon || stop)
    {
@@ -1397,6 +1420,12 @@ accept_metrics_cb(struct ev_loop* loop, struct ev_io* watcher, int revents)
       return;
    }
 
+   if (pgmoneta_prometheus_snapshot_valid())
+   {
+      pgmoneta_prometheus_serve(loop, client_fd);
+      return;
+   }
+
    if (!fork())
    {
       ev_loop_fork(loop);
@@ -1513,67 +1542,6 @@ coredump_cb(struct ev_loop* loop, ev_signal* w, int revents)
    abort();
 }
 
-static void
-wal_cb(struct ev_loop* loop, ev_periodic* w, int revents)
-{
-   struct configuration* config;
-
-   config = (struct configuration*)shmem;
-
-   if (EV_ERROR & revents)
-   {
-      pgmoneta_log_trace("wal_cb: got invalid event: %s", strerror(errno));
-      return;
-   }
-
-   for (int i = 0; i < config->number_of_servers; i++)
-   {
-      /* Compression is always in a fork() */
-      if (!fork())
-      {
-         bool active = false;
-         char* d = NULL;
-
-         pgmoneta_set_proc_title(1, argv_ptr, "wal", config->servers[i].name);
-
-         shutdown_ports();
-
-         if (atomic_compare_exchange_strong(&config->servers[i].wal, &active, true))
-         {
-            d = pgmoneta_get_server_wal(i);
-
-            if (config->compression_type == COMPRESSION_CLIENT_GZIP || config->compression_type == COMPRESSION_SERVER_GZIP)
-            {
-               pgmoneta_gzip_wal(d);
-            }
-            else if (config->compression_type == COMPRESSION_CLIENT_ZSTD || config->compression_type == COMPRESSION_SERVER_ZSTD)
-            {
-               pgmoneta_zstandardc_wal(d);
-            }
-            else if (config->compression_type == COMPRESSION_CLIENT_LZ4 || config->compression_type == COMPRESSION_SERVER_LZ4)
-            {
-               pgmoneta_lz4c_wal(d);
-            }
-            else if (config->compression_type == COMPRESSION_CLIENT_BZIP2)
-            {
-               pgmoneta_bzip2_wal(d);
-            }
-
-            if (config->encryption != 0)
-            {
-               pgmoneta_encrypt_wal(d);
-            }
-
-            free(d);
-
-            atomic_store(&config->servers[i].wal, false);
-         }
-
-         exit(0);
-      }
-   }
-}
-
 static void
 retention_cb(struct ev_loop* loop, ev_periodic* w, int revents)
 {
@@ -1625,6 +1593,70 @@ valid_cb(struct ev_loop* loop, ev_periodic* w, int revents)
    }
 }
 
+static void
+size_cb(struct ev_loop* loop, ev_periodic* w, int revents)
+{
+   if (EV_ERROR & revents)
+   {
+      pgmoneta_log_trace("size_cb: got invalid event: %s", strerror(errno));
+      return;
+   }
+
+   reconcile_sizes();
+}
+
+static void
+metrics_cb(struct ev_loop* loop, ev_periodic* w, int revents)
+{
+   if (EV_ERROR & revents)
+   {
+      pgmoneta_log_trace("metrics_cb: got invalid event: %s", strerror(errno));
+      return;
+   }
+
+   if (!pgmoneta_prometheus_snapshot_due())
+   {
+      return;
+   }
+
+   if (!fork())
+   {
+      shutdown_ports();
+
+      pgmoneta_start_logging();
+      pgmoneta_set_proc_title(1, argv_ptr, "metrics", NULL);
+
+      pgmoneta_prometheus_snapshot();
+
+      pgmoneta_stop_logging();
+
+      exit(0);
+   }
+}
+
+static void
+reconcile_sizes(void)
+{
+   if (catalog_shmem == NULL)
+   {
+      return;
+   }
+
+   if (!fork())
+   {
+      shutdown_ports();
+
+      pgmoneta_start_logging();
+      pgmoneta_set_proc_title(1, argv_ptr, "size", NULL);
+
+      pgmoneta_catalog_reconcile();
+
+      pgmoneta_stop_logging();
+
+      exit(0);
+   }
+}
+
 static void
 wal_streaming_cb(struct ev_loop* loop, ev_periodic* w, int revents)
 {
@@ -1737,6 +1769,9 @@ reload_configuration(void)
 
    pgmoneta_reload_configuration();
 
+   pgmoneta_catalog_load();
+   reconcile_sizes();
+
    if (old_metrics != config->metrics)
    {
       shutdown_metrics();